@@ -21,6 +21,6 @@ fi
 [ -f lodepng.o ] || "$CXX" lodepng.cpp -O3 -mavx2 -o lodepng.o -c
 
 "$CXX" -O3 -mavx2 -DFASTLL_ENABLE_AVX2_INTRINSICS -fopenmp \
-  -I. lodepng.o \
-  "$DIR"/fast_lossless.cc "$DIR"/fast_lossless_main.cc \
+  -I. -I"$DIR"/../.. lodepng.o \
+  "$DIR"/../../lib/jxl/enc_fast_lossless.cc "$DIR"/fast_lossless_main.cc \
   -o fast_lossless
@@ -10,10 +10,18 @@
 #include <chrono>
 #include <thread>
 
-#include "fast_lossless.h"
+#include "lib/jxl/enc_fast_lossless.h"
 #include "lodepng.h"
 #include "pam-input.h"
 
+void ParallelRunner(void* /*runner_opaque*/, void* opaque,
+                    void fun(void*, size_t), size_t count) {
+#pragma omp parallel for
+  for (size_t i = 0; i < count; i++) {
+    fun(opaque, i);
+  }
+}
+
 int main(int argc, char** argv) {
   if (argc < 3) {
     fprintf(stderr, "Usage: %s in.png out.jxl [effort] [num_reps]\n", argv[0]);
@@ -51,8 +59,10 @@ int main(int argc, char** argv) {
   auto start = std::chrono::high_resolution_clock::now();
   for (size_t _ = 0; _ < num_reps; _++) {
     free(encoded);
-    encoded_size = FastLosslessEncode(png, width, stride, height, nb_chans,
-                                      bitdepth, effort, &encoded);
+    // PAM input stores 16-bit samples in big-endian order.
+    encoded_size = JxlFastLosslessEncode(
+        png, width, stride, height, nb_chans, bitdepth,
+        /*big_endian=*/true, effort, &encoded, nullptr, &ParallelRunner);
   }
   auto stop = std::chrono::high_resolution_clock::now();
   if (num_reps > 1) {
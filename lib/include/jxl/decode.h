@@ -107,6 +107,17 @@ JXL_EXPORT JxlDecoder* JxlDecoderCreate(const JxlMemoryManager* memory_manager);
  */
 JXL_EXPORT void JxlDecoderReset(JxlDecoder* dec);
 
+/**
+ * Re-initializes a @ref JxlDecoder instance like @ref JxlDecoderReset, but
+ * keeps the internal buffers allocated for the previous image. The next image
+ * reuses them where they are large enough and only grows them when needed,
+ * which avoids most allocations when decoding many images of similar size,
+ * such as thumbnails, with a single decoder.
+ *
+ * @param dec instance to be re-initialized.
+ */
+JXL_EXPORT void JxlDecoderRecycle(JxlDecoder* dec);
+
 /**
  * Deinitializes and frees @ref JxlDecoder instance.
  *
@@ -200,6 +211,14 @@ typedef enum {
    */
   JXL_DEC_BOX_NEED_MORE_OUTPUT = 7,
 
+  /** The work budget set with @ref JxlDecoderSetWorkBudget was used up
+   * before the current frame was complete. The decoder stopped at a group
+   * boundary, and the next call to @ref JxlDecoderProcessInput continues
+   * where it stopped, with the same input. Like @ref JXL_DEC_NEED_MORE_INPUT,
+   * this status is returned without subscribing to it.
+   */
+  JXL_DEC_YIELD = 8,
+
   /** Informative event by @ref JxlDecoderProcessInput
    * "JxlDecoderProcessInput": Basic information such as image dimensions and
    * extra channels. This event occurs max once per image.
@@ -370,12 +389,15 @@ typedef enum {
  * The difference to @ref JxlDecoderReset is that some state is kept, namely
  * settings set by a call to
  *  - @ref JxlDecoderSetCoalescing,
+ *  - @ref JxlDecoderSetFrameLookahead,
+ *  - @ref JxlDecoderSetMemoryLimit,
  *  - @ref JxlDecoderSetDesiredIntensityTarget,
  *  - @ref JxlDecoderSetDecompressBoxes,
  *  - @ref JxlDecoderSetKeepOrientation,
  *  - @ref JxlDecoderSetUnpremultiplyAlpha,
  *  - @ref JxlDecoderSetParallelRunner,
- *  - @ref JxlDecoderSetRenderSpotcolors, and
+ *  - @ref JxlDecoderSetRenderSpotcolors,
+ *  - @ref JxlDecoderSetWorkBudget, and
  *  - @ref JxlDecoderSubscribeEvents.
  *
  * @param dec decoder object
@@ -402,6 +424,30 @@ JXL_EXPORT void JxlDecoderRewind(JxlDecoder* dec);
  */
 JXL_EXPORT void JxlDecoderSkipFrames(JxlDecoder* dec, size_t amount);
 
+/** Rewinds the decoder and makes it skip to the frame with the given index,
+ * counted from the first frame like for @ref JxlDecoderSkipFrames. As for @ref
+ * JxlDecoderRewind, the same input must be given again from the beginning of
+ * the file, and the events must be subscribed to again.
+ *
+ * Unlike rewinding and skipping frames, the decoder does not parse every frame
+ * before the requested one: once it reaches the first frame, it jumps in the
+ * codestream to the first frame that the requested frame depends on, which is
+ * known for frames seen before (see @ref JxlDecoderRewind), or to the last
+ * keyframe before it listed in a frame index box (jxli) that the decoder
+ * passed before. The input bytes up to there are still consumed, but not
+ * parsed, so this is cheap when the whole file is available, see @ref
+ * JxlDecoderSetPersistentInput. The first @ref JXL_DEC_FRAME event is that of
+ * the requested frame.
+ *
+ * The frame index box is usually at the end of the file, the decoder only
+ * passes it when subscribed to @ref JXL_DEC_BOX. It is only used when
+ * coalescing is enabled.
+ *
+ * @param dec decoder object
+ * @param index index of the frame to decode next
+ */
+JXL_EXPORT void JxlDecoderSeekFrame(JxlDecoder* dec, size_t index);
+
 /**
  * Skips processing the current frame. Can be called after frame processing
  * already started, signaled by a @ref JXL_DEC_NEED_IMAGE_OUT_BUFFER event,
@@ -562,6 +608,167 @@ JxlDecoderSetRenderSpotcolors(JxlDecoder* dec, JXL_BOOL render_spotcolors);
 JXL_EXPORT JxlDecoderStatus JxlDecoderSetCoalescing(JxlDecoder* dec,
                                                     JXL_BOOL coalescing);
 
+/**
+ * Enables decoding several frames of an animation at once, for animations
+ * whose frames are too small for their groups alone to keep the threads of
+ * the parallel runner busy. When the decoder reaches a frame, it looks at the
+ * headers of the frames that follow it in the available input. The frames
+ * that are displayed on their own, replace the whole image and do not use
+ * patches, and thus do not depend on any earlier frame, are then decoded
+ * concurrently, each on one thread of the runner, up to @p max_frames of them.
+ * They are still returned one at a time and in order, as if they were
+ * decoded when reached; the other frames are decoded as usual.
+ *
+ * Frames are only decoded ahead while coalescing is enabled, no crop region
+ * or downsampling is set, @ref JXL_DEC_FULL_IMAGE is subscribed to and @ref
+ * JXL_DEC_FRAME_PROGRESSION is not, no JPEG reconstruction is requested, and
+ * no frames are being skipped. Only frames that are fully available in the
+ * input are decoded ahead, and frames in different partial codestream (jxlp)
+ * boxes are not decoded together. The pixels of up to @p max_frames frames
+ * are held in memory until they are returned. The frames decoded ahead are
+ * converted to the output format once it is known, which gives the same
+ * pixels as decoding in order, except for 8-bit output of XYB images to sRGB
+ * that the render pipeline converts with an approximation: when such an
+ * output buffer is set, the frames decoded ahead are dropped and the
+ * lookahead is disabled until @ref JxlDecoderReset.
+ *
+ * @param dec decoder object
+ * @param max_frames maximum number of frames decoded at once, or 0 or 1 to
+ *     decode each frame when it is reached (the default).
+ * @return @ref JXL_DEC_SUCCESS if no error, @ref JXL_DEC_ERROR if decoding
+ *     already started.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetFrameLookahead(JxlDecoder* dec,
+                                                        size_t max_frames);
+
+/**
+ * Limits the memory the decoder allocates for image data, in bytes. This
+ * counts the internal image buffers, including those allocated by the threads
+ * of the parallel runner on behalf of this decoder, but not the decoder
+ * object itself, the input or the output buffers. Before allocating the
+ * buffers of the image or of a frame, the decoder checks that another float
+ * image of that size, with all color and extra channels, still fits next to
+ * the memory in use, and the usage is checked again whenever @ref
+ * JxlDecoderProcessInput returns. When either check fails, @ref
+ * JxlDecoderProcessInput returns @ref JXL_DEC_ERROR. The actual peak usage
+ * can exceed the estimate, so this is a guard against decoding images that
+ * are too large rather than an exact bound; use @ref JxlDecoderGetMemoryUsage
+ * to measure the peak of typical images.
+ *
+ * @param dec decoder object
+ * @param max_bytes maximum number of bytes, or 0 for no limit (the default).
+ * @return @ref JXL_DEC_SUCCESS if no error, @ref JXL_DEC_ERROR if decoding
+ *     already started.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetMemoryLimit(JxlDecoder* dec,
+                                                     size_t max_bytes);
+
+/**
+ * Keeps up to @p max_cached_bytes of the image buffers that the decoder frees
+ * to serve its later allocations of a similar size, instead of returning them
+ * to the memory manager. With @ref JxlDecoderRecycle, this lets decoding a
+ * series of images of similar sizes reuse the same memory. Buffers are
+ * rounded up to size classes, wasting at most a quarter of each buffer.
+ * Cached buffers are not counted as in use by @ref JxlDecoderGetMemoryUsage.
+ * The setting is kept by @ref JxlDecoderReset and @ref JxlDecoderRecycle, and
+ * the cached buffers are freed when it is lowered or the decoder is destroyed.
+ *
+ * @param dec decoder object
+ * @param max_cached_bytes maximum number of bytes of freed buffers to keep,
+ *     or 0 to keep none (the default).
+ */
+JXL_EXPORT void JxlDecoderSetMemoryPool(JxlDecoder* dec,
+                                        size_t max_cached_bytes);
+
+/**
+ * Returns the memory currently allocated by the decoder for image data, and
+ * the largest amount allocated at once since the decoder was created or last
+ * reset, counted as for @ref JxlDecoderSetMemoryLimit.
+ *
+ * @param dec decoder object
+ * @param bytes_in_use output for the bytes in use, may be NULL.
+ * @param max_bytes_in_use output for the peak bytes in use, may be NULL.
+ * @return @ref JXL_DEC_SUCCESS if no error.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderGetMemoryUsage(const JxlDecoder* dec,
+                                                     size_t* bytes_in_use,
+                                                     size_t* max_bytes_in_use);
+
+/**
+ * Starts or stops recording how long the calls that the decoder makes to its
+ * parallel runner take, grouped by the part of the decoder making them, to
+ * find the parts that do not scale with the number of threads. Enabling
+ * clears the statistics recorded so far. Recording reads the clock before and
+ * after each task. The setting and the statistics are kept by @ref
+ * JxlDecoderReset and @ref JxlDecoderRecycle, so they can cover a series of
+ * images.
+ *
+ * @param dec decoder object
+ * @param enabled JXL_TRUE to start recording, JXL_FALSE to stop.
+ */
+JXL_EXPORT void JxlDecoderSetRunnerStats(JxlDecoder* dec, JXL_BOOL enabled);
+
+/**
+ * Returns the size in bytes, including the terminating null character, of
+ * the statistics returned by @ref JxlDecoderGetRunnerStats.
+ *
+ * @param dec decoder object
+ * @param size output for the size.
+ * @return @ref JXL_DEC_SUCCESS if no error, @ref JXL_DEC_ERROR if the
+ *     statistics were never enabled.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderGetRunnerStatsSize(const JxlDecoder* dec,
+                                                         size_t* size);
+
+/**
+ * Writes the statistics recorded since @ref JxlDecoderSetRunnerStats enabled
+ * them as a null-terminated JSON object. Its "sites" array has one object per
+ * part of the decoder, in decreasing order of the time spent in its calls,
+ * with the fields:
+ *  - "caller": the name of the part of the decoder,
+ *  - "calls", "tasks": the number of calls and of tasks in them,
+ *  - "max_threads": the largest number of threads of a call,
+ *  - "wall_ns": the total time from the start to the end of the calls,
+ *  - "busy_ns": the total time spent in tasks, summed over threads,
+ *  - "idle_ns": the time threads of the calls did not run a task,
+ *  - "max_task_ns": the duration of the longest task,
+ *  - "parallelism": busy_ns / wall_ns, the average number of busy threads,
+ *  - "imbalance": how much longer the busiest thread of the calls was busy
+ *    than the average thread,
+ *  - "task_ns_log2": the number of tasks taking [2^i, 2^(i+1)) nanoseconds,
+ *    for i from 0.
+ *
+ * @param dec decoder object
+ * @param json buffer to write the statistics to.
+ * @param size size of @p json, at least the size given by @ref
+ *     JxlDecoderGetRunnerStatsSize.
+ * @return @ref JXL_DEC_SUCCESS if no error, @ref JXL_DEC_ERROR if the
+ *     statistics were never enabled or the buffer is too small.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderGetRunnerStats(const JxlDecoder* dec,
+                                                     char* json, size_t size);
+
+/**
+ * Limits the work done by each call to @ref JxlDecoderProcessInput, so that
+ * the decoder can be interleaved with other work on the same thread. Once a
+ * call decoded @p max_groups groups of a frame, or @p max_microseconds passed
+ * since the call started, no further group is started and the call returns
+ * @ref JXL_DEC_YIELD. A call always decodes at least one group, so decoding
+ * makes progress with any budget. Headers, the global sections of frames and
+ * the frames decoded ahead with @ref JxlDecoderSetFrameLookahead are not
+ * split, and the time limit does not interrupt groups already started, so a
+ * call may take longer than @p max_microseconds. By default there is no
+ * limit. The limit is reset by @ref JxlDecoderReset.
+ *
+ * @param dec decoder object
+ * @param max_groups number of DC and AC groups decoded per call, or 0 for no
+ *     limit.
+ * @param max_microseconds time after which no new group is started in a call,
+ *     or 0 for no limit.
+ */
+JXL_EXPORT void JxlDecoderSetWorkBudget(JxlDecoder* dec, size_t max_groups,
+                                        uint64_t max_microseconds);
+
 /**
  * Decodes JPEG XL file using the available bytes. Requires input has been
  * set with @ref JxlDecoderSetInput. After @ref JxlDecoderProcessInput, input
@@ -665,6 +872,29 @@ JXL_EXPORT size_t JxlDecoderReleaseInput(JxlDecoder* dec);
  */
 JXL_EXPORT void JxlDecoderCloseInput(JxlDecoder* dec);
 
+/**
+ * Sets the complete input data, like @ref JxlDecoderSetInput followed by @ref
+ * JxlDecoderCloseInput, for a caller that holds the whole file in memory, for
+ * example memory mapped. The caller must keep the data alive and unchanged
+ * until the decoder is destroyed, reset or rewound, or until @ref
+ * JxlDecoderReleaseInput is called.
+ *
+ * The decoder reads the codestream directly from this data. The only copies
+ * are made for the parts of the codestream that are split over two partial
+ * codestream (jxlp) boxes, and they are limited to about the size of the part
+ * that crosses the box boundary, while with @ref JxlDecoderSetInput all of the
+ * remaining box may be copied.
+ *
+ * @param dec decoder object
+ * @param data pointer to the complete input data.
+ * @param size amount of bytes of the input data.
+ * @return @ref JXL_DEC_ERROR if input was already set without releasing or
+ *     input was already closed, @ref JXL_DEC_SUCCESS otherwise.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetPersistentInput(JxlDecoder* dec,
+                                                         const uint8_t* data,
+                                                         size_t size);
+
 /**
  * Outputs the basic image information, such as image dimensions, bit depth and
  * all other JxlBasicInfo fields, if available.
@@ -1030,6 +1260,63 @@ JXL_DEPRECATED JXL_EXPORT JxlDecoderStatus JxlDecoderDCOutBufferSize(
 JXL_DEPRECATED JXL_EXPORT JxlDecoderStatus JxlDecoderSetDCOutBuffer(
     JxlDecoder* dec, const JxlPixelFormat* format, void* buffer, size_t size);
 
+/**
+ * Enables downsampled output of the image by the given factor, for example to
+ * create thumbnails. The image output buffer, callback and extra channel
+ * buffers then have the dimensions of the image, or of the crop region set
+ * with @ref JxlDecoderSetCropRegion, divided by the factor and rounded up, and
+ * @ref JxlDecoderImageOutBufferSize returns the size for those. Each output
+ * pixel is the center pixel of the corresponding block of the full resolution
+ * image; the blocks are not averaged, so fine detail may alias.
+ *
+ * With a factor of 8, frames that use VarDCT and have no extra channels are
+ * reconstructed from their 1:8 DC image only, without decoding their AC
+ * coefficients, which makes decoding several times faster. Factors 2 and 4 only
+ * resample the output: the frames are decoded at full resolution, as are other
+ * frames with a factor of 8, so these only save output buffer memory and
+ * conversion work, not decoding time.
+ *
+ * Does not apply to the preview frame, or when coalescing is disabled with
+ * @ref JxlDecoderSetCoalescing.
+ *
+ * @param dec decoder object
+ * @param factor downsampling factor: 1 (no downsampling, the default), 2, 4 or
+ *     8.
+ * @return @ref JXL_DEC_SUCCESS if the factor was set, @ref JXL_DEC_ERROR if
+ *     the factor is not supported or decoding already started.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetDownsampling(JxlDecoder* dec,
+                                                      uint32_t factor);
+
+/**
+ * Restricts the output of the following frames to a rectangular region of the
+ * image. The image output buffer, callback and extra channel buffers then have
+ * the dimensions of the region, and @ref JxlDecoderImageOutBufferSize returns
+ * the size for it. Groups of a frame that do not contribute to the region are
+ * not decoded if no other frame depends on the frame and its groups can be
+ * decoded independently; other frames are decoded entirely and only the
+ * output is restricted. The whole codestream is still read in either case.
+ *
+ * Can be called after the @ref JXL_DEC_BASIC_INFO event, before the image
+ * output buffer of a frame is set, and applies until it is changed or the
+ * decoder is reset. Requires coalescing (see @ref JxlDecoderSetCoalescing),
+ * and either an image without orientation or @ref
+ * JxlDecoderSetKeepOrientation. Does not apply to the preview frame. A region
+ * of zero size restores decoding of the whole image.
+ *
+ * @param dec decoder object
+ * @param x0 left edge of the region, in pixels
+ * @param y0 top edge of the region, in pixels
+ * @param xsize width of the region, in pixels
+ * @param ysize height of the region, in pixels
+ * @return @ref JXL_DEC_SUCCESS on success, @ref JXL_DEC_ERROR if the region
+ *     does not fit in the image or the requirements above are not met.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetCropRegion(JxlDecoder* dec,
+                                                    uint32_t x0, uint32_t y0,
+                                                    uint32_t xsize,
+                                                    uint32_t ysize);
+
 /**
  * Returns the minimum size in bytes of the image output pixel buffer for the
  * given format. This is the buffer for @ref JxlDecoderSetImageOutBuffer.
@@ -1504,6 +1791,65 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderFlushImage(JxlDecoder* dec);
 JXL_EXPORT JxlDecoderStatus
 JxlDecoderSetImageOutBitDepth(JxlDecoder* dec, const JxlBitDepth* bit_depth);
 
+/**
+ * One image to decode with @ref JxlDecoderDecodeBatch.
+ */
+typedef struct {
+  /** Complete JPEG XL file or codestream. */
+  const uint8_t* data;
+
+  /** Size of data in bytes. */
+  size_t size;
+
+  /** Format of the output pixels. */
+  JxlPixelFormat format;
+
+  /** Output buffer for the pixels, see @ref JxlDecoderSetImageOutBuffer. */
+  void* buffer;
+
+  /** Size of buffer in bytes. */
+  size_t buffer_size;
+
+  /** Set by the decoder to the dimensions of the image, or 0 if the basic info
+   * could not be decoded. */
+  uint32_t xsize;
+  uint32_t ysize;
+
+  /** Set by the decoder: @ref JXL_DEC_SUCCESS if the image was decoded, @ref
+   * JXL_DEC_NEED_IMAGE_OUT_BUFFER if buffer is too small for the image, @ref
+   * JXL_DEC_NEED_MORE_INPUT if data is truncated and @ref JXL_DEC_ERROR if
+   * data is not a valid image. */
+  JxlDecoderStatus status;
+} JxlDecoderBatchItem;
+
+/**
+ * Decodes several complete images, sharing one parallel runner between them.
+ * Only the first displayed frame of each image is decoded, in the orientation
+ * it is meant to be displayed in, as @ref JxlDecoderSetImageOutBuffer does for
+ * a still image.
+ *
+ * Images that fit in a single group of 256x256 pixels leave little work to
+ * split within one image, so these are decoded concurrently, one image per
+ * task of the runner. Larger images are decoded one after the other, each
+ * using the whole runner.
+ *
+ * @param items the images to decode, each with its own output buffer. The
+ *     result of each image is stored in its status field.
+ * @param num_items number of images.
+ * @param memory_manager custom allocator function for the decoders. It may be
+ *     NULL to use the default allocator. It need not be thread-safe: the
+ *     decoders run concurrently, but their calls into it are serialized.
+ * @param parallel_runner function pointer to runner for multithreading. It may
+ *     be NULL to use the default, single-threaded, runner.
+ * @param parallel_runner_opaque opaque pointer for parallel_runner.
+ * @return @ref JXL_DEC_SUCCESS if all images were decoded, @ref JXL_DEC_ERROR
+ *     if any of them failed.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderDecodeBatch(
+    JxlDecoderBatchItem* items, size_t num_items,
+    const JxlMemoryManager* memory_manager, JxlParallelRunner parallel_runner,
+    void* parallel_runner_opaque);
+
 #if defined(__cplusplus) || defined(c_plusplus)
 }
 #endif
@@ -133,7 +133,9 @@ typedef enum {
   /** Sets encoder effort/speed level without affecting decoding speed. Valid
    * values are, from faster to slower speed: 1:lightning 2:thunder 3:falcon
    * 4:cheetah 5:hare 6:wombat 7:squirrel 8:kitten 9:tortoise.
-   * Default: squirrel (7).
+   * Default: squirrel (7). For lossless frames of 8 to 16 bit integer samples
+   * with at most an interleaved alpha channel, lightning (1) uses a dedicated
+   * encoder that is considerably faster than the other effort levels.
    */
   JXL_ENC_FRAME_SETTING_EFFORT = 0,
 
@@ -329,6 +331,10 @@ typedef enum {
    * a later frame is attempted to be indexed, JXL_ENC_ERROR will occur.
    * If non-keyframes, i.e., frames with cropping, blending or patches are
    * attempted to be indexed, JXL_ENC_ERROR will occur.
+   * Adding an indexed frame makes the encoder use the container format, while
+   * setting this option on frame settings that are not used to add a frame
+   * has no effect. The jxli box is written after the last frame. The decoder
+   * can use it to seek, see @ref JxlDecoderSeekFrame.
    */
   JXL_ENC_FRAME_INDEX_BOX = 31,
 
@@ -346,6 +352,44 @@ typedef enum {
    */
   JXL_ENC_FRAME_SETTING_JPEG_COMPRESS_BOXES = 33,
 
+  /** Maximum size in bytes of the encoded frame. The encoder searches for the
+   * quantization that gives the largest frame that fits within this size,
+   * reusing the results of the other encoding heuristics between attempts, so
+   * the distance set with @ref JxlEncoderSetFrameDistance only acts as the
+   * starting point. If no attempt fits, the smallest result is used. Only
+   * affects lossy VarDCT frames. -1 or 0 = default (no limit).
+   * Takes precedence over JXL_ENC_FRAME_SETTING_TARGET_BITRATE.
+   */
+  JXL_ENC_FRAME_SETTING_TARGET_SIZE = 34,
+
+  /** Target bitrate in bits per pixel of the encoded frame, as a float option.
+   * Like JXL_ENC_FRAME_SETTING_TARGET_SIZE, but the encoder picks the
+   * quantization that comes closest to the target, which may be slightly
+   * above it. Only affects lossy VarDCT frames. -1 or 0 = default (no target).
+   */
+  JXL_ENC_FRAME_SETTING_TARGET_BITRATE = 35,
+
+  /** Encodes each animation frame as only the region that changed since the
+   * previous frame, blended onto the previous canvas, which is kept in
+   * reference slot 3. Applies to full frames with JXL_BLEND_REPLACE blending
+   * that are not saved as reference themselves; other frames are encoded as
+   * they are, and the frame after them in full. Only has an effect if the
+   * basic info has an animation. Reference slot 3 is then reserved for the
+   * canvas: adding a frame that is saved to it, or blended from it, fails.
+   * -1 = default (off), 0 = off, 1 = on.
+   */
+  JXL_ENC_FRAME_SETTING_AUTO_CROP = 36,
+
+  /** Maximum number of bytes the encoder should have allocated at once while
+   * encoding a frame, counting the frame's own input image. Settings that
+   * only trade compression density for memory, such as a slow effort or
+   * patches, are lowered until the estimated peak fits, and frames that do not
+   * fit even then fail with JXL_ENC_ERR_OOM before encoding starts. The
+   * estimate is rough, see @ref JxlEncoderEstimatePeakMemory. Frames that are
+   * encoded concurrently share the limit. -1 or 0 = default (no limit).
+   */
+  JXL_ENC_FRAME_SETTING_MAX_MEMORY = 37,
+
   /** Enum value not to be used as an option. This value is added to force the
    * C compiler to have the enum to take a known size.
    */
@@ -376,6 +420,21 @@ JXL_EXPORT JxlEncoder* JxlEncoderCreate(const JxlMemoryManager* memory_manager);
  */
 JXL_EXPORT void JxlEncoderReset(JxlEncoder* enc);
 
+/**
+ * Re-initializes a JxlEncoder instance like JxlEncoderReset, but keeps the
+ * buffers of quantized coefficients allocated for the previous image. The
+ * next image reuses them where they are large enough and only grows them when
+ * needed, when encoding many images of similar size, such as thumbnails, with
+ * a single encoder.
+ *
+ * The other per-frame buffers, such as the copy of the input pixels and the
+ * intermediate images, are still allocated anew for every frame. To reuse
+ * those as well, also enable @ref JxlEncoderSetMemoryPool.
+ *
+ * @param enc instance to be re-initialized.
+ */
+JXL_EXPORT void JxlEncoderRecycle(JxlEncoder* enc);
+
 /**
  * Deinitializes and frees JxlEncoder instance.
  *
@@ -437,6 +496,10 @@ JXL_EXPORT JxlEncoderError JxlEncoderGetError(JxlEncoder* enc);
  * @ref JxlEncoderProcessOutput call, or the codestream won't be encoded
  * correctly.
  *
+ * With a parallel runner, several small frames added before the next box are
+ * encoded concurrently, one per thread, and then written in order. The output
+ * is the same as when the frames are encoded one at a time.
+ *
  * @param enc encoder object.
  * @param next_out pointer to next bytes to write to.
  * @param avail_out amount of bytes available starting from *next_out.
@@ -448,6 +511,92 @@ JXL_EXPORT JxlEncoderStatus JxlEncoderProcessOutput(JxlEncoder* enc,
                                                     uint8_t** next_out,
                                                     size_t* avail_out);
 
+/**
+ * Destination for the encoded bytes, used instead of the output buffers of
+ * @ref JxlEncoderProcessOutput when set with @ref JxlEncoderSetOutputSink.
+ * The bytes are passed in file order, so the sink can for example be backed
+ * directly by a file descriptor or a socket.
+ */
+typedef struct {
+  /** Opaque pointer passed as first argument to write. */
+  void* opaque;
+
+  /**
+   * Writes size bytes starting at data to the output. May write fewer bytes
+   * than requested, in which case it is called again with the remainder.
+   *
+   * @param opaque user supplied opaque pointer.
+   * @param data bytes to write, only valid during this call.
+   * @param size amount of bytes to write.
+   * @return the amount of bytes written, 0 signals an error.
+   */
+  size_t (*write)(void* opaque, const uint8_t* data, size_t size);
+} JxlEncoderOutputSink;
+
+/**
+ * Sets a sink that receives the encoded bytes once each frame is encoded.
+ * The sections of each frame are written to the sink straight from the
+ * buffers they were encoded into, so the encoder does not keep an additional
+ * copy of the compressed frame. When a sink is set, the output must be
+ * produced with @ref JxlEncoderFlushInput instead of @ref
+ * JxlEncoderProcessOutput.
+ *
+ * The sink is written to in order only, without seeking back, so a frame is
+ * still buffered whole until it is encoded: its table of contents, which
+ * comes first, needs the sizes of all its sections. The sink only saves the
+ * copy of the output, not the memory of the compressed frame itself.
+ *
+ * Must be called before any output was produced.
+ *
+ * @param enc encoder object.
+ * @param output_sink the sink to write the output to.
+ * @return JXL_ENC_SUCCESS on success, JXL_ENC_ERROR on error
+ */
+JXL_EXPORT JxlEncoderStatus
+JxlEncoderSetOutputSink(JxlEncoder* enc, JxlEncoderOutputSink output_sink);
+
+/**
+ * Encodes all frames and boxes added so far and writes them to the output sink
+ * set with @ref JxlEncoderSetOutputSink. As with @ref JxlEncoderProcessOutput,
+ * @ref JxlEncoderCloseInput, @ref JxlEncoderCloseFrames and/or @ref
+ * JxlEncoderCloseBoxes must be called before the last frame or box is flushed.
+ *
+ * @param enc encoder object.
+ * @return JXL_ENC_SUCCESS when all input was encoded and written.
+ * @return JXL_ENC_ERROR when encoding or writing failed, or no sink is set.
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderFlushInput(JxlEncoder* enc);
+
+/**
+ * Encodes all frames and boxes added so far to each of several encoders,
+ * sharing one parallel runner between them. Each encoder keeps its own
+ * settings and produces its own output: encoders with an output sink write to
+ * it as with @ref JxlEncoderFlushInput, the output of the others is kept
+ * until it is retrieved with @ref JxlEncoderProcessOutput.
+ *
+ * Images that fit in a single group of 256x256 pixels leave little work to
+ * split within one image, so these are encoded concurrently, one image per
+ * task of the runner. Larger images are encoded one after the other, each
+ * using the whole runner. While this function runs, the runners set with
+ * @ref JxlEncoderSetParallelRunner on the encoders are not used, and output
+ * sinks may be called from any thread of the runner, but never concurrently
+ * for the same encoder. For the same reason, encoders in one batch must not
+ * share a memory manager passed to @ref JxlEncoderCreate unless it is
+ * thread-safe.
+ *
+ * @param encoders the encoders to process, must be distinct.
+ * @param num_encoders number of encoders.
+ * @param parallel_runner function pointer to runner for multithreading. It may
+ * be NULL to use the default, single-threaded, runner.
+ * @param parallel_runner_opaque opaque pointer for parallel_runner.
+ * @return JXL_ENC_SUCCESS when the input of all encoders was encoded.
+ * @return JXL_ENC_ERROR when encoding failed for any of the encoders, @ref
+ * JxlEncoderGetError reports the error of each encoder.
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderProcessBatch(
+    JxlEncoder* const* encoders, size_t num_encoders,
+    JxlParallelRunner parallel_runner, void* parallel_runner_opaque);
+
 /**
  * Sets the frame information for this frame to the encoder. This includes
  * animation information such as frame duration to store in the frame header.
@@ -664,6 +813,111 @@ JXL_EXPORT JxlEncoderStatus JxlEncoderSetExtraChannelBuffer(
     const JxlPixelFormat* pixel_format, const void* buffer, size_t size,
     uint32_t index);
 
+/**
+ * Set of callbacks through which the encoder pulls the pixels of a frame
+ * added with @ref JxlEncoderAddChunkedFrame. Instead of passing the whole frame
+ * in one buffer, the caller hands out rectangles of the frame on request, so
+ * that the caller never needs to hold the full interleaved image in memory,
+ * e.g. when reading a very large image from disk.
+ *
+ * The encoder requests each rectangle at most once from
+ * get_color_channel_data_at, for all color channels and the interleaved
+ * alpha together, and at most once per extra channel from
+ * get_extra_channel_data_at. It calls release_buffer for every non-NULL
+ * pointer returned by the data callbacks once it no longer needs it.
+ */
+typedef struct {
+  /** Opaque pointer passed as first argument to every callback. */
+  void* opaque;
+
+  /**
+   * Gets the pixel format of the color channels. The same rules as for the
+   * pixel_format of @ref JxlEncoderAddImageFrame apply. If the format has an
+   * alpha channel (2 or 4 channels), it is used as the alpha extra channel.
+   *
+   * @param opaque user supplied opaque pointer.
+   * @param pixel_format output, the pixel format of the color channels.
+   */
+  void (*get_color_channels_pixel_format)(void* opaque,
+                                          JxlPixelFormat* pixel_format);
+
+  /**
+   * Returns a pointer to the color channel pixels of the given rectangle of the
+   * frame, in the format given by get_color_channels_pixel_format. The
+   * align field of the pixel format is ignored, instead the distance in bytes
+   * between the starts of two consecutive rows is returned in row_offset.
+   *
+   * @param opaque user supplied opaque pointer.
+   * @param xpos horizontal position of the rectangle in the frame.
+   * @param ypos vertical position of the rectangle in the frame.
+   * @param xsize width of the rectangle.
+   * @param ysize height of the rectangle.
+   * @param row_offset output, stride of the returned rows in bytes.
+   * @return pointer to the first pixel of the rectangle, or NULL on error.
+   */
+  const void* (*get_color_channel_data_at)(void* opaque, size_t xpos,
+                                           size_t ypos, size_t xsize,
+                                           size_t ysize, size_t* row_offset);
+
+  /**
+   * Gets the pixel format of the extra channel with the given index. The
+   * num_channels value is ignored, since an extra channel always has one
+   * channel. Not called for the alpha channel if the color channels already
+   * include alpha.
+   *
+   * @param opaque user supplied opaque pointer.
+   * @param ec_index index of the extra channel.
+   * @param pixel_format output, the pixel format of the extra channel.
+   */
+  void (*get_extra_channel_pixel_format)(void* opaque, size_t ec_index,
+                                         JxlPixelFormat* pixel_format);
+
+  /**
+   * Same as get_color_channel_data_at, but for the extra channel with the
+   * given index.
+   */
+  const void* (*get_extra_channel_data_at)(void* opaque, size_t ec_index,
+                                           size_t xpos, size_t ypos,
+                                           size_t xsize, size_t ysize,
+                                           size_t* row_offset);
+
+  /**
+   * Releases a buffer previously returned by get_color_channel_data_at or
+   * get_extra_channel_data_at.
+   *
+   * @param opaque user supplied opaque pointer.
+   * @param buf pointer returned by one of the data callbacks.
+   */
+  void (*release_buffer)(void* opaque, const void* buf);
+} JxlChunkedFrameInputSource;
+
+/**
+ * Adds a frame whose pixels are pulled through the callbacks of
+ * chunked_frame_input, one DC group sized rectangle (2048x2048 pixels) at a
+ * time, instead of from a single buffer as with @ref JxlEncoderAddImageFrame.
+ * All channels, including all extra channels, are read through the callbacks,
+ * so @ref JxlEncoderSetExtraChannelBuffer must not be used for this frame.
+ *
+ * All callbacks are called before this function returns, so the input source
+ * does not need to outlive this call.
+ *
+ * This does not lower the peak memory use of the encoder: the rectangles are
+ * converted into a copy of the whole frame, with 4 bytes per sample for every
+ * channel, which is then encoded as a frame added with @ref
+ * JxlEncoderAddImageFrame would be. Only the caller's own buffer of the
+ * whole frame is avoided.
+ *
+ * @param frame_settings set of options and metadata for this frame. Also
+ * includes reference to the encoder object.
+ * @param is_last_frame if true, @ref JxlEncoderCloseFrames is called after
+ * adding this frame.
+ * @param chunked_frame_input the input source of the frame pixels.
+ * @return JXL_ENC_SUCCESS on success, JXL_ENC_ERROR on error
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderAddChunkedFrame(
+    const JxlEncoderFrameSettings* frame_settings, JXL_BOOL is_last_frame,
+    JxlChunkedFrameInputSource chunked_frame_input);
+
 /** Adds a metadata box to the file format. JxlEncoderProcessOutput must be used
  * to effectively write the box to the output. @ref JxlEncoderUseBoxes must
  * be enabled before using this function.
@@ -962,6 +1216,80 @@ JXL_EXPORT JxlEncoderStatus JxlEncoderFrameSettingsSetFloatOption(
     JxlEncoderFrameSettings* frame_settings, JxlEncoderFrameSettingId option,
     float value);
 
+/**
+ * Estimates the largest number of bytes the encoder will have allocated at
+ * once while encoding a frame added with the given frame settings and the
+ * current basic info, including the frame's input image. With
+ * JXL_ENC_FRAME_SETTING_MAX_MEMORY, this is the estimate for the settings
+ * after they were lowered to fit the limit. Fast lossless and JPEG frames are
+ * not covered. The estimate is rough and meant for admission control, the
+ * actual peak can differ depending on the image content.
+ *
+ * @param frame_settings set of options and metadata for the frame.
+ * @param peak_bytes receives the estimated number of bytes.
+ * @return JXL_ENC_SUCCESS if the estimate was computed.
+ * @return JXL_ENC_ERROR if the basic info is not set yet, or if the frame does
+ * not fit JXL_ENC_FRAME_SETTING_MAX_MEMORY, in which case
+ * @ref JxlEncoderGetError returns JXL_ENC_ERR_OOM.
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderEstimatePeakMemory(
+    const JxlEncoderFrameSettings* frame_settings, size_t* peak_bytes);
+
+/**
+ * Keeps up to @p max_cached_bytes of the image buffers that the encoder frees
+ * to serve its later allocations of a similar size, instead of returning them
+ * to the memory manager. With @ref JxlEncoderRecycle, this lets encoding a
+ * series of images of similar sizes reuse the same memory. Buffers are
+ * rounded up to size classes, wasting at most a quarter of each buffer. The
+ * setting is kept by @ref JxlEncoderReset and @ref JxlEncoderRecycle, and the
+ * cached buffers are freed when it is lowered or the encoder is destroyed.
+ *
+ * @param enc encoder object.
+ * @param max_cached_bytes maximum number of bytes of freed buffers to keep,
+ *     or 0 to keep none (the default).
+ */
+JXL_EXPORT void JxlEncoderSetMemoryPool(JxlEncoder* enc,
+                                        size_t max_cached_bytes);
+
+/**
+ * Starts or stops recording how long the calls that the encoder makes to the
+ * parallel runner set with @ref JxlEncoderSetParallelRunner take, grouped by
+ * the part of the encoder making them. Without a parallel runner, nothing is
+ * recorded. Enabling clears the statistics recorded so far. The setting and
+ * the statistics are kept by @ref JxlEncoderReset and @ref JxlEncoderRecycle.
+ *
+ * @param enc encoder object.
+ * @param enabled JXL_TRUE to start recording, JXL_FALSE to stop.
+ */
+JXL_EXPORT void JxlEncoderSetRunnerStats(JxlEncoder* enc, JXL_BOOL enabled);
+
+/**
+ * Returns the size in bytes, including the terminating null character, of
+ * the statistics returned by @ref JxlEncoderGetRunnerStats.
+ *
+ * @param enc encoder object.
+ * @param size output for the size.
+ * @return JXL_ENC_SUCCESS if no error, JXL_ENC_ERROR if the statistics were
+ * never enabled.
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderGetRunnerStatsSize(JxlEncoder* enc,
+                                                         size_t* size);
+
+/**
+ * Writes the statistics recorded since @ref JxlEncoderSetRunnerStats enabled
+ * them as a null-terminated JSON object, in the format described for @ref
+ * JxlDecoderGetRunnerStats.
+ *
+ * @param enc encoder object.
+ * @param json buffer to write the statistics to.
+ * @param size size of @p json, at least the size given by @ref
+ * JxlEncoderGetRunnerStatsSize.
+ * @return JXL_ENC_SUCCESS if no error, JXL_ENC_ERROR if the statistics were
+ * never enabled or the buffer is too small.
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderGetRunnerStats(JxlEncoder* enc,
+                                                     char* json, size_t size);
+
 /** Forces the encoder to use the box-based container format (BMFF) even
  * when not necessary.
  *
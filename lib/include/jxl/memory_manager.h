@@ -46,7 +46,11 @@ typedef void (*jpegxl_free_func)(void* opaque, void* address);
 /**
  * Memory Manager struct.
  * These functions, when provided by the caller, will be used to handle memory
- * allocations.
+ * allocations. They need not be thread-safe: the image buffers of an encoder
+ * or decoder may be allocated and freed by the threads of its parallel
+ * runner, but these calls are never made concurrently for one instance.
+ * Different instances may call them concurrently, so a manager shared by the
+ * encoders passed to @ref JxlEncoderProcessBatch must be thread-safe.
  */
 typedef struct JxlMemoryManagerStruct {
   /** The opaque pointer that will be passed as the first parameter to all the
@@ -38,6 +38,7 @@
 #include "jxl/jxl_threads_export.h"
 #include "jxl/memory_manager.h"
 #include "jxl/parallel_runner.h"
+#include "jxl/types.h"
 
 #if defined(__cplusplus) || defined(c_plusplus)
 extern "C" {
@@ -55,6 +56,114 @@ JXL_THREADS_EXPORT JxlParallelRetCode JxlThreadParallelRunner(
 JXL_THREADS_EXPORT void* JxlThreadParallelRunnerCreate(
     const JxlMemoryManager* memory_manager, size_t num_worker_threads);
 
+/** Placement of the worker threads of a JxlThreadParallelRunner, see @ref
+ * JxlThreadParallelRunnerCreateWithOptions.
+ */
+typedef struct {
+  /** Number of worker threads to create, as for @ref
+   * JxlThreadParallelRunnerCreate.
+   */
+  size_t num_worker_threads;
+
+  /** CPUs to pin the worker threads to: worker i only runs on CPU cpus[i %
+   * num_cpus]. NULL or 0 CPUs to not pin the workers. Pinning is only
+   * supported on Linux and is skipped where it fails.
+   */
+  const int* cpus;
+  size_t num_cpus;
+
+  /** NUMA node of each of the @p num_cpus CPUs, or NULL to look it up from
+   * the system. Only used with @p numa_partition.
+   */
+  const int* cpu_nodes;
+
+  /** If JXL_TRUE and the pinned workers are on several NUMA nodes, splits the
+   * tasks of every call into one contiguous range per node, in proportion to
+   * the workers of the node, which start with the tasks of their own range
+   * and only help with the other ranges once it is done. Adjacent tasks, such
+   * as the groups of one area of an image, are then processed and their
+   * buffers first touched on the same node.
+   */
+  JXL_BOOL numa_partition;
+} JxlThreadParallelRunnerOptions;
+
+/** Creates the runner for JxlThreadParallelRunner with the given placement of
+ * its worker threads. Use as the opaque runner.
+ *
+ * @return NULL if @p options is NULL or invalid, or if the runner can not be
+ * allocated.
+ */
+JXL_THREADS_EXPORT void* JxlThreadParallelRunnerCreateWithOptions(
+    const JxlMemoryManager* memory_manager,
+    const JxlThreadParallelRunnerOptions* options);
+
+/** Time and number of tasks of one thread of a JxlThreadParallelRunner, see
+ * @ref JxlThreadParallelRunnerGetStats.
+ */
+typedef struct {
+  /** Number of tasks the thread ran. */
+  uint64_t num_tasks;
+
+  /** Nanoseconds the thread spent running tasks. */
+  uint64_t busy_ns;
+
+  /** Nanoseconds from the start to the end of the calls during which the
+   * thread did not run a task: waking up, waiting for the other threads to
+   * finish their last tasks, or having no task at all.
+   */
+  uint64_t idle_ns;
+
+  /** Part of @p idle_ns from the start of the calls until the thread started
+   * its first task.
+   */
+  uint64_t wake_ns;
+} JxlThreadParallelRunnerThreadStats;
+
+/** Totals of the calls to a JxlThreadParallelRunner, see @ref
+ * JxlThreadParallelRunnerGetStats.
+ */
+typedef struct {
+  /** Number of calls and the tasks they had. */
+  uint64_t num_calls;
+  uint64_t num_tasks;
+
+  /** Nanoseconds from the start to the end of the calls. */
+  uint64_t wall_ns;
+
+  /** Number of threads that run tasks: the number of worker threads, or 1
+   * if tasks run on the calling thread.
+   */
+  size_t num_threads;
+} JxlThreadParallelRunnerStats;
+
+/** Starts or stops recording statistics of the calls to the runner. Enabling
+ * them clears the statistics recorded so far. Recording adds two clock reads
+ * to each chunk of tasks that a thread reserves. Must not be called while the
+ * runner is running tasks.
+ *
+ * @param runner_opaque runner created by @ref JxlThreadParallelRunnerCreate.
+ * @param enabled JXL_TRUE to start recording, JXL_FALSE to stop.
+ */
+JXL_THREADS_EXPORT void JxlThreadParallelRunnerSetStatsEnabled(
+    void* runner_opaque, JXL_BOOL enabled);
+
+/** Returns the statistics recorded since they were enabled. Must not be
+ * called while the runner is running tasks.
+ *
+ * A thread with a much larger @p busy_ns than the others points to tasks of
+ * unequal size, a large @p idle_ns on all threads to calls with fewer tasks
+ * than threads or to serial work between them.
+ *
+ * @param runner_opaque runner created by @ref JxlThreadParallelRunnerCreate.
+ * @param stats receives the totals of the calls.
+ * @param threads receives the statistics of the first @p num_threads threads,
+ *     may be NULL if @p num_threads is 0.
+ * @param num_threads size of @p threads.
+ */
+JXL_THREADS_EXPORT void JxlThreadParallelRunnerGetStats(
+    const void* runner_opaque, JxlThreadParallelRunnerStats* stats,
+    JxlThreadParallelRunnerThreadStats* threads, size_t num_threads);
+
 /** Destroys the runner created by JxlThreadParallelRunnerCreate.
  */
 JXL_THREADS_EXPORT void JxlThreadParallelRunnerDestroy(void* runner_opaque);
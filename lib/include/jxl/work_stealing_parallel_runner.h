@@ -0,0 +1,130 @@
+/* Copyright (c) the JPEG XL Project Authors. All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/** @addtogroup libjxl_threads
+ * @{
+ * @file work_stealing_parallel_runner.h
+ * @brief implementation using std::thread of a work-stealing
+ * ::JxlParallelRunner that allows nested and concurrent calls.
+ */
+
+/** Implementation of JxlParallelRunner than can be used to enable
+ * multithreading when using the JPEG XL library. This uses std::thread
+ * internally and related synchronization functions. The number of threads
+ * created is fixed at construction time.
+ *
+ * Unlike @ref thread_parallel_runner.h, any number of
+ * JxlWorkStealingParallelRunner calls per instance are allowed at a time: a
+ * task may itself call the runner, and several encoder or decoder instances on
+ * different threads may share one runner. Each call is queued on the worker
+ * thread that makes it, or on a shared queue for other threads, and idle
+ * workers steal the oldest calls of the other queues. A worker that waits for
+ * the tasks of its nested call to finish runs other tasks meanwhile, so nesting
+ * does not leave threads idle.
+ *
+ * Within one call, tasks are claimed one at a time, which balances tasks of
+ * irregular sizes. The thread id passed to the tasks is the index of the
+ * worker thread, or @p num_worker_threads for the calling thread if it is not
+ * a worker; the number of threads passed to the init function is always
+ * @p num_worker_threads + 1. No two tasks of the same call run at once with
+ * the same thread id.
+ *
+ * Several clients, each with its own runner opaque and priority, can be
+ * attached to the same worker threads, for example one per encoder or decoder
+ * instance, or to a worker pool shared by the whole process. Idle workers
+ * help with the calls of the highest priority first, and share themselves
+ * between the clients of the same priority by joining the call of the client
+ * that the fewest workers help. Workers helping with a call switch to a newly
+ * queued call of a higher priority after their current task. The thread that
+ * makes a call always runs its tasks too, so the worker threads are the only
+ * threads the runner adds to the process.
+ */
+
+#ifndef JXL_WORK_STEALING_PARALLEL_RUNNER_H_
+#define JXL_WORK_STEALING_PARALLEL_RUNNER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "jxl/jxl_threads_export.h"
+#include "jxl/memory_manager.h"
+#include "jxl/parallel_runner.h"
+
+#if defined(__cplusplus) || defined(c_plusplus)
+extern "C" {
+#endif
+
+/** Priority class of the calls of a client of a JxlWorkStealingParallelRunner.
+ */
+typedef enum {
+  /** Work that may wait, such as re-encoding in the background. */
+  JXL_PARALLEL_RUNNER_PRIORITY_BACKGROUND = 0,
+  /** The priority of the client returned by
+   * @ref JxlWorkStealingParallelRunnerCreate. */
+  JXL_PARALLEL_RUNNER_PRIORITY_NORMAL = 1,
+  /** Work that a user waits for, such as decoding an image being displayed. */
+  JXL_PARALLEL_RUNNER_PRIORITY_INTERACTIVE = 2,
+} JxlParallelRunnerPriority;
+
+/** Parallel runner internally using std::thread. Use as JxlParallelRunner.
+ */
+JXL_THREADS_EXPORT JxlParallelRetCode JxlWorkStealingParallelRunner(
+    void* runner_opaque, void* jpegxl_opaque, JxlParallelRunInit init,
+    JxlParallelRunFunction func, uint32_t start_range, uint32_t end_range);
+
+/** Creates the runner for JxlWorkStealingParallelRunner with its own worker
+ * threads, and returns a client of it with @ref
+ * JXL_PARALLEL_RUNNER_PRIORITY_NORMAL. Use as the opaque runner. With 0
+ * worker threads, all tasks run on the calling thread. The runner and the
+ * client are allocated with @p memory_manager, which may be NULL to use
+ * malloc and free.
+ *
+ * @return the new client, or NULL if @p memory_manager is invalid or the
+ * allocation failed.
+ */
+JXL_THREADS_EXPORT void* JxlWorkStealingParallelRunnerCreate(
+    const JxlMemoryManager* memory_manager, size_t num_worker_threads);
+
+/** Attaches another client to the worker threads of the client @p
+ * runner_opaque. Use as the opaque runner. The new client is allocated with
+ * the memory manager of @p runner_opaque.
+ *
+ * @return the new client, or NULL if @p priority is invalid or the allocation
+ * failed.
+ */
+JXL_THREADS_EXPORT void* JxlWorkStealingParallelRunnerAttach(
+    void* runner_opaque, JxlParallelRunnerPriority priority);
+
+/** Attaches a client to the worker threads shared by the whole process. Use
+ * as the opaque runner. The shared workers are started by the first client,
+ * with @p num_worker_threads threads or one per hardware thread if 0, which
+ * caps the worker threads of all the clients; the value is ignored while
+ * other clients are attached. The workers stop when the last client is
+ * destroyed. The shared runner and its clients are allocated with malloc.
+ *
+ * @return the new client, or NULL if @p priority is invalid or the allocation
+ * failed.
+ */
+JXL_THREADS_EXPORT void* JxlWorkStealingParallelRunnerAttachShared(
+    JxlParallelRunnerPriority priority, size_t num_worker_threads);
+
+/** Destroys a client returned by @ref JxlWorkStealingParallelRunnerCreate,
+ * @ref JxlWorkStealingParallelRunnerAttach or @ref
+ * JxlWorkStealingParallelRunnerAttachShared. The worker threads stop with
+ * their last client. No call of the client may be running.
+ */
+JXL_THREADS_EXPORT void JxlWorkStealingParallelRunnerDestroy(
+    void* runner_opaque);
+
+#if defined(__cplusplus) || defined(c_plusplus)
+}
+#endif
+
+#endif /* JXL_WORK_STEALING_PARALLEL_RUNNER_H_ */
+
+/** @}*/
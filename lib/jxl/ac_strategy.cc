@@ -94,6 +94,12 @@ AcStrategyImage::AcStrategyImage(size_t xsize, size_t ysize)
   stride_ = layers_.PixelsPerRow();
 }
 
+void AcStrategyImage::ReuseOrAllocate(size_t xsize, size_t ysize) {
+  layers_.ReuseOrAllocate(xsize, ysize);
+  row_ = layers_.Row(0);
+  stride_ = layers_.PixelsPerRow();
+}
+
 size_t AcStrategyImage::CountBlocks(AcStrategy::Type type) const {
   size_t ret = 0;
   for (size_t y = 0; y < layers_.ysize(); y++) {
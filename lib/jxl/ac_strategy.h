@@ -195,6 +195,9 @@ class AcStrategyImage {
   AcStrategyImage(AcStrategyImage&&) = default;
   AcStrategyImage& operator=(AcStrategyImage&&) = default;
 
+  // See Plane::ReuseOrAllocate.
+  void ReuseOrAllocate(size_t xsize, size_t ysize);
+
   void FillDCT8(const Rect& rect) {
     FillPlane<uint8_t>((static_cast<uint8_t>(AcStrategy::Type::DCT) << 1) | 1,
                        &layers_, rect);
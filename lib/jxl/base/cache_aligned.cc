@@ -8,7 +8,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-// Disabled: slower than malloc + alignment.
+// Disabled: slower than malloc + alignment. The blocks would then bypass the
+// memory manager and pool of the AllocationTracker, which only counts them.
 #define JXL_USE_MMAP 0
 
 #if JXL_USE_MMAP
@@ -19,6 +20,9 @@
 #include <atomic>
 #include <hwy/base.h>  // kMaxVectorSize
 #include <limits>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/status.h"
@@ -30,6 +34,7 @@ namespace {
 struct AllocationHeader {
   void* allocated;
   size_t allocated_size;
+  AllocationTracker* tracker;
   uint8_t left_padding[hwy::kMaxVectorSize];
 };
 #pragma pack(pop)
@@ -38,8 +43,124 @@ std::atomic<uint64_t> num_allocations{0};
 std::atomic<uint64_t> bytes_in_use{0};
 std::atomic<uint64_t> max_bytes_in_use{0};
 
+thread_local AllocationTracker* thread_tracker = nullptr;
+
+// Rounds up to one of four size classes per power of two, so that blocks of
+// similar sizes (e.g. planes of groups at the image edge) share a class while
+// wasting at most a quarter of the block.
+size_t PoolSizeClass(const size_t size) {
+  if (size <= 4096) return hwy::RoundUpTo(size, 64);
+  size_t step = 1;
+  while (step <= size / 8) step <<= 1;
+  return hwy::RoundUpTo(size, step);
+}
+
 }  // namespace
 
+struct AllocationTracker::Pool {
+  // Guards the fields below, and is only held for these.
+  std::mutex mutex;
+  size_t limit = 0;
+  size_t cached_bytes = 0;
+  // Freed blocks by size.
+  std::unordered_map<size_t, std::vector<void*>> blocks;
+  // Serializes the calls of the memory manager, see below.
+  std::mutex manager_mutex;
+};
+
+AllocationTracker::AllocationTracker() : pool_(new Pool()) {}
+
+AllocationTracker::~AllocationTracker() { SetPoolLimit(0); }
+
+// The memory manager is not required to be thread-safe, but blocks are
+// allocated and freed by the worker threads of the parallel runner, so its
+// calls are serialized. This uses a lock of its own, so that blocks reused
+// from the pool do not wait for the memory manager, and the malloc fallback
+// takes no lock at all.
+void* AllocationTracker::ManagerAlloc(const size_t size) {
+  if (!memory_manager_.alloc) return malloc(size);
+  std::lock_guard<std::mutex> lock(pool_->manager_mutex);
+  return memory_manager_.alloc(memory_manager_.opaque, size);
+}
+
+void AllocationTracker::ManagerFree(void* block) {
+  if (!memory_manager_.free) {
+    free(block);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(pool_->manager_mutex);
+  memory_manager_.free(memory_manager_.opaque, block);
+}
+
+void AllocationTracker::SetPoolLimit(const size_t max_cached_bytes) {
+  std::vector<void*> evicted;
+  {
+    std::lock_guard<std::mutex> lock(pool_->mutex);
+    pool_->limit = max_cached_bytes;
+    for (auto& bucket : pool_->blocks) {
+      while (pool_->cached_bytes > pool_->limit && !bucket.second.empty()) {
+        evicted.push_back(bucket.second.back());
+        bucket.second.pop_back();
+        pool_->cached_bytes -= bucket.first;
+      }
+    }
+  }
+  for (void* block : evicted) ManagerFree(block);
+}
+
+size_t AllocationTracker::CachedBytes() const {
+  std::lock_guard<std::mutex> lock(pool_->mutex);
+  return pool_->cached_bytes;
+}
+
+void* AllocationTracker::AllocateBlock(size_t* size) {
+  {
+    std::lock_guard<std::mutex> lock(pool_->mutex);
+    if (pool_->limit != 0) {
+      *size = PoolSizeClass(*size);
+      auto it = pool_->blocks.find(*size);
+      if (it != pool_->blocks.end() && !it->second.empty()) {
+        void* block = it->second.back();
+        it->second.pop_back();
+        pool_->cached_bytes -= *size;
+        return block;
+      }
+    }
+  }
+  return ManagerAlloc(*size);
+}
+
+void AllocationTracker::FreeBlock(void* block, const size_t size) {
+  {
+    std::lock_guard<std::mutex> lock(pool_->mutex);
+    if (pool_->cached_bytes + size <= pool_->limit) {
+      pool_->blocks[size].push_back(block);
+      pool_->cached_bytes += size;
+      return;
+    }
+  }
+  ManagerFree(block);
+}
+
+void AllocationTracker::Add(const size_t bytes) {
+  const size_t prev = bytes_in_use_.fetch_add(bytes, std::memory_order_acq_rel);
+  size_t expected_max = max_bytes_in_use_.load(std::memory_order_acquire);
+  while (expected_max < prev + bytes &&
+         !max_bytes_in_use_.compare_exchange_weak(expected_max, prev + bytes,
+                                                  std::memory_order_acq_rel)) {
+  }
+}
+
+void AllocationTracker::Remove(const size_t bytes) {
+  bytes_in_use_.fetch_sub(bytes, std::memory_order_acq_rel);
+}
+
+AllocationTracker* CacheAligned::ThreadTracker() { return thread_tracker; }
+
+void CacheAligned::SetThreadTracker(AllocationTracker* tracker) {
+  thread_tracker = tracker;
+}
+
 // Avoids linker errors in pre-C++17 builds.
 constexpr size_t CacheAligned::kPointerSize;
 constexpr size_t CacheAligned::kCacheLineSize;
@@ -84,8 +205,10 @@ void* CacheAligned::Allocate(const size_t payload_size, size_t offset) {
   if (allocated == MAP_FAILED) return nullptr;
   const uintptr_t aligned = reinterpret_cast<uintptr_t>(allocated);
 #else
-  const size_t allocated_size = kAlias + offset + payload_size;
-  void* allocated = malloc(allocated_size);
+  size_t allocated_size = kAlias + offset + payload_size;
+  AllocationTracker* tracker = thread_tracker;
+  void* allocated = tracker ? tracker->AllocateBlock(&allocated_size)
+                            : malloc(allocated_size);
   if (allocated == nullptr) return nullptr;
   // Always round up even if already aligned - we already asked for kAlias
   // extra bytes and there's no way to give them back.
@@ -130,6 +253,12 @@ void* CacheAligned::Allocate(const size_t payload_size, size_t offset) {
   AllocationHeader* header = reinterpret_cast<AllocationHeader*>(payload) - 1;
   header->allocated = allocated;
   header->allocated_size = allocated_size;
+  header->tracker = thread_tracker;
+  if (header->tracker != nullptr) {
+    // Keeps the memory manager and pool alive until the block is freed.
+    header->tracker->Ref();
+    header->tracker->Add(allocated_size);
+  }
 
   return JXL_ASSUME_ALIGNED(reinterpret_cast<void*>(payload), 64);
 }
@@ -146,12 +275,20 @@ void CacheAligned::Free(const void* aligned_pointer) {
   // Subtract (2's complement negation).
   bytes_in_use.fetch_add(~header->allocated_size + 1,
                          std::memory_order_acq_rel);
+  AllocationTracker* tracker = header->tracker;
+  if (tracker != nullptr) tracker->Remove(header->allocated_size);
 
 #if JXL_USE_MMAP
   munmap(header->allocated, header->allocated_size);
 #else
-  free(header->allocated);
+  if (tracker != nullptr) {
+    // The header is part of the block, so it cannot be used from here on.
+    tracker->FreeBlock(header->allocated, header->allocated_size);
+  } else {
+    free(header->allocated);
+  }
 #endif
+  if (tracker != nullptr) tracker->Unref();
 }
 
 }  // namespace jxl
@@ -11,12 +11,93 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <atomic>
 #include <memory>
 
+#include "jxl/memory_manager.h"
 #include "lib/jxl/base/compiler_specific.h"
 
 namespace jxl {
 
+class CacheAligned;
+
+// Accounts the bytes allocated via CacheAligned while it is installed as the
+// current thread's tracker (see AllocationTrackerScope), and obtains that
+// memory from its memory manager, optionally keeping freed blocks in a pool
+// for reuse. Reference counted because allocations keep their tracker alive
+// until they are freed, which may happen after the owner (e.g. a decoder) has
+// released it.
+class AllocationTracker {
+ public:
+  static AllocationTracker* Create() { return new AllocationTracker(); }
+
+  // Drops the owner's reference and frees the pooled blocks; blocks freed
+  // afterwards are returned to the memory manager directly.
+  void Release() {
+    SetPoolLimit(0);
+    Unref();
+  }
+
+  // Obtains the memory from `memory_manager` instead of malloc. Must be called
+  // before anything is allocated with this tracker.
+  void SetMemoryManager(const JxlMemoryManager& memory_manager) {
+    memory_manager_ = memory_manager;
+  }
+
+  // Keeps up to `max_cached_bytes` of freed blocks to serve later allocations
+  // of the same size class, or frees all of them if 0 (the default).
+  void SetPoolLimit(size_t max_cached_bytes);
+  // Bytes of freed blocks currently held by the pool.
+  size_t CachedBytes() const;
+
+  size_t BytesInUse() const {
+    return bytes_in_use_.load(std::memory_order_relaxed);
+  }
+  size_t MaxBytesInUse() const {
+    return max_bytes_in_use_.load(std::memory_order_relaxed);
+  }
+  // Restarts peak tracking from the current usage.
+  void ResetMaxBytesInUse() {
+    max_bytes_in_use_.store(BytesInUse(), std::memory_order_relaxed);
+  }
+
+ private:
+  friend class CacheAligned;
+  struct Pool;
+
+  AllocationTracker();
+  ~AllocationTracker();
+
+  // Returns a block of at least *size bytes and updates *size to the bytes
+  // actually reserved for it.
+  void* AllocateBlock(size_t* size);
+  void FreeBlock(void* block, size_t size);
+  // Calls of the memory manager, or malloc and free if none was set.
+  void* ManagerAlloc(size_t size);
+  void ManagerFree(void* block);
+  void Add(size_t bytes);
+  void Remove(size_t bytes);
+  void Ref() { refs_.fetch_add(1, std::memory_order_relaxed); }
+  void Unref() {
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
+  }
+
+  std::atomic<size_t> refs_{1};
+  std::atomic<size_t> bytes_in_use_{0};
+  std::atomic<size_t> max_bytes_in_use_{0};
+  JxlMemoryManager memory_manager_ = {};
+  std::unique_ptr<Pool> pool_;
+};
+
+struct AllocationTrackerReleaser {
+  void operator()(AllocationTracker* tracker) const {
+    if (tracker) tracker->Release();
+  }
+};
+
+using AllocationTrackerPtr =
+    std::unique_ptr<AllocationTracker, AllocationTrackerReleaser>;
+
 // Functions that depend on the cache line size.
 class CacheAligned {
  public:
@@ -44,6 +125,26 @@ class CacheAligned {
   }
 
   static void Free(const void* aligned_pointer);
+
+  // Tracker charged by allocations made on the calling thread, or null.
+  static AllocationTracker* ThreadTracker();
+  static void SetThreadTracker(AllocationTracker* tracker);
+};
+
+// Installs `tracker` as the calling thread's tracker for the lifetime of the
+// scope and restores the previous one afterwards.
+class AllocationTrackerScope {
+ public:
+  explicit AllocationTrackerScope(AllocationTracker* tracker)
+      : previous_(CacheAligned::ThreadTracker()) {
+    CacheAligned::SetThreadTracker(tracker);
+  }
+  ~AllocationTrackerScope() { CacheAligned::SetThreadTracker(previous_); }
+  AllocationTrackerScope(const AllocationTrackerScope&) = delete;
+  AllocationTrackerScope& operator=(const AllocationTrackerScope&) = delete;
+
+ private:
+  AllocationTracker* previous_;
 };
 
 // Avoids the need for a function pointer (deleter) in CacheAlignedUniquePtr.
@@ -5,8 +5,175 @@
 
 #include "lib/jxl/base/data_parallel.h"
 
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
 namespace jxl {
 
+constexpr size_t RunStats::kNumBuckets;
+
+struct RunStats::Impl {
+  mutable std::mutex mutex;
+  std::map<std::string, Site> sites;
+};
+
+RunStats::RunStats() : impl_(new Impl) {}
+RunStats::~RunStats() = default;
+
+// static
+uint64_t RunStats::NowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+RunStats::Call::Call(RunStats* stats, const char* caller, uint32_t num_tasks)
+    : stats_(stats),
+      caller_(caller),
+      num_tasks_(num_tasks),
+      start_ns_(stats ? NowNanos() : 0) {
+  if (!stats_) return;
+  for (auto& count : task_ns_log2_) count.store(0, std::memory_order_relaxed);
+}
+
+void RunStats::Call::Init(size_t num_threads) {
+  num_threads_ = num_threads;
+  busy_ns_.reset(new std::atomic<uint64_t>[num_threads]);
+  for (size_t i = 0; i < num_threads; ++i) {
+    busy_ns_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void RunStats::Call::AddTask(size_t thread, uint64_t task_ns) {
+  // Runners must call the init function before any task.
+  if (thread < num_threads_) {
+    busy_ns_[thread].fetch_add(task_ns, std::memory_order_relaxed);
+  }
+  uint64_t max = max_task_ns_.load(std::memory_order_relaxed);
+  while (task_ns > max && !max_task_ns_.compare_exchange_weak(
+                              max, task_ns, std::memory_order_relaxed)) {
+  }
+  size_t bucket = 0;
+  while (bucket + 1 < kNumBuckets && (task_ns >> (bucket + 1)) != 0) ++bucket;
+  task_ns_log2_[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+RunStats::Call::~Call() {
+  if (!stats_) return;
+  Site call;
+  call.num_calls = 1;
+  call.num_tasks = num_tasks_;
+  call.max_threads = num_threads_;
+  call.wall_ns = NowNanos() - start_ns_;
+  for (size_t i = 0; i < num_threads_; ++i) {
+    const uint64_t busy = busy_ns_[i].load(std::memory_order_relaxed);
+    call.busy_ns += busy;
+    call.max_thread_busy_ns = std::max(call.max_thread_busy_ns, busy);
+  }
+  if (num_threads_ != 0) call.mean_thread_busy_ns = call.busy_ns / num_threads_;
+  const uint64_t available_ns = call.wall_ns * num_threads_;
+  call.idle_ns = available_ns > call.busy_ns ? available_ns - call.busy_ns : 0;
+  call.max_task_ns = max_task_ns_.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < kNumBuckets; ++i) {
+    call.task_ns_log2[i] = task_ns_log2_[i].load(std::memory_order_relaxed);
+  }
+  stats_->Record(caller_, call);
+}
+
+void RunStats::Record(const char* caller, const Site& call) {
+  std::lock_guard<std::mutex> lock(impl_->mutex);
+  Site& site = impl_->sites[caller ? caller : ""];
+  site.num_calls += call.num_calls;
+  site.num_tasks += call.num_tasks;
+  site.max_threads = std::max(site.max_threads, call.max_threads);
+  site.wall_ns += call.wall_ns;
+  site.busy_ns += call.busy_ns;
+  site.idle_ns += call.idle_ns;
+  site.max_thread_busy_ns += call.max_thread_busy_ns;
+  site.mean_thread_busy_ns += call.mean_thread_busy_ns;
+  site.max_task_ns = std::max(site.max_task_ns, call.max_task_ns);
+  for (size_t i = 0; i < kNumBuckets; ++i) {
+    site.task_ns_log2[i] += call.task_ns_log2[i];
+  }
+}
+
+void RunStats::Clear() {
+  std::lock_guard<std::mutex> lock(impl_->mutex);
+  impl_->sites.clear();
+}
+
+bool RunStats::GetSite(const std::string& caller, Site* site) const {
+  std::lock_guard<std::mutex> lock(impl_->mutex);
+  auto it = impl_->sites.find(caller);
+  if (it == impl_->sites.end()) return false;
+  *site = it->second;
+  return true;
+}
+
+std::string RunStats::ToJSON() const {
+  std::vector<std::pair<std::string, Site>> sites;
+  {
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    sites.assign(impl_->sites.begin(), impl_->sites.end());
+  }
+  std::stable_sort(sites.begin(), sites.end(),
+                   [](const std::pair<std::string, Site>& a,
+                      const std::pair<std::string, Site>& b) {
+                     return a.second.wall_ns > b.second.wall_ns;
+                   });
+  std::string json = "{\"sites\":[";
+  char buf[64];
+  const auto add_field = [&](const char* name, uint64_t value) {
+    snprintf(buf, sizeof(buf), ",\"%s\":%" PRIu64, name, value);
+    json += buf;
+  };
+  const auto add_ratio = [&](const char* name, uint64_t num, uint64_t den) {
+    snprintf(buf, sizeof(buf), ",\"%s\":%.3f", name,
+             den == 0 ? 0.0 : static_cast<double>(num) / den);
+    json += buf;
+  };
+  for (size_t i = 0; i < sites.size(); ++i) {
+    const Site& site = sites[i].second;
+    json += i == 0 ? "{\"caller\":\"" : ",{\"caller\":\"";
+    for (char c : sites[i].first) {
+      if (c == '"' || c == '\\') json += '\\';
+      if (static_cast<unsigned char>(c) >= 0x20) json += c;
+    }
+    json += '"';
+    add_field("calls", site.num_calls);
+    add_field("tasks", site.num_tasks);
+    add_field("max_threads", site.max_threads);
+    add_field("wall_ns", site.wall_ns);
+    add_field("busy_ns", site.busy_ns);
+    add_field("idle_ns", site.idle_ns);
+    add_field("max_task_ns", site.max_task_ns);
+    // Average number of threads running tasks, and how much longer the
+    // busiest thread ran than the average one.
+    add_ratio("parallelism", site.busy_ns, site.wall_ns);
+    add_ratio("imbalance", site.max_thread_busy_ns, site.mean_thread_busy_ns);
+    size_t num_buckets = kNumBuckets;
+    while (num_buckets > 0 && site.task_ns_log2[num_buckets - 1] == 0) {
+      --num_buckets;
+    }
+    json += ",\"task_ns_log2\":[";
+    for (size_t b = 0; b < num_buckets; ++b) {
+      snprintf(buf, sizeof(buf), "%s%" PRIu64, b == 0 ? "" : ",",
+               site.task_ns_log2[b]);
+      json += buf;
+    }
+    json += "]}";
+  }
+  json += "]}";
+  return json;
+}
+
 // static
 JxlParallelRetCode ThreadPool::SequentialRunnerStatic(
     void* runner_opaque, void* jpegxl_opaque, JxlParallelRunInit init,
@@ -12,8 +12,13 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <atomic>
+#include <memory>
+#include <string>
+
 #include "jxl/parallel_runner.h"
 #include "lib/jxl/base/bits.h"
+#include "lib/jxl/base/cache_aligned.h"
 #include "lib/jxl/base/status.h"
 #if JXL_COMPILER_MSVC
 // suppress warnings about the const & applied to function types
@@ -22,6 +27,76 @@
 
 namespace jxl {
 
+// Timing statistics of the Run calls of the ThreadPools it is attached to,
+// grouped by their `caller` label. Thread-safe.
+class RunStats {
+ public:
+  // Durations of tasks are counted in kNumBuckets buckets, the i-th one
+  // holding tasks of [2^i, 2^(i+1)) nanoseconds.
+  static constexpr size_t kNumBuckets = 40;
+
+  struct Site {
+    uint64_t num_calls = 0;
+    uint64_t num_tasks = 0;
+    // Largest number of threads passed to the init function of a call.
+    uint64_t max_threads = 0;
+    // Sum over the calls of the time from the start of the call to its end.
+    uint64_t wall_ns = 0;
+    // Time spent in tasks, summed over all threads.
+    uint64_t busy_ns = 0;
+    // Sum over the calls of wall time times threads, minus the busy time:
+    // time a thread of the call was not running one of its tasks.
+    uint64_t idle_ns = 0;
+    // Sum over the calls of the busy time of their busiest thread, and of
+    // the mean busy time of their threads; their ratio is the imbalance.
+    uint64_t max_thread_busy_ns = 0;
+    uint64_t mean_thread_busy_ns = 0;
+    uint64_t max_task_ns = 0;
+    uint64_t task_ns_log2[kNumBuckets] = {};
+  };
+
+  // State of one Run call; does nothing if `stats` is null.
+  class Call {
+   public:
+    Call(RunStats* stats, const char* caller, uint32_t num_tasks);
+    ~Call();
+    Call(const Call&) = delete;
+    Call& operator=(const Call&) = delete;
+
+    bool enabled() const { return stats_ != nullptr; }
+    void Init(size_t num_threads);
+    void AddTask(size_t thread, uint64_t task_ns);
+
+   private:
+    RunStats* const stats_;
+    const char* const caller_;
+    const uint32_t num_tasks_;
+    const uint64_t start_ns_;
+    size_t num_threads_ = 0;
+    std::unique_ptr<std::atomic<uint64_t>[]> busy_ns_;
+    std::atomic<uint64_t> max_task_ns_{0};
+    std::atomic<uint64_t> task_ns_log2_[kNumBuckets];
+  };
+
+  RunStats();
+  ~RunStats();
+
+  static uint64_t NowNanos();
+
+  void Clear();
+  // Returns whether a site with the given label was recorded, and its stats.
+  bool GetSite(const std::string& caller, Site* site) const;
+  // Returns the stats of all sites as a JSON object, with the sites in
+  // decreasing order of wall time.
+  std::string ToJSON() const;
+
+ private:
+  struct Impl;
+  // Adds the stats of one call.
+  void Record(const char* caller, const Site& call);
+  std::unique_ptr<Impl> impl_;
+};
+
 class ThreadPool {
  public:
   ThreadPool(JxlParallelRunner runner, void* runner_opaque)
@@ -34,6 +109,11 @@ class ThreadPool {
   JxlParallelRunner runner() const { return runner_; }
   void* runner_opaque() const { return runner_opaque_; }
 
+  // Records the timing of all subsequent calls to Run in `stats`, if not
+  // null. Run is slightly slower while recording.
+  void SetStats(RunStats* stats) { stats_ = stats; }
+  RunStats* stats() const { return stats_; }
+
   // Runs init_func(num_threads) followed by data_func(task, thread) on worker
   // thread(s) for every task in [begin, end). init_func() must return a Status
   // indicating whether the initialization succeeded.
@@ -47,7 +127,9 @@ class ThreadPool {
              const DataFunc& data_func, const char* caller = "") {
     JXL_ASSERT(begin <= end);
     if (begin == end) return true;
-    RunCallState<InitFunc, DataFunc> call_state(init_func, data_func);
+    RunStats::Call stats_call(stats_, caller, end - begin);
+    RunCallState<InitFunc, DataFunc> call_state(init_func, data_func,
+                                                &stats_call);
     // The runner_ uses the C convention and returns 0 in case of error, so we
     // convert it to a Status.
     return (*runner_)(runner_opaque_, static_cast<void*>(&call_state),
@@ -64,13 +146,19 @@ class ThreadPool {
   template <class InitFunc, class DataFunc>
   class RunCallState final {
    public:
-    RunCallState(const InitFunc& init_func, const DataFunc& data_func)
-        : init_func_(init_func), data_func_(data_func) {}
+    RunCallState(const InitFunc& init_func, const DataFunc& data_func,
+                 RunStats::Call* stats_call)
+        : init_func_(init_func),
+          data_func_(data_func),
+          tracker_(CacheAligned::ThreadTracker()),
+          stats_call_(stats_call) {}
 
     // JxlParallelRunInit interface.
     static int CallInitFunc(void* jpegxl_opaque, size_t num_threads) {
       const auto* self =
           static_cast<RunCallState<InitFunc, DataFunc>*>(jpegxl_opaque);
+      AllocationTrackerScope scope(self->tracker_);
+      if (self->stats_call_->enabled()) self->stats_call_->Init(num_threads);
       // Returns -1 when the internal init function returns false Status to
       // indicate an error.
       return self->init_func_(num_threads) ? 0 : -1;
@@ -81,12 +169,21 @@ class ThreadPool {
                              size_t thread_id) {
       const auto* self =
           static_cast<RunCallState<InitFunc, DataFunc>*>(jpegxl_opaque);
-      return self->data_func_(value, thread_id);
+      // Allocations made by workers are charged to the caller's tracker.
+      AllocationTrackerScope scope(self->tracker_);
+      if (!self->stats_call_->enabled()) {
+        return self->data_func_(value, thread_id);
+      }
+      const uint64_t start_ns = RunStats::NowNanos();
+      self->data_func_(value, thread_id);
+      self->stats_call_->AddTask(thread_id, RunStats::NowNanos() - start_ns);
     }
 
    private:
     const InitFunc& init_func_;
     const DataFunc& data_func_;
+    AllocationTracker* const tracker_;
+    RunStats::Call* const stats_call_;
   };
 
   // Default JxlParallelRunner used when no runner is provided by the
@@ -98,6 +195,7 @@ class ThreadPool {
   // The caller supplied runner function and its opaque void*.
   const JxlParallelRunner runner_;
   void* const runner_opaque_;
+  RunStats* stats_ = nullptr;
 };
 
 template <class InitFunc, class DataFunc>
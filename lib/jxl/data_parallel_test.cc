@@ -5,6 +5,10 @@
 
 #include "lib/jxl/base/data_parallel.h"
 
+#include <atomic>
+#include <chrono>
+#include <thread>
+
 #include "gtest/gtest.h"
 #include "lib/jxl/base/thread_pool_internal.h"
 #include "lib/jxl/test_utils.h"
@@ -86,4 +90,53 @@ TEST_F(DataParallelTest, RunnerNotCalledOnEmptyRange) {
   EXPECT_EQ(0, runner_called_);
 }
 
+TEST(RunStatsTest, RecordsCallsBySite) {
+  ThreadPoolInternal pool(4);
+  RunStats stats;
+  pool.SetStats(&stats);
+  std::atomic<uint32_t> num_run{0};
+  const auto sleepy_task = [&](uint32_t task, size_t /* thread */) {
+    // One long task makes the call imbalanced.
+    std::this_thread::sleep_for(std::chrono::milliseconds(task == 0 ? 20 : 1));
+    num_run++;
+  };
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_TRUE(RunOnPool(&pool, 0, 8, ThreadPool::NoInit, sleepy_task,
+                          "Sleepy"));
+  }
+  EXPECT_TRUE(RunOnPool(
+      &pool, 0, 3, ThreadPool::NoInit,
+      [](uint32_t /* task */, size_t /* thread */) {}, "Empty"));
+  pool.SetStats(nullptr);
+  EXPECT_TRUE(RunOnPool(&pool, 0, 8, ThreadPool::NoInit, sleepy_task,
+                        "Sleepy"));
+  EXPECT_EQ(24u, num_run.load());
+
+  RunStats::Site site;
+  ASSERT_TRUE(stats.GetSite("Sleepy", &site));
+  EXPECT_EQ(2u, site.num_calls);
+  EXPECT_EQ(16u, site.num_tasks);
+  EXPECT_EQ(pool.NumThreads(), site.max_threads);
+  EXPECT_GE(site.max_task_ns, 20000000u);
+  EXPECT_GE(site.busy_ns, 2 * 27000000u);
+  EXPECT_LE(site.busy_ns, site.wall_ns * site.max_threads);
+  EXPECT_EQ(site.wall_ns * site.max_threads - site.busy_ns, site.idle_ns);
+  EXPECT_GT(site.max_thread_busy_ns, site.mean_thread_busy_ns);
+  uint64_t num_counted = 0;
+  for (uint64_t count : site.task_ns_log2) num_counted += count;
+  EXPECT_EQ(16u, num_counted);
+  // All tasks take at least 1 ms, more than 2^19 ns.
+  for (size_t i = 0; i < 19; ++i) EXPECT_EQ(0u, site.task_ns_log2[i]);
+
+  ASSERT_TRUE(stats.GetSite("Empty", &site));
+  EXPECT_EQ(1u, site.num_calls);
+  EXPECT_FALSE(stats.GetSite("Other", &site));
+
+  const std::string json = stats.ToJSON();
+  EXPECT_EQ(0u, json.find("{\"sites\":[{\"caller\":\"Sleepy\",\"calls\":2,"));
+  EXPECT_NE(std::string::npos, json.find("{\"caller\":\"Empty\",\"calls\":1,"));
+  stats.Clear();
+  EXPECT_EQ("{\"sites\":[]}", stats.ToJSON());
+}
+
 }  // namespace jxl
@@ -45,6 +45,8 @@ class ACImage {
   virtual void ZeroFill() = 0;
   virtual void ZeroFillPlane(size_t c) = 0;
   virtual bool IsEmpty() const = 0;
+  // See Plane::ReuseOrAllocate.
+  virtual void ReuseOrAllocate(size_t xsize, size_t ysize) = 0;
 };
 
 template <typename T>
@@ -77,6 +79,10 @@ class ACImageT final : public ACImage {
     return img_.xsize() == 0 || img_.ysize() == 0;
   }
 
+  void ReuseOrAllocate(size_t xsize, size_t ysize) override {
+    img_.ReuseOrAllocate(xsize, ysize);
+  }
+
  private:
   Image3<T> img_;
 };
@@ -152,8 +152,11 @@ class ANSSymbolReader {
  public:
   // Invalid symbol reader, to be overwritten.
   ANSSymbolReader() = default;
+  // If `window_storage` is not null, the LZ77 window is kept there instead of
+  // being allocated for this reader, so that it can be reused by later ones.
   ANSSymbolReader(const ANSCode* code, BitReader* JXL_RESTRICT br,
-                  size_t distance_multiplier = 0)
+                  size_t distance_multiplier = 0,
+                  CacheAlignedUniquePtr* window_storage = nullptr)
       : alias_tables_(
             reinterpret_cast<AliasTable::Entry*>(code->alias_tables.get())),
         huffman_data_(code->huffman_data.data()),
@@ -170,8 +173,13 @@ class ANSSymbolReader {
     if (!code->lz77.enabled) return;
     // a std::vector incurs unacceptable decoding speed loss because of
     // initialization.
-    lz77_window_storage_ = AllocateArray(kWindowSize * sizeof(uint32_t));
-    lz77_window_ = reinterpret_cast<uint32_t*>(lz77_window_storage_.get());
+    // The window is only read where it was written by this reader, so reusing
+    // the storage of an earlier one is fine.
+    if (window_storage == nullptr) window_storage = &lz77_window_storage_;
+    if (!*window_storage) {
+      *window_storage = AllocateArray(kWindowSize * sizeof(uint32_t));
+    }
+    lz77_window_ = reinterpret_cast<uint32_t*>(window_storage->get());
     lz77_ctx_ = code->lz77.nonserialized_distance_context;
     lz77_length_uint_ = code->lz77.length_uint_config;
     lz77_threshold_ = code->lz77.min_symbol;
@@ -214,9 +214,14 @@ Status PassesDecoderState::PreparePipeline(ImageBundle* decoded,
     }
 
     if (main_output.callback.IsPresent() || main_output.buffer) {
-      builder.AddStage(GetWriteToOutputStage(main_output, width, height,
-                                             has_alpha, unpremul_alpha, alpha_c,
-                                             undo_orientation, extra_output));
+      Rect region = crop;
+      if (downsampling > 1 && region.xsize() == 0) {
+        region = Rect(0, 0, frame_header.nonserialized_metadata->xsize(),
+                      frame_header.nonserialized_metadata->ysize());
+      }
+      builder.AddStage(GetWriteToOutputStage(
+          main_output, width, height, region, downsampling, has_alpha,
+          unpremul_alpha, alpha_c, undo_orientation, extra_output));
     } else {
       builder.AddStage(GetWriteToImageBundleStage(
           decoded, output_encoding_info.color_encoding));
@@ -13,6 +13,7 @@
 
 #include "jxl/decode.h"
 #include "lib/jxl/ac_strategy.h"
+#include "lib/jxl/base/cache_aligned.h"
 #include "lib/jxl/base/profiler.h"
 #include "lib/jxl/coeff_order.h"
 #include "lib/jxl/common.h"
@@ -70,6 +71,81 @@ struct ImageOutput {
   size_t stride;
 };
 
+// Temp images required for decoding a single group. Reduces memory allocations
+// for large images because we only initialize min(#threads, #groups) instances.
+struct GroupDecCache {
+  void InitOnce(size_t num_passes, size_t used_acs) {
+    PROFILER_FUNC;
+
+    for (size_t i = 0; i < num_passes; i++) {
+      if (num_nzeroes[i].xsize() == 0) {
+        // Allocate enough for a whole group - partial groups on the
+        // right/bottom border just use a subset. The valid size is passed via
+        // Rect.
+
+        num_nzeroes[i] = Image3I(kGroupDimInBlocks, kGroupDimInBlocks);
+      }
+    }
+    size_t max_block_area = 0;
+
+    for (uint8_t o = 0; o < AcStrategy::kNumValidStrategies; ++o) {
+      AcStrategy acs = AcStrategy::FromRawStrategy(o);
+      if ((used_acs & (1 << o)) == 0) continue;
+      size_t area =
+          acs.covered_blocks_x() * acs.covered_blocks_y() * kDCTBlockSize;
+      max_block_area = std::max(area, max_block_area);
+    }
+
+    if (max_block_area > max_block_area_) {
+      max_block_area_ = max_block_area;
+      // We need 3x float blocks for dequantized coefficients and 1x for scratch
+      // space for transforms.
+      float_memory_ = hwy::AllocateAligned<float>(max_block_area_ * 4);
+      // We need 3x int32 or int16 blocks for quantized coefficients.
+      int32_memory_ = hwy::AllocateAligned<int32_t>(max_block_area_ * 3);
+      int16_memory_ = hwy::AllocateAligned<int16_t>(max_block_area_ * 3);
+    }
+
+    dec_group_block = float_memory_.get();
+    scratch_space = dec_group_block + max_block_area_ * 3;
+    dec_group_qblock = int32_memory_.get();
+    dec_group_qblock16 = int16_memory_.get();
+  }
+
+  void InitDCBufferOnce() {
+    if (dc_buffer.xsize() == 0) {
+      dc_buffer = ImageF(kGroupDimInBlocks + kRenderPipelineXOffset * 2,
+                         kGroupDimInBlocks + 4);
+    }
+  }
+
+  // Scratch space used by DecGroupImpl().
+  float* dec_group_block;
+  int32_t* dec_group_qblock;
+  int16_t* dec_group_qblock16;
+
+  // For TransformToPixels.
+  float* scratch_space;
+  // Note that scratch_space is never used at the same time as dec_group_qblock.
+  // Moreover, only one of dec_group_qblock16 is ever used.
+  // TODO(veluca): figure out if we can save allocations.
+
+  // AC decoding
+  Image3I num_nzeroes[kMaxNumPasses];
+
+  // Buffer for DC upsampling.
+  ImageF dc_buffer;
+
+  // LZ77 windows of the AC symbol readers, one per pass.
+  CacheAlignedUniquePtr lz77_windows[kMaxNumPasses];
+
+ private:
+  hwy::AlignedFreeUniquePtr<float[]> float_memory_;
+  hwy::AlignedFreeUniquePtr<int32_t[]> int32_memory_;
+  hwy::AlignedFreeUniquePtr<int16_t[]> int16_memory_;
+  size_t max_block_area_ = 0;
+};
+
 // Per-frame decoder state. All the images here should be accessed through a
 // group rect (either with block units or pixel units).
 struct PassesDecoderState {
@@ -108,6 +184,15 @@ struct PassesDecoderState {
   // intended display orientation.
   Orientation undo_orientation;
 
+  // If not empty, only this region of the image is written to the output,
+  // whose dimensions are then those of the region. Groups that do not
+  // contribute to it may be left undecoded.
+  Rect crop;
+
+  // Only one pixel of each downsampling x downsampling block of the image, or
+  // of the crop region, is written to the output.
+  size_t downsampling;
+
   // Used for seeding noise.
   size_t visible_frame_index = 0;
   size_t nonvisible_frame_index = 0;
@@ -124,6 +209,9 @@ struct PassesDecoderState {
   // Storage for the current frame if it can be referenced by future frames.
   ImageBundle frame_storage_for_referencing;
 
+  // Per-thread group decoding buffers, kept across frames.
+  std::vector<GroupDecCache> group_dec_caches;
+
   struct PipelineOptions {
     bool use_slow_render_pipeline;
     bool coalescing;
@@ -149,17 +237,37 @@ struct PassesDecoderState {
     fast_xyb_srgb8_conversion = false;
     unpremul_alpha = false;
     undo_orientation = Orientation::kIdentity;
+    crop = Rect();
+    downsampling = 1;
 
     used_acs = 0;
 
     upsampler8x = GetUpsamplingStage(shared->metadata->transform_data, 0, 3);
     if (shared->frame_header.loop_filter.epf_iters > 0) {
-      sigma = ImageF(shared->frame_dim.xsize_blocks + 2 * kSigmaPadding,
-                     shared->frame_dim.ysize_blocks + 2 * kSigmaPadding);
+      sigma.ReuseOrAllocate(shared->frame_dim.xsize_blocks + 2 * kSigmaPadding,
+                            shared->frame_dim.ysize_blocks + 2 * kSigmaPadding);
     }
     return true;
   }
 
+  // Forgets the frames and output settings of the current image, so that the
+  // state can be used for decoding another one. Buffers that are sized per
+  // frame are kept and reused by the next image if they are large enough.
+  void ResetForNewImage() {
+    for (size_t i = 0; i < 4; i++) {
+      shared_storage.dc_frames[i] = Image3F();
+      shared_storage.reference_frames[i].storage = ImageBundle();
+      shared_storage.reference_frames[i].frame =
+          &shared_storage.reference_frames[i].storage;
+      shared_storage.reference_frames[i].ib_is_in_xyb = false;
+    }
+    frame_storage_for_referencing = ImageBundle();
+    visible_frame_index = 0;
+    nonvisible_frame_index = 0;
+    render_pipeline.reset();
+    output_encoding_info = OutputEncodingInfo();
+  }
+
   // Initialize the decoder state after all of DC is decoded.
   Status InitForAC(ThreadPool* pool) {
     shared_storage.coeff_order_size = 0;
@@ -184,78 +292,6 @@ struct PassesDecoderState {
   void ComputeSigma(const Rect& block_rect, PassesDecoderState* state);
 };
 
-// Temp images required for decoding a single group. Reduces memory allocations
-// for large images because we only initialize min(#threads, #groups) instances.
-struct GroupDecCache {
-  void InitOnce(size_t num_passes, size_t used_acs) {
-    PROFILER_FUNC;
-
-    for (size_t i = 0; i < num_passes; i++) {
-      if (num_nzeroes[i].xsize() == 0) {
-        // Allocate enough for a whole group - partial groups on the
-        // right/bottom border just use a subset. The valid size is passed via
-        // Rect.
-
-        num_nzeroes[i] = Image3I(kGroupDimInBlocks, kGroupDimInBlocks);
-      }
-    }
-    size_t max_block_area = 0;
-
-    for (uint8_t o = 0; o < AcStrategy::kNumValidStrategies; ++o) {
-      AcStrategy acs = AcStrategy::FromRawStrategy(o);
-      if ((used_acs & (1 << o)) == 0) continue;
-      size_t area =
-          acs.covered_blocks_x() * acs.covered_blocks_y() * kDCTBlockSize;
-      max_block_area = std::max(area, max_block_area);
-    }
-
-    if (max_block_area > max_block_area_) {
-      max_block_area_ = max_block_area;
-      // We need 3x float blocks for dequantized coefficients and 1x for scratch
-      // space for transforms.
-      float_memory_ = hwy::AllocateAligned<float>(max_block_area_ * 4);
-      // We need 3x int32 or int16 blocks for quantized coefficients.
-      int32_memory_ = hwy::AllocateAligned<int32_t>(max_block_area_ * 3);
-      int16_memory_ = hwy::AllocateAligned<int16_t>(max_block_area_ * 3);
-    }
-
-    dec_group_block = float_memory_.get();
-    scratch_space = dec_group_block + max_block_area_ * 3;
-    dec_group_qblock = int32_memory_.get();
-    dec_group_qblock16 = int16_memory_.get();
-  }
-
-  void InitDCBufferOnce() {
-    if (dc_buffer.xsize() == 0) {
-      dc_buffer = ImageF(kGroupDimInBlocks + kRenderPipelineXOffset * 2,
-                         kGroupDimInBlocks + 4);
-    }
-  }
-
-  // Scratch space used by DecGroupImpl().
-  float* dec_group_block;
-  int32_t* dec_group_qblock;
-  int16_t* dec_group_qblock16;
-
-  // For TransformToPixels.
-  float* scratch_space;
-  // Note that scratch_space is never used at the same time as dec_group_qblock.
-  // Moreover, only one of dec_group_qblock16 is ever used.
-  // TODO(veluca): figure out if we can save allocations.
-
-  // AC decoding
-  Image3I num_nzeroes[kMaxNumPasses];
-
-  // Buffer for DC upsampling.
-  ImageF dc_buffer;
-
- private:
-  hwy::AlignedFreeUniquePtr<float[]> float_memory_;
-  hwy::AlignedFreeUniquePtr<int32_t[]> int32_memory_;
-  hwy::AlignedFreeUniquePtr<int16_t[]> int16_memory_;
-  size_t max_block_area_ = 0;
-};
-
 }  // namespace jxl
 
 #endif  // LIB_JXL_DEC_CACHE_H_
@@ -75,8 +75,46 @@ Status DecodeGlobalDCInfo(BitReader* reader, bool is_jpeg,
   state->shared_storage.ac_strategy.FillInvalid();
   return true;
 }
+
+// Returns whether each group of `group_dim` pixels in a grid of `xsize_groups`
+// by `ysize_groups` groups intersects `rect`.
+std::vector<uint8_t> GroupsIntersecting(const Rect& rect, size_t group_dim,
+                                        size_t xsize_groups,
+                                        size_t ysize_groups) {
+  std::vector<uint8_t> groups(xsize_groups * ysize_groups, 0);
+  if (rect.xsize() == 0 || rect.ysize() == 0) return groups;
+  size_t gx1 =
+      std::min(DivCeil(rect.x0() + rect.xsize(), group_dim), xsize_groups);
+  size_t gy1 =
+      std::min(DivCeil(rect.y0() + rect.ysize(), group_dim), ysize_groups);
+  for (size_t gy = rect.y0() / group_dim; gy < gy1; gy++) {
+    for (size_t gx = rect.x0() / group_dim; gx < gx1; gx++) {
+      groups[gy * xsize_groups + gx] = 1;
+    }
+  }
+  return groups;
+}
 }  // namespace
 
+bool UsesFastXYBTosRGB8(const PassesDecoderState& dec_state,
+                        const ImageMetadata& metadata,
+                        const FrameHeader& frame_header,
+                        const JxlPixelFormat& format, bool unpremul_alpha,
+                        Orientation undo_orientation) {
+#if JXL_HIGH_PRECISION
+  return false;
+#else
+  const OutputEncodingInfo& info = dec_state.output_encoding_info;
+  return format.data_type == JXL_TYPE_UINT8 && format.num_channels >= 3 &&
+         !unpremul_alpha && undo_orientation == Orientation::kIdentity &&
+         dec_state.crop.xsize() == 0 && dec_state.downsampling == 1 &&
+         metadata.xyb_encoded && info.color_encoding.IsSRGB() &&
+         info.all_default_opsin &&
+         info.desired_intensity_target == info.orig_intensity_target &&
+         HasFastXYBTosRGB8() && frame_header.needs_color_transform();
+#endif
+}
+
 Status DecodeFrame(PassesDecoderState* dec_state, ThreadPool* JXL_RESTRICT pool,
                    const uint8_t* next_in, size_t avail_in,
                    ImageBundle* decoded, const CodecMetadata& metadata,
@@ -132,7 +170,7 @@ Status FrameDecoder::InitFrame(BitReader* JXL_RESTRICT br, ImageBundle* decoded,
   JXL_ASSERT(is_finalized_);
 
   // Reset the dequantization matrices to their default values.
-  dec_state_->shared_storage.matrices = DequantMatrices();
+  dec_state_->shared_storage.matrices.ResetToDefault();
 
   frame_header_.nonserialized_is_preview = is_preview;
   JXL_ASSERT(frame_header_.nonserialized_metadata != nullptr);
@@ -241,6 +279,9 @@ Status FrameDecoder::InitFrame(BitReader* JXL_RESTRICT br, ImageBundle* decoded,
   num_sections_done_ = 0;
   decoded_dc_groups_.clear();
   decoded_dc_groups_.resize(frame_dim_.num_dc_groups);
+  dc_group_needed_.clear();
+  ac_group_needed_.clear();
+  skip_ac_ = false;
   decoded_passes_per_ac_group_.clear();
   decoded_passes_per_ac_group_.resize(frame_dim_.num_groups, 0);
   processed_section_.clear();
@@ -393,7 +434,10 @@ Status FrameDecoder::ProcessACGlobal(BitReader* br) {
     bool store = frame_header_.passes.num_passes > 1;
     size_t xs = store ? kGroupDim * kGroupDim : 0;
     size_t ys = store ? frame_dim_.num_groups : 0;
-    if (use_16_bit) {
+    const ACType type = use_16_bit ? ACType::k16 : ACType::k32;
+    if (store && dec_state_->coefficients->Type() == type) {
+      dec_state_->coefficients->ReuseOrAllocate(xs, ys);
+    } else if (use_16_bit) {
       dec_state_->coefficients = make_unique<ACImageT<int16_t>>(xs, ys);
     } else {
       dec_state_->coefficients = make_unique<ACImageT<int32_t>>(xs, ys);
@@ -467,10 +511,11 @@ Status FrameDecoder::ProcessACGroup(size_t ac_group_id,
   bool should_run_pipeline = true;
 
   if (frame_header_.encoding == FrameEncoding::kVarDCT) {
-    group_dec_caches_[thread].InitOnce(frame_header_.passes.num_passes,
-                                       dec_state_->used_acs);
+    GroupDecCache* group_dec_cache = &dec_state_->group_dec_caches[thread];
+    group_dec_cache->InitOnce(frame_header_.passes.num_passes,
+                              dec_state_->used_acs);
     JXL_RETURN_IF_ERROR(DecodeGroup(br, num_passes, ac_group_id, dec_state_,
-                                    &group_dec_caches_[thread], thread,
+                                    group_dec_cache, thread,
                                     render_pipeline_input, decoded_,
                                     decoded_passes_per_ac_group_[ac_group_id],
                                     force_draw, dc_only, &should_run_pipeline));
@@ -540,6 +585,68 @@ Status FrameDecoder::ProcessACGroup(size_t ac_group_id,
   return true;
 }
 
+bool FrameDecoder::CanSkipGroups() const {
+  // Frames that later frames refer to must be complete. Frames that do not
+  // cover the whole image render the area around them from their edge groups.
+  // The simple pipeline only renders once all groups are done.
+  return dec_state_->crop.xsize() != 0 && coalescing_ &&
+         !use_slow_rendering_pipeline_ &&
+         frame_header_.frame_type == FrameType::kRegularFrame &&
+         !frame_header_.CanBeReferenced() &&
+         !frame_header_.custom_size_or_origin && !decoded_->IsJPEG() &&
+         modular_frame_decoder_.GroupsAreIndependent();
+}
+
+Rect FrameDecoder::CropRegionInFrame(size_t border_x, size_t border_y) const {
+  const Rect& crop = dec_state_->crop;
+  const size_t upsampling = frame_header_.upsampling;
+  size_t x0 = crop.x0() / upsampling;
+  size_t y0 = crop.y0() / upsampling;
+  size_t x1 = DivCeil(crop.x0() + crop.xsize(), upsampling) + border_x;
+  size_t y1 = DivCeil(crop.y0() + crop.ysize(), upsampling) + border_y;
+  x0 = x0 > border_x ? x0 - border_x : 0;
+  y0 = y0 > border_y ? y0 - border_y : 0;
+  return Rect(x0, y0, x1 - x0, y1 - y0, frame_dim_.xsize, frame_dim_.ysize);
+}
+
+bool FrameDecoder::CanSkipAC() const {
+  // The upsampled DC is close to the center pixel of each 8x8 block, which is
+  // the only one that is written with 8x downsampling. The AC group sections
+  // of VarDCT frames also hold the extra channels, so those need them. DC
+  // frames are themselves the DC of other frames.
+  return dec_state_->downsampling >= kBlockDim &&
+         frame_header_.frame_type == FrameType::kRegularFrame &&
+         frame_header_.encoding == FrameEncoding::kVarDCT &&
+         frame_header_.upsampling == 1 && !decoded_->IsJPEG() &&
+         frame_header_.nonserialized_metadata->m.num_extra_channels == 0;
+}
+
+Status FrameDecoder::DrawGroupsFromDC() {
+  std::atomic<bool> has_error{false};
+  JXL_RETURN_IF_ERROR(RunOnPool(
+      pool_, 0, decoded_passes_per_ac_group_.size(),
+      [this](const size_t num_threads) {
+        return PrepareStorage(num_threads,
+                              decoded_passes_per_ac_group_.size());
+      },
+      [this, &has_error](const uint32_t g, size_t thread) {
+        if (!ac_group_needed_.empty() && !ac_group_needed_[g]) {
+          // Not needed for the crop region.
+          return;
+        }
+        BitReader* JXL_RESTRICT readers[kMaxNumPasses] = {};
+        bool ok = ProcessACGroup(
+            g, readers, /*num_passes=*/0, GetStorageLocation(thread, g),
+            /*force_draw=*/true, /*dc_only=*/true);
+        if (!ok) has_error = true;
+      },
+      "DrawGroupFromDC"));
+  if (has_error) {
+    return JXL_FAILURE("Drawing groups failed");
+  }
+  return true;
+}
+
 void FrameDecoder::MarkSections(const SectionInfo* sections, size_t num,
                                 SectionStatus* section_status) {
   num_sections_done_ += num;
@@ -625,14 +732,58 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
     }
   }
 
+  if (decoded_dc_global_ && dc_group_needed_.empty() && CanSkipGroups()) {
+    // The AC groups needed for the crop region extend at most one group
+    // beyond it, and adaptive DC smoothing reads one more block.
+    const size_t border = frame_dim_.group_dim + kBlockDim;
+    dc_group_needed_ = GroupsIntersecting(
+        CropRegionInFrame(border, border), frame_dim_.dc_group_dim,
+        frame_dim_.xsize_dc_groups, frame_dim_.ysize_dc_groups);
+  }
+
+  // Claims the budget for decoding one more group, or returns false if the
+  // group should be left for a later call.
+  std::atomic<size_t> num_budget_groups{budget_ ? budget_->num_groups : 0};
+  std::atomic<bool> over_budget{false};
+  const auto start_group = [this, single_section, &num_budget_groups,
+                            &over_budget]() {
+    if (budget_ == nullptr || single_section) return true;
+    size_t n = num_budget_groups.load();
+    do {
+      if (n != 0 &&
+          ((budget_->max_groups != 0 && n >= budget_->max_groups) ||
+           std::chrono::steady_clock::now() >= budget_->deadline)) {
+        over_budget = true;
+        return false;
+      }
+    } while (!num_budget_groups.compare_exchange_weak(n, n + 1));
+    return true;
+  };
+  const auto update_budget = [this, &num_budget_groups, &over_budget]() {
+    if (budget_ == nullptr) return;
+    budget_->num_groups = num_budget_groups.load();
+    if (over_budget) budget_->exhausted = true;
+  };
+
+  // The DC groups, the AC global section and the AC groups are decoded in
+  // separate passes rather than as a graph of per-group dependencies: the AC
+  // global section needs the AC strategies used by all the DC groups, and
+  // FinalizeDC (adaptive DC smoothing, pipeline setup) needs every DC group,
+  // so no AC group can start before all DC groups are done.
   std::atomic<bool> has_error{false};
   if (decoded_dc_global_) {
     JXL_RETURN_IF_ERROR(RunOnPool(
         pool_, 0, dc_group_sec.size(), ThreadPool::NoInit,
-        [this, &dc_group_sec, &num, &sections, &section_status, &has_error](
-            size_t i, size_t thread) {
+        [this, &dc_group_sec, &num, &sections, &section_status, &start_group,
+         &has_error](size_t i, size_t thread) {
           if (dc_group_sec[i] != num) {
-            if (!ProcessDCGroup(i, sections[dc_group_sec[i]].br)) {
+            if (!dc_group_needed_.empty() && !dc_group_needed_[i]) {
+              // Not needed for the crop region.
+              decoded_dc_groups_[i] = uint8_t{true};
+              section_status[dc_group_sec[i]] = SectionStatus::kDone;
+            } else if (!start_group()) {
+              // Left for a later call.
+            } else if (!ProcessDCGroup(i, sections[dc_group_sec[i]].br)) {
               has_error = true;
             } else {
               section_status[dc_group_sec[i]] = SectionStatus::kDone;
@@ -640,6 +791,7 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
           }
         },
         "DecodeDCGroup"));
+    update_budget();
   }
   if (has_error) return JXL_FAILURE("Error in DC group");
 
@@ -651,8 +803,20 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
     pipeline_options.render_spotcolors = render_spotcolors_;
     JXL_RETURN_IF_ERROR(
         dec_state_->PreparePipeline(decoded_, pipeline_options));
+    std::pair<size_t, size_t> group_border;
+    if (!dc_group_needed_.empty() &&
+        dec_state_->render_pipeline->GetGroupBorder(&group_border)) {
+      ac_group_needed_ = GroupsIntersecting(
+          CropRegionInFrame(group_border.first, group_border.second),
+          frame_dim_.group_dim, frame_dim_.xsize_groups,
+          frame_dim_.ysize_groups);
+    }
     FinalizeDC();
     JXL_RETURN_IF_ERROR(AllocateOutput());
+    if (CanSkipAC()) {
+      JXL_RETURN_IF_ERROR(DrawGroupsFromDC());
+      skip_ac_ = true;
+    }
     if (progressive_detail_ >= JxlProgressiveDetail::kDC) {
       MarkSections(sections, num, section_status);
       return true;
@@ -660,7 +824,11 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
   }
 
   if (finalized_dc_ && ac_global_sec != num && !decoded_ac_global_) {
-    JXL_RETURN_IF_ERROR(ProcessACGlobal(sections[ac_global_sec].br));
+    if (skip_ac_) {
+      decoded_ac_global_ = true;
+    } else {
+      JXL_RETURN_IF_ERROR(ProcessACGlobal(sections[ac_global_sec].br));
+    }
     section_status[ac_global_sec] = SectionStatus::kDone;
   }
 
@@ -677,7 +845,7 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
   if (decoded_ac_global_) {
     // Mark all the AC groups that we received as not complete yet.
     for (size_t i = 0; i < ac_group_sec.size(); i++) {
-      if (desired_num_ac_passes[i] != 0) {
+      if (desired_num_ac_passes[i] != 0 && !skip_ac_) {
         dec_state_->render_pipeline->ClearDone(i);
       }
     }
@@ -689,13 +857,25 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
                                 decoded_passes_per_ac_group_.size());
         },
         [this, &ac_group_sec, &desired_num_ac_passes, &num, &sections,
-         &section_status, &has_error](size_t g, size_t thread) {
+         &section_status, &start_group, &has_error](size_t g, size_t thread) {
           if (desired_num_ac_passes[g] == 0) {
             // no new AC pass, nothing to do
             return;
           }
           (void)num;
           size_t first_pass = decoded_passes_per_ac_group_[g];
+          if (skip_ac_ ||
+              (!ac_group_needed_.empty() && !ac_group_needed_[g])) {
+            // Already drawn from the DC, or not needed for the crop region.
+            for (size_t i = 0; i < desired_num_ac_passes[g]; i++) {
+              section_status[ac_group_sec[g][first_pass + i]] =
+                  SectionStatus::kDone;
+            }
+            decoded_passes_per_ac_group_[g] += desired_num_ac_passes[g];
+            return;
+          }
+          // Left for a later call.
+          if (!start_group()) return;
           BitReader* JXL_RESTRICT readers[kMaxNumPasses];
           for (size_t i = 0; i < desired_num_ac_passes[g]; i++) {
             JXL_ASSERT(ac_group_sec[g][first_pass + i] != num);
@@ -713,6 +893,7 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
           }
         },
         "DecodeGroup"));
+    update_budget();
   }
   if (has_error) return JXL_FAILURE("Error in AC group");
 
@@ -745,7 +926,8 @@ Status FrameDecoder::Flush() {
 
   uint32_t completely_decoded_ac_pass = *std::min_element(
       decoded_passes_per_ac_group_.begin(), decoded_passes_per_ac_group_.end());
-  if (completely_decoded_ac_pass < frame_header_.passes.num_passes) {
+  if (completely_decoded_ac_pass < frame_header_.passes.num_passes &&
+      !skip_ac_) {
     // We don't have all AC yet: force a draw of all the missing areas.
     // Mark all sections as not complete.
     for (size_t i = 0; i < decoded_passes_per_ac_group_.size(); i++) {
@@ -766,6 +948,10 @@ Status FrameDecoder::Flush() {
             // This group was drawn already, nothing to do.
             return;
           }
+          if (!ac_group_needed_.empty() && !ac_group_needed_[g]) {
+            // Not needed for the crop region.
+            return;
+          }
           BitReader* JXL_RESTRICT readers[kMaxNumPasses] = {};
           bool ok = ProcessACGroup(
               g, readers, /*num_passes=*/0, GetStorageLocation(thread, g),
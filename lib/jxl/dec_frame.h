@@ -8,6 +8,8 @@
 
 #include <stdint.h>
 
+#include <chrono>
+
 #include "jxl/decode.h"
 #include "jxl/types.h"
 #include "lib/jxl/base/compiler_specific.h"
@@ -35,6 +37,15 @@ Status DecodeFrame(PassesDecoderState* dec_state, ThreadPool* JXL_RESTRICT pool,
                    ImageBundle* decoded, const CodecMetadata& metadata,
                    bool use_slow_rendering_pipeline = false);
 
+// Whether the render pipeline converts the frame from XYB to 8-bit sRGB with
+// its fast approximation when writing it to an image buffer in `format`. The
+// crop region, downsampling and output encoding are those of `dec_state`.
+bool UsesFastXYBTosRGB8(const PassesDecoderState& dec_state,
+                        const ImageMetadata& metadata,
+                        const FrameHeader& frame_header,
+                        const JxlPixelFormat& format, bool unpremul_alpha,
+                        Orientation undo_orientation);
+
 // TODO(veluca): implement "forced drawing".
 class FrameDecoder {
  public:
@@ -48,6 +59,37 @@ class FrameDecoder {
 
   void SetRenderSpotcolors(bool rsc) { render_spotcolors_ = rsc; }
   void SetCoalescing(bool c) { coalescing_ = c; }
+  // Limits the output to `crop`, in image coordinates, or to the whole image
+  // if it is empty. Must be called after InitFrame and before SetImageOutput.
+  // The groups that do not contribute to the region are then not decoded, if
+  // the frame is not used by other frames and its groups are independent.
+  void SetCropRegion(const Rect& crop) { dec_state_->crop = crop; }
+  // Writes only one pixel of each `downsampling` x `downsampling` block to the
+  // output. With a factor of 8, VarDCT frames are rendered from their DC and
+  // their AC is not decoded. Must be called after InitFrame and before
+  // SetImageOutput.
+  void SetDownsampling(size_t downsampling) {
+    dec_state_->downsampling = downsampling;
+  }
+
+  // Work allowed to the ProcessSections calls sharing it, e.g. those made by
+  // one call to the decoder API.
+  struct WorkBudget {
+    // Number of DC and AC groups that may be decoded, or 0 for no limit.
+    size_t max_groups = 0;
+    // No group is started after this time.
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::time_point::max();
+    // Number of groups decoded so far.
+    size_t num_groups = 0;
+    // Whether a group was left for later because of the budget.
+    bool exhausted = false;
+  };
+  // Limits the groups that ProcessSections decodes to `budget`, or removes
+  // the limit if it is null; the groups left out keep the kSkipped status.
+  // A frame with a single group, and the first group of the budget, are
+  // always decoded, so that decoding makes progress.
+  void SetWorkBudget(WorkBudget* budget) { budget_ = budget; }
 
   // Read FrameHeader and table of contents from the given BitReader.
   // Also checks frame dimensions for their limits, and sets the output
@@ -201,20 +243,12 @@ class FrameDecoder {
       }
     }
     dec_state_->extra_output.clear();
-#if !JXL_HIGH_PRECISION
     if (dec_state_->main_output.buffer &&
-        (format.data_type == JXL_TYPE_UINT8) && (format.num_channels >= 3) &&
-        !dec_state_->unpremul_alpha &&
-        (dec_state_->undo_orientation == Orientation::kIdentity) &&
-        decoded_->metadata()->xyb_encoded &&
-        dec_state_->output_encoding_info.color_encoding.IsSRGB() &&
-        dec_state_->output_encoding_info.all_default_opsin &&
-        (dec_state_->output_encoding_info.desired_intensity_target ==
-         dec_state_->output_encoding_info.orig_intensity_target) &&
-        HasFastXYBTosRGB8() && frame_header_.needs_color_transform()) {
+        UsesFastXYBTosRGB8(*dec_state_, *decoded_->metadata(), frame_header_,
+                           format, dec_state_->unpremul_alpha,
+                           dec_state_->undo_orientation)) {
       dec_state_->fast_xyb_srgb8_conversion = true;
     }
-#endif
   }
 
   void AddExtraChannelOutput(void* buffer, size_t buffer_size, size_t xsize,
@@ -240,6 +274,16 @@ class FrameDecoder {
   void MarkSections(const SectionInfo* sections, size_t num,
                     SectionStatus* section_status);
 
+  // Whether groups outside of the crop region may be skipped for this frame.
+  bool CanSkipGroups() const;
+  // Returns the crop region in frame coordinates, grown by the given border
+  // on each side.
+  Rect CropRegionInFrame(size_t border_x, size_t border_y) const;
+  // Whether the output only needs the DC of this frame.
+  bool CanSkipAC() const;
+  // Renders all needed groups from the DC only.
+  Status DrawGroupsFromDC();
+
   // Allocates storage for parallel decoding using up to `num_threads` threads
   // of up to `num_tasks` tasks. The value of `thread` passed to
   // `GetStorageLocation` must be smaller than the `num_threads` value passed
@@ -247,8 +291,8 @@ class FrameDecoder {
   // than the value of `num_tasks` passed here.
   Status PrepareStorage(size_t num_threads, size_t num_tasks) {
     size_t storage_size = std::min(num_threads, num_tasks);
-    if (storage_size > group_dec_caches_.size()) {
-      group_dec_caches_.resize(storage_size);
+    if (storage_size > dec_state_->group_dec_caches.size()) {
+      dec_state_->group_dec_caches.resize(storage_size);
     }
     use_task_id_ = num_threads > num_tasks;
     bool use_group_ids = (modular_frame_decoder_.UsesFullImage() &&
@@ -296,16 +340,20 @@ class FrameDecoder {
   std::vector<uint8_t> processed_section_;
   std::vector<uint8_t> decoded_passes_per_ac_group_;
   std::vector<uint8_t> decoded_dc_groups_;
+  // Whether each DC or AC group is needed to render the crop region, or empty
+  // when not known yet or all groups are needed.
+  std::vector<uint8_t> dc_group_needed_;
+  std::vector<uint8_t> ac_group_needed_;
   bool decoded_dc_global_;
   bool decoded_ac_global_;
+  // Whether the groups were rendered from the DC, and the AC is ignored.
+  bool skip_ac_ = false;
   bool HasEverything() const;
   bool finalized_dc_ = true;
   size_t num_sections_done_ = 0;
   bool is_finalized_ = true;
   bool allocated_ = false;
 
-  std::vector<GroupDecCache> group_dec_caches_;
-
   // Whether or not the task id should be used for storage indexing, instead of
   // the thread id.
   bool use_task_id_ = false;
@@ -313,6 +361,8 @@ class FrameDecoder {
   // Testing setting: whether or not to use the slow rendering pipeline.
   bool use_slow_rendering_pipeline_;
 
+  WorkBudget* budget_ = nullptr;
+
   JxlProgressiveDetail progressive_detail_ = kFrames;
   // Number of completed passes where section decoding should pause.
   // Used for progressive details at least kLastPasses.
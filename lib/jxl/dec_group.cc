@@ -593,7 +593,9 @@ struct GetBlockFromBitstream : public GetBlock {
       ctx_offset[pass] = cur_histogram * block_ctx_map->NumACContexts();
 
       decoders[pass] =
-          ANSSymbolReader(&dec_state->code[pass + first_pass], readers[pass]);
+          ANSSymbolReader(&dec_state->code[pass + first_pass], readers[pass],
+                          /*distance_multiplier=*/0,
+                          &group_dec_cache->lz77_windows[pass]);
     }
     nzeros_stride = group_dec_cache->num_nzeroes[0].PixelsPerRow();
     for (size_t i = 0; i < num_passes; i++) {
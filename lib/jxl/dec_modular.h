@@ -116,6 +116,11 @@ class ModularFrameDecoder {
   bool have_dc() const { return have_something; }
   void MaybeDropFullImage();
   bool UsesFullImage() const { return use_full_image; }
+  // Whether each group can be decoded and rendered on its own, without
+  // global transforms or channels. Valid after DecodeGlobalInfo.
+  bool GroupsAreIndependent() const {
+    return full_image.transform.empty() && !have_something && all_same_shift;
+  }
 
  private:
   Status ModularImageToDecodedRect(Image& gi, PassesDecoderState* dec_state,
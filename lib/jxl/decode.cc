@@ -5,8 +5,15 @@
 
 #include "jxl/decode.h"
 
+#include <chrono>
+#include <deque>
+#include <limits>
+#include <mutex>
+
+#include "jxl/decode_cxx.h"
 #include "jxl/types.h"
 #include "lib/jxl/base/byte_order.h"
+#include "lib/jxl/base/cache_aligned.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/box_content_decoder.h"
@@ -170,10 +177,19 @@ enum class DecoderStage : uint32_t {
   kError,               // Error occurred, decoder object no longer usable
 };
 
+// Initial number of bytes of a partial codestream box that are copied to join
+// them with the end of the previous box, when the input is persistent.
+constexpr size_t kMinCodestreamCopy = 4096;
+
+// Larger frame index boxes are skipped rather than held in the input to be
+// parsed at once, they would list hundreds of thousands of keyframes.
+constexpr size_t kMaxFrameIndexBoxSize = 1 << 20;
+
 enum class FrameStage : uint32_t {
-  kHeader,      // Must parse frame header.
-  kTOC,         // Must parse TOC
-  kFull,        // Must parse full pixels
+  kHeader,        // Must parse frame header.
+  kTOC,           // Must parse TOC
+  kFull,          // Must parse full pixels
+  kDecodedAhead,  // Must output the pixels of a frame decoded ahead
 };
 
 enum class BoxStage : uint32_t {
@@ -184,6 +200,7 @@ enum class BoxStage : uint32_t {
   kCodestream,  // Handling codestream box contents, or non-container stream
   kPartialCodestream,  // Handling the extra header of partial codestream box
   kJpegRecon,          // Handling jpeg reconstruction box
+  kFrameIndex,         // Handling the frame index box
 };
 
 enum class JpegReconStage : uint32_t {
@@ -321,6 +338,22 @@ typedef struct JxlDecoderFrameIndexBoxStruct {
   }
 } JxlDecoderFrameIndexBox;
 
+// A frame that was decoded before the decoder reached it, see
+// DecodeFramesAhead.
+struct DecodedAheadFrame {
+  explicit DecodedAheadFrame(const CodecMetadata* metadata)
+      : header(metadata) {}
+
+  FrameHeader header;
+  // Codestream bytes of the frame, including its header and TOC.
+  size_t size = 0;
+  // Pixels of the frame, in the output color encoding.
+  ImageBundle ib;
+  // What the frame saved in its reference slot, if it can be referenced.
+  ImageBundle reference;
+  bool reference_in_xyb = false;
+};
+
 }  // namespace jxl
 
 // NOLINTNEXTLINE(clang-analyzer-optin.performance.Padding)
@@ -346,7 +379,11 @@ struct JxlDecoderStruct {
   bool got_all_headers;               // Codestream metadata headers.
   bool post_headers;                  // Already decoding pixels.
   jxl::ICCReader icc_reader;
+  // Contents of the jxli box, if one was seen. Like the frame references
+  // below, this is kept when rewinding so that it can be used for seeking.
   jxl::JxlDecoderFrameIndexBox frame_index_box;
+  // Bytes of the jxli box received so far, parsed once the box is complete.
+  std::vector<uint8_t> frame_index_box_data;
   // This means either we actually got the preview image, or determined we
   // cannot get it or there is none.
   bool got_preview_image;
@@ -391,6 +428,9 @@ struct JxlDecoderStruct {
   bool render_spotcolors;
   bool coalescing;
   float desired_intensity_target;
+  // Region of the image to output, empty for the whole image.
+  jxl::Rect crop;
+  size_t downsampling;
 
   // Bitfield, for which informative events (JXL_DEC_BASIC_INFO, etc...) the
   // decoder returns a status. By default, do not return for any of the events,
@@ -446,6 +486,21 @@ struct JxlDecoderStruct {
   size_t next_section;
   std::vector<char> section_processed;
 
+  // Maximum number of frames decoded concurrently ahead of being reached, or
+  // 0 to decode each frame only when it is reached.
+  size_t frame_lookahead;
+  // Frames that were decoded ahead and are not returned yet, in codestream
+  // order. The first one is the next frame of the codestream.
+  std::deque<jxl::DecodedAheadFrame> decoded_ahead;
+  // One decoder state per frame decoded ahead at once, kept for reuse.
+  std::vector<std::unique_ptr<jxl::PassesDecoderState>> decoded_ahead_states;
+  // Codestream offset up to which the frames were found to be too few to
+  // decode ahead, so that their headers are not read again for that.
+  uint64_t decode_ahead_stop;
+  // Set once an image output format is used that only decoding in order
+  // produces, which stops frames from being decoded ahead.
+  bool decode_ahead_disabled;
+
   // headers and TOC for the current frame. When got_toc is true, this is
   // always the frame header of the last frame of the current still series,
   // that is, the displayed frame.
@@ -477,6 +532,8 @@ struct JxlDecoderStruct {
   // FrameDecoder::References and FrameDecoder::SaveAs.
   std::vector<int> frame_references;
   std::vector<int> frame_saved_as;
+  // For each internal frame, the codestream offset of its frame header.
+  std::vector<uint64_t> frame_offsets;
 
   // Translates external frame index to internal frame index. The external
   // index is the index of user-visible frames. The internal index can be larger
@@ -489,6 +546,14 @@ struct JxlDecoderStruct {
   // vector, it must be treated as a required frame.
   std::vector<char> frame_required;
 
+  // Set by JxlDecoderSeekFrame, the jump to the first frame needed for the
+  // requested frame is made once the first frame header is reached.
+  bool seek_pending;
+  // Set when seeking jumped to a keyframe of the frame index box beyond all
+  // frames seen so far. The internal frame indices are then unknown, so the
+  // per frame vectors above are neither used nor extended until rewinding.
+  bool frames_untracked;
+
   // Codestream input data is copied here temporarily when the decoder needs
   // more input bytes to process the next part of the stream. We copy the input
   // data in order to be able to release it all through the API it when
@@ -504,6 +569,16 @@ struct JxlDecoderStruct {
   size_t codestream_pos;
   // Number of bits after codestream_pos that were already processed.
   size_t codestream_bits_ahead;
+  // Number of codestream bytes the decoder advanced past so far, regardless
+  // of how the codestream is split into boxes.
+  uint64_t codestream_offset;
+  // With persistent input, at most this many bytes of the current box are
+  // copied to the end of codestream_copy, since the rest of the box remains
+  // available.
+  size_t codestream_copy_limit;
+  // Set when RequestMoreInput grew codestream_copy_limit instead of
+  // consuming the input, so that the codestream is processed again.
+  bool retry_codestream;
 
   BoxStage box_stage;
 
@@ -536,6 +611,9 @@ struct JxlDecoderStruct {
   const uint8_t* next_in;
   size_t avail_in;
   bool input_closed;
+  // Whether next_in is the complete input, which stays available until the
+  // decoder is destroyed, reset or rewound.
+  bool persistent_input;
 
   void AdvanceInput(size_t size) {
     JXL_DASSERT(avail_in >= size);
@@ -554,6 +632,7 @@ struct JxlDecoderStruct {
   }
 
   void AdvanceCodestream(size_t size) {
+    codestream_offset += size;
     size_t avail_codestream = AvailableCodestream();
     if (codestream_copy.empty()) {
       if (size <= avail_codestream) {
@@ -582,6 +661,13 @@ struct JxlDecoderStruct {
       codestream_copy.insert(codestream_copy.end(), next_in,
                              next_in + avail_codestream);
       AdvanceInput(avail_codestream);
+      codestream_copy_limit = kMinCodestreamCopy;
+    } else if (persistent_input &&
+               codestream_unconsumed < AvailableCodestream() &&
+               codestream_copy_limit < AvailableCodestream()) {
+      // Copy more of the current box, rather than all of it at once.
+      codestream_copy_limit *= 2;
+      retry_codestream = true;
     } else {
       AdvanceInput(codestream_unconsumed);
       codestream_unconsumed = 0;
@@ -609,10 +695,17 @@ struct JxlDecoderStruct {
       *span = jxl::Span<const uint8_t>(next_in, avail_codestream);
       return JXL_DEC_SUCCESS;
     } else {
+      // The bytes before the end of the box are only copied as far as needed
+      // to join the part of the codestream that was in the previous box.
+      size_t copy_end = avail_codestream;
+      if (persistent_input) {
+        copy_end = std::max(codestream_unconsumed,
+                            std::min(avail_codestream, codestream_copy_limit));
+      }
       codestream_copy.insert(codestream_copy.end(),
                              next_in + codestream_unconsumed,
-                             next_in + avail_codestream);
-      codestream_unconsumed = avail_codestream;
+                             next_in + copy_end);
+      codestream_unconsumed = copy_end;
       *span = jxl::Span<const uint8_t>(codestream_copy.data() + codestream_pos,
                                        codestream_copy.size() - codestream_pos);
       return JXL_DEC_SUCCESS;
@@ -637,11 +730,49 @@ struct JxlDecoderStruct {
   size_t memory_limit_base = 0;
   size_t cpu_limit_base = 0;
   size_t used_cpu_base = 0;
+
+  // Accounts the image memory allocated on behalf of this decoder, including
+  // by the worker threads of the parallel runner.
+  jxl::AllocationTrackerPtr allocation_tracker;
+  // Bytes of tracked memory the decoder may use, or 0 for no limit.
+  size_t memory_limit;
+
+  // Timing of the parallel runner calls, kept across resets. Recorded while
+  // runner_stats_enabled, for the thread pools created after enabling too.
+  std::unique_ptr<jxl::RunStats> runner_stats;
+  bool runner_stats_enabled = false;
+
+  // Limits of each JxlDecoderProcessInput call, 0 meaning no limit.
+  size_t max_groups_per_call;
+  uint64_t max_microseconds_per_call;
+  // What the current JxlDecoderProcessInput call may still decode.
+  jxl::FrameDecoder::WorkBudget work_budget;
 };
 
 namespace {
 
+// Whether `num_pixels` pixels, with float color and extra channels, still fit
+// in the memory limit in addition to what is in use already.
+bool CheckMemoryLimitForPixels(JxlDecoder* dec, size_t num_pixels) {
+  if (!dec->memory_limit) return true;
+  const size_t num_channels = 3 + dec->metadata.m.num_extra_channels;
+  const size_t in_use = dec->allocation_tracker->BytesInUse();
+  if (in_use > dec->memory_limit) return false;
+  const size_t available = dec->memory_limit - in_use;
+  return num_pixels <= available / (num_channels * sizeof(float));
+}
+
+// Same as CheckMemoryLimitForPixels, for an image of the given size.
+bool CheckMemoryLimit(JxlDecoder* dec, size_t xsize, size_t ysize) {
+  if (!dec->memory_limit) return true;
+  if (xsize != 0 && ysize > std::numeric_limits<size_t>::max() / xsize) {
+    return false;
+  }
+  return CheckMemoryLimitForPixels(dec, xsize * ysize);
+}
+
 bool CheckSizeLimit(JxlDecoder* dec, size_t xsize, size_t ysize) {
+  if (!CheckMemoryLimit(dec, xsize, ysize)) return false;
   if (!dec->memory_limit_base) return true;
   if (xsize == 0 || ysize == 0) return true;
   if (xsize >= dec->memory_limit_base || ysize >= dec->memory_limit_base) {
@@ -655,6 +786,25 @@ bool CheckSizeLimit(JxlDecoder* dec, size_t xsize, size_t ysize) {
   return true;
 }
 
+// Whether an image of the given size still fits in the limits together with
+// the images decoded at the same time as it, whose sizes add up to
+// `*batch_pixels`. If so, the image is added to `*batch_pixels`.
+bool AddToBatchSizeLimit(JxlDecoder* dec, size_t xsize, size_t ysize,
+                         size_t* batch_pixels) {
+  if (!dec->memory_limit && !dec->memory_limit_base) return true;
+  // Rough estimate of real row length, as in CheckSizeLimit.
+  xsize = jxl::DivCeil(xsize, 32) * 32;
+  const size_t max_pixels = std::numeric_limits<size_t>::max() - *batch_pixels;
+  if (xsize != 0 && ysize > max_pixels / xsize) return false;
+  const size_t num_pixels = *batch_pixels + xsize * ysize;
+  if (!CheckMemoryLimitForPixels(dec, num_pixels)) return false;
+  if (dec->memory_limit_base && num_pixels > dec->memory_limit_base) {
+    return false;
+  }
+  *batch_pixels = num_pixels;
+  return true;
+}
+
 }  // namespace
 
 // TODO(zond): Make this depend on the data loaded into the decoder.
@@ -689,6 +839,7 @@ void JxlDecoderRewindDecodingState(JxlDecoder* dec) {
   memset(dec->box_decoded_type, 0, sizeof(dec->box_decoded_type));
   dec->box_event = false;
   dec->box_stage = BoxStage::kHeader;
+  dec->frame_index_box_data.clear();
   dec->box_out_buffer_set = false;
   dec->box_out_buffer_set_current_box = false;
   dec->box_out_buffer = nullptr;
@@ -722,6 +873,7 @@ void JxlDecoderRewindDecodingState(JxlDecoder* dec) {
   dec->next_in = 0;
   dec->avail_in = 0;
   dec->input_closed = false;
+  dec->persistent_input = false;
 
   dec->passes_state.reset(nullptr);
   dec->frame_dec.reset(nullptr);
@@ -737,6 +889,9 @@ void JxlDecoderRewindDecodingState(JxlDecoder* dec) {
   dec->codestream_unconsumed = 0;
   dec->codestream_pos = 0;
   dec->codestream_bits_ahead = 0;
+  dec->codestream_offset = 0;
+  dec->codestream_copy_limit = 0;
+  dec->retry_codestream = false;
 
   dec->frame_stage = FrameStage::kHeader;
   dec->remaining_frame_size = 0;
@@ -746,6 +901,10 @@ void JxlDecoderRewindDecodingState(JxlDecoder* dec) {
   dec->skipping_frame = false;
   dec->internal_frames = 0;
   dec->external_frames = 0;
+  dec->seek_pending = false;
+  dec->frames_untracked = false;
+  dec->decoded_ahead.clear();
+  dec->decode_ahead_stop = 0;
 }
 
 void JxlDecoderReset(JxlDecoder* dec) {
@@ -757,12 +916,33 @@ void JxlDecoderReset(JxlDecoder* dec) {
   dec->render_spotcolors = true;
   dec->coalescing = true;
   dec->desired_intensity_target = 0;
+  dec->crop = jxl::Rect();
+  dec->downsampling = 1;
+  dec->frame_lookahead = 0;
+  dec->decoded_ahead_states.clear();
+  dec->decode_ahead_disabled = false;
   dec->orig_events_wanted = 0;
   dec->frame_references.clear();
   dec->frame_saved_as.clear();
+  dec->frame_offsets.clear();
   dec->frame_external_to_internal.clear();
   dec->frame_required.clear();
+  dec->frame_index_box = jxl::JxlDecoderFrameIndexBox();
   dec->decompress_boxes = false;
+  dec->memory_limit = 0;
+  dec->allocation_tracker->ResetMaxBytesInUse();
+  dec->max_groups_per_call = 0;
+  dec->max_microseconds_per_call = 0;
+}
+
+void JxlDecoderRecycle(JxlDecoder* dec) {
+  std::unique_ptr<jxl::PassesDecoderState> passes_state =
+      std::move(dec->passes_state);
+  JxlDecoderReset(dec);
+  if (passes_state) {
+    passes_state->ResetForNewImage();
+    dec->passes_state = std::move(passes_state);
+  }
 }
 
 JxlDecoder* JxlDecoderCreate(const JxlMemoryManager* memory_manager) {
@@ -776,6 +956,10 @@ JxlDecoder* JxlDecoderCreate(const JxlMemoryManager* memory_manager) {
   // Placement new constructor on allocated memory
   JxlDecoder* dec = new (alloc) JxlDecoder();
   dec->memory_manager = local_memory_manager;
+  dec->allocation_tracker.reset(jxl::AllocationTracker::Create());
+  if (memory_manager) {
+    dec->allocation_tracker->SetMemoryManager(local_memory_manager);
+  }
 
 #ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
   if (!memory_manager) {
@@ -803,17 +987,13 @@ void JxlDecoderDestroy(JxlDecoder* dec) {
 
 void JxlDecoderRewind(JxlDecoder* dec) { JxlDecoderRewindDecodingState(dec); }
 
-void JxlDecoderSkipFrames(JxlDecoder* dec, size_t amount) {
-  // Increment amount, rather than set it: making the amount smaller is
-  // impossible because the decoder may already have skipped frames required to
-  // decode earlier frames, and making the amount larger compared to an existing
-  // amount is impossible because if JxlDecoderSkipFrames is called in the
-  // middle of already skipping frames, the user cannot know how many frames
-  // have already been skipped internally so far so an absolute value cannot
-  // be defined.
-  dec->skip_frames += amount;
+namespace {
 
+// Marks which of the frames seen so far are required to decode the frame that
+// is skipped to, and any frames after it.
+void UpdateRequiredFrames(JxlDecoder* dec) {
   dec->frame_required.clear();
+  if (dec->frames_untracked) return;
   size_t next_frame = dec->external_frames + dec->skip_frames;
 
   // A frame that has been seen before a rewind
@@ -832,7 +1012,65 @@ void JxlDecoderSkipFrames(JxlDecoder* dec, size_t amount) {
   }
 }
 
+// Updates the decoder as if the current frame, which was decoded ahead, had
+// been decoded when it was reached, and moves on to the next frame.
+void FinishDecodedAheadFrame(JxlDecoder* dec) {
+  jxl::DecodedAheadFrame& frame = dec->decoded_ahead.front();
+  jxl::PassesDecoderState* state = dec->passes_state.get();
+  // Frames decoded ahead are displayed frames, see FrameDecoder::InitFrame.
+  state->visible_frame_index++;
+  state->nonvisible_frame_index = 0;
+  if (frame.header.CanBeReferenced()) {
+    auto& info =
+        state->shared_storage.reference_frames[frame.header.save_as_reference];
+    info.storage = std::move(frame.reference);
+    info.ib_is_in_xyb = frame.reference_in_xyb;
+    info.frame = &info.storage;
+  }
+  if (!dec->frames_untracked) {
+    // Frames decoded ahead do not use any reference.
+    dec->frame_references[dec->internal_frames - 1] = 0;
+  }
+  dec->AdvanceCodestream(dec->remaining_frame_size);
+  dec->decoded_ahead.pop_front();
+}
+
+}  // namespace
+
+void JxlDecoderSkipFrames(JxlDecoder* dec, size_t amount) {
+  // Increment amount, rather than set it: making the amount smaller is
+  // impossible because the decoder may already have skipped frames required to
+  // decode earlier frames, and making the amount larger compared to an existing
+  // amount is impossible because if JxlDecoderSkipFrames is called in the
+  // middle of already skipping frames, the user cannot know how many frames
+  // have already been skipped internally so far so an absolute value cannot
+  // be defined.
+  dec->skip_frames += amount;
+  UpdateRequiredFrames(dec);
+  // The frames decoded ahead after the current one are dropped, the ones
+  // that are required for the frame skipped to are decoded again.
+  size_t keep = dec->frame_stage == FrameStage::kDecodedAhead ? 1 : 0;
+  if (dec->decoded_ahead.size() > keep) {
+    dec->decoded_ahead.erase(dec->decoded_ahead.begin() + keep,
+                             dec->decoded_ahead.end());
+  }
+}
+
+void JxlDecoderSeekFrame(JxlDecoder* dec, size_t index) {
+  JxlDecoderRewindDecodingState(dec);
+  // The frames to skip are only known once the decoder reached the first
+  // frame and chose where to continue, see SeekToFirstRequiredFrame.
+  dec->skip_frames = index;
+  dec->seek_pending = true;
+}
+
 JxlDecoderStatus JxlDecoderSkipCurrentFrame(JxlDecoder* dec) {
+  if (dec->frame_stage == FrameStage::kDecodedAhead) {
+    FinishDecodedAheadFrame(dec);
+    dec->frame_stage = FrameStage::kHeader;
+    dec->image_out_buffer_set = false;
+    return JXL_DEC_SUCCESS;
+  }
   if (dec->frame_stage != FrameStage::kFull) {
     return JXL_DEC_ERROR;
   }
@@ -845,17 +1083,68 @@ JxlDecoderStatus JxlDecoderSkipCurrentFrame(JxlDecoder* dec) {
   return JXL_DEC_SUCCESS;
 }
 
+namespace {
+// Replaces the thread pool of the decoder, which records the runner stats if
+// they are enabled.
+void ResetThreadPool(JxlDecoder* dec, JxlParallelRunner parallel_runner,
+                     void* parallel_runner_opaque) {
+  dec->thread_pool.reset(
+      new jxl::ThreadPool(parallel_runner, parallel_runner_opaque));
+  if (dec->runner_stats_enabled) {
+    dec->thread_pool->SetStats(dec->runner_stats.get());
+  }
+}
+}  // namespace
+
 JXL_EXPORT JxlDecoderStatus
 JxlDecoderSetParallelRunner(JxlDecoder* dec, JxlParallelRunner parallel_runner,
                             void* parallel_runner_opaque) {
   if (dec->stage != DecoderStage::kInited) {
     return JXL_API_ERROR("parallel_runner must be set before starting");
   }
-  dec->thread_pool.reset(
-      new jxl::ThreadPool(parallel_runner, parallel_runner_opaque));
+  ResetThreadPool(dec, parallel_runner, parallel_runner_opaque);
   return JXL_DEC_SUCCESS;
 }
 
+void JxlDecoderSetRunnerStats(JxlDecoder* dec, JXL_BOOL enabled) {
+  dec->runner_stats_enabled = enabled;
+  if (enabled) {
+    if (!dec->runner_stats) dec->runner_stats.reset(new jxl::RunStats());
+    dec->runner_stats->Clear();
+  }
+  if (dec->thread_pool) {
+    dec->thread_pool->SetStats(enabled ? dec->runner_stats.get() : nullptr);
+  }
+}
+
+JxlDecoderStatus JxlDecoderGetRunnerStatsSize(const JxlDecoder* dec,
+                                              size_t* size) {
+  if (!dec->runner_stats) {
+    return JXL_API_ERROR("runner stats were never enabled");
+  }
+  *size = dec->runner_stats->ToJSON().size() + 1;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderGetRunnerStats(const JxlDecoder* dec, char* json,
+                                          size_t size) {
+  if (!dec->runner_stats) {
+    return JXL_API_ERROR("runner stats were never enabled");
+  }
+  const std::string stats = dec->runner_stats->ToJSON();
+  if (size < stats.size() + 1) {
+    return JXL_API_ERROR("runner stats buffer too small");
+  }
+  memcpy(json, stats.c_str(), stats.size() + 1);
+  return JXL_DEC_SUCCESS;
+}
+
+void JxlDecoderSetWorkBudget(JxlDecoder* dec, size_t max_groups,
+                             uint64_t max_microseconds) {
+  dec->max_groups_per_call = max_groups;
+  dec->max_microseconds_per_call = max_microseconds;
+}
+
 size_t JxlDecoderSizeHintBasicInfo(const JxlDecoder* dec) {
   if (dec->got_basic_info) return 0;
   return dec->basic_info_size_hint;
@@ -908,6 +1197,79 @@ JxlDecoderStatus JxlDecoderSetCoalescing(JxlDecoder* dec, JXL_BOOL coalescing) {
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlDecoderSetDownsampling(JxlDecoder* dec, uint32_t factor) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set downsampling option before starting");
+  }
+  if (factor != 1 && factor != 2 && factor != 4 && factor != 8) {
+    return JXL_API_ERROR("Invalid downsampling factor");
+  }
+  dec->downsampling = factor;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetFrameLookahead(JxlDecoder* dec,
+                                             size_t max_frames) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set frame lookahead before starting");
+  }
+  dec->frame_lookahead = max_frames;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetMemoryLimit(JxlDecoder* dec, size_t max_bytes) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set memory limit before starting");
+  }
+  dec->memory_limit = max_bytes;
+  return JXL_DEC_SUCCESS;
+}
+
+void JxlDecoderSetMemoryPool(JxlDecoder* dec, size_t max_cached_bytes) {
+  dec->allocation_tracker->SetPoolLimit(max_cached_bytes);
+}
+
+JxlDecoderStatus JxlDecoderGetMemoryUsage(const JxlDecoder* dec,
+                                          size_t* bytes_in_use,
+                                          size_t* max_bytes_in_use) {
+  if (bytes_in_use) *bytes_in_use = dec->allocation_tracker->BytesInUse();
+  if (max_bytes_in_use) {
+    *max_bytes_in_use = dec->allocation_tracker->MaxBytesInUse();
+  }
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetCropRegion(JxlDecoder* dec, uint32_t x0,
+                                         uint32_t y0, uint32_t xsize,
+                                         uint32_t ysize) {
+  if (!dec->got_basic_info) {
+    return JXL_API_ERROR("Basic info not yet available");
+  }
+  if (dec->frame_stage == FrameStage::kFull ||
+      dec->frame_stage == FrameStage::kDecodedAhead) {
+    return JXL_API_ERROR("Must set crop region before the frame is decoded");
+  }
+  if (xsize == 0 || ysize == 0) {
+    dec->crop = jxl::Rect();
+    return JXL_DEC_SUCCESS;
+  }
+  if (!dec->coalescing) {
+    return JXL_API_ERROR("Crop region requires coalescing");
+  }
+  if (!dec->keep_orientation &&
+      dec->metadata.m.GetOrientation() != jxl::Orientation::kIdentity) {
+    return JXL_API_ERROR("Crop region requires keep_orientation");
+  }
+  if (static_cast<uint64_t>(x0) + xsize > dec->metadata.size.xsize() ||
+      static_cast<uint64_t>(y0) + ysize > dec->metadata.size.ysize()) {
+    return JXL_API_ERROR("Crop region outside of the image");
+  }
+  dec->crop = jxl::Rect(x0, y0, xsize, ysize);
+  // Frames decoded ahead have the full image size.
+  dec->decoded_ahead.clear();
+  return JXL_DEC_SUCCESS;
+}
+
 namespace {
 // helper function to get the dimensions of the current image buffer
 void GetCurrentDimensions(const JxlDecoder* dec, size_t& xsize, size_t& ysize) {
@@ -918,7 +1280,14 @@ void GetCurrentDimensions(const JxlDecoder* dec, size_t& xsize, size_t& ysize) {
   }
   xsize = dec->metadata.oriented_xsize(dec->keep_orientation);
   ysize = dec->metadata.oriented_ysize(dec->keep_orientation);
-  if (!dec->coalescing) {
+  if (dec->crop.xsize() != 0) {
+    xsize = dec->crop.xsize();
+    ysize = dec->crop.ysize();
+  }
+  if (dec->coalescing) {
+    xsize = jxl::DivCeil(xsize, dec->downsampling);
+    ysize = jxl::DivCeil(ysize, dec->downsampling);
+  } else {
     const auto frame_dim = dec->frame_header->ToFrameDimensions();
     xsize = frame_dim.xsize_upsampled;
     ysize = frame_dim.ysize_upsampled;
@@ -1152,13 +1521,335 @@ JxlDecoderStatus JxlDecoderProcessSections(JxlDecoder* dec) {
   return JXL_DEC_SUCCESS;
 }
 
+// Called at the first frame header after JxlDecoderSeekFrame, with
+// skip_frames set to the requested frame. Jumps to the frame where decoding
+// must start: the earliest frame that the requested frame depends on, if it
+// was seen before, or the last keyframe before it listed in the frame index
+// box, whichever comes later. The codestream bytes in between are skipped
+// without parsing the frame headers.
+void SeekToFirstRequiredFrame(JxlDecoder* dec) {
+  JXL_DASSERT(dec->internal_frames == 0 && dec->external_frames == 0);
+  const size_t target = dec->skip_frames;
+  size_t start_internal = 0;
+  size_t start_external = 0;
+  uint64_t start_offset = dec->codestream_offset;
+  bool untracked = false;
+
+  const std::vector<size_t>& to_internal = dec->frame_external_to_internal;
+  if (target < to_internal.size()) {
+    size_t internal = to_internal[target];
+    std::vector<size_t> deps = GetFrameDependencies(
+        internal, dec->frame_saved_as, dec->frame_references);
+    start_internal = internal;
+    for (size_t i = 0; i < deps.size(); i++) {
+      start_internal = std::min(start_internal, deps[i]);
+    }
+    // The external frame that the start frame is part of.
+    start_external =
+        std::lower_bound(to_internal.begin(), to_internal.end(),
+                         start_internal) -
+        to_internal.begin();
+    start_offset = dec->frame_offsets[start_internal];
+  }
+
+  // The frame counts of the index are in terms of coalesced frames.
+  const std::vector<JxlDecoderFrameIndexBoxEntry>& entries =
+      dec->frame_index_box.entries;
+  const size_t num_entries = dec->coalescing ? entries.size() : 0;
+  uint64_t offset = 0;
+  size_t external = 0;
+  for (size_t i = 0; i < num_entries; i++) {
+    const JxlDecoderFrameIndexBoxEntry& entry = entries[i];
+    offset += entry.OFFi;
+    if (external > target) break;
+    if (offset > start_offset) {
+      const std::vector<uint64_t>& offsets = dec->frame_offsets;
+      auto it = std::lower_bound(offsets.begin(), offsets.end(), offset);
+      if (it != offsets.end() && *it == offset) {
+        // A keyframe seen before, verify that the index agrees with it.
+        size_t internal = it - offsets.begin();
+        if (static_cast<size_t>(std::lower_bound(to_internal.begin(),
+                                                 to_internal.end(), internal) -
+                                to_internal.begin()) == external) {
+          start_internal = internal;
+          start_external = external;
+          start_offset = offset;
+          untracked = false;
+        }
+      } else if (it == offsets.end() && external >= to_internal.size()) {
+        start_internal = dec->frame_saved_as.size();
+        start_external = external;
+        start_offset = offset;
+        untracked = true;
+      }
+    }
+    external += entry.Fi;
+  }
+
+  dec->AdvanceCodestream(start_offset - dec->codestream_offset);
+  dec->internal_frames = start_internal;
+  dec->external_frames = start_external;
+  dec->skip_frames = target - start_external;
+  dec->frames_untracked = untracked;
+  UpdateRequiredFrames(dec);
+}
+
+// Whether the frames from the current one on may be decoded before they are
+// reached: this excludes the outputs that are set up for each frame as it is
+// decoded, frames that are skipped, which are only decoded if required, and
+// frames before the point where an earlier look found too few frames.
+bool CanDecodeAhead(const JxlDecoder* dec) {
+  return dec->frame_lookahead >= 2 && !dec->decode_ahead_disabled &&
+         dec->codestream_offset > dec->decode_ahead_stop && dec->coalescing &&
+         !dec->preview_frame && dec->skip_frames == 0 &&
+         (dec->events_wanted & JXL_DEC_FULL_IMAGE) &&
+         !(dec->events_wanted & JXL_DEC_FRAME_PROGRESSION) &&
+         !dec->jpeg_decoder.IsOutputSet() && dec->crop.xsize() == 0 &&
+         dec->downsampling == 1;
+}
+
+// Whether the frame is displayed on its own and is decoded without reading
+// any reference slot, so that it does not depend on the frames before it.
+bool IsIndependentFrame(const FrameHeader& header) {
+  if (header.frame_type != FrameType::kRegularFrame) return false;
+  if (!header.is_last && header.animation_frame.duration == 0) return false;
+  if (header.custom_size_or_origin) return false;
+  if (header.flags & (FrameHeader::kPatches | FrameHeader::kUseDcFrame)) {
+    return false;
+  }
+  if (header.blending_info.mode != BlendMode::kReplace) return false;
+  for (const auto& info : header.extra_channel_blending_info) {
+    if (info.mode != BlendMode::kReplace) return false;
+  }
+  return true;
+}
+
+// Decodes one of the frames found by DecodeFramesAhead, without a runner.
+bool DecodeFrameAhead(const JxlDecoder* dec, PassesDecoderState* state,
+                      Span<const uint8_t> data, DecodedAheadFrame* frame) {
+  FrameDecoder frame_dec(state, dec->metadata, /*pool=*/nullptr,
+                         /*use_slow_rendering_pipeline=*/false);
+  auto reader = GetBitReader(data);
+  if (!frame_dec.InitFrame(reader.get(), &frame->ib, /*is_preview=*/false,
+                           /*output_needed=*/true) ||
+      !reader->AllReadsWithinBounds()) {
+    return false;
+  }
+  frame_dec.SetRenderSpotcolors(dec->render_spotcolors);
+  frame_dec.SetCoalescing(true);
+
+  size_t pos = reader->TotalBitsConsumed() / kBitsPerByte;
+  const auto& toc = frame_dec.Toc();
+  std::vector<decltype(reader)> section_readers;
+  std::vector<FrameDecoder::SectionInfo> section_info;
+  for (size_t i = 0; i < toc.size(); ++i) {
+    section_readers.push_back(GetBitReader(
+        Span<const uint8_t>(data.data() + pos, toc[i].size)));
+    section_info.emplace_back(
+        FrameDecoder::SectionInfo{section_readers.back().get(), toc[i].id});
+    pos += toc[i].size;
+  }
+  std::vector<FrameDecoder::SectionStatus> section_status(section_info.size());
+  if (!frame_dec.ProcessSections(section_info.data(), section_info.size(),
+                                 section_status.data())) {
+    return false;
+  }
+  for (size_t i = 0; i < section_info.size(); ++i) {
+    if (!section_readers[i]->AllReadsWithinBounds() ||
+        section_status[i] != FrameDecoder::kDone) {
+      return false;
+    }
+  }
+  if (!frame_dec.FinalizeFrame()) return false;
+
+  if (frame->header.CanBeReferenced()) {
+    auto& info =
+        state->shared_storage.reference_frames[frame->header.save_as_reference];
+    frame->reference = std::move(info.storage);
+    frame->reference_in_xyb = info.ib_is_in_xyb;
+  }
+  return true;
+}
+
+// Called at the header of the current frame, with the codestream input
+// starting there. Decodes the independent frames that follow each other from
+// the current one on, and are fully available in `span`, concurrently: each
+// frame is one task of the runner, and is decoded with a state of its own.
+// The frames are then returned from decoded_ahead, in order, as if they had
+// been decoded when reached. A frame that fails to decode here is decoded
+// again once reached, which reports the error.
+void DecodeFramesAhead(JxlDecoder* dec, Span<const uint8_t> span) {
+  std::vector<DecodedAheadFrame> frames;
+  std::vector<Span<const uint8_t>> frame_data;
+  size_t pos = 0;
+  // Whether the frames are known to end at `pos` for decoding ahead, rather
+  // than because the input ends there.
+  bool found_end = false;
+  // All frames of the batch are held at once, so they must fit in the limits
+  // together, not only each on its own.
+  size_t batch_pixels = 0;
+  while (frames.size() < dec->frame_lookahead && pos < span.size()) {
+    const size_t i = frames.size();
+    if (i == dec->decoded_ahead_states.size()) {
+      dec->decoded_ahead_states.emplace_back(new PassesDecoderState());
+    }
+    PassesDecoderState* state = dec->decoded_ahead_states[i].get();
+    // Only the frame header and TOC are read here.
+    FrameDecoder frame_dec(state, dec->metadata, /*pool=*/nullptr,
+                           /*use_slow_rendering_pipeline=*/false);
+    DecodedAheadFrame frame(&dec->metadata);
+    frame.ib = ImageBundle(&dec->image_metadata);
+    Span<const uint8_t> data(span.data() + pos, span.size() - pos);
+    auto reader = GetBitReader(data);
+    if (!frame_dec.InitFrame(reader.get(), &frame.ib, /*is_preview=*/false,
+                             /*output_needed=*/false) ||
+        !reader->AllReadsWithinBounds()) {
+      break;
+    }
+    frame.header = frame_dec.GetFrameHeader();
+    frame.size = reader->TotalBitsConsumed() / kBitsPerByte +
+                 frame_dec.SumSectionSizes();
+    if (frame.size > data.size()) break;
+    FrameDimensions frame_dim = frame.header.ToFrameDimensions();
+    if (!IsIndependentFrame(frame.header) ||
+        !CheckSizeLimit(dec, frame_dim.xsize_upsampled_padded,
+                        frame_dim.ysize_upsampled_padded)) {
+      found_end = true;
+      break;
+    }
+    // A frame that only fits without the ones before it is decoded ahead
+    // with the next batch instead.
+    if (!AddToBatchSizeLimit(dec, frame_dim.xsize_upsampled_padded,
+                             frame_dim.ysize_upsampled_padded, &batch_pixels)) {
+      break;
+    }
+    state->output_encoding_info = dec->passes_state->output_encoding_info;
+    // The noise is seeded as if the frames were decoded in order.
+    state->visible_frame_index = dec->passes_state->visible_frame_index + i;
+    state->nonvisible_frame_index = 0;
+    frame_data.emplace_back(data.data(), frame.size);
+    pos += frame.size;
+    bool is_last = frame.header.is_last;
+    frames.push_back(std::move(frame));
+    if (is_last) {
+      found_end = true;
+      break;
+    }
+  }
+  if (frames.size() < 2) {
+    if (found_end) dec->decode_ahead_stop = dec->codestream_offset + pos;
+    return;
+  }
+
+  std::vector<char> decoded(frames.size(), 0);
+  const auto decode_frame = [&](const uint32_t task, size_t /*thread*/) {
+    decoded[task] = DecodeFrameAhead(dec, dec->decoded_ahead_states[task].get(),
+                                     frame_data[task], &frames[task]);
+  };
+  if (!RunOnPool(dec->thread_pool.get(), 0, frames.size(), ThreadPool::NoInit,
+                 decode_frame, "DecodeFramesAhead")) {
+    return;
+  }
+  for (size_t i = 0; i < frames.size() && decoded[i]; i++) {
+    dec->decoded_ahead.push_back(std::move(frames[i]));
+  }
+}
+
+// Writes the pixels of the current frame, which was decoded ahead, to the
+// image output buffer or callback and to the extra channel buffers.
+JxlDecoderStatus OutputDecodedAheadFrame(JxlDecoder* dec) {
+  const ImageBundle& ib = dec->decoded_ahead.front().ib;
+  const Orientation undo_orientation = dec->keep_orientation
+                                           ? Orientation::kIdentity
+                                           : dec->metadata.m.GetOrientation();
+  size_t xsize, ysize;
+  GetCurrentDimensions(dec, xsize, ysize);
+  const auto row_size = [xsize](const JxlPixelFormat& format,
+                                size_t num_channels) {
+    size_t row_size = DivCeil(
+        xsize * num_channels * BitsPerChannel(format.data_type), kBitsPerByte);
+    if (format.align > 1) {
+      row_size = DivCeil(row_size, format.align) * format.align;
+    }
+    return row_size;
+  };
+  const auto is_float = [](const JxlPixelFormat& format) {
+    return format.data_type == JXL_TYPE_FLOAT ||
+           format.data_type == JXL_TYPE_FLOAT16;
+  };
+
+  const JxlPixelFormat& format = dec->image_out_format;
+  if (!ConvertToExternal(
+          ib, GetBitDepth(dec->image_out_bit_depth, dec->metadata.m, format),
+          is_float(format), format.num_channels, format.endianness,
+          row_size(format, format.num_channels), dec->thread_pool.get(),
+          dec->image_out_buffer, dec->image_out_size,
+          PixelCallback{
+              dec->image_out_init_callback, dec->image_out_run_callback,
+              dec->image_out_destroy_callback, dec->image_out_init_opaque},
+          undo_orientation, dec->unpremul_alpha)) {
+    return JXL_API_ERROR("failed to output the frame");
+  }
+  for (size_t i = 0; i < dec->extra_channel_output.size(); ++i) {
+    const auto& extra = dec->extra_channel_output[i];
+    if (extra.buffer == nullptr) continue;
+    if (!ConvertToExternal(
+            ib.extra_channels()[i],
+            GetBitDepth(dec->image_out_bit_depth,
+                        dec->metadata.m.extra_channel_info[i], extra.format),
+            is_float(extra.format), extra.format.endianness,
+            row_size(extra.format, 1), dec->thread_pool.get(), extra.buffer,
+            extra.buffer_size, PixelCallback(), undo_orientation)) {
+      return JXL_API_ERROR("failed to output the extra channel");
+    }
+  }
+  return JXL_DEC_SUCCESS;
+}
+
+// Whether the current frame, with header `header`, is written to the image
+// output buffer with the fast XYB to sRGB conversion of the render pipeline,
+// which the frames decoded ahead do not use.
+bool UsesFastOutput(const JxlDecoder* dec, const FrameHeader& header) {
+  if (dec->image_out_buffer == nullptr) return false;
+  const ExtraChannelInfo* alpha = dec->metadata.m.Find(ExtraChannel::kAlpha);
+  const bool unpremul_alpha =
+      dec->unpremul_alpha && alpha != nullptr && alpha->alpha_associated;
+  const Orientation undo_orientation = dec->keep_orientation
+                                           ? Orientation::kIdentity
+                                           : dec->metadata.m.GetOrientation();
+  return UsesFastXYBTosRGB8(*dec->passes_state, dec->metadata.m, header,
+                            dec->image_out_format, unpremul_alpha,
+                            undo_orientation);
+}
+
+// Reads the header and TOC of the current frame into the frame decoder, from
+// `span` which starts at the frame.
+JxlDecoderStatus ReadFrameHeader(JxlDecoder* dec, Span<const uint8_t> span) {
+  auto reader = GetBitReader(span);
+  bool output_needed =
+      (dec->preview_frame ? (dec->events_wanted & JXL_DEC_PREVIEW_IMAGE)
+                          : (dec->events_wanted & JXL_DEC_FULL_IMAGE));
+  jxl::Status status = dec->frame_dec->InitFrame(
+      reader.get(), dec->ib.get(), dec->preview_frame, output_needed);
+  if (!reader->AllReadsWithinBounds() ||
+      status.code() == StatusCode::kNotEnoughBytes) {
+    return dec->RequestMoreInput();
+  } else if (!status) {
+    return JXL_API_ERROR("invalid frame header");
+  }
+  dec->AdvanceCodestream(reader->TotalBitsConsumed() / kBitsPerByte);
+  *dec->frame_header = dec->frame_dec->GetFrameHeader();
+  dec->remaining_frame_size = dec->frame_dec->SumSectionSizes();
+  return JXL_DEC_SUCCESS;
+}
+
 // TODO(eustas): no CodecInOut -> no image size reinforcement -> possible OOM.
 JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
   // If no parallel runner is set, use the default
   // TODO(lode): move this initialization to an appropriate location once the
   // runner is used to decode pixels.
   if (!dec->thread_pool) {
-    dec->thread_pool.reset(new jxl::ThreadPool(nullptr, nullptr));
+    ResetThreadPool(dec, nullptr, nullptr);
   }
 
   // No matter what events are wanted, the basic info is always required.
@@ -1219,6 +1910,10 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
         return JXL_API_ERROR(
             "cannot decode a next frame after JPEG reconstruction frame");
       }
+      if (dec->seek_pending && !dec->preview_frame) {
+        dec->seek_pending = false;
+        SeekToFirstRequiredFrame(dec);
+      }
       if (!dec->ib) {
         dec->ib.reset(new jxl::ImageBundle(&dec->image_metadata));
       }
@@ -1231,22 +1926,21 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
           dec->passes_state.get(), dec->metadata, dec->thread_pool.get(),
           /*use_slow_rendering_pipeline=*/false));
       dec->frame_header.reset(new FrameHeader(&dec->metadata));
+      const uint64_t frame_offset = dec->codestream_offset;
       Span<const uint8_t> span;
       JXL_API_RETURN_IF_ERROR(dec->GetCodestreamInput(&span));
-      auto reader = GetBitReader(span);
-      bool output_needed =
-          (dec->preview_frame ? (dec->events_wanted & JXL_DEC_PREVIEW_IMAGE)
-                              : (dec->events_wanted & JXL_DEC_FULL_IMAGE));
-      jxl::Status status = dec->frame_dec->InitFrame(
-          reader.get(), dec->ib.get(), dec->preview_frame, output_needed);
-      if (!reader->AllReadsWithinBounds() ||
-          status.code() == StatusCode::kNotEnoughBytes) {
-        return dec->RequestMoreInput();
-      } else if (!status) {
-        return JXL_API_ERROR("invalid frame header");
+      if (dec->decoded_ahead.empty() && CanDecodeAhead(dec)) {
+        DecodeFramesAhead(dec, span);
+      }
+      JXL_DASSERT(dec->decoded_ahead.empty() || dec->skip_frames == 0);
+      const bool decoded_ahead = !dec->decoded_ahead.empty();
+      if (decoded_ahead) {
+        // The codestream of the frame is skipped once its pixels are output.
+        *dec->frame_header = dec->decoded_ahead.front().header;
+        dec->remaining_frame_size = dec->decoded_ahead.front().size;
+      } else {
+        JXL_API_RETURN_IF_ERROR(ReadFrameHeader(dec, span));
       }
-      dec->AdvanceCodestream(reader->TotalBitsConsumed() / kBitsPerByte);
-      *dec->frame_header = dec->frame_dec->GetFrameHeader();
       jxl::FrameDimensions frame_dim = dec->frame_header->ToFrameDimensions();
       if (!CheckSizeLimit(dec, frame_dim.xsize_upsampled_padded,
                           frame_dim.ysize_upsampled_padded)) {
@@ -1263,9 +1957,8 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
           return JXL_API_ERROR("used too much CPU");
         }
       }
-      dec->remaining_frame_size = dec->frame_dec->SumSectionSizes();
-
-      dec->frame_stage = FrameStage::kTOC;
+      dec->frame_stage =
+          decoded_ahead ? FrameStage::kDecodedAhead : FrameStage::kTOC;
       if (dec->preview_frame) {
         if (!(dec->events_wanted & JXL_DEC_PREVIEW_IMAGE)) {
           dec->frame_stage = FrameStage::kHeader;
@@ -1300,15 +1993,20 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
         dec->skipping_frame = false;
       }
 
-      if (external_frame_index >= dec->frame_external_to_internal.size()) {
+      // After jumping to a keyframe that was not seen before, the internal
+      // frame index is unknown, so nothing is recorded for the frame.
+      if (!dec->frames_untracked &&
+          external_frame_index >= dec->frame_external_to_internal.size()) {
         dec->frame_external_to_internal.push_back(internal_frame_index);
         JXL_ASSERT(dec->frame_external_to_internal.size() ==
                    external_frame_index + 1);
       }
 
-      if (internal_frame_index >= dec->frame_saved_as.size()) {
+      if (!dec->frames_untracked &&
+          internal_frame_index >= dec->frame_saved_as.size()) {
         dec->frame_saved_as.push_back(saved_as);
         JXL_ASSERT(dec->frame_saved_as.size() == internal_frame_index + 1);
+        dec->frame_offsets.push_back(frame_offset);
 
         // add the value 0xff (which means all references) to new slots: we only
         // know the references of the frame at FinalizeFrame, and fill in the
@@ -1348,9 +2046,35 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
       }
     }
 
+    if (dec->frame_stage == FrameStage::kDecodedAhead) {
+      if (!dec->image_out_buffer_set) {
+        return JXL_DEC_NEED_IMAGE_OUT_BUFFER;
+      }
+      if (UsesFastOutput(dec, *dec->frame_header)) {
+        // The output would differ from that of decoding in order, so the
+        // frames decoded ahead are dropped, and this frame and the next ones
+        // are decoded in order.
+        dec->decode_ahead_disabled = true;
+        dec->decoded_ahead.clear();
+        Span<const uint8_t> span;
+        JXL_API_RETURN_IF_ERROR(dec->GetCodestreamInput(&span));
+        JXL_API_RETURN_IF_ERROR(ReadFrameHeader(dec, span));
+        dec->frame_stage = FrameStage::kTOC;
+      } else {
+        JXL_API_RETURN_IF_ERROR(OutputDecodedAheadFrame(dec));
+        FinishDecodedAheadFrame(dec);
+        dec->image_out_buffer_set = false;
+        dec->extra_channel_output.clear();
+      }
+    }
+
     if (dec->frame_stage == FrameStage::kTOC) {
       dec->frame_dec->SetRenderSpotcolors(dec->render_spotcolors);
       dec->frame_dec->SetCoalescing(dec->coalescing);
+      dec->frame_dec->SetCropRegion(dec->preview_frame ? jxl::Rect()
+                                                       : dec->crop);
+      dec->frame_dec->SetDownsampling(
+          dec->preview_frame || !dec->coalescing ? 1 : dec->downsampling);
 
       if (!dec->preview_frame &&
           (dec->events_wanted & JXL_DEC_FRAME_PROGRESSION)) {
@@ -1417,6 +2141,9 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
 
       size_t next_num_passes_to_pause = dec->frame_dec->NextNumPassesToPause();
 
+      const bool has_budget =
+          dec->max_groups_per_call != 0 || dec->max_microseconds_per_call != 0;
+      dec->frame_dec->SetWorkBudget(has_budget ? &dec->work_budget : nullptr);
       JXL_API_RETURN_IF_ERROR(JxlDecoderProcessSections(dec));
 
       bool all_sections_done = dec->frame_dec->HasDecodedAll();
@@ -1443,10 +2170,11 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
 
       if (!all_sections_done) {
         // Not all sections have been processed yet
+        if (dec->work_budget.exhausted) return JXL_DEC_YIELD;
         return dec->RequestMoreInput();
       }
 
-      if (!dec->preview_frame) {
+      if (!dec->preview_frame && !dec->frames_untracked) {
         size_t internal_index = dec->internal_frames - 1;
         JXL_ASSERT(dec->frame_references.size() > internal_index);
         // Always fill this in, even if it was already written, it could be that
@@ -1512,10 +2240,20 @@ JxlDecoderStatus JxlDecoderSetInput(JxlDecoder* dec, const uint8_t* data,
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlDecoderSetPersistentInput(JxlDecoder* dec,
+                                              const uint8_t* data,
+                                              size_t size) {
+  JXL_API_RETURN_IF_ERROR(JxlDecoderSetInput(dec, data, size));
+  dec->input_closed = true;
+  dec->persistent_input = true;
+  return JXL_DEC_SUCCESS;
+}
+
 size_t JxlDecoderReleaseInput(JxlDecoder* dec) {
   size_t result = dec->avail_in;
   dec->next_in = nullptr;
   dec->avail_in = 0;
+  dec->persistent_input = false;
   return result;
 }
 
@@ -1585,6 +2323,29 @@ static JxlDecoderStatus ParseBoxHeader(const uint8_t* in, size_t size,
   return JXL_DEC_SUCCESS;
 }
 
+// Parses the contents of a jxli box. The frame index only serves to seek
+// faster, so a malformed box leaves the index empty rather than failing.
+static void ParseFrameIndexBox(const uint8_t* in, size_t size,
+                               jxl::JxlDecoderFrameIndexBox* index) {
+  *index = jxl::JxlDecoderFrameIndexBox();
+  size_t pos = 0;
+  uint64_t num_frames = jxl::DecodeVarInt(in, size, &pos);
+  if (OutOfBounds(pos, 8, size)) return;
+  jxl::JxlDecoderFrameIndexBox result;
+  result.TNUM = LoadBE32(in + pos);
+  result.TDEN = LoadBE32(in + pos + 4);
+  pos += 8;
+  if (result.TDEN == 0) return;
+  for (uint64_t i = 0; i < num_frames; i++) {
+    uint64_t OFFi = jxl::DecodeVarInt(in, size, &pos);
+    uint64_t Ti = jxl::DecodeVarInt(in, size, &pos);
+    uint64_t Fi = jxl::DecodeVarInt(in, size, &pos);
+    if (pos > size) return;
+    result.AddFrame(OFFi, Ti, Fi);
+  }
+  *index = std::move(result);
+}
+
 // This includes handling the codestream if it is not a box-based jxl file.
 static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
   // Box handling loop
@@ -1818,6 +2579,10 @@ static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
               "multiple JPEG reconstruction boxes not supported");
         }
         dec->box_stage = BoxStage::kJpegRecon;
+      } else if (memcmp(dec->box_type, "jxli", 4) == 0 &&
+                 !dec->box_contents_unbounded &&
+                 dec->box_contents_size <= kMaxFrameIndexBoxSize) {
+        dec->box_stage = BoxStage::kFrameIndex;
       } else {
         dec->box_stage = BoxStage::kSkip;
       }
@@ -1856,6 +2621,10 @@ static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
       dec->box_stage = BoxStage::kCodestream;
     } else if (dec->box_stage == BoxStage::kCodestream) {
       JxlDecoderStatus status = jxl::JxlDecoderProcessCodestream(dec);
+      if (dec->retry_codestream) {
+        dec->retry_codestream = false;
+        if (status == JXL_DEC_NEED_MORE_INPUT) continue;
+      }
       if (status == JXL_DEC_FULL_IMAGE) {
         if (dec->recon_output_jpeg != JpegReconStage::kNone) {
           continue;
@@ -1933,6 +2702,21 @@ static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
         // If anything else, return the result.
         return recon_result;
       }
+    } else if (dec->box_stage == BoxStage::kFrameIndex) {
+      // The input is consumed as it arrives, so that the caller does not need
+      // to keep the box in its buffer, and the frame index is parsed once the
+      // full box is available.
+      const size_t remaining = dec->box_contents_end - dec->file_pos;
+      const size_t num = std::min(remaining, dec->avail_in);
+      dec->frame_index_box_data.insert(dec->frame_index_box_data.end(),
+                                       dec->next_in, dec->next_in + num);
+      dec->AdvanceInput(num);
+      if (num < remaining) return JXL_DEC_NEED_MORE_INPUT;
+      ParseFrameIndexBox(dec->frame_index_box_data.data(),
+                         dec->frame_index_box_data.size(),
+                         &dec->frame_index_box);
+      dec->frame_index_box_data.clear();
+      dec->box_stage = BoxStage::kHeader;
     } else if (dec->box_stage == BoxStage::kSkip) {
       if (dec->box_contents_unbounded) {
         if (dec->input_closed) {
@@ -1973,6 +2757,7 @@ static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
 }
 
 JxlDecoderStatus JxlDecoderProcessInput(JxlDecoder* dec) {
+  jxl::AllocationTrackerScope tracker_scope(dec->allocation_tracker.get());
   if (dec->stage == DecoderStage::kInited) {
     dec->stage = DecoderStage::kStarted;
   }
@@ -1982,6 +2767,16 @@ JxlDecoderStatus JxlDecoderProcessInput(JxlDecoder* dec) {
         "JxlDecoderReset to reset it");
   }
 
+  dec->work_budget = jxl::FrameDecoder::WorkBudget();
+  dec->work_budget.max_groups = dec->max_groups_per_call;
+  if (dec->max_microseconds_per_call != 0) {
+    // Clamped to about two weeks, so that the deadline does not overflow.
+    const uint64_t microseconds =
+        std::min<uint64_t>(dec->max_microseconds_per_call, 1ull << 40);
+    dec->work_budget.deadline = std::chrono::steady_clock::now() +
+                                std::chrono::microseconds(microseconds);
+  }
+
   if (!dec->got_signature) {
     JxlSignature sig = JxlSignatureCheck(dec->next_in, dec->avail_in);
     if (sig == JXL_SIG_INVALID) return JXL_API_ERROR("invalid signature");
@@ -2003,6 +2798,11 @@ JxlDecoderStatus JxlDecoderProcessInput(JxlDecoder* dec) {
 
   JxlDecoderStatus status = HandleBoxes(dec);
 
+  if (status != JXL_DEC_ERROR && dec->memory_limit != 0 &&
+      dec->allocation_tracker->BytesInUse() > dec->memory_limit) {
+    return JXL_API_ERROR("exceeded the memory limit");
+  }
+
   if (status == JXL_DEC_NEED_MORE_INPUT && dec->input_closed) {
     return JXL_API_ERROR("missing input");
   }
@@ -2271,6 +3071,11 @@ size_t JxlDecoderGetIntendedDownsamplingRatio(JxlDecoder* dec) {
 
 JxlDecoderStatus JxlDecoderFlushImage(JxlDecoder* dec) {
   if (!dec->image_out_buffer_set) return JXL_DEC_ERROR;
+  jxl::AllocationTrackerScope tracker_scope(dec->allocation_tracker.get());
+  if (dec->frame_stage == FrameStage::kDecodedAhead) {
+    // All of the frame is decoded already.
+    return jxl::OutputDecodedAheadFrame(dec);
+  }
   if (dec->frame_stage != FrameStage::kFull) {
     return JXL_DEC_ERROR;
   }
@@ -2781,3 +3586,153 @@ JxlDecoderStatus JxlDecoderSetImageOutBitDepth(JxlDecoder* dec,
   dec->image_out_bit_depth = *bit_depth;
   return JXL_DEC_SUCCESS;
 }
+
+namespace {
+// Decodes until the next subscribed event, and stores the result in item if
+// decoding stops there because of an error or the image is complete.
+bool ContinueBatchItem(JxlDecoder* dec, JxlDecoderBatchItem* item) {
+  for (;;) {
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec);
+    if (status == JXL_DEC_BASIC_INFO) {
+      JxlBasicInfo info;
+      if (JxlDecoderGetBasicInfo(dec, &info) != JXL_DEC_SUCCESS) {
+        item->status = JXL_DEC_ERROR;
+        return false;
+      }
+      item->xsize = info.xsize;
+      item->ysize = info.ysize;
+      return true;
+    } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+      size_t buffer_size;
+      if (JxlDecoderImageOutBufferSize(dec, &item->format, &buffer_size) !=
+          JXL_DEC_SUCCESS) {
+        item->status = JXL_DEC_ERROR;
+        return false;
+      }
+      if (buffer_size > item->buffer_size) {
+        item->status = JXL_DEC_NEED_IMAGE_OUT_BUFFER;
+        return false;
+      }
+      if (JxlDecoderSetImageOutBuffer(dec, &item->format, item->buffer,
+                                      item->buffer_size) != JXL_DEC_SUCCESS) {
+        item->status = JXL_DEC_ERROR;
+        return false;
+      }
+    } else if (status == JXL_DEC_FULL_IMAGE) {
+      item->status = JXL_DEC_SUCCESS;
+      return false;
+    } else if (status == JXL_DEC_SUCCESS) {
+      // The input ended without any displayed frame.
+      item->status = JXL_DEC_ERROR;
+      return false;
+    } else {
+      item->status =
+          status == JXL_DEC_NEED_MORE_INPUT ? status : JXL_DEC_ERROR;
+      return false;
+    }
+  }
+}
+
+// Memory managers need not be thread-safe, but the decoders of a batch run
+// concurrently, so their calls into the caller's manager are serialized.
+struct SerializedMemoryManager {
+  JxlMemoryManager manager;
+  std::mutex mutex;
+
+  static void* Alloc(void* opaque, size_t size) {
+    SerializedMemoryManager* self =
+        static_cast<SerializedMemoryManager*>(opaque);
+    std::lock_guard<std::mutex> lock(self->mutex);
+    return self->manager.alloc(self->manager.opaque, size);
+  }
+
+  static void Free(void* opaque, void* address) {
+    SerializedMemoryManager* self =
+        static_cast<SerializedMemoryManager*>(opaque);
+    std::lock_guard<std::mutex> lock(self->mutex);
+    self->manager.free(self->manager.opaque, address);
+  }
+};
+}  // namespace
+
+JxlDecoderStatus JxlDecoderDecodeBatch(JxlDecoderBatchItem* items,
+                                       size_t num_items,
+                                       const JxlMemoryManager* memory_manager,
+                                       JxlParallelRunner parallel_runner,
+                                       void* parallel_runner_opaque) {
+  // The default allocator is thread-safe, and a manager with only one of
+  // alloc and free set is rejected by JxlDecoderMake.
+  SerializedMemoryManager serialized;
+  JxlMemoryManager serialized_manager;
+  if (memory_manager != nullptr && memory_manager->alloc != nullptr &&
+      memory_manager->free != nullptr) {
+    serialized.manager = *memory_manager;
+    serialized_manager.opaque = &serialized;
+    serialized_manager.alloc = &SerializedMemoryManager::Alloc;
+    serialized_manager.free = &SerializedMemoryManager::Free;
+    memory_manager = &serialized_manager;
+  }
+
+  jxl::ThreadPool pool(parallel_runner, parallel_runner_opaque);
+  std::vector<JxlDecoderPtr> decoders(num_items);
+
+  // The basic info tells which images are small enough to be decoded
+  // concurrently. Decoders of images that are done or failed are destroyed.
+  const auto decode_basic_info = [&](const uint32_t task, size_t /*thread*/) {
+    JxlDecoderBatchItem* item = &items[task];
+    item->xsize = 0;
+    item->ysize = 0;
+    item->status = JXL_DEC_ERROR;
+    JxlDecoderPtr dec = JxlDecoderMake(memory_manager);
+    if (!dec) return;
+    if (JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_BASIC_INFO |
+                                                 JXL_DEC_FULL_IMAGE) !=
+            JXL_DEC_SUCCESS ||
+        JxlDecoderSetInput(dec.get(), item->data, item->size) !=
+            JXL_DEC_SUCCESS) {
+      return;
+    }
+    // The input is not closed, so that truncated data is reported as such.
+    if (ContinueBatchItem(dec.get(), item)) decoders[task] = std::move(dec);
+  };
+  if (!jxl::RunOnPool(&pool, 0, num_items, jxl::ThreadPool::NoInit,
+                      decode_basic_info, "DecodeBatchBasicInfo")) {
+    return JXL_DEC_ERROR;
+  }
+
+  std::vector<size_t> small;
+  std::vector<size_t> large;
+  for (size_t i = 0; i < num_items; i++) {
+    if (!decoders[i]) continue;
+    if (items[i].xsize <= jxl::kGroupDim && items[i].ysize <= jxl::kGroupDim) {
+      small.push_back(i);
+    } else {
+      large.push_back(i);
+    }
+  }
+
+  // The runner does not support nested parallelism, so the small images are
+  // each decoded with the default single-threaded runner.
+  const auto decode_small = [&](const uint32_t task, size_t /*thread*/) {
+    size_t i = small[task];
+    (void)ContinueBatchItem(decoders[i].get(), &items[i]);
+    decoders[i].reset();
+  };
+  if (!jxl::RunOnPool(&pool, 0, small.size(), jxl::ThreadPool::NoInit,
+                      decode_small, "DecodeBatch")) {
+    return JXL_DEC_ERROR;
+  }
+
+  for (size_t i : large) {
+    // The frames are not started yet, so the runner can still be replaced.
+    ResetThreadPool(decoders[i].get(), parallel_runner,
+                    parallel_runner_opaque);
+    (void)ContinueBatchItem(decoders[i].get(), &items[i]);
+    decoders[i].reset();
+  }
+
+  for (size_t i = 0; i < num_items; i++) {
+    if (items[i].status != JXL_DEC_SUCCESS) return JXL_DEC_ERROR;
+  }
+  return JXL_DEC_SUCCESS;
+}
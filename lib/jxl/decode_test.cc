@@ -8,13 +8,17 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <atomic>
+#include <chrono>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "gtest/gtest.h"
 #include "jxl/decode_cxx.h"
+#include "jxl/encode_cxx.h"
 #include "jxl/resizable_parallel_runner_cxx.h"
 #include "jxl/thread_parallel_runner_cxx.h"
 #include "jxl/types.h"
@@ -1630,6 +1634,842 @@ TEST(DecodeTest, PixelTestWithICCProfileLossless) {
   JxlDecoderDestroy(dec);
 }
 
+TEST(DecodeTest, RecycleTest) {
+  JxlDecoder* dec = JxlDecoderCreate(NULL);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+  // The buffers kept from each image are either too large or too small for
+  // the next one.
+  const size_t sizes[][2] = {{300, 200}, {123, 77}, {520, 300}};
+  for (const auto& size : sizes) {
+    size_t xsize = size[0], ysize = size[1];
+    std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+    jxl::TestCodestreamParams params;
+    jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+        jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+        params);
+    jxl::Span<const uint8_t> span(compressed.data(), compressed.size());
+    std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+        span, format, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+    std::vector<uint8_t> recycled = jxl::DecodeWithAPI(
+        dec, span, format, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+    JxlDecoderRecycle(dec);
+    EXPECT_EQ(xsize * ysize * 3, recycled.size());
+    EXPECT_EQ(expected, recycled);
+  }
+  JxlDecoderDestroy(dec);
+}
+
+TEST(DecodeTest, CropRegionTest) {
+  size_t xsize = 600, ysize = 500;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      params);
+  // Float output avoids the fast uint8 path, which is not used with a crop.
+  JxlPixelFormat format = {3, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
+  const size_t kPixelSize = 3 * sizeof(float);
+  std::vector<uint8_t> full = jxl::DecodeWithAPI(
+      jxl::Span<const uint8_t>(compressed.data(), compressed.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false, /*require_boxes=*/false,
+      /*expect_success=*/true);
+  ASSERT_EQ(xsize * ysize * kPixelSize, full.size());
+
+  // Inside a single group, across group boundaries and at the image edge.
+  const size_t regions[][4] = {
+      {10, 20, 30, 40}, {200, 230, 150, 60}, {520, 400, 80, 100}};
+  for (const auto& region : regions) {
+    size_t x0 = region[0], y0 = region[1];
+    size_t crop_xsize = region[2], crop_ysize = region[3];
+    JxlDecoder* dec = JxlDecoderCreate(NULL);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(
+                  dec, JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_ERROR,
+              JxlDecoderSetCropRegion(dec, x0, y0, crop_xsize, crop_ysize));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+    JxlDecoderCloseInput(dec);
+    EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetCropRegion(dec, x0, y0,
+                                                     xsize - x0 + 1, 1));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetCropRegion(dec, x0, y0, crop_xsize, crop_ysize));
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetCropRegion(dec, 0, 0, 1, 1));
+    size_t buffer_size;
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderImageOutBufferSize(dec, &format, &buffer_size));
+    EXPECT_EQ(crop_xsize * crop_ysize * kPixelSize, buffer_size);
+    std::vector<uint8_t> cropped(buffer_size);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetImageOutBuffer(dec, &format, cropped.data(),
+                                          cropped.size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
+    JxlDecoderDestroy(dec);
+
+    for (size_t y = 0; y < crop_ysize; y++) {
+      EXPECT_EQ(0, memcmp(&cropped[y * crop_xsize * kPixelSize],
+                          &full[((y0 + y) * xsize + x0) * kPixelSize],
+                          crop_xsize * kPixelSize))
+          << "row " << y << " of region at " << x0 << ", " << y0;
+    }
+  }
+}
+
+TEST(DecodeTest, DownsamplingTest) {
+  size_t xsize = 600, ysize = 500;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      params);
+  // Float output avoids the fast uint8 path, which is not used with
+  // downsampling.
+  JxlPixelFormat format = {3, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> full = jxl::DecodeWithAPI(
+      jxl::Span<const uint8_t>(compressed.data(), compressed.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false, /*require_boxes=*/false,
+      /*expect_success=*/true);
+  ASSERT_EQ(xsize * ysize * 3 * sizeof(float), full.size());
+  auto full_pixel = [&](size_t x, size_t y, size_t c) {
+    float value;
+    memcpy(&value, &full[((y * xsize + x) * 3 + c) * sizeof(float)],
+           sizeof(value));
+    return value;
+  };
+
+  for (size_t factor : {2, 4, 8}) {
+    JxlDecoder* dec = JxlDecoderCreate(NULL);
+    EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetDownsampling(dec, 3));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetDownsampling(dec, factor));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec, JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+    JxlDecoderCloseInput(dec);
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetDownsampling(dec, 1));
+    size_t out_xsize = jxl::DivCeil(xsize, factor);
+    size_t out_ysize = jxl::DivCeil(ysize, factor);
+    size_t buffer_size;
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderImageOutBufferSize(dec, &format, &buffer_size));
+    EXPECT_EQ(out_xsize * out_ysize * 3 * sizeof(float), buffer_size);
+    std::vector<float> downsampled(out_xsize * out_ysize * 3);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetImageOutBuffer(dec, &format, downsampled.data(),
+                                          buffer_size));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
+    JxlDecoderDestroy(dec);
+
+    double total_error = 0;
+    for (size_t y = 0; y < out_ysize; y++) {
+      size_t full_y = std::min(y * factor + factor / 2, ysize - 1);
+      for (size_t x = 0; x < out_xsize; x++) {
+        size_t full_x = std::min(x * factor + factor / 2, xsize - 1);
+        for (size_t c = 0; c < 3; c++) {
+          float value = downsampled[(y * out_xsize + x) * 3 + c];
+          if (factor < 8) {
+            // The image is decoded fully, and block centers are kept.
+            ASSERT_EQ(full_pixel(full_x, full_y, c), value);
+          } else {
+            total_error += std::abs(full_pixel(full_x, full_y, c) - value);
+          }
+        }
+      }
+    }
+    // Only the DC is decoded, which is close to the full image on average.
+    EXPECT_LT(total_error / (out_xsize * out_ysize * 3), 0.05);
+  }
+}
+
+TEST(DecodeTest, PersistentInputTest) {
+  // Large enough that sections cross the boundaries of partial codestream
+  // boxes.
+  size_t xsize = 600, ysize = 500;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+  for (int i = 0; i < kCSBF_NUM_ENTRIES; ++i) {
+    jxl::TestCodestreamParams params;
+    params.box_format = static_cast<CodeStreamBoxFormat>(i);
+    jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+        jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize,
+        3, params);
+    std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+        jxl::Span<const uint8_t>(compressed.data(), compressed.size()),
+        format, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+
+    JxlDecoder* dec = JxlDecoderCreate(NULL);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec, JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetPersistentInput(dec, compressed.data(),
+                                           compressed.size()));
+    EXPECT_EQ(JXL_DEC_ERROR,
+              JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+    std::vector<uint8_t> decoded(expected.size());
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetImageOutBuffer(dec, &format, decoded.data(),
+                                          decoded.size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
+    JxlDecoderDestroy(dec);
+    EXPECT_EQ(expected, decoded) << "box format " << i;
+  }
+}
+
+namespace {
+
+// Decodes the frames from the current position of dec, which must be
+// subscribed to JXL_DEC_FRAME and JXL_DEC_FULL_IMAGE, and compares them to
+// expected starting at frame first.
+void ExpectFramesFrom(JxlDecoder* dec, size_t first,
+                      const std::vector<std::vector<uint8_t>>& expected,
+                      const std::vector<uint32_t>& durations,
+                      const JxlPixelFormat& format) {
+  for (size_t i = first; i < expected.size(); ++i) {
+    EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec));
+    JxlFrameHeader frame_header;
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetFrameHeader(dec, &frame_header));
+    EXPECT_EQ(durations[i], frame_header.duration);
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+    std::vector<uint8_t> pixels(expected[i].size());
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                   dec, &format, pixels.data(), pixels.size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(expected[i], pixels) << "frame " << i;
+  }
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
+}
+
+}  // namespace
+
+TEST(DecodeTest, SeekFrameTest) {
+  size_t xsize = 90, ysize = 120;
+  constexpr size_t num_frames = 16;
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  std::vector<uint32_t> durations(num_frames);
+
+  // Every fourth frame is a keyframe listed in the frame index box, the
+  // frames in between add to the previous frame.
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  JxlBasicInfo basic_info;
+  JxlEncoderInitBasicInfo(&basic_info);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.bits_per_sample = 16;
+  basic_info.uses_original_profile = JXL_TRUE;
+  basic_info.have_animation = JXL_TRUE;
+  basic_info.animation.tps_numerator = 1000;
+  basic_info.animation.tps_denominator = 1;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  for (size_t i = 0; i < num_frames; ++i) {
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameLossless(frame_settings, JXL_TRUE));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_EFFORT, 1));
+    JxlFrameHeader header;
+    JxlEncoderInitFrameHeader(&header);
+    durations[i] = 10 + i;
+    header.duration = durations[i];
+    header.layer_info.save_as_reference = 1;
+    header.layer_info.blend_info.source = 1;
+    header.layer_info.blend_info.blendmode =
+        (i % 4 == 0) ? JXL_BLEND_REPLACE : JXL_BLEND_ADD;
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameHeader(frame_settings, &header));
+    if (i % 4 == 0) {
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderFrameSettingsSetOption(frame_settings,
+                                                 JXL_ENC_FRAME_INDEX_BOX, 1));
+    }
+    std::vector<uint8_t> frame =
+        jxl::test::GetSomeTestImage(xsize, ysize, 3, i);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &format, frame.data(),
+                                      frame.size()));
+  }
+  JxlEncoderCloseInput(enc.get());
+  std::vector<uint8_t> compressed(64);
+  uint8_t* next_out = compressed.data();
+  size_t avail_out = compressed.size();
+  JxlEncoderStatus process_result = JXL_ENC_NEED_MORE_OUTPUT;
+  while (process_result == JXL_ENC_NEED_MORE_OUTPUT) {
+    process_result = JxlEncoderProcessOutput(enc.get(), &next_out, &avail_out);
+    size_t offset = next_out - compressed.data();
+    compressed.resize(process_result == JXL_ENC_NEED_MORE_OUTPUT
+                          ? compressed.size() * 2
+                          : offset);
+    next_out = compressed.data() + offset;
+    avail_out = compressed.size() - offset;
+  }
+  ASSERT_EQ(JXL_ENC_SUCCESS, process_result);
+
+  // A copy of the file where the codestream of frames 1 to 7 is corrupted,
+  // which the decoder must jump over. Each frame is in its own jxlp box.
+  std::vector<uint8_t> corrupted = compressed;
+  std::vector<std::pair<size_t, size_t>> jxlp_boxes;
+  for (size_t pos = 0; pos + 8 <= compressed.size();) {
+    size_t box_size = LoadBE32(compressed.data() + pos);
+    ASSERT_GE(box_size, 8u);
+    if (!memcmp(compressed.data() + pos + 4, "jxlp", 4)) {
+      jxlp_boxes.emplace_back(pos + 12, pos + box_size);
+    }
+    pos += box_size;
+  }
+  ASSERT_GE(jxlp_boxes.size(), num_frames);
+  size_t first_frame_box = jxlp_boxes.size() - num_frames;
+  for (size_t i = 1; i < 8; ++i) {
+    const auto& box = jxlp_boxes[first_frame_box + i];
+    for (size_t pos = box.first; pos < box.second; ++pos) {
+      corrupted[pos] ^= 0x55;
+    }
+  }
+
+  std::vector<std::vector<uint8_t>> expected(num_frames);
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  JxlDecoderCloseInput(dec.get());
+  for (size_t i = 0; i < num_frames; ++i) {
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+    expected[i].resize(xsize * ysize * 6);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetImageOutBuffer(dec.get(), &format,
+                                          expected[i].data(),
+                                          expected[i].size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+  }
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec.get()));
+
+  // Frame 10 depends on frames 8 and 9, which are known from the first pass.
+  JxlDecoderSeekFrame(dec.get(), 10);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(),
+                                      JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), corrupted.data(),
+                                                corrupted.size()));
+  JxlDecoderCloseInput(dec.get());
+  ExpectFramesFrom(dec.get(), 10, expected, durations, format);
+
+  // Seeking back to an earlier frame.
+  JxlDecoderSeekFrame(dec.get(), 2);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(),
+                                      JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  JxlDecoderCloseInput(dec.get());
+  ExpectFramesFrom(dec.get(), 2, expected, durations, format);
+
+  // A decoder that only read the boxes knows the keyframes from the frame
+  // index box, but none of the frames.
+  dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_BOX));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  JxlDecoderCloseInput(dec.get());
+  JxlDecoderStatus status;
+  while ((status = JxlDecoderProcessInput(dec.get())) == JXL_DEC_BOX) {
+  }
+  EXPECT_EQ(JXL_DEC_SUCCESS, status);
+  JxlDecoderSeekFrame(dec.get(), 11);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(),
+                                      JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), corrupted.data(),
+                                                corrupted.size()));
+  JxlDecoderCloseInput(dec.get());
+  ExpectFramesFrom(dec.get(), 11, expected, durations, format);
+}
+
+TEST(DecodeTest, FrameLookaheadTest) {
+  size_t xsize = 123, ysize = 77;
+  constexpr size_t num_frames = 11;
+  JxlPixelFormat format = {3, JXL_TYPE_FLOAT, JXL_LITTLE_ENDIAN, 0};
+  JxlPixelFormat input_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+
+  jxl::CodecInOut io;
+  io.SetSize(xsize, ysize);
+  io.metadata.m.SetUintSamples(16);
+  io.metadata.m.color_encoding = jxl::ColorEncoding::SRGB(false);
+  io.metadata.m.have_animation = true;
+  io.frames.clear();
+  io.frames.reserve(num_frames);
+
+  // Every third frame is blended onto the frame before it, the other frames
+  // do not depend on any frame and can be decoded ahead. Each frame is saved
+  // for the next one, including those decoded ahead.
+  std::vector<uint32_t> durations(num_frames);
+  for (size_t i = 0; i < num_frames; ++i) {
+    std::vector<uint8_t> frame =
+        jxl::test::GetSomeTestImage(xsize, ysize, 3, i);
+    durations[i] = 5 + i;
+    jxl::ImageBundle bundle(&io.metadata.m);
+    EXPECT_TRUE(ConvertFromExternal(
+        jxl::Span<const uint8_t>(frame.data(), frame.size()), xsize, ysize,
+        jxl::ColorEncoding::SRGB(/*is_gray=*/false),
+        /*alpha_is_premultiplied=*/false, /*bits_per_sample=*/16,
+        input_format, /*pool=*/nullptr, &bundle));
+    bundle.duration = durations[i];
+    bundle.use_for_next_frame = true;
+    if (i % 3 == 2) {
+      bundle.blend = true;
+      bundle.blendmode = jxl::BlendMode::kMul;
+    }
+    io.frames.push_back(std::move(bundle));
+  }
+
+  // Lossy, so that the frames decoded ahead are converted from XYB too.
+  jxl::CompressParams cparams;
+  cparams.speed_tier = jxl::SpeedTier::kFalcon;
+  jxl::AuxOut aux_out;
+  jxl::PaddedBytes compressed;
+  jxl::PassesEncoderState enc_state;
+  EXPECT_TRUE(jxl::EncodeFile(cparams, &io, &enc_state, &compressed,
+                              jxl::GetJxlCms(), &aux_out, nullptr));
+
+  size_t buffer_size = xsize * ysize * 3 * sizeof(float);
+  std::vector<std::vector<uint8_t>> expected(num_frames);
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  JxlDecoderCloseInput(dec.get());
+  for (size_t i = 0; i < num_frames; ++i) {
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+    expected[i].resize(buffer_size);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetImageOutBuffer(dec.get(), &format,
+                                          expected[i].data(),
+                                          expected[i].size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+  }
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec.get()));
+
+  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(
+      nullptr, JxlThreadParallelRunnerDefaultNumWorkerThreads());
+  dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetParallelRunner(dec.get(), JxlThreadParallelRunner,
+                                        runner.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetFrameLookahead(dec.get(), 4));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(),
+                                      JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  JxlDecoderCloseInput(dec.get());
+  ExpectFramesFrom(dec.get(), 0, expected, durations, format);
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetFrameLookahead(dec.get(), 2));
+
+  // Skipping frames drops the frames decoded ahead, frame 1 here, and
+  // decodes the ones that the frame skipped to depends on.
+  JxlDecoderRewind(dec.get());
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(),
+                                      JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  JxlDecoderCloseInput(dec.get());
+  EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  std::vector<uint8_t> pixels(buffer_size);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetImageOutBuffer(dec.get(), &format, pixels.data(),
+                                        pixels.size()));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(expected[0], pixels);
+  JxlDecoderSkipFrames(dec.get(), 3);
+  ExpectFramesFrom(dec.get(), 4, expected, durations, format);
+
+  // 8-bit sRGB output may be converted from XYB with a faster approximation
+  // when decoding in order, which the lookahead gives too.
+  JxlPixelFormat format8 = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<std::vector<uint8_t>> expected8(num_frames);
+  for (size_t lookahead : {0, 4}) {
+    dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetParallelRunner(dec.get(), JxlThreadParallelRunner,
+                                          runner.get()));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetFrameLookahead(dec.get(), lookahead));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(),
+                                        JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                  compressed.size()));
+    JxlDecoderCloseInput(dec.get());
+    if (lookahead == 0) {
+      for (size_t i = 0; i < num_frames; ++i) {
+        EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec.get()));
+        EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER,
+                  JxlDecoderProcessInput(dec.get()));
+        expected8[i].resize(xsize * ysize * 3);
+        EXPECT_EQ(JXL_DEC_SUCCESS,
+                  JxlDecoderSetImageOutBuffer(dec.get(), &format8,
+                                              expected8[i].data(),
+                                              expected8[i].size()));
+        EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+      }
+      EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec.get()));
+    } else {
+      ExpectFramesFrom(dec.get(), 0, expected8, durations, format8);
+    }
+  }
+}
+
+TEST(DecodeTest, WorkBudgetTest) {
+  // 6 AC groups and one DC group, in a VarDCT and in a modular frame.
+  size_t xsize = 600, ysize = 400;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  jxl::TestCodestreamParams lossless_params;
+  lossless_params.cparams.SetLossless();
+  lossless_params.cparams.responsive = 0;
+  lossless_params.cparams.palette_colors = 0;
+  lossless_params.cparams.channel_colors_pre_transform_percent = 0;
+  lossless_params.cparams.channel_colors_percent = 0;
+  for (const auto& params : {jxl::TestCodestreamParams(), lossless_params}) {
+    jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+        jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+        params);
+    std::vector<uint8_t> expected;
+    for (size_t max_groups : {0, 1}) {
+      for (uint64_t max_microseconds : {0, 1}) {
+        JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+        JxlDecoderSetWorkBudget(dec.get(), max_groups, max_microseconds);
+        EXPECT_EQ(JXL_DEC_SUCCESS,
+                  JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+        EXPECT_EQ(JXL_DEC_SUCCESS,
+                  JxlDecoderSetInput(dec.get(), compressed.data(),
+                                     compressed.size()));
+        JxlDecoderCloseInput(dec.get());
+        std::vector<uint8_t> pixels2(xsize * ysize * 6);
+        size_t num_yields = 0;
+        for (;;) {
+          JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+          if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+            EXPECT_EQ(JXL_DEC_SUCCESS,
+                      JxlDecoderSetImageOutBuffer(
+                          dec.get(), &format, pixels2.data(), pixels2.size()));
+          } else if (status == JXL_DEC_YIELD) {
+            num_yields++;
+          } else if (status == JXL_DEC_SUCCESS) {
+            break;
+          } else if (status != JXL_DEC_FULL_IMAGE) {
+            FAIL() << "Unexpected status " << status;
+          }
+        }
+        if (max_groups == 0 && max_microseconds == 0) {
+          EXPECT_EQ(0u, num_yields);
+          expected = pixels2;
+        } else if (max_groups == 1) {
+          // One group per call.
+          EXPECT_EQ(6u, num_yields);
+        } else {
+          EXPECT_LE(1u, num_yields);
+          EXPECT_GE(6u, num_yields);
+        }
+        EXPECT_EQ(0u, jxl::test::ComparePixels(expected.data(), pixels2.data(),
+                                               xsize, ysize, format, format));
+      }
+    }
+  }
+}
+
+TEST(DecodeTest, MemoryLimitTest) {
+  size_t xsize = 300, ysize = 200;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      params);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> out(xsize * ysize * 3);
+
+  // Decodes with the given limit and returns the status of the last step.
+  const auto decode = [&](size_t limit, size_t* peak) -> JxlDecoderStatus {
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetMemoryLimit(dec.get(), limit));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(
+                  dec.get(), JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                  compressed.size()));
+    JxlDecoderCloseInput(dec.get());
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+    if (status != JXL_DEC_BASIC_INFO) return status;
+    status = JxlDecoderProcessInput(dec.get());
+    if (status != JXL_DEC_NEED_IMAGE_OUT_BUFFER) return status;
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetImageOutBuffer(dec.get(), &format, out.data(),
+                                          out.size()));
+    status = JxlDecoderProcessInput(dec.get());
+    if (status != JXL_DEC_FULL_IMAGE) return status;
+    size_t in_use;
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderGetMemoryUsage(dec.get(), &in_use, peak));
+    EXPECT_LE(in_use, *peak);
+    // Usage can no longer be limited once decoding started.
+    EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetMemoryLimit(dec.get(), 0));
+    return JxlDecoderProcessInput(dec.get());
+  };
+
+  size_t peak = 0;
+  EXPECT_EQ(JXL_DEC_SUCCESS, decode(0, &peak));
+  // At least one float image of the full size is held at some point.
+  EXPECT_GE(peak, xsize * ysize * sizeof(float));
+
+  size_t limited_peak = 0;
+  EXPECT_EQ(JXL_DEC_SUCCESS, decode(4 * peak, &limited_peak));
+  EXPECT_LE(limited_peak, 4 * peak);
+  EXPECT_EQ(JXL_DEC_ERROR, decode(xsize * ysize, &limited_peak));
+}
+
+TEST(DecodeTest, MemoryPoolTest) {
+  size_t xsize = 300, ysize = 200;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      params);
+  jxl::Span<const uint8_t> span(compressed.data(), compressed.size());
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+
+  struct CalledCounters {
+    std::atomic<size_t> allocs{0};
+    std::atomic<size_t> frees{0};
+  } counters;
+  JxlMemoryManager mm;
+  mm.opaque = &counters;
+  mm.alloc = [](void* opaque, size_t size) {
+    reinterpret_cast<CalledCounters*>(opaque)->allocs++;
+    return malloc(size);
+  };
+  mm.free = [](void* opaque, void* address) {
+    reinterpret_cast<CalledCounters*>(opaque)->frees++;
+    free(address);
+  };
+
+  JxlDecoder* dec = JxlDecoderCreate(&mm);
+  JxlDecoderSetMemoryPool(dec, size_t{1} << 30);
+  std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+      span, format, /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false, /*require_boxes=*/false,
+      /*expect_success=*/true);
+  size_t allocs_per_image[2];
+  for (size_t i = 0; i < 2; i++) {
+    size_t allocs_before = counters.allocs;
+    std::vector<uint8_t> decoded = jxl::DecodeWithAPI(
+        dec, span, format, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+    JxlDecoderRecycle(dec);
+    EXPECT_EQ(expected, decoded);
+    allocs_per_image[i] = counters.allocs - allocs_before;
+  }
+  // The image buffers of the first image are obtained from the memory manager
+  // and reused for the second one.
+  EXPECT_LT(allocs_per_image[1], allocs_per_image[0]);
+
+  // Lowering the limit returns the cached buffers to the memory manager.
+  size_t frees_before = counters.frees;
+  JxlDecoderSetMemoryPool(dec, 0);
+  EXPECT_LT(frees_before, counters.frees);
+  JxlDecoderDestroy(dec);
+  EXPECT_EQ(counters.allocs, counters.frees);
+}
+
+TEST(DecodeTest, MemoryManagerThreadsTest) {
+  size_t xsize = 600, ysize = 400;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      params);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> out(xsize * ysize * 3);
+
+  // A memory manager that is not thread-safe, and detects concurrent calls.
+  struct Manager {
+    std::atomic<bool> in_call{false};
+    std::atomic<size_t> concurrent_calls{0};
+    size_t allocs = 0;
+    size_t frees = 0;
+    void Enter() {
+      if (in_call.exchange(true)) concurrent_calls++;
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  } manager;
+  JxlMemoryManager mm;
+  mm.opaque = &manager;
+  mm.alloc = [](void* opaque, size_t size) {
+    Manager* manager = reinterpret_cast<Manager*>(opaque);
+    manager->Enter();
+    manager->allocs++;
+    void* result = malloc(size);
+    manager->in_call = false;
+    return result;
+  };
+  mm.free = [](void* opaque, void* address) {
+    Manager* manager = reinterpret_cast<Manager*>(opaque);
+    manager->Enter();
+    manager->frees++;
+    free(address);
+    manager->in_call = false;
+  };
+
+  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(nullptr, 4);
+  JxlDecoder* dec = JxlDecoderCreate(&mm);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetParallelRunner(dec, JxlThreadParallelRunner,
+                                        runner.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec, JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+  JxlDecoderCloseInput(dec);
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetImageOutBuffer(dec, &format, out.data(), out.size()));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+  JxlDecoderDestroy(dec);
+  EXPECT_LT(0u, manager.allocs);
+  EXPECT_EQ(manager.allocs, manager.frees);
+  EXPECT_EQ(0u, manager.concurrent_calls.load());
+}
+
+TEST(DecodeTest, RunnerStatsTest) {
+  size_t xsize = 600, ysize = 400;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      params);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> out(xsize * ysize * 3);
+
+  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(nullptr, 3);
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  size_t size;
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderGetRunnerStatsSize(dec.get(), &size));
+  for (int image = 0; image < 2; ++image) {
+    JxlDecoderRecycle(dec.get());
+    // Enabled before and after the runner is set.
+    if (image == 0) JxlDecoderSetRunnerStats(dec.get(), JXL_TRUE);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetParallelRunner(dec.get(), JxlThreadParallelRunner,
+                                          runner.get()));
+    if (image == 1) JxlDecoderSetRunnerStats(dec.get(), JXL_TRUE);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                  compressed.size()));
+    JxlDecoderCloseInput(dec.get());
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetImageOutBuffer(dec.get(), &format, out.data(),
+                                          out.size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+
+    ASSERT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetRunnerStatsSize(dec.get(), &size));
+    std::vector<char> json(size);
+    EXPECT_EQ(JXL_DEC_ERROR,
+              JxlDecoderGetRunnerStats(dec.get(), json.data(), size - 1));
+    ASSERT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderGetRunnerStats(dec.get(), json.data(), size));
+    const std::string stats(json.data());
+    EXPECT_EQ(size - 1, stats.size());
+    EXPECT_EQ(0u, stats.find("{\"sites\":[{\"caller\":\""));
+    // Each of the 6 groups is decoded by one task of one call.
+    EXPECT_NE(std::string::npos,
+              stats.find("{\"caller\":\"DecodeGroup\",\"calls\":1,"
+                         "\"tasks\":6,\"max_threads\":3,"));
+  }
+}
+
+TEST(DecodeTest, DecodeBatchTest) {
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+  // Single group images that are decoded concurrently and a larger one that
+  // uses the runner by itself.
+  const size_t sizes[][2] = {{64, 48}, {300, 200}, {123, 77}, {256, 256}};
+  const size_t kNumImages = 4;
+  std::vector<jxl::PaddedBytes> compressed(kNumImages);
+  std::vector<std::vector<uint8_t>> expected(kNumImages);
+  std::vector<std::vector<uint8_t>> decoded(kNumImages);
+  std::vector<JxlDecoderBatchItem> items(kNumImages + 2);
+  for (size_t i = 0; i < kNumImages; i++) {
+    size_t xsize = sizes[i][0], ysize = sizes[i][1];
+    std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, 3, i);
+    jxl::TestCodestreamParams params;
+    compressed[i] = jxl::CreateTestJXLCodestream(
+        jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+        params);
+    expected[i] = jxl::DecodeWithAPI(
+        jxl::Span<const uint8_t>(compressed[i].data(), compressed[i].size()),
+        format, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+    decoded[i].resize(xsize * ysize * 3);
+    items[i].data = compressed[i].data();
+    items[i].size = compressed[i].size();
+    items[i].format = format;
+    items[i].buffer = decoded[i].data();
+    items[i].buffer_size = decoded[i].size();
+  }
+  // Failures are reported for each image separately.
+  std::vector<uint8_t> small_buffer(100);
+  items[kNumImages] = items[0];
+  items[kNumImages].buffer = small_buffer.data();
+  items[kNumImages].buffer_size = small_buffer.size();
+  items[kNumImages + 1] = items[1];
+  items[kNumImages + 1].size = items[1].size / 2;
+
+  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(
+      nullptr, JxlThreadParallelRunnerDefaultNumWorkerThreads());
+  EXPECT_EQ(JXL_DEC_ERROR,
+            JxlDecoderDecodeBatch(items.data(), items.size(), nullptr,
+                                  JxlThreadParallelRunner, runner.get()));
+  for (size_t i = 0; i < kNumImages; i++) {
+    EXPECT_EQ(JXL_DEC_SUCCESS, items[i].status);
+    EXPECT_EQ(sizes[i][0], items[i].xsize);
+    EXPECT_EQ(sizes[i][1], items[i].ysize);
+    EXPECT_EQ(expected[i], decoded[i]);
+  }
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, items[kNumImages].status);
+  EXPECT_EQ(JXL_DEC_NEED_MORE_INPUT, items[kNumImages + 1].status);
+  EXPECT_EQ(sizes[1][0], items[kNumImages + 1].xsize);
+
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderDecodeBatch(items.data(), kNumImages, nullptr,
+                                  JxlThreadParallelRunner, runner.get()));
+}
+
 TEST(DecodeTest, PixelTestWithICCProfileLossy) {
   JxlDecoder* dec = JxlDecoderCreate(NULL);
 
@@ -62,6 +62,10 @@ Status InitializePassesEncoder(const Image3F& opsin, const JxlCmsInterface& cms,
   while (enc_state->coeffs.size() > shared.frame_header.passes.num_passes) {
     enc_state->coeffs.pop_back();
   }
+  // Coefficients kept from a previous frame may be too small for this one.
+  for (const auto& coeffs : enc_state->coeffs) {
+    coeffs->ReuseOrAllocate(kGroupDim * kGroupDim, shared.frame_dim.num_groups);
+  }
 
   float scale =
       shared.quantizer.ScaleGlobalScale(enc_state->cparams.quant_ac_rescale);
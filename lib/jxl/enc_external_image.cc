@@ -118,7 +118,6 @@ Status ConvertFromExternal(Span<const uint8_t> bytes, size_t xsize,
   }
   size_t bytes_per_channel = JxlDataTypeBytes(format.data_type);
   size_t bytes_per_pixel = format.num_channels * bytes_per_channel;
-  size_t pixel_offset = c * bytes_per_channel;
 
   const size_t last_row_size = xsize * bytes_per_pixel;
   const size_t align = format.align;
@@ -141,19 +140,48 @@ Status ConvertFromExternal(Span<const uint8_t> bytes, size_t xsize,
     return JXL_FAILURE("Buffer size is too large");
   }
 
+  return ConvertFromExternalNoSizeCheck(bytes.data(), row_size,
+                                        bits_per_sample, format, c, pool,
+                                        Rect(*channel), channel);
+}
+
+Status ConvertFromExternalNoSizeCheck(const uint8_t* data, size_t stride,
+                                      size_t bits_per_sample,
+                                      JxlPixelFormat format, size_t c,
+                                      ThreadPool* pool, const Rect& rect,
+                                      ImageF* channel) {
+  if (format.data_type == JXL_TYPE_UINT8) {
+    JXL_RETURN_IF_ERROR(bits_per_sample > 0 && bits_per_sample <= 8);
+  } else if (format.data_type == JXL_TYPE_UINT16) {
+    JXL_RETURN_IF_ERROR(bits_per_sample > 8 && bits_per_sample <= 16);
+  } else if (format.data_type == JXL_TYPE_FLOAT16) {
+    JXL_RETURN_IF_ERROR(bits_per_sample == 16);
+  } else if (format.data_type == JXL_TYPE_FLOAT) {
+    JXL_RETURN_IF_ERROR(bits_per_sample == 32);
+  } else {
+    return JXL_FAILURE("unsupported pixel format data type %d",
+                       format.data_type);
+  }
+  JXL_ASSERT(rect.IsInside(*channel));
+  const size_t xsize = rect.xsize();
+  const size_t ysize = rect.ysize();
+  size_t bytes_per_channel = JxlDataTypeBytes(format.data_type);
+  size_t bytes_per_pixel = format.num_channels * bytes_per_channel;
+  size_t pixel_offset = c * bytes_per_channel;
+
   const bool little_endian =
       format.endianness == JXL_LITTLE_ENDIAN ||
       (format.endianness == JXL_NATIVE_ENDIAN && IsLittleEndian());
 
-  const uint8_t* const in = bytes.data();
+  const uint8_t* const in = data;
   if (format.data_type == JXL_TYPE_FLOAT ||
       format.data_type == JXL_TYPE_FLOAT16) {
     JXL_RETURN_IF_ERROR(RunOnPool(
         pool, 0, static_cast<uint32_t>(ysize), ThreadPool::NoInit,
         [&](const uint32_t task, size_t /*thread*/) {
           const size_t y = task;
-          size_t i = row_size * task + pixel_offset;
-          float* JXL_RESTRICT row_out = channel->Row(y);
+          size_t i = stride * task + pixel_offset;
+          float* JXL_RESTRICT row_out = rect.Row(channel, y);
           if (format.data_type == JXL_TYPE_FLOAT16) {
             if (little_endian) {
               for (size_t x = 0; x < xsize; ++x) {
@@ -187,8 +215,8 @@ Status ConvertFromExternal(Span<const uint8_t> bytes, size_t xsize,
         pool, 0, static_cast<uint32_t>(ysize), ThreadPool::NoInit,
         [&](const uint32_t task, size_t /*thread*/) {
           const size_t y = task;
-          size_t i = row_size * task + pixel_offset;
-          float* JXL_RESTRICT row_out = channel->Row(y);
+          size_t i = stride * task + pixel_offset;
+          float* JXL_RESTRICT row_out = rect.Row(channel, y);
           if (format.data_type == JXL_TYPE_UINT8) {
             LoadFloatRow<Load8>(row_out, in + i, mul, xsize, bytes_per_pixel);
           } else {
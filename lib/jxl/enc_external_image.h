@@ -26,6 +26,15 @@ Status ConvertFromExternal(Span<const uint8_t> bytes, size_t xsize,
                            JxlPixelFormat format, size_t c, ThreadPool* pool,
                            ImageF* channel);
 
+// Same as above, but reads rows that are `stride` bytes apart into the given
+// rect of `channel`, without validating a total buffer size. Used to fill an
+// image piece by piece from chunked input.
+Status ConvertFromExternalNoSizeCheck(const uint8_t* data, size_t stride,
+                                      size_t bits_per_sample,
+                                      JxlPixelFormat format, size_t c,
+                                      ThreadPool* pool, const Rect& rect,
+                                      ImageF* channel);
+
 // Convert an interleaved pixel buffer to the internal ImageBundle
 // representation. This is the opposite of ConvertToExternal().
 Status ConvertFromExternal(Span<const uint8_t> bytes, size_t xsize,
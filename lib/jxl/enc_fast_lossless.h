@@ -0,0 +1,95 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_ENC_FAST_LOSSLESS_H_
+#define LIB_JXL_ENC_FAST_LOSSLESS_H_
+
+// Very fast lossless encoder for images of up to 16 bits per sample, used for
+// effort 1 lossless encoding. Produces a single modular frame using a fixed
+// predictor and prefix codes. This file only depends on the C standard library
+// so that it can also be built standalone (see experimental/fast_lossless).
+
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A FJxlParallelRunner must call fun(opaque, i) for all i from 0 to count. It
+// may do so in parallel.
+typedef void(FJxlParallelRunner)(void* runner_opaque, void* opaque,
+                                 void fun(void*, size_t), size_t count);
+
+// Encodes the given image into a complete codestream. Samples of up to 8 bits
+// are stored in one byte, larger ones in two bytes with the given endianness.
+// The output buffer is allocated with malloc() and must be freed by the caller.
+// Returns the size of the output, or 0 on failure. `runner` may be NULL, in
+// which case encoding is sequential.
+size_t JxlFastLosslessEncode(const unsigned char* rgba, size_t width,
+                             size_t row_stride, size_t height, size_t nb_chans,
+                             size_t bitdepth, int big_endian, int effort,
+                             unsigned char** output, void* runner_opaque,
+                             FJxlParallelRunner runner);
+
+// Lower level API, that allows encoding a frame that is part of a larger
+// codestream.
+
+// Intermediate state of an encoded frame.
+typedef struct JxlFastLosslessFrameState JxlFastLosslessFrameState;
+
+// Encodes the pixel data of a frame. The input buffer is no longer needed
+// after this returns. Returns NULL if the fast encoder is not available on
+// this platform.
+JxlFastLosslessFrameState* JxlFastLosslessPrepareFrame(
+    const unsigned char* rgba, size_t width, size_t row_stride, size_t height,
+    size_t nb_chans, size_t bitdepth, int big_endian, int effort,
+    void* runner_opaque, FJxlParallelRunner runner);
+
+// Same as JxlFastLosslessPrepareFrame, but with one buffer per channel.
+// `row_stride` is the same for all the planes.
+JxlFastLosslessFrameState* JxlFastLosslessPrepareFramePlanar(
+    const unsigned char* const* planes, size_t width, size_t row_stride,
+    size_t height, size_t nb_chans, size_t bitdepth, int big_endian, int effort,
+    void* runner_opaque, FJxlParallelRunner runner);
+
+// Copies the samples of columns [x0, x0 + xsize) of row `y` to `output`. For
+// interleaved input, `channel` is always 0 and all the channels of a pixel are
+// written; for planar input, only the samples of `channel` are. Samples are
+// stored as for JxlFastLosslessPrepareFrame. The function may be called
+// concurrently from the threads of the runner, and more than once for the same
+// row.
+typedef void(JxlFastLosslessReadRow)(void* opaque, size_t channel, size_t x0,
+                                     size_t y, size_t xsize,
+                                     unsigned char* output);
+
+// Same as JxlFastLosslessPrepareFrame, but reads the input one row segment at
+// a time, so that the frame never needs to be in memory as a whole.
+JxlFastLosslessFrameState* JxlFastLosslessPrepareFrameFromRows(
+    void* row_opaque, JxlFastLosslessReadRow read_row, int planar, size_t width,
+    size_t height, size_t nb_chans, size_t bitdepth, int big_endian, int effort,
+    void* runner_opaque, FJxlParallelRunner runner);
+
+// Prepares the headers that precede the frame data. If `add_image_header` is
+// set, the signature and image metadata are included too, otherwise the output
+// is a frame to be appended to a codestream whose headers are written by the
+// caller. `is_last` marks the last frame of the codestream.
+void JxlFastLosslessPrepareHeader(JxlFastLosslessFrameState* frame,
+                                  int add_image_header, int is_last);
+
+// Returns the size of the output of JxlFastLosslessWriteOutput.
+size_t JxlFastLosslessOutputSize(const JxlFastLosslessFrameState* frame);
+
+// Writes the prepared headers and the frame data to `output`. Returns the
+// number of bytes written, or 0 if `output_size` is too small.
+size_t JxlFastLosslessWriteOutput(const JxlFastLosslessFrameState* frame,
+                                  unsigned char* output, size_t output_size);
+
+void JxlFastLosslessFreeFrameState(JxlFastLosslessFrameState* frame);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // LIB_JXL_ENC_FAST_LOSSLESS_H_
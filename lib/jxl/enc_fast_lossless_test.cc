@@ -0,0 +1,158 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/enc_fast_lossless.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace jxl {
+namespace {
+
+// Interleaved samples, stored as expected by JxlFastLosslessPrepareFrame.
+struct TestImage {
+  size_t xsize;
+  size_t ysize;
+  size_t nb_chans;
+  size_t bitdepth;
+  size_t bytedepth;
+  std::vector<unsigned char> pixels;
+
+  size_t row_stride() const { return xsize * nb_chans * bytedepth; }
+
+  // Returns the samples of channel c, with the same row stride as the
+  // interleaved image.
+  std::vector<unsigned char> Plane(size_t c) const {
+    std::vector<unsigned char> plane(row_stride() * ysize);
+    for (size_t y = 0; y < ysize; y++) {
+      for (size_t x = 0; x < xsize; x++) {
+        memcpy(&plane[y * row_stride() + x * bytedepth],
+               &pixels[y * row_stride() + (x * nb_chans + c) * bytedepth],
+               bytedepth);
+      }
+    }
+    return plane;
+  }
+};
+
+// Big endian, smooth enough for the predictor to matter, with some noise.
+TestImage MakeTestImage(size_t xsize, size_t ysize, size_t nb_chans,
+                        size_t bitdepth) {
+  TestImage image;
+  image.xsize = xsize;
+  image.ysize = ysize;
+  image.nb_chans = nb_chans;
+  image.bitdepth = bitdepth;
+  image.bytedepth = bitdepth > 8 ? 2 : 1;
+  image.pixels.resize(image.row_stride() * ysize);
+  const uint32_t mask = (1u << bitdepth) - 1;
+  uint32_t state = 12345;
+  unsigned char* p = image.pixels.data();
+  for (size_t y = 0; y < ysize; y++) {
+    for (size_t x = 0; x < xsize; x++) {
+      for (size_t c = 0; c < nb_chans; c++) {
+        state = state * 1103515245u + 12345u;
+        uint32_t v = ((x * (c + 1) + y * 3) << (bitdepth > 8 ? 6 : 0)) +
+                     ((state >> 16) & 7);
+        v &= mask;
+        if (image.bytedepth == 2) *p++ = v >> 8;
+        *p++ = v & 0xFF;
+      }
+    }
+  }
+  return image;
+}
+
+std::vector<unsigned char> WriteCodestream(JxlFastLosslessFrameState* frame) {
+  std::vector<unsigned char> output;
+  if (frame == nullptr) return output;
+  JxlFastLosslessPrepareHeader(frame, /*add_image_header=*/1, /*is_last=*/1);
+  output.resize(JxlFastLosslessOutputSize(frame));
+  output.resize(
+      JxlFastLosslessWriteOutput(frame, output.data(), output.size()));
+  JxlFastLosslessFreeFrameState(frame);
+  return output;
+}
+
+// Runs the tasks sequentially in reverse order, to check that they do not
+// depend on each other.
+void ReverseRunner(void* /*runner_opaque*/, void* opaque,
+                   void fun(void*, size_t), size_t count) {
+  for (size_t i = count; i > 0; i--) fun(opaque, i - 1);
+}
+
+struct RowSource {
+  const TestImage* image;
+  std::vector<std::vector<unsigned char>> planes;
+  bool planar;
+};
+
+void ReadRow(void* opaque, size_t channel, size_t x0, size_t y, size_t xsize,
+             unsigned char* output) {
+  const RowSource* source = static_cast<const RowSource*>(opaque);
+  const TestImage& image = *source->image;
+  const size_t pixel_bytes =
+      (source->planar ? 1 : image.nb_chans) * image.bytedepth;
+  const unsigned char* row =
+      source->planar ? source->planes[channel].data() : image.pixels.data();
+  memcpy(output, row + y * image.row_stride() + x0 * pixel_bytes,
+         xsize * pixel_bytes);
+}
+
+// All the ways to pass the samples to the encoder produce the same codestream.
+void TestInputsMatch(size_t nb_chans, size_t bitdepth) {
+  const TestImage image = MakeTestImage(300, 280, nb_chans, bitdepth);
+  const int effort = 2;
+  const std::vector<unsigned char> expected = WriteCodestream(
+      JxlFastLosslessPrepareFrame(image.pixels.data(), image.xsize,
+                                  image.row_stride(), image.ysize, nb_chans,
+                                  bitdepth, /*big_endian=*/1, effort,
+                                  /*runner_opaque=*/nullptr, ReverseRunner));
+  if (expected.empty()) {
+    // The fast encoder is not available on this platform.
+    GTEST_SKIP();
+  }
+
+  RowSource source = {&image, {}, /*planar=*/true};
+  std::vector<const unsigned char*> planes;
+  for (size_t c = 0; c < nb_chans; c++) {
+    source.planes.push_back(image.Plane(c));
+    planes.push_back(source.planes[c].data());
+  }
+  EXPECT_EQ(expected, WriteCodestream(JxlFastLosslessPrepareFramePlanar(
+                          planes.data(), image.xsize, image.row_stride(),
+                          image.ysize, nb_chans, bitdepth, /*big_endian=*/1,
+                          effort, /*runner_opaque=*/nullptr, nullptr)));
+
+  for (int planar = 0; planar <= 1; planar++) {
+    source.planar = planar;
+    EXPECT_EQ(expected,
+              WriteCodestream(JxlFastLosslessPrepareFrameFromRows(
+                  &source, ReadRow, planar, image.xsize, image.ysize, nb_chans,
+                  bitdepth, /*big_endian=*/1, effort,
+                  /*runner_opaque=*/nullptr, ReverseRunner)));
+  }
+}
+
+TEST(FastLosslessTest, InputsMatch8Bit) {
+  for (size_t nb_chans = 1; nb_chans <= 4; nb_chans++) {
+    TestInputsMatch(nb_chans, 8);
+  }
+}
+
+TEST(FastLosslessTest, InputsMatch12Bit) { TestInputsMatch(3, 12); }
+
+TEST(FastLosslessTest, InputsMatch16Bit) {
+  for (size_t nb_chans = 1; nb_chans <= 4; nb_chans++) {
+    TestInputsMatch(nb_chans, 16);
+  }
+}
+
+}  // namespace
+}  // namespace jxl
@@ -493,18 +493,66 @@ void SimplifyInvisible(Image3F* image, const ImageF& alpha, bool lossless) {
   }
 }
 
+// Output of LossyFrameHeuristics, which does not depend on
+// CompressParams::quant_ac_rescale. The target bitrate search only changes the
+// rescale between iterations, so it runs the heuristics once and restores
+// their results before quantizing the frame again.
+struct LossyHeuristicsCache {
+  void Save(const PassesEncoderState& enc_state, const Image3F& opsin_in) {
+    const PassesSharedState& shared = enc_state.shared;
+    opsin = CopyImage(opsin_in);
+    quantizer = make_unique<Quantizer>(shared.quantizer);
+    for (size_t c = 0; c < 3; c++) {
+      inv_dc_quant[c] = shared.matrices.InvDCQuant(c);
+    }
+    // ComputeCoefficients adjusts the quant field in place.
+    raw_quant_field = CopyImage(shared.raw_quant_field);
+    num_special_frames = enc_state.special_frames.size();
+    valid = true;
+  }
+
+  void Restore(PassesEncoderState* enc_state, Image3F* opsin_out) const {
+    JXL_ASSERT(valid);
+    PassesSharedState& shared = enc_state->shared;
+    *opsin_out = CopyImage(opsin);
+    shared.quantizer = *quantizer;
+    // The saved values went through an encode/decode roundtrip already, so
+    // this gives back exactly the same DC quantization.
+    DequantMatricesSetCustomDC(&shared.matrices, inv_dc_quant);
+    CopyImageTo(raw_quant_field, &shared.raw_quant_field);
+    // Drops the DC frames of the previous iteration but keeps the patch
+    // frame written by the heuristics.
+    enc_state->special_frames.resize(num_special_frames);
+  }
+
+  bool valid = false;
+  Image3F opsin;
+  std::unique_ptr<Quantizer> quantizer;
+  float inv_dc_quant[3];
+  ImageI raw_quant_field;
+  size_t num_special_frames = 0;
+};
+
 }  // namespace
 
 class LossyFrameEncoder {
  public:
+  // If `cache` holds valid heuristics results, the shared state is left as the
+  // previous encoding of the same frame produced it.
   LossyFrameEncoder(const CompressParams& cparams,
                     const FrameHeader& frame_header,
                     PassesEncoderState* JXL_RESTRICT enc_state,
                     const JxlCmsInterface& cms, ThreadPool* pool,
-                    AuxOut* aux_out)
-      : enc_state_(enc_state), cms_(cms), pool_(pool), aux_out_(aux_out) {
-    JXL_CHECK(InitializePassesSharedState(frame_header, &enc_state_->shared,
-                                          /*encoder=*/true));
+                    AuxOut* aux_out, LossyHeuristicsCache* cache = nullptr)
+      : enc_state_(enc_state),
+        cms_(cms),
+        pool_(pool),
+        aux_out_(aux_out),
+        cache_(cache) {
+    if (cache_ == nullptr || !cache_->valid) {
+      JXL_CHECK(InitializePassesSharedState(frame_header, &enc_state_->shared,
+                                            /*encoder=*/true));
+    }
     enc_state_->cparams = cparams;
     enc_state_->passes.clear();
   }
@@ -519,25 +567,13 @@ class LossyFrameEncoder {
                (opsin->ysize() % kBlockDim) == 0);
     PassesSharedState& shared = enc_state_->shared;
 
-    if (!enc_state_->cparams.max_error_mode) {
-      float x_qm_scale_steps[2] = {1.25f, 9.0f};
-      shared.frame_header.x_qm_scale = 2;
-      for (float x_qm_scale_step : x_qm_scale_steps) {
-        if (enc_state_->cparams.butteraugli_distance > x_qm_scale_step) {
-          shared.frame_header.x_qm_scale++;
-        }
-      }
-      if (enc_state_->cparams.butteraugli_distance < 0.299f) {
-        // Favor chromacity preservation for making images appear more
-        // faithful to original even with extreme (5-10x) zooming.
-        shared.frame_header.x_qm_scale++;
-      }
+    if (cache_ != nullptr && cache_->valid) {
+      cache_->Restore(enc_state_, opsin);
+    } else {
+      JXL_RETURN_IF_ERROR(RunHeuristics(linear, opsin, modular_frame_encoder));
+      if (cache_ != nullptr) cache_->Save(*enc_state_, *opsin);
     }
 
-    JXL_RETURN_IF_ERROR(enc_state_->heuristics->LossyFrameHeuristics(
-        enc_state_, modular_frame_encoder, linear, opsin, cms_, pool_,
-        aux_out_));
-
     JXL_RETURN_IF_ERROR(InitializePassesEncoder(
         *opsin, cms, pool_, enc_state_, modular_frame_encoder, aux_out_));
 
@@ -1010,6 +1046,28 @@ class LossyFrameEncoder {
   PassesEncoderState* State() { return enc_state_; }
 
  private:
+  Status RunHeuristics(const ImageBundle* linear, Image3F* JXL_RESTRICT opsin,
+                       ModularFrameEncoder* modular_frame_encoder) {
+    PassesSharedState& shared = enc_state_->shared;
+    if (!enc_state_->cparams.max_error_mode) {
+      float x_qm_scale_steps[2] = {1.25f, 9.0f};
+      shared.frame_header.x_qm_scale = 2;
+      for (float x_qm_scale_step : x_qm_scale_steps) {
+        if (enc_state_->cparams.butteraugli_distance > x_qm_scale_step) {
+          shared.frame_header.x_qm_scale++;
+        }
+      }
+      if (enc_state_->cparams.butteraugli_distance < 0.299f) {
+        // Favor chromacity preservation for making images appear more
+        // faithful to original even with extreme (5-10x) zooming.
+        shared.frame_header.x_qm_scale++;
+      }
+    }
+    return enc_state_->heuristics->LossyFrameHeuristics(
+        enc_state_, modular_frame_encoder, linear, opsin, cms_, pool_,
+        aux_out_);
+  }
+
   void ComputeAllCoeffOrders(const FrameDimensions& frame_dim) {
     PROFILER_FUNC;
     // No coefficient reordering in Falcon or faster.
@@ -1053,6 +1111,7 @@ class LossyFrameEncoder {
   JxlCmsInterface cms_;
   ThreadPool* pool_;
   AuxOut* aux_out_;
+  LossyHeuristicsCache* cache_;
   std::vector<EncCache> group_caches_;
   bool doing_jpeg_recompression = false;
 };
@@ -1087,61 +1146,27 @@ Status ParamsPostInit(CompressParams* p) {
   return true;
 }
 
-Status EncodeFrame(const CompressParams& cparams_orig,
-                   const FrameInfo& frame_info, const CodecMetadata* metadata,
-                   const ImageBundle& ib, PassesEncoderState* passes_enc_state,
-                   const JxlCmsInterface& cms, ThreadPool* pool,
-                   BitWriter* writer, AuxOut* aux_out) {
+namespace {
+
+// Encodes the frame once with the given quant_ac_rescale. If `cache` is not
+// null, the lossy heuristics are skipped when it is valid and stored into it
+// otherwise; `passes_enc_state` must then be the same for all calls.
+Status EncodeFrameWithCache(const CompressParams& cparams_orig,
+                            const FrameInfo& frame_info,
+                            const CodecMetadata* metadata,
+                            const ImageBundle& ib,
+                            PassesEncoderState* passes_enc_state,
+                            const JxlCmsInterface& cms, ThreadPool* pool,
+                            BitWriter* writer, AuxOut* aux_out,
+                            std::vector<BitWriter>* sections,
+                            LossyHeuristicsCache* cache) {
   CompressParams cparams = cparams_orig;
-  if (cparams_orig.target_bitrate > 0.0f &&
-      frame_info.frame_type == FrameType::kRegularFrame) {
-    cparams.target_bitrate = 0.0f;
-    const float target_bitrate = cparams_orig.target_bitrate;
-    float bitrate = 0.0f;
-    float prev_bitrate = 0.0f;
-    float rescale = 1.0f;
-    size_t prev_bits = 0;
-    float error = 0.0f;
-    float best_error = 100.0f;
-    float best_rescale = 1.0f;
-    for (size_t i = 0; i < 10; ++i) {
-      std::unique_ptr<PassesEncoderState> state =
-          jxl::make_unique<PassesEncoderState>();
-      BitWriter bw;
-      JXL_CHECK(EncodeFrame(cparams, frame_info, metadata, ib, state.get(), cms,
-                            pool, &bw, nullptr));
-      bitrate = bw.BitsWritten() * 1.0 / (ib.xsize() * ib.ysize());
-      error = target_bitrate / bitrate - 1.0f;
-      if (std::abs(error) < std::abs(best_error)) {
-        best_error = error;
-        best_rescale = cparams.quant_ac_rescale;
-      }
-      if (bw.BitsWritten() == prev_bits || std::abs(error) < 0.0005f) {
-        break;
-      }
-      float lambda = 1.0f;
-      if (i > 0) {
-        lambda = (((bitrate / prev_bitrate) - 1.0f) / (rescale - 1.0f));
-      }
-      rescale = (1.0f + ((target_bitrate / bitrate) - 1.0f) / lambda);
-      if (rescale < 0.0f) {
-        break;
-      }
-      cparams.quant_ac_rescale *= rescale;
-      prev_bitrate = bitrate;
-      prev_bits = bw.BitsWritten();
-    }
-    if (aux_out) {
-      aux_out->max_quant_rescale = best_rescale;
-      aux_out->min_quant_rescale = best_rescale;
-      aux_out->min_bitrate_error = best_error;
-      aux_out->max_bitrate_error = best_error;
-    }
-    cparams.quant_ac_rescale = best_rescale;
-  }
   ib.VerifyMetadata();
 
-  passes_enc_state->special_frames.clear();
+  const bool reuse_heuristics = cache != nullptr && cache->valid;
+  if (!reuse_heuristics) {
+    passes_enc_state->special_frames.clear();
+  }
 
   if (cparams.qprogressive_mode) {
     passes_enc_state->progressive_splitter.SetProgressiveMode(
@@ -1253,20 +1278,28 @@ Status EncodeFrame(const CompressParams& cparams_orig,
   };
 
   LossyFrameEncoder lossy_frame_encoder(cparams, *frame_header,
-                                        passes_enc_state, cms, pool, aux_out);
+                                        passes_enc_state, cms, pool, aux_out,
+                                        cache);
   std::unique_ptr<ModularFrameEncoder> modular_frame_encoder =
       jxl::make_unique<ModularFrameEncoder>(*frame_header, cparams);
 
   const std::vector<ImageF>* extra_channels = &ib.extra_channels();
   std::vector<ImageF> extra_channels_storage;
-  // Clear patches
-  passes_enc_state->shared.image_features.patches = PatchDictionary();
-  passes_enc_state->shared.image_features.patches.SetPassesSharedState(
-      &passes_enc_state->shared);
+  if (!reuse_heuristics) {
+    // Clear patches
+    passes_enc_state->shared.image_features.patches = PatchDictionary();
+    passes_enc_state->shared.image_features.patches.SetPassesSharedState(
+        &passes_enc_state->shared);
+  }
 
   if (ib.IsJPEG()) {
     JXL_RETURN_IF_ERROR(lossy_frame_encoder.ComputeJPEGTranscodingData(
         *ib.jpeg_data, modular_frame_encoder.get(), frame_header.get()));
+  } else if (reuse_heuristics) {
+    // The opsin image is restored from the cache.
+    JXL_RETURN_IF_ERROR(lossy_frame_encoder.ComputeEncodingData(
+        &ib, &opsin, cms, pool, modular_frame_encoder.get(),
+        frame_header.get()));
   } else if (!lossy_frame_encoder.State()->heuristics->HandlesColorConversion(
                  cparams, ib) ||
              frame_header->encoding != FrameEncoding::kVarDCT) {
@@ -1336,6 +1369,11 @@ Status EncodeFrame(const CompressParams& cparams_orig,
       *frame_header, *ib.metadata(), &opsin, *extra_channels,
       lossy_frame_encoder.State(), cms, pool, aux_out,
       /* do_color=*/frame_header->encoding == FrameEncoding::kModular));
+  // Everything that follows works on the coefficients and tokens, so the
+  // images they were computed from are freed before the groups are written.
+  opsin = Image3F();
+  linear_storage = ImageBundle(metadata_linear.get());
+  extra_channels_storage.clear();
 
   writer->AppendByteAligned(lossy_frame_encoder.State()->special_frames);
   frame_header->UpdateFlag(
@@ -1556,9 +1594,154 @@ Status EncodeFrame(const CompressParams& cparams_orig,
 
   JXL_RETURN_IF_ERROR(
       WriteGroupOffsets(group_codes, permutation_ptr, writer, aux_out));
-  writer->AppendByteAligned(group_codes);
+  if (sections) {
+    *sections = std::move(group_codes);
+  } else {
+    writer->AppendByteAligned(group_codes);
+  }
 
   return true;
 }
 
+}  // namespace
+
+Status EncodeFrame(const CompressParams& cparams_orig,
+                   const FrameInfo& frame_info, const CodecMetadata* metadata,
+                   const ImageBundle& ib, PassesEncoderState* passes_enc_state,
+                   const JxlCmsInterface& cms, ThreadPool* pool,
+                   BitWriter* writer, AuxOut* aux_out,
+                   std::vector<BitWriter>* sections) {
+  CompressParams cparams = cparams_orig;
+  if ((cparams_orig.target_size > 0 || cparams_orig.target_bitrate > 0.0f) &&
+      frame_info.frame_type == FrameType::kRegularFrame) {
+    cparams.target_size = 0;
+    cparams.target_bitrate = 0.0f;
+    // A target size is a limit that the frame should stay within, while a
+    // target bitrate is approached from either side.
+    const bool target_is_limit = cparams_orig.target_size > 0;
+    const float target_bitrate =
+        target_is_limit ? cparams_orig.target_size * kBitsPerByte * 1.0f /
+                              (ib.xsize() * ib.ysize())
+                        : cparams_orig.target_bitrate;
+    float bitrate = 0.0f;
+    float prev_bitrate = 0.0f;
+    float rescale = 1.0f;
+    size_t prev_bits = 0;
+    float error = 0.0f;
+    float best_error = 100.0f;
+    float best_rescale = 1.0f;
+    // Only the quantization depends on the rescale factor, so all iterations
+    // and the final encoding share the results of the heuristics.
+    LossyHeuristicsCache cache;
+    for (size_t i = 0; i < 10; ++i) {
+      BitWriter bw;
+      JXL_CHECK(EncodeFrameWithCache(cparams, frame_info, metadata, ib,
+                                     passes_enc_state, cms, pool, &bw, nullptr,
+                                     nullptr, &cache));
+      bitrate = bw.BitsWritten() * 1.0 / (ib.xsize() * ib.ysize());
+      error = target_bitrate / bitrate - 1.0f;
+      bool is_best = std::abs(error) < std::abs(best_error);
+      if (target_is_limit && i > 0 && (error >= 0.0f) != (best_error >= 0.0f)) {
+        // Prefer any frame that fits over the closest one.
+        is_best = error >= 0.0f;
+      }
+      if (is_best) {
+        best_error = error;
+        best_rescale = cparams.quant_ac_rescale;
+      }
+      if (bw.BitsWritten() == prev_bits || std::abs(error) < 0.0005f) {
+        break;
+      }
+      float lambda = 1.0f;
+      if (i > 0) {
+        lambda = (((bitrate / prev_bitrate) - 1.0f) / (rescale - 1.0f));
+      }
+      rescale = (1.0f + ((target_bitrate / bitrate) - 1.0f) / lambda);
+      if (rescale < 0.0f) {
+        break;
+      }
+      cparams.quant_ac_rescale *= rescale;
+      prev_bitrate = bitrate;
+      prev_bits = bw.BitsWritten();
+    }
+    if (aux_out) {
+      aux_out->max_quant_rescale = best_rescale;
+      aux_out->min_quant_rescale = best_rescale;
+      aux_out->min_bitrate_error = best_error;
+      aux_out->max_bitrate_error = best_error;
+    }
+    cparams.quant_ac_rescale = best_rescale;
+    return EncodeFrameWithCache(cparams, frame_info, metadata, ib,
+                                passes_enc_state, cms, pool, writer, aux_out,
+                                sections, &cache);
+  }
+  return EncodeFrameWithCache(cparams, frame_info, metadata, ib,
+                              passes_enc_state, cms, pool, writer, aux_out,
+                              sections, /*cache=*/nullptr);
+}
+
+size_t EstimateEncodeFrameMemory(const CompressParams& cparams, size_t xsize,
+                                 size_t ysize, size_t num_extra_channels) {
+  const size_t num_pixels =
+      RoundUpToBlockDim(xsize) * RoundUpToBlockDim(ysize);
+  // Bytes per pixel of the images that exist at the same time. Tokens take 8
+  // bytes each, and there are at most as many as there are samples.
+  size_t bytes_per_pixel = 3 * sizeof(float);  // opsin
+  if (cparams.modular_mode) {
+    // Modular image and its tokens, and the samples for learning the tree.
+    const size_t bytes_per_sample = sizeof(int32_t) + sizeof(Token) +
+                                    (cparams.speed_tier < SpeedTier::kFalcon
+                                         ? sizeof(int32_t)
+                                         : 0);
+    bytes_per_pixel += (3 + num_extra_channels) * bytes_per_sample;
+  } else {
+    const size_t num_passes =
+        cparams.progressive_mode ? 3 : (cparams.qprogressive_mode ? 2 : 1);
+    // Coefficients of each pass, their tokens and the gaborish copy of the
+    // opsin image.
+    bytes_per_pixel += 3 * sizeof(int32_t) * num_passes +
+                       3 * sizeof(Token) / 2 + 3 * sizeof(float);
+    bytes_per_pixel +=
+        num_extra_channels * (sizeof(int32_t) + sizeof(Token));
+    if (cparams.speed_tier <= SpeedTier::kKitten) {
+      // Linear copy of the input and the Butteraugli comparator.
+      bytes_per_pixel += 3 * sizeof(float) + 24 * sizeof(float);
+    }
+    if (cparams.target_size > 0 || cparams.target_bitrate > 0.0f) {
+      // Cached opsin image and the output of the previous iteration.
+      bytes_per_pixel += 3 * sizeof(float) + 3;
+    }
+  }
+  if (cparams.patches != Override::kOff &&
+      cparams.speed_tier <= SpeedTier::kSquirrel) {
+    // Screenshot area detection and the patch reference frame.
+    bytes_per_pixel += 4 * sizeof(float);
+  }
+  // The encoded sections.
+  bytes_per_pixel += 3 + num_extra_channels;
+  return num_pixels * bytes_per_pixel;
+}
+
+bool FitEncodeFrameMemory(size_t max_memory, size_t xsize, size_t ysize,
+                          size_t num_extra_channels, CompressParams* cparams) {
+  const auto fits = [&]() {
+    return EstimateEncodeFrameMemory(*cparams, xsize, ysize,
+                                     num_extra_channels) <= max_memory;
+  };
+  if (fits()) return true;
+  if (cparams->speed_tier < SpeedTier::kSquirrel) {
+    cparams->speed_tier = SpeedTier::kSquirrel;
+    if (fits()) return true;
+  }
+  if (cparams->patches != Override::kOff) {
+    cparams->patches = Override::kOff;
+    if (fits()) return true;
+  }
+  if (cparams->modular_mode && cparams->speed_tier < SpeedTier::kFalcon) {
+    cparams->speed_tier = SpeedTier::kFalcon;
+    if (fits()) return true;
+  }
+  return false;
+}
+
 }  // namespace jxl
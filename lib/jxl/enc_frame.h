@@ -66,12 +66,29 @@ Status ParamsPostInit(CompressParams* p);
 // Encodes a single frame (including its header) into a byte stream.  Groups may
 // be processed in parallel by `pool`. metadata is the ImageMetadata encoded in
 // the codestream, and must be used for the FrameHeaders, do not use
-// ib.metadata.
+// ib.metadata. If `sections` is not null, `writer` only receives the frame
+// header and TOC, and the byte-aligned sections that follow the TOC are moved
+// into `sections` instead of being appended to `writer`, so that the caller
+// can output them without concatenating them first.
 Status EncodeFrame(const CompressParams& cparams_orig,
                    const FrameInfo& frame_info, const CodecMetadata* metadata,
                    const ImageBundle& ib, PassesEncoderState* passes_enc_state,
                    const JxlCmsInterface& cms, ThreadPool* pool,
-                   BitWriter* writer, AuxOut* aux_out);
+                   BitWriter* writer, AuxOut* aux_out,
+                   std::vector<BitWriter>* sections = nullptr);
+
+// Returns a rough estimate of the largest number of bytes that EncodeFrame
+// has allocated at once when encoding a frame of the given size, not counting
+// the ImageBundle that holds the input.
+size_t EstimateEncodeFrameMemory(const CompressParams& cparams, size_t xsize,
+                                 size_t ysize, size_t num_extra_channels);
+
+// Lowers the settings of `cparams` that only trade compression density for
+// memory, such as a slow speed tier, until the estimate of
+// EstimateEncodeFrameMemory is at most `max_memory`. Returns false if the
+// frame does not fit even then.
+bool FitEncodeFrameMemory(size_t max_memory, size_t xsize, size_t ysize,
+                          size_t num_extra_channels, CompressParams* cparams);
 
 }  // namespace jxl
 
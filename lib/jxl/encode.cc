@@ -10,6 +10,7 @@
 #include <algorithm>
 #include <cstddef>
 #include <cstring>
+#include <limits>
 
 #include "jxl/codestream_header.h"
 #include "jxl/types.h"
@@ -23,6 +24,7 @@
 #include "lib/jxl/enc_icc_codec.h"
 #include "lib/jxl/encode_internal.h"
 #include "lib/jxl/exif.h"
+#include "lib/jxl/image_ops.h"
 #include "lib/jxl/jpeg/enc_jpeg_data.h"
 #include "lib/jxl/sanitizers.h"
 
@@ -70,6 +72,14 @@ void QueueFrame(
     frame->option_values.cparams.SetLossless();
   }
 
+  if (frame->option_values.frame_index_box) {
+    // The index is stored in a box, so the container must be used. Only the
+    // frames that are added count: the first frame must be indexed for any
+    // frame to be, so this is known before the headers are written.
+    frame_settings->enc->frame_index_box.index_box_requested_through_api =
+        true;
+  }
+
   jxl::JxlEncoderQueuedInput queued_input(frame_settings->enc->memory_manager);
   queued_input.frame = std::move(frame);
   frame_settings->enc->input_queue.emplace_back(std::move(queued_input));
@@ -255,86 +265,397 @@ JxlEncoderStatus VerifyInputBitDepth(JxlBitDepth bit_depth,
   return JXL_ENC_SUCCESS;
 }
 
-bool EncodeFrameIndexBox(const jxl::JxlEncoderFrameIndexBox& frame_index_box,
-                         jxl::BitWriter& writer) {
-  bool ok = true;
-  int NF = 0;
-  for (size_t i = 0; i < frame_index_box.entries.size(); ++i) {
-    if (i == 0 || frame_index_box.entries[i].to_be_indexed) {
-      ++NF;
+// Returns whether a frame with the given pixel format can be encoded with the
+// fast lossless encoder used at effort 1. That encoder writes a single
+// non-blended full frame of 8 to 12 bit integer samples, with interleaved alpha
+// as the only possible extra channel.
+bool CanUseFastLossless(const JxlEncoderFrameSettings* frame_settings,
+                        const JxlPixelFormat& format) {
+  const jxl::JxlEncoderFrameSettingsValues& values = frame_settings->values;
+  const jxl::ImageMetadata& metadata = frame_settings->enc->metadata.m;
+  if (!values.lossless ||
+      values.cparams.speed_tier != jxl::SpeedTier::kLightning ||
+      values.cparams.resampling > 1 || values.cparams.ec_resampling > 1) {
+    return false;
+  }
+  if (metadata.xyb_encoded || metadata.have_animation) return false;
+  const JxlLayerInfo& layer_info = values.header.layer_info;
+  if (layer_info.have_crop || layer_info.save_as_reference != 0 ||
+      layer_info.blend_info.blendmode != JXL_BLEND_REPLACE ||
+      !values.frame_name.empty()) {
+    return false;
+  }
+  for (const JxlBlendInfo& blend_info : values.extra_channel_blend_info) {
+    if (blend_info.blendmode != JXL_BLEND_REPLACE) return false;
+  }
+  // The samples are encoded as they are, so they must already have the bit
+  // depth of the codestream.
+  const uint32_t bits_per_sample =
+      GetBitDepth(values.image_bit_depth, metadata, format);
+  if (metadata.bit_depth.floating_point_sample ||
+      bits_per_sample != metadata.bit_depth.bits_per_sample) {
+    return false;
+  }
+  if (!(format.data_type == JXL_TYPE_UINT8 && bits_per_sample == 8) &&
+      !(format.data_type == JXL_TYPE_UINT16 && bits_per_sample > 8 &&
+        bits_per_sample <= 16)) {
+    return false;
+  }
+  const bool has_alpha = format.num_channels == 2 || format.num_channels == 4;
+  if (metadata.num_extra_channels != (has_alpha ? 1u : 0u)) return false;
+  if (has_alpha) {
+    const jxl::ExtraChannelInfo& alpha = metadata.extra_channel_info[0];
+    if (alpha.type != jxl::ExtraChannel::kAlpha || alpha.dim_shift != 0 ||
+        alpha.bit_depth.floating_point_sample ||
+        alpha.bit_depth.bits_per_sample != bits_per_sample) {
+      return false;
     }
   }
-  // Frame index box contents varint + 8 bytes
-  // continue with NF * 3 * varint
-  // varint max length is 10 for 64 bit numbers, and these numbers
-  // are limited to 63 bits.
-  static const int kVarintMaxLength = 10;
-  static const int kFrameIndexBoxHeaderLength = kVarintMaxLength + 8;
-  static const int kFrameIndexBoxElementLength = 3 * kVarintMaxLength;
-  const int buffer_size =
-      kFrameIndexBoxHeaderLength + NF * kFrameIndexBoxElementLength;
-  std::vector<uint8_t> buffer_vec(buffer_size);
-  uint8_t* buffer = buffer_vec.data();
-  size_t output_pos = 0;
-  ok &= jxl::EncodeVarInt(NF, buffer_vec.size(), &output_pos, buffer);
-  StoreBE32(frame_index_box.TNUM, &buffer[output_pos]);
-  output_pos += 4;
-  StoreBE32(frame_index_box.TDEN, &buffer[output_pos]);
-  output_pos += 4;
-  // When we record a frame in the index, the record needs to know
-  // how many frames until the next indexed frame. That is why
-  // we store the 'prev' record. That 'prev' record needs to store
-  // the offset byte position to previously recorded indexed frame,
-  // that's why we also trace previous to the previous frame.
-  int prev_prev_ix = -1;  // For position offset (OFFi) delta coding.
-  int prev_ix = 0;
-  int T_prev = 0;
-  int T = 0;
-  for (size_t i = 1; i < frame_index_box.entries.size(); ++i) {
-    if (frame_index_box.entries[i].to_be_indexed) {
-      // Now we can record the previous entry, since we need to store
-      // there how many frames until the next one.
-      int64_t OFFi = frame_index_box.entries[prev_ix].OFFi;
-      if (prev_prev_ix != -1) {
-        // Offi needs to be offset of start byte of this frame compared to start
-        // byte of previous frame from this index in the JPEG XL codestream. For
-        // the first frame, this is the offset from the first byte of the JPEG
-        // XL codestream.
-        OFFi -= frame_index_box.entries[prev_prev_ix].OFFi;
-      }
-      int32_t Ti = T_prev;
-      int32_t Fi = i - prev_ix;
-      ok &= jxl::EncodeVarInt(OFFi, buffer_vec.size(), &output_pos, buffer);
-      ok &= jxl::EncodeVarInt(Ti, buffer_vec.size(), &output_pos, buffer);
-      ok &= jxl::EncodeVarInt(Fi, buffer_vec.size(), &output_pos, buffer);
-      prev_prev_ix = prev_ix;
-      prev_ix = i;
-      T_prev = T;
-      T += frame_index_box.entries[i].duration;
-    }
+  return true;
+}
+
+// Runner state passed to the fast lossless encoder. The encoder has no way to
+// report an error from the runner, so failures are recorded in `ok` and
+// checked once the frame is prepared.
+struct FastLosslessRunner {
+  jxl::ThreadPool* pool;
+  bool ok;
+};
+
+// Runs the tasks of the fast lossless encoder on the encoder's thread pool.
+// Once a run failed, the remaining ones are skipped: the frame is discarded.
+void FastLosslessRunOnPool(void* runner_opaque, void* opaque,
+                           void fun(void*, size_t), size_t count) {
+  FastLosslessRunner* runner = static_cast<FastLosslessRunner*>(runner_opaque);
+  if (!runner->ok) return;
+  if (!jxl::RunOnPool(
+          runner->pool, 0, count, jxl::ThreadPool::NoInit,
+          [&](const uint32_t task, size_t /*thread*/) { fun(opaque, task); },
+          "EncodeFastLossless")) {
+    runner->ok = false;
   }
-  {
-    // Last frame.
-    size_t i = frame_index_box.entries.size();
-    int64_t OFFi = frame_index_box.entries[prev_ix].OFFi;
-    if (prev_prev_ix != -1) {
-      OFFi -= frame_index_box.entries[prev_prev_ix].OFFi;
+}
+
+// Appends the contents of the jxli box to output. Every frame of the
+// codestream was recorded in frame_index_box, so that the durations and frame
+// counts between two indexed frames can be summed up here.
+void EncodeFrameIndexBox(const jxl::JxlEncoderFrameIndexBox& frame_index_box,
+                         jxl::PaddedBytes* output) {
+  const std::vector<jxl::JxlEncoderFrameIndexBoxEntry>& entries =
+      frame_index_box.entries;
+  // The first frame is always listed in the index.
+  std::vector<size_t> indexed;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (i == 0 || entries[i].to_be_indexed) indexed.push_back(i);
+  }
+  jxl::EncodeVarInt(indexed.size(), output);
+  size_t pos = output->size();
+  output->resize(pos + 8);
+  StoreBE32(frame_index_box.TNUM, output->data() + pos);
+  StoreBE32(frame_index_box.TDEN, output->data() + pos + 4);
+  for (size_t k = 0; k < indexed.size(); ++k) {
+    const size_t begin = indexed[k];
+    const size_t end = k + 1 < indexed.size() ? indexed[k + 1] : entries.size();
+    // OFFi is relative to the previous indexed frame, or to the start of the
+    // codestream for the first one.
+    uint64_t OFFi = entries[begin].OFFi;
+    if (k > 0) OFFi -= entries[indexed[k - 1]].OFFi;
+    // Ti and Fi span the frames up to the next indexed frame. Only frames that
+    // are displayed count for Fi: those with a duration, and the last frame.
+    uint64_t Ti = 0;
+    uint64_t Fi = 0;
+    for (size_t i = begin; i < end; ++i) {
+      Ti += entries[i].duration;
+      if (entries[i].duration != 0 || i + 1 == entries.size()) ++Fi;
     }
-    int32_t Ti = T_prev;
-    int32_t Fi = i - prev_ix;
-    ok &= jxl::EncodeVarInt(OFFi, buffer_vec.size(), &output_pos, buffer);
-    ok &= jxl::EncodeVarInt(Ti, buffer_vec.size(), &output_pos, buffer);
-    ok &= jxl::EncodeVarInt(Fi, buffer_vec.size(), &output_pos, buffer);
+    jxl::EncodeVarInt(OFFi, output);
+    jxl::EncodeVarInt(Ti, output);
+    jxl::EncodeVarInt(Fi, output);
+  }
+}
+
+// Grows [*x0, *x1) x [*y0, *y1) to contain the samples in which a and b
+// differ.
+void ExtendChangedRegion(const jxl::ImageF& a, const jxl::ImageF& b, size_t* x0,
+                         size_t* x1, size_t* y0, size_t* y1) {
+  const size_t xsize = a.xsize();
+  for (size_t y = 0; y < a.ysize(); ++y) {
+    const float* JXL_RESTRICT row_a = a.ConstRow(y);
+    const float* JXL_RESTRICT row_b = b.ConstRow(y);
+    if (memcmp(row_a, row_b, xsize * sizeof(float)) == 0) continue;
+    size_t begin = 0;
+    while (begin < xsize && row_a[begin] == row_b[begin]) ++begin;
+    // Only the sign of a zero differs.
+    if (begin == xsize) continue;
+    size_t end = xsize;
+    while (row_a[end - 1] == row_b[end - 1]) --end;
+    *x0 = std::min(*x0, begin);
+    *x1 = std::max(*x1, end);
+    *y0 = std::min(*y0, y);
+    *y1 = std::max(*y1, y + 1);
   }
-  // Enough buffer has been allocated, this function should never fail in
-  // writing.
-  JXL_ASSERT(ok);
-  return ok;
+}
+
+// Lowers the settings in `cparams` to fit `max_memory`, unless it is 0, and
+// sets `memory` to the estimated peak for encoding a frame of the given size,
+// including its input image. Returns false if the frame does not fit.
+bool FitFrameMemory(size_t max_memory, size_t xsize, size_t ysize,
+                    size_t num_extra_channels, jxl::CompressParams* cparams,
+                    size_t* memory) {
+  const size_t input_memory =
+      xsize * ysize * (3 + num_extra_channels) * sizeof(float);
+  if (max_memory != 0 &&
+      (input_memory > max_memory ||
+       !jxl::FitEncodeFrameMemory(max_memory - input_memory, xsize, ysize,
+                                  num_extra_channels, cparams))) {
+    return false;
+  }
+  *memory = input_memory + jxl::EstimateEncodeFrameMemory(
+                               *cparams, xsize, ysize, num_extra_channels);
+  return true;
+}
+
+// Like FitFrameMemory for a queued frame. The memory of JPEG and fast lossless
+// frames is not estimated.
+bool FitQueuedFrameMemory(const jxl::JxlEncoderQueuedFrame& frame,
+                          size_t num_extra_channels,
+                          jxl::CompressParams* cparams, size_t* memory) {
+  *memory = 0;
+  if (frame.fast_lossless_frame || frame.frame.IsJPEG()) return true;
+  return FitFrameMemory(frame.option_values.max_memory, frame.frame.xsize(),
+                        frame.frame.ysize(), num_extra_channels, cparams,
+                        memory);
 }
 
 }  // namespace
 
+void JxlEncoderStruct::AutoCropFrame(jxl::JxlEncoderQueuedFrame* input_frame) {
+  jxl::JxlEncoderFrameSettingsValues& values = input_frame->option_values;
+  JxlLayerInfo& layer_info = values.header.layer_info;
+  jxl::ImageBundle& ib = input_frame->frame;
+  // Only full frames that replace the canvas are cropped, since the saved
+  // canvas is what they are blended onto.
+  bool replaces_canvas =
+      values.auto_crop && metadata.m.have_animation &&
+      !input_frame->fast_lossless_frame && ib.HasColor() && !ib.IsJPEG() &&
+      !layer_info.have_crop && layer_info.save_as_reference == 0 &&
+      layer_info.blend_info.blendmode == JXL_BLEND_REPLACE &&
+      layer_info.blend_info.source == 0;
+  for (const JxlBlendInfo& info : values.extra_channel_blend_info) {
+    replaces_canvas &= (info.blendmode == JXL_BLEND_REPLACE);
+  }
+  for (uint8_t initialized : input_frame->ec_initialized) {
+    replaces_canvas &= (initialized != 0);
+  }
+  if (!replaces_canvas) {
+    // Any other frame changes the canvas in a way that is not tracked.
+    auto_crop_color = jxl::Image3F();
+    auto_crop_extra_channels.clear();
+    return;
+  }
+  layer_info.save_as_reference = jxl::kAutoCropReference;
+
+  const size_t xsize = ib.xsize();
+  const size_t ysize = ib.ysize();
+  // Indexed frames must be keyframes, so they are encoded in full.
+  const bool can_crop = !values.frame_index_box &&
+                        auto_crop_color.xsize() == xsize &&
+                        auto_crop_color.ysize() == ysize;
+  size_t x0 = xsize;
+  size_t x1 = 0;
+  size_t y0 = ysize;
+  size_t y1 = 0;
+  if (can_crop) {
+    for (size_t c = 0; c < 3; ++c) {
+      ExtendChangedRegion(ib.color()->Plane(c), auto_crop_color.Plane(c), &x0,
+                          &x1, &y0, &y1);
+    }
+    for (size_t i = 0; i < auto_crop_extra_channels.size(); ++i) {
+      ExtendChangedRegion(ib.extra_channels()[i], auto_crop_extra_channels[i],
+                          &x0, &x1, &y0, &y1);
+    }
+    if (x0 >= x1) {
+      // Nothing changed, but a frame can't be empty.
+      x0 = y0 = 0;
+      x1 = y1 = 1;
+    }
+  }
+  if (!can_crop || (x1 - x0 == xsize && y1 - y0 == ysize)) {
+    auto_crop_color = jxl::CopyImage(*ib.color());
+    auto_crop_extra_channels.clear();
+    for (const jxl::ImageF& ec : ib.extra_channels()) {
+      auto_crop_extra_channels.push_back(jxl::CopyImage(ec));
+    }
+    return;
+  }
+
+  // The full frame becomes the new canvas and only the changed region is
+  // encoded, replacing that region of the saved canvas.
+  const jxl::Rect rect(x0, y0, x1 - x0, y1 - y0);
+  jxl::Image3F color(rect.xsize(), rect.ysize());
+  jxl::CopyImageTo(rect, *ib.color(), jxl::Rect(color), &color);
+  std::vector<jxl::ImageF> extra_channels;
+  for (const jxl::ImageF& ec : ib.extra_channels()) {
+    extra_channels.emplace_back(rect.xsize(), rect.ysize());
+    jxl::CopyImageTo(rect, ec, jxl::Rect(extra_channels.back()),
+                     &extra_channels.back());
+  }
+  auto_crop_color = std::move(*ib.color());
+  auto_crop_extra_channels = std::move(ib.extra_channels());
+  ib.extra_channels().clear();
+  const jxl::ColorEncoding c_current = ib.c_current();
+  ib.SetFromImage(std::move(color), c_current);
+  if (!extra_channels.empty()) ib.SetExtraChannels(std::move(extra_channels));
+
+  layer_info.have_crop = JXL_TRUE;
+  layer_info.crop_x0 = x0;
+  layer_info.crop_y0 = y0;
+  layer_info.xsize = rect.xsize();
+  layer_info.ysize = rect.ysize();
+  layer_info.blend_info.source = jxl::kAutoCropReference;
+  for (JxlBlendInfo& info : values.extra_channel_blend_info) {
+    info.source = jxl::kAutoCropReference;
+  }
+}
+
+void JxlEncoderStruct::PrepareFrame(jxl::JxlEncoderQueuedFrame* input_frame,
+                                    bool last_frame,
+                                    jxl::FrameInfo* frame_info) {
+  const jxl::JxlEncoderFrameSettingsValues& values = input_frame->option_values;
+  if (metadata.m.xyb_encoded) {
+    input_frame->option_values.cparams.color_transform =
+        jxl::ColorTransform::kXYB;
+  } else {
+    // TODO(zond): Figure out when to use kYCbCr instead.
+    input_frame->option_values.cparams.color_transform =
+        jxl::ColorTransform::kNone;
+  }
+
+  // EncodeFrame creates jxl::FrameHeader object internally based on the
+  // FrameInfo, imagebundle, cparams and metadata. Copy the information to
+  // these.
+  jxl::ImageBundle& ib = input_frame->frame;
+  ib.name = values.frame_name;
+  if (metadata.m.have_animation) {
+    ib.duration = values.header.duration;
+    ib.timecode = values.header.timecode;
+  } else {
+    // If have_animation is false, the encoder should ignore the duration and
+    // timecode values. However, assigning them to ib will cause the encoder
+    // to write an invalid frame header that can't be decoded so ensure
+    // they're the default value of 0 here.
+    ib.duration = 0;
+    ib.timecode = 0;
+  }
+  const JxlLayerInfo& layer_info = values.header.layer_info;
+  ib.blendmode = static_cast<jxl::BlendMode>(layer_info.blend_info.blendmode);
+  ib.blend = layer_info.blend_info.blendmode != JXL_BLEND_REPLACE;
+
+  size_t save_as_reference = layer_info.save_as_reference;
+  ib.use_for_next_frame = !!save_as_reference;
+
+  *frame_info = jxl::FrameInfo();
+  frame_info->is_last = last_frame;
+  frame_info->save_as_reference = save_as_reference;
+  frame_info->source = layer_info.blend_info.source;
+  frame_info->clamp = layer_info.blend_info.clamp;
+  frame_info->alpha_channel = layer_info.blend_info.alpha;
+  frame_info->extra_channel_blending_info.resize(metadata.m.num_extra_channels);
+  // If extra channel blend info has not been set, use the blend mode from the
+  // layer_info.
+  JxlBlendInfo default_blend_info = layer_info.blend_info;
+  for (size_t i = 0; i < metadata.m.num_extra_channels; ++i) {
+    auto& to = frame_info->extra_channel_blending_info[i];
+    const auto& from = i < values.extra_channel_blend_info.size()
+                           ? values.extra_channel_blend_info[i]
+                           : default_blend_info;
+    to.mode = static_cast<jxl::BlendMode>(from.blendmode);
+    to.source = from.source;
+    to.alpha_channel = from.alpha;
+    to.clamp = (from.clamp != 0);
+  }
+
+  if (layer_info.have_crop) {
+    ib.origin.x0 = layer_info.crop_x0;
+    ib.origin.y0 = layer_info.crop_y0;
+  }
+}
+
+void JxlEncoderStruct::EncodeFramesAhead() {
+  // The frames at the front of the queue, up to the first box, are encoded
+  // concurrently. Whether a frame is the last one is part of its header, so
+  // while frames are not closed the last queued frame has to wait.
+  std::vector<jxl::JxlEncoderQueuedFrame*> frames;
+  size_t max_groups = 0;
+  // The frames that run at the same time share the smallest memory limit.
+  size_t memory = 0;
+  size_t max_memory = std::numeric_limits<size_t>::max();
+  for (size_t i = 0; i < input_queue.size() && input_queue[i].frame; ++i) {
+    jxl::JxlEncoderQueuedFrame* frame = input_queue[i].frame.get();
+    if (!frames_closed && i + 1 == num_queued_frames) break;
+    // Frames with missing extra channels fail in RefillOutputByteQueue, and
+    // fast lossless frames were encoded when they were added.
+    if (frame->encoded || frame->fast_lossless_frame) break;
+    if (std::find(frame->ec_initialized.begin(), frame->ec_initialized.end(),
+                  0) != frame->ec_initialized.end()) {
+      break;
+    }
+    // Cropping only makes the frame smaller, so the estimate of the full
+    // frame is an upper bound.
+    jxl::CompressParams cparams = frame->option_values.cparams;
+    size_t frame_memory;
+    if (!FitQueuedFrameMemory(*frame, metadata.m.num_extra_channels, &cparams,
+                              &frame_memory)) {
+      break;
+    }
+    if (frame->option_values.max_memory != 0) {
+      max_memory = std::min(max_memory, frame->option_values.max_memory);
+    }
+    memory += frame_memory;
+    if (memory > max_memory) break;
+    frames.push_back(frame);
+    max_groups = std::max(
+        max_groups, jxl::DivCeil(frame->frame.xsize(), jxl::kGroupDim) *
+                        jxl::DivCeil(frame->frame.ysize(), jxl::kGroupDim));
+  }
+  // Each frame is encoded without a thread pool of its own since the runner
+  // does not support nested parallelism, which is only worth it when there
+  // are more frames than groups per frame to run in parallel.
+  if (frames.size() < 2 || frames.size() <= max_groups) return;
+
+  std::vector<jxl::FrameInfo> frame_infos(frames.size());
+  for (size_t i = 0; i < frames.size(); ++i) {
+    AutoCropFrame(frames[i]);
+    size_t frame_memory;
+    (void)FitQueuedFrameMemory(*frames[i], metadata.m.num_extra_channels,
+                               &frames[i]->option_values.cparams,
+                               &frame_memory);
+    PrepareFrame(frames[i], frames_closed && i + 1 == num_queued_frames,
+                 &frame_infos[i]);
+  }
+  const bool use_sections = HasOutputSink();
+  // A frame that fails to encode here is encoded again by
+  // RefillOutputByteQueue, which reports the error.
+  (void)jxl::RunOnPool(
+      thread_pool.get(), 0, frames.size(), jxl::ThreadPool::NoInit,
+      [&](const uint32_t task, size_t /*thread*/) {
+        jxl::JxlEncoderQueuedFrame* frame = frames[task];
+        jxl::PassesEncoderState enc_state;
+        frame->encoded = jxl::EncodeFrame(
+            frame->option_values.cparams, frame_infos[task], &metadata,
+            frame->frame, &enc_state, cms, /*pool=*/nullptr,
+            &frame->encoded_frame, /*aux_out=*/nullptr,
+            use_sections ? &frame->encoded_sections : nullptr);
+        if (!frame->encoded) {
+          frame->encoded_frame = jxl::BitWriter();
+          frame->encoded_sections.clear();
+        }
+      },
+      "EncodeFramesAhead");
+}
+
 JxlEncoderStatus JxlEncoderStruct::RefillOutputByteQueue() {
+  jxl::AllocationTrackerScope tracker_scope(allocation_tracker.get());
   jxl::PaddedBytes bytes;
 
   jxl::JxlEncoderQueuedInput& input = input_queue[0];
@@ -439,6 +760,7 @@ JxlEncoderStatus JxlEncoderStruct::RefillOutputByteQueue() {
   // Choose frame or box processing: exactly one of the two unique pointers (box
   // or frame) in the input queue item is non-null.
   if (input.frame) {
+    if (thread_pool && !input.frame->encoded) EncodeFramesAhead();
     jxl::MemoryManagerUniquePtr<jxl::JxlEncoderQueuedFrame> input_frame =
         std::move(input.frame);
     input_queue.erase(input_queue.begin());
@@ -449,6 +771,17 @@ JxlEncoderStatus JxlEncoderStruct::RefillOutputByteQueue() {
                              "Extra channel %u is not initialized", idx);
       }
     }
+    if (!input_frame->encoded) {
+      AutoCropFrame(input_frame.get());
+      size_t frame_memory;
+      if (!FitQueuedFrameMemory(*input_frame, metadata.m.num_extra_channels,
+                                &input_frame->option_values.cparams,
+                                &frame_memory)) {
+        return JXL_API_ERROR(this, JXL_ENC_ERR_OOM,
+                             "Encoding the frame needs more memory than "
+                             "JXL_ENC_FRAME_SETTING_MAX_MEMORY allows");
+      }
+    }
 
     // TODO(zond): If the input queue is empty and the frames_closed is true,
     // then mark this frame as the last.
@@ -458,102 +791,91 @@ JxlEncoderStatus JxlEncoderStruct::RefillOutputByteQueue() {
     //             JxlEncoderCloseFrames has been called and if the frame queue
     //             is empty (to see if it's the last animation frame).
 
-    if (metadata.m.xyb_encoded) {
-      input_frame->option_values.cparams.color_transform =
-          jxl::ColorTransform::kXYB;
-    } else {
-      // TODO(zond): Figure out when to use kYCbCr instead.
-      input_frame->option_values.cparams.color_transform =
-          jxl::ColorTransform::kNone;
-    }
-
     jxl::BitWriter writer;
     jxl::PassesEncoderState enc_state;
-
-    // EncodeFrame creates jxl::FrameHeader object internally based on the
-    // FrameInfo, imagebundle, cparams and metadata. Copy the information to
-    // these.
-    jxl::ImageBundle& ib = input_frame->frame;
-    ib.name = input_frame->option_values.frame_name;
-    if (metadata.m.have_animation) {
-      ib.duration = input_frame->option_values.header.duration;
-      ib.timecode = input_frame->option_values.header.timecode;
-    } else {
-      // If have_animation is false, the encoder should ignore the duration and
-      // timecode values. However, assigning them to ib will cause the encoder
-      // to write an invalid frame header that can't be decoded so ensure
-      // they're the default value of 0 here.
-      ib.duration = 0;
-      ib.timecode = 0;
-    }
-    frame_index_box.AddFrame(codestream_bytes_written_end_of_frame, ib.duration,
-                             input_frame->option_values.frame_index_box);
-    ib.blendmode = static_cast<jxl::BlendMode>(
-        input_frame->option_values.header.layer_info.blend_info.blendmode);
-    ib.blend =
-        input_frame->option_values.header.layer_info.blend_info.blendmode !=
-        JXL_BLEND_REPLACE;
-
-    size_t save_as_reference =
-        input_frame->option_values.header.layer_info.save_as_reference;
-    ib.use_for_next_frame = !!save_as_reference;
+    enc_state.coeffs = std::move(recycled_coeffs);
 
     jxl::FrameInfo frame_info;
     bool last_frame = frames_closed && !num_queued_frames;
-    frame_info.is_last = last_frame;
-    frame_info.save_as_reference = save_as_reference;
-    frame_info.source =
-        input_frame->option_values.header.layer_info.blend_info.source;
-    frame_info.clamp =
-        input_frame->option_values.header.layer_info.blend_info.clamp;
-    frame_info.alpha_channel =
-        input_frame->option_values.header.layer_info.blend_info.alpha;
-    frame_info.extra_channel_blending_info.resize(
-        metadata.m.num_extra_channels);
-    // If extra channel blend info has not been set, use the blend mode from the
-    // layer_info.
-    JxlBlendInfo default_blend_info =
-        input_frame->option_values.header.layer_info.blend_info;
-    for (size_t i = 0; i < metadata.m.num_extra_channels; ++i) {
-      auto& to = frame_info.extra_channel_blending_info[i];
-      const auto& from =
-          i < input_frame->option_values.extra_channel_blend_info.size()
-              ? input_frame->option_values.extra_channel_blend_info[i]
-              : default_blend_info;
-      to.mode = static_cast<jxl::BlendMode>(from.blendmode);
-      to.source = from.source;
-      to.alpha_channel = from.alpha;
-      to.clamp = (from.clamp != 0);
-    }
-
-    if (input_frame->option_values.header.layer_info.have_crop) {
-      ib.origin.x0 = input_frame->option_values.header.layer_info.crop_x0;
-      ib.origin.y0 = input_frame->option_values.header.layer_info.crop_y0;
+    PrepareFrame(input_frame.get(), last_frame, &frame_info);
+    const jxl::ImageBundle& ib = input_frame->frame;
+    if (input_frame->option_values.frame_index_box) {
+      const JxlLayerInfo& layer_info =
+          input_frame->option_values.header.layer_info;
+      if (!frame_index_box.entries.empty() &&
+          !frame_index_box.entries[0].to_be_indexed) {
+        return JXL_API_ERROR(this, JXL_ENC_ERR_API_USAGE,
+                             "The first frame must be indexed when later "
+                             "frames are indexed");
+      }
+      bool keyframe = !layer_info.have_crop &&
+                      layer_info.blend_info.blendmode == JXL_BLEND_REPLACE;
+      for (const JxlBlendInfo& info :
+           input_frame->option_values.extra_channel_blend_info) {
+        keyframe &= (info.blendmode == JXL_BLEND_REPLACE);
+      }
+      if (!keyframe) {
+        return JXL_API_ERROR(this, JXL_ENC_ERR_API_USAGE,
+                             "Only frames without cropping or blending can be "
+                             "indexed");
+      }
     }
+    frame_index_box.AddFrame(codestream_bytes_written_end_of_frame, ib.duration,
+                             input_frame->option_values.frame_index_box);
     JXL_ASSERT(writer.BitsWritten() == 0);
-    if (!jxl::EncodeFrame(input_frame->option_values.cparams, frame_info,
-                          &metadata, input_frame->frame, &enc_state, cms,
-                          thread_pool.get(), &writer,
-                          /*aux_out=*/nullptr)) {
+    // With an output sink, the frame sections are kept separate and written
+    // to the sink one by one instead of being concatenated first.
+    std::vector<jxl::BitWriter> sections;
+    JxlFastLosslessFrameState* fast_frame =
+        input_frame->fast_lossless_frame.get();
+    size_t fast_frame_size = 0;
+    if (fast_frame) {
+      // The pixel data was already encoded when the frame was added, only the
+      // frame header depends on whether this is the last frame.
+      JxlFastLosslessPrepareHeader(fast_frame, /*add_image_header=*/0,
+                                   last_frame);
+      fast_frame_size = JxlFastLosslessOutputSize(fast_frame);
+    } else if (input_frame->encoded) {
+      // Encoded ahead by EncodeFramesAhead.
+      writer = std::move(input_frame->encoded_frame);
+      sections = std::move(input_frame->encoded_sections);
+    } else if (!jxl::EncodeFrame(input_frame->option_values.cparams,
+                                 frame_info, &metadata, input_frame->frame,
+                                 &enc_state, cms, thread_pool.get(), &writer,
+                                 /*aux_out=*/nullptr,
+                                 HasOutputSink() ? &sections : nullptr)) {
       return JXL_API_ERROR(this, JXL_ENC_ERR_GENERIC, "Failed to encode frame");
     }
+    recycled_coeffs = std::move(enc_state.coeffs);
+    size_t sections_size = 0;
+    for (const jxl::BitWriter& section : sections) {
+      sections_size += section.BitsWritten() / jxl::kBitsPerByte;
+    }
     codestream_bytes_written_beginning_of_frame =
         codestream_bytes_written_end_of_frame;
     codestream_bytes_written_end_of_frame +=
-        jxl::DivCeil(writer.BitsWritten(), 8);
+        jxl::DivCeil(writer.BitsWritten(), 8) + sections_size + fast_frame_size;
 
     // Possibly bytes already contains the codestream header: in case this is
     // the first frame, and the codestream header was not encoded as jxlp above.
     bytes.append(std::move(writer).TakeBytes());
+    if (fast_frame) {
+      size_t offset = bytes.size();
+      bytes.resize(offset + fast_frame_size);
+      JxlFastLosslessWriteOutput(fast_frame, bytes.data() + offset,
+                                 fast_frame_size);
+    }
     if (MustUseContainer()) {
       if (last_frame && jxlp_counter == 0) {
         // If this is the last frame and no jxlp boxes were used yet, it's
         // slighly more efficient to write a jxlc box since it has 4 bytes less
         // overhead.
-        jxl::AppendBoxHeader(jxl::MakeBoxType("jxlc"), bytes.size(),
+        jxl::AppendBoxHeader(jxl::MakeBoxType("jxlc"),
+                             bytes.size() + sections_size,
                              /*unbounded=*/false, &output_byte_queue);
       } else {
-        jxl::AppendBoxHeader(jxl::MakeBoxType("jxlp"), bytes.size() + 4,
+        jxl::AppendBoxHeader(jxl::MakeBoxType("jxlp"),
+                             bytes.size() + sections_size + 4,
                              /*unbounded=*/false, &output_byte_queue);
         AppendJxlpBoxCounter(jxlp_counter++, last_frame, &output_byte_queue);
       }
@@ -561,13 +883,29 @@ JxlEncoderStatus JxlEncoderStruct::RefillOutputByteQueue() {
 
     output_byte_queue.insert(output_byte_queue.end(), bytes.data(),
                              bytes.data() + bytes.size());
+    if (!sections.empty()) {
+      if (FlushOutputByteQueue() != JXL_ENC_SUCCESS) return JXL_ENC_ERROR;
+      for (const jxl::BitWriter& section : sections) {
+        jxl::Span<const uint8_t> span = section.GetSpan();
+        if (WriteToOutputSink(span.data(), span.size()) != JXL_ENC_SUCCESS) {
+          return JXL_ENC_ERROR;
+        }
+      }
+    }
 
     last_used_cparams = input_frame->option_values.cparams;
     if (last_frame && frame_index_box.StoreFrameIndexBox()) {
-      bytes.clear();
-      EncodeFrameIndexBox(frame_index_box, writer);
-      jxl::AppendBoxHeader(jxl::MakeBoxType("jxli"), bytes.size(),
+      if (metadata.m.have_animation) {
+        // A tick lasts TNUM / TDEN seconds.
+        frame_index_box.TNUM = metadata.m.animation.tps_denominator;
+        frame_index_box.TDEN = metadata.m.animation.tps_numerator;
+      }
+      jxl::PaddedBytes index_box;
+      EncodeFrameIndexBox(frame_index_box, &index_box);
+      jxl::AppendBoxHeader(jxl::MakeBoxType("jxli"), index_box.size(),
                            /*unbounded=*/false, &output_byte_queue);
+      output_byte_queue.insert(output_byte_queue.end(), index_box.data(),
+                               index_box.data() + index_box.size());
     }
   } else {
     // Not a frame, so is a box instead
@@ -604,6 +942,35 @@ JxlEncoderStatus JxlEncoderStruct::RefillOutputByteQueue() {
   return JXL_ENC_SUCCESS;
 }
 
+JxlEncoderStatus JxlEncoderStruct::WriteToOutputSink(const uint8_t* data,
+                                                     size_t size) {
+  while (size > 0) {
+    size_t written = output_sink.write(output_sink.opaque, data, size);
+    if (written == 0 || written > size) {
+      return JXL_API_ERROR(this, JXL_ENC_ERR_GENERIC,
+                           "Writing to the output sink failed");
+    }
+    data += written;
+    size -= written;
+  }
+  return JXL_ENC_SUCCESS;
+}
+
+JxlEncoderStatus JxlEncoderStruct::FlushOutputByteQueue() {
+  // A deque is not contiguous, so copy through a fixed size buffer.
+  uint8_t buffer[4096];
+  while (!output_byte_queue.empty()) {
+    size_t to_copy = std::min(sizeof(buffer), output_byte_queue.size());
+    std::copy_n(output_byte_queue.begin(), to_copy, buffer);
+    output_byte_queue.erase(output_byte_queue.begin(),
+                            output_byte_queue.begin() + to_copy);
+    if (WriteToOutputSink(buffer, to_copy) != JXL_ENC_SUCCESS) {
+      return JXL_ENC_ERROR;
+    }
+  }
+  return JXL_ENC_SUCCESS;
+}
+
 JxlEncoderStatus JxlEncoderSetColorEncoding(JxlEncoder* enc,
                                             const JxlColorEncoding* color) {
   if (!enc->basic_info_set) {
@@ -1210,9 +1577,42 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetOption(
       }
       return JXL_ENC_SUCCESS;
     case JXL_ENC_FRAME_INDEX_BOX:
-      frame_settings->values.frame_index_box = true;
+      if (value < 0 || value > 1) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
+                             "Option value has to be 0 or 1");
+      }
+      frame_settings->values.frame_index_box = (value == 1);
+      return JXL_ENC_SUCCESS;
+    case JXL_ENC_FRAME_SETTING_AUTO_CROP:
+      if (value < -1 || value > 1) {
+        return JXL_API_ERROR(
+            frame_settings->enc, JXL_ENC_ERR_API_USAGE,
+            "Option value has to be -1 (default), 0 (off) or 1 (on)");
+      }
+      frame_settings->values.auto_crop = (value == 1);
+      return JXL_ENC_SUCCESS;
+    case JXL_ENC_FRAME_SETTING_MAX_MEMORY:
+      if (value < -1) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
+                             "Option value has to be -1 (default) or >= 0");
+      }
+      if (static_cast<uint64_t>(std::max<int64_t>(value, 0)) >
+          std::numeric_limits<size_t>::max()) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
+                             "Option value does not fit in a size_t");
+      }
+      frame_settings->values.max_memory =
+          value == -1 ? 0 : static_cast<size_t>(value);
+      return JXL_ENC_SUCCESS;
+    case JXL_ENC_FRAME_SETTING_TARGET_SIZE:
+      if (value < -1) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
+                             "Option value has to be -1 (default) or >= 0");
+      }
+      frame_settings->values.cparams.target_size = value == -1 ? 0 : value;
       return JXL_ENC_SUCCESS;
     case JXL_ENC_FRAME_SETTING_PHOTON_NOISE:
+    case JXL_ENC_FRAME_SETTING_TARGET_BITRATE:
       return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
                            "Float option, try setting it with "
                            "JxlEncoderFrameSettingsSetFloatOption");
@@ -1235,6 +1635,13 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetFloatOption(
       // the noise synthesis parameters per frame for more fine grained control.
       frame_settings->values.cparams.photon_noise_iso = value;
       return JXL_ENC_SUCCESS;
+    case JXL_ENC_FRAME_SETTING_TARGET_BITRATE:
+      if (value < -1.f) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
+                             "Option value has to be -1 (default) or >= 0");
+      }
+      frame_settings->values.cparams.target_bitrate = std::max(0.0f, value);
+      return JXL_ENC_SUCCESS;
     case JXL_ENC_FRAME_SETTING_MODULAR_MA_TREE_LEARNING_PERCENT:
       if (value < -1.f || value > 100.f) {
         return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
@@ -1308,6 +1715,9 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetFloatOption(
     case JXL_ENC_FRAME_SETTING_BROTLI_EFFORT:
     case JXL_ENC_FRAME_SETTING_FILL_ENUM:
     case JXL_ENC_FRAME_SETTING_JPEG_COMPRESS_BOXES:
+    case JXL_ENC_FRAME_SETTING_TARGET_SIZE:
+    case JXL_ENC_FRAME_SETTING_AUTO_CROP:
+    case JXL_ENC_FRAME_SETTING_MAX_MEMORY:
       return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
                            "Int option, try setting it with "
                            "JxlEncoderFrameSettingsSetOption");
@@ -1327,6 +1737,10 @@ JxlEncoder* JxlEncoderCreate(const JxlMemoryManager* memory_manager) {
   if (!alloc) return nullptr;
   JxlEncoder* enc = new (alloc) JxlEncoder();
   enc->memory_manager = local_memory_manager;
+  enc->allocation_tracker.reset(jxl::AllocationTracker::Create());
+  if (memory_manager) {
+    enc->allocation_tracker->SetMemoryManager(local_memory_manager);
+  }
   // TODO(sboukortt): add an API function to set this.
   enc->cms = jxl::GetJxlCms();
 
@@ -1337,14 +1751,23 @@ JxlEncoder* JxlEncoderCreate(const JxlMemoryManager* memory_manager) {
 }
 
 void JxlEncoderReset(JxlEncoder* enc) {
+  JxlEncoderRecycle(enc);
+  enc->recycled_coeffs.clear();
+}
+
+void JxlEncoderRecycle(JxlEncoder* enc) {
   enc->thread_pool.reset();
   enc->input_queue.clear();
   enc->num_queued_frames = 0;
   enc->num_queued_boxes = 0;
   enc->encoder_options.clear();
   enc->output_byte_queue.clear();
+  enc->output_sink = {};
   enc->codestream_bytes_written_beginning_of_frame = 0;
   enc->codestream_bytes_written_end_of_frame = 0;
+  enc->frame_index_box = jxl::JxlEncoderFrameIndexBox();
+  enc->auto_crop_color = jxl::Image3F();
+  enc->auto_crop_extra_channels.clear();
   enc->wrote_bytes = false;
   enc->jxlp_counter = 0;
   enc->metadata = jxl::CodecMetadata();
@@ -1425,6 +1848,44 @@ JxlEncoderStatus JxlEncoderSetParallelRunner(JxlEncoder* enc,
     return JXL_API_ERROR(enc, JXL_ENC_ERR_GENERIC,
                          "error setting parallel runner");
   }
+  if (enc->runner_stats_enabled) {
+    enc->thread_pool->SetStats(enc->runner_stats.get());
+  }
+  return JXL_ENC_SUCCESS;
+}
+
+void JxlEncoderSetRunnerStats(JxlEncoder* enc, JXL_BOOL enabled) {
+  enc->runner_stats_enabled = enabled;
+  if (enabled) {
+    if (!enc->runner_stats) enc->runner_stats.reset(new jxl::RunStats());
+    enc->runner_stats->Clear();
+  }
+  if (enc->thread_pool) {
+    enc->thread_pool->SetStats(enabled ? enc->runner_stats.get() : nullptr);
+  }
+}
+
+JxlEncoderStatus JxlEncoderGetRunnerStatsSize(JxlEncoder* enc, size_t* size) {
+  if (!enc->runner_stats) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "runner stats were never enabled");
+  }
+  *size = enc->runner_stats->ToJSON().size() + 1;
+  return JXL_ENC_SUCCESS;
+}
+
+JxlEncoderStatus JxlEncoderGetRunnerStats(JxlEncoder* enc, char* json,
+                                          size_t size) {
+  if (!enc->runner_stats) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "runner stats were never enabled");
+  }
+  const std::string stats = enc->runner_stats->ToJSON();
+  if (size < stats.size() + 1) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "runner stats buffer too small");
+  }
+  memcpy(json, stats.c_str(), stats.size() + 1);
   return JXL_ENC_SUCCESS;
 }
 
@@ -1449,15 +1910,67 @@ JxlEncoderStatus GetCurrentDimensions(
   }
   return JXL_ENC_SUCCESS;
 }
+
+// With auto crop, the reference slot that holds the canvas is overwritten
+// between frames, so frames must not save to it or blend from it themselves.
+JxlEncoderStatus CheckAutoCropReference(
+    const JxlEncoderFrameSettings* frame_settings) {
+  const jxl::JxlEncoderFrameSettingsValues& values = frame_settings->values;
+  if (!values.auto_crop || !frame_settings->enc->metadata.m.have_animation) {
+    return JXL_ENC_SUCCESS;
+  }
+  const JxlLayerInfo& layer_info = values.header.layer_info;
+  bool uses_reference =
+      layer_info.save_as_reference == jxl::kAutoCropReference ||
+      layer_info.blend_info.source == jxl::kAutoCropReference;
+  for (const JxlBlendInfo& info : values.extra_channel_blend_info) {
+    uses_reference |= (info.source == jxl::kAutoCropReference);
+  }
+  if (uses_reference) {
+    return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
+                         "Reference slot 3 is reserved for auto crop");
+  }
+  return JXL_ENC_SUCCESS;
+}
 }  // namespace
 
+JxlEncoderStatus JxlEncoderEstimatePeakMemory(
+    const JxlEncoderFrameSettings* frame_settings, size_t* peak_bytes) {
+  JxlEncoder* enc = frame_settings->enc;
+  if (!enc->basic_info_set) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE, "Basic info not set yet");
+  }
+  size_t xsize, ysize;
+  if (GetCurrentDimensions(frame_settings, xsize, ysize) != JXL_ENC_SUCCESS) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_GENERIC, "bad dimensions");
+  }
+  jxl::CompressParams cparams = frame_settings->values.cparams;
+  if (!FitFrameMemory(frame_settings->values.max_memory, xsize, ysize,
+                      enc->metadata.m.num_extra_channels, &cparams,
+                      peak_bytes)) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_OOM,
+                         "Encoding the frame needs more memory than "
+                         "JXL_ENC_FRAME_SETTING_MAX_MEMORY allows");
+  }
+  return JXL_ENC_SUCCESS;
+}
+
+void JxlEncoderSetMemoryPool(JxlEncoder* enc, size_t max_cached_bytes) {
+  enc->allocation_tracker->SetPoolLimit(max_cached_bytes);
+}
+
 JxlEncoderStatus JxlEncoderAddJPEGFrame(
     const JxlEncoderFrameSettings* frame_settings, const uint8_t* buffer,
     size_t size) {
+  jxl::AllocationTrackerScope tracker_scope(
+      frame_settings->enc->allocation_tracker.get());
   if (frame_settings->enc->frames_closed) {
     return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
                          "Frame input is already closed");
   }
+  if (CheckAutoCropReference(frame_settings) != JXL_ENC_SUCCESS) {
+    return JXL_ENC_ERROR;
+  }
 
   jxl::CodecInOut io;
   if (!jxl::jpeg::DecodeImageJPG(jxl::Span<const uint8_t>(buffer, size), &io)) {
@@ -1542,7 +2055,8 @@ JxlEncoderStatus JxlEncoderAddJPEGFrame(
       jxl::JxlEncoderQueuedFrame{
           frame_settings->values,
           jxl::ImageBundle(&frame_settings->enc->metadata.m),
-          {}});
+          {},
+          nullptr});
   if (!queued_frame) {
     // TODO(jon): when can this happen? is this an API usage error?
     return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_GENERIC,
@@ -1578,6 +2092,8 @@ JxlEncoderStatus JxlEncoderAddJPEGFrame(
 JxlEncoderStatus JxlEncoderAddImageFrame(
     const JxlEncoderFrameSettings* frame_settings,
     const JxlPixelFormat* pixel_format, const void* buffer, size_t size) {
+  jxl::AllocationTrackerScope tracker_scope(
+      frame_settings->enc->allocation_tracker.get());
   if (!frame_settings->enc->basic_info_set ||
       (!frame_settings->enc->color_encoding_set &&
        !frame_settings->enc->metadata.m.xyb_encoded)) {
@@ -1592,6 +2108,9 @@ JxlEncoderStatus JxlEncoderAddImageFrame(
     return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
                          "Frame input already closed");
   }
+  if (CheckAutoCropReference(frame_settings) != JXL_ENC_SUCCESS) {
+    return JXL_ENC_ERROR;
+  }
   if (pixel_format->num_channels < 3) {
     if (frame_settings->enc->basic_info.num_color_channels != 1) {
       return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
@@ -1611,7 +2130,8 @@ JxlEncoderStatus JxlEncoderAddImageFrame(
       jxl::JxlEncoderQueuedFrame{
           frame_settings->values,
           jxl::ImageBundle(&frame_settings->enc->metadata.m),
-          {}});
+          {},
+          nullptr});
 
   if (!queued_frame) {
     // TODO(jon): when can this happen? is this an API usage error?
@@ -1645,6 +2165,47 @@ JxlEncoderStatus JxlEncoderAddImageFrame(
     return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_GENERIC,
                          "bad dimensions");
   }
+  if (CanUseFastLossless(frame_settings, *pixel_format)) {
+    const size_t bytes_per_pixel =
+        num_channels * (pixel_format->data_type == JXL_TYPE_UINT8 ? 1 : 2);
+    const size_t last_row_size = xsize * bytes_per_pixel;
+    const size_t align = pixel_format->align;
+    const size_t row_size =
+        (align > 1 ? jxl::DivCeil(last_row_size, align) * align
+                   : last_row_size);
+    if (size < row_size * (ysize - 1) + last_row_size ||
+        size > row_size * ysize) {
+      return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
+                           "Invalid input buffer");
+    }
+    // The effort of the fast encoder is on its own scale, unrelated to the
+    // effort of the frame settings (which is always 1 here): the histograms
+    // are built from the middle 2 * effort rows of every group, and values
+    // below 2 disable the palette detection. 2 is the fast encoder's default.
+    const int kFastLosslessEffort = 2;
+    FastLosslessRunner runner = {frame_settings->enc->thread_pool.get(),
+                                 /*ok=*/true};
+    queued_frame->fast_lossless_frame.reset(JxlFastLosslessPrepareFrame(
+        reinterpret_cast<const unsigned char*>(buffer), xsize, row_size, ysize,
+        num_channels, frame_settings->enc->metadata.m.bit_depth.bits_per_sample,
+        pixel_format->endianness == JXL_BIG_ENDIAN, kFastLosslessEffort,
+        &runner, &FastLosslessRunOnPool));
+    if (!runner.ok) {
+      return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_GENERIC,
+                           "Error during fast lossless encoding");
+    }
+    // Without support for the fast encoder on this platform, fall back to the
+    // regular encoder.
+    if (queued_frame->fast_lossless_frame) {
+      queued_frame->ec_initialized.assign(
+          frame_settings->enc->metadata.m.num_extra_channels, 1);
+      queued_frame->option_values.cparams.level =
+          frame_settings->enc->codestream_level;
+      QueueFrame(frame_settings, queued_frame);
+      return JXL_ENC_SUCCESS;
+    }
+  }
+
   std::vector<jxl::ImageF> extra_channels(
       frame_settings->enc->metadata.m.num_extra_channels);
   for (auto& extra_channel : extra_channels) {
@@ -1783,6 +2344,11 @@ JXL_EXPORT JxlEncoderStatus JxlEncoderSetExtraChannelBuffer(
       frame_settings->enc->metadata.m.extra_channel_info[index], ec_format);
   const uint8_t* uint8_buffer = reinterpret_cast<const uint8_t*>(buffer);
   auto queued_frame = frame_settings->enc->input_queue.back().frame.get();
+  if (queued_frame->fast_lossless_frame) {
+    return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
+                         "Extra channel buffers can't be set for frames that "
+                         "are encoded with effort 1 lossless");
+  }
   if (!jxl::ConvertFromExternal(jxl::Span<const uint8_t>(uint8_buffer, size),
                                 xsize, ysize, bits_per_sample, ec_format, 0,
                                 frame_settings->enc->thread_pool.get(),
@@ -1795,6 +2361,210 @@ JXL_EXPORT JxlEncoderStatus JxlEncoderSetExtraChannelBuffer(
   return JXL_ENC_SUCCESS;
 }
 
+namespace {
+// Reads the interleaved channels of the pixels returned by `get_data`, one
+// DC group sized rectangle at a time: channel `c` goes to `channels[c]`, or is
+// ignored if that is null. Each rectangle is requested once.
+template <typename GetData>
+JxlEncoderStatus ReadChunkedChannels(
+    const JxlEncoderFrameSettings* frame_settings,
+    const JxlChunkedFrameInputSource& input, const JxlPixelFormat& format,
+    size_t bits_per_sample, const GetData& get_data, size_t xsize,
+    size_t ysize, const std::vector<jxl::ImageF*>& channels) {
+  constexpr size_t kChunkDim = jxl::kGroupDim * jxl::kBlockDim;
+  for (size_t y0 = 0; y0 < ysize; y0 += kChunkDim) {
+    for (size_t x0 = 0; x0 < xsize; x0 += kChunkDim) {
+      const jxl::Rect rect(x0, y0, kChunkDim, kChunkDim, xsize, ysize);
+      size_t row_offset = 0;
+      const void* data = get_data(rect, &row_offset);
+      if (!data) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_GENERIC,
+                             "No pixel data for chunk");
+      }
+      jxl::Status ok = true;
+      for (size_t c = 0; c < channels.size() && ok; ++c) {
+        if (channels[c] == nullptr) continue;
+        ok = jxl::ConvertFromExternalNoSizeCheck(
+            reinterpret_cast<const uint8_t*>(data), row_offset,
+            bits_per_sample, format, c, frame_settings->enc->thread_pool.get(),
+            rect, channels[c]);
+      }
+      input.release_buffer(input.opaque, data);
+      if (!ok) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
+                             "Invalid chunk pixel data");
+      }
+    }
+  }
+  return JXL_ENC_SUCCESS;
+}
+}  // namespace
+
+JxlEncoderStatus JxlEncoderAddChunkedFrame(
+    const JxlEncoderFrameSettings* frame_settings, JXL_BOOL is_last_frame,
+    JxlChunkedFrameInputSource chunked_frame_input) {
+  JxlEncoder* enc = frame_settings->enc;
+  jxl::AllocationTrackerScope tracker_scope(enc->allocation_tracker.get());
+  if (!enc->basic_info_set ||
+      (!enc->color_encoding_set && !enc->metadata.m.xyb_encoded)) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "Basic info or color encoding not set yet");
+  }
+  if (enc->frames_closed) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "Frame input already closed");
+  }
+  if (CheckAutoCropReference(frame_settings) != JXL_ENC_SUCCESS) {
+    return JXL_ENC_ERROR;
+  }
+  const JxlChunkedFrameInputSource& input = chunked_frame_input;
+  if (!input.get_color_channels_pixel_format ||
+      !input.get_color_channel_data_at || !input.release_buffer ||
+      (enc->metadata.m.num_extra_channels > 0 &&
+       (!input.get_extra_channel_pixel_format ||
+        !input.get_extra_channel_data_at))) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "Missing chunked input callback");
+  }
+  JxlPixelFormat format;
+  input.get_color_channels_pixel_format(input.opaque, &format);
+  const size_t color_channels = enc->basic_info.num_color_channels;
+  if ((format.num_channels < 3) != (color_channels == 1)) {
+    return JXL_API_ERROR(
+        enc, JXL_ENC_ERR_API_USAGE,
+        "Pixel format does not match number of color channels");
+  }
+  const bool has_interleaved_alpha =
+      format.num_channels == 2 || format.num_channels == 4;
+  if (has_interleaved_alpha && enc->metadata.m.num_extra_channels == 0) {
+    return JXL_API_ERROR(
+        enc, JXL_ENC_ERR_API_USAGE,
+        "number of extra channels mismatch (need 1 extra channel for alpha)");
+  }
+  if (JXL_ENC_SUCCESS !=
+      VerifyInputBitDepth(frame_settings->values.image_bit_depth, format)) {
+    return JXL_API_ERROR_NOSET("Invalid input bit depth");
+  }
+  if (frame_settings->values.lossless && enc->metadata.m.xyb_encoded) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "Set use_original_profile=true for lossless encoding");
+  }
+  size_t xsize, ysize;
+  if (GetCurrentDimensions(frame_settings, xsize, ysize) != JXL_ENC_SUCCESS) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_GENERIC, "bad dimensions");
+  }
+
+  auto queued_frame = jxl::MemoryManagerMakeUnique<jxl::JxlEncoderQueuedFrame>(
+      &enc->memory_manager,
+      jxl::JxlEncoderQueuedFrame{frame_settings->values,
+                                 jxl::ImageBundle(&enc->metadata.m),
+                                 {},
+                                 nullptr});
+  if (!queued_frame) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_OOM, "Failed to allocate frame");
+  }
+
+  jxl::ColorEncoding c_current;
+  if (!enc->color_encoding_set) {
+    const bool is_float = format.data_type == JXL_TYPE_FLOAT ||
+                          format.data_type == JXL_TYPE_FLOAT16;
+    c_current = is_float ? jxl::ColorEncoding::LinearSRGB(color_channels == 1)
+                         : jxl::ColorEncoding::SRGB(color_channels == 1);
+  } else {
+    c_current = enc->metadata.m.color_encoding;
+  }
+
+  // Each chunk is converted directly into the planar frame, so no copy of the
+  // full interleaved input is ever made. The planar frame itself is still
+  // whole, since the frame encoder needs all of it.
+  size_t bits_per_sample = GetBitDepth(frame_settings->values.image_bit_depth,
+                                       enc->metadata.m, format);
+  auto get_color = [&](const jxl::Rect& rect, size_t* row_offset) {
+    return input.get_color_channel_data_at(input.opaque, rect.x0(), rect.y0(),
+                                           rect.xsize(), rect.ysize(),
+                                           row_offset);
+  };
+  jxl::Image3F color(xsize, ysize);
+  const auto& ec_info = enc->metadata.m.extra_channel_info;
+  std::vector<jxl::ImageF> extra_channels(ec_info.size());
+  for (size_t ec = 0; ec < ec_info.size(); ++ec) {
+    extra_channels[ec] = jxl::ImageF(xsize, ysize);
+  }
+  // The color pixels give the color channels and the first alpha channel.
+  size_t interleaved_alpha = ec_info.size();
+  std::vector<jxl::ImageF*> color_planes(format.num_channels);
+  for (size_t c = 0; c < color_channels; ++c) {
+    color_planes[c] = &color.Plane(c);
+  }
+  if (has_interleaved_alpha) {
+    for (size_t ec = 0; ec < ec_info.size(); ++ec) {
+      if (ec_info[ec].type == jxl::ExtraChannel::kAlpha) {
+        interleaved_alpha = ec;
+        color_planes[format.num_channels - 1] = &extra_channels[ec];
+        break;
+      }
+    }
+  }
+  if (ReadChunkedChannels(frame_settings, input, format, bits_per_sample,
+                          get_color, xsize, ysize,
+                          color_planes) != JXL_ENC_SUCCESS) {
+    return JXL_ENC_ERROR;
+  }
+  if (color_channels == 1) {
+    jxl::CopyImageTo(color.Plane(0), &color.Plane(1));
+    jxl::CopyImageTo(color.Plane(0), &color.Plane(2));
+  }
+  queued_frame->frame.SetFromImage(std::move(color), c_current);
+
+  for (size_t ec = 0; ec < ec_info.size(); ++ec) {
+    if (ec != interleaved_alpha) {
+      JxlPixelFormat ec_format;
+      input.get_extra_channel_pixel_format(input.opaque, ec, &ec_format);
+      ec_format.num_channels = 1;
+      if (JXL_ENC_SUCCESS !=
+          VerifyInputBitDepth(frame_settings->values.image_bit_depth,
+                              ec_format)) {
+        return JXL_API_ERROR_NOSET("Invalid input bit depth");
+      }
+      size_t ec_bits_per_sample = GetBitDepth(
+          frame_settings->values.image_bit_depth, ec_info[ec], ec_format);
+      auto get_ec = [&](const jxl::Rect& rect, size_t* row_offset) {
+        return input.get_extra_channel_data_at(input.opaque, ec, rect.x0(),
+                                               rect.y0(), rect.xsize(),
+                                               rect.ysize(), row_offset);
+      };
+      if (ReadChunkedChannels(frame_settings, input, ec_format,
+                              ec_bits_per_sample, get_ec, xsize, ysize,
+                              {&extra_channels[ec]}) != JXL_ENC_SUCCESS) {
+        return JXL_ENC_ERROR;
+      }
+    }
+    queued_frame->ec_initialized.push_back(1);
+  }
+  queued_frame->frame.SetExtraChannels(std::move(extra_channels));
+
+  queued_frame->frame.origin.x0 =
+      frame_settings->values.header.layer_info.crop_x0;
+  queued_frame->frame.origin.y0 =
+      frame_settings->values.header.layer_info.crop_y0;
+  queued_frame->frame.use_for_next_frame =
+      (frame_settings->values.header.layer_info.save_as_reference != 0u);
+  queued_frame->frame.blendmode =
+      frame_settings->values.header.layer_info.blend_info.blendmode ==
+              JXL_BLEND_REPLACE
+          ? jxl::BlendMode::kReplace
+          : jxl::BlendMode::kBlend;
+  queued_frame->frame.blend =
+      frame_settings->values.header.layer_info.blend_info.source > 0;
+  queued_frame->option_values.cparams.level = enc->codestream_level;
+
+  QueueFrame(frame_settings, queued_frame);
+  if (is_last_frame) {
+    JxlEncoderCloseFrames(enc);
+  }
+  return JXL_ENC_SUCCESS;
+}
+
 void JxlEncoderCloseFrames(JxlEncoder* enc) { enc->frames_closed = true; }
 
 void JxlEncoderCloseBoxes(JxlEncoder* enc) { enc->boxes_closed = true; }
@@ -1805,6 +2575,10 @@ void JxlEncoderCloseInput(JxlEncoder* enc) {
 }
 JxlEncoderStatus JxlEncoderProcessOutput(JxlEncoder* enc, uint8_t** next_out,
                                          size_t* avail_out) {
+  if (enc->HasOutputSink()) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "Use JxlEncoderFlushInput with an output sink");
+  }
   while (*avail_out > 0 &&
          (!enc->output_byte_queue.empty() || !enc->input_queue.empty())) {
     if (!enc->output_byte_queue.empty()) {
@@ -1827,6 +2601,110 @@ JxlEncoderStatus JxlEncoderProcessOutput(JxlEncoder* enc, uint8_t** next_out,
   return JXL_ENC_SUCCESS;
 }
 
+JxlEncoderStatus JxlEncoderSetOutputSink(JxlEncoder* enc,
+                                         JxlEncoderOutputSink output_sink) {
+  if (enc->wrote_bytes) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "this setting can only be set at the beginning");
+  }
+  if (!output_sink.write) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "output sink has no write callback");
+  }
+  enc->output_sink = output_sink;
+  return JXL_ENC_SUCCESS;
+}
+
+namespace {
+// Encodes all queued input, writing it to the output sink if there is one and
+// keeping it in the output byte queue otherwise.
+JxlEncoderStatus ProcessAllInput(JxlEncoder* enc) {
+  while (!enc->input_queue.empty()) {
+    if (enc->RefillOutputByteQueue() != JXL_ENC_SUCCESS) {
+      return JXL_ENC_ERROR;
+    }
+    if (enc->HasOutputSink() &&
+        enc->FlushOutputByteQueue() != JXL_ENC_SUCCESS) {
+      return JXL_ENC_ERROR;
+    }
+  }
+  return JXL_ENC_SUCCESS;
+}
+
+// Whether every frame of the image fits in a single group, in which case the
+// encoder has almost no work to run in parallel within the image.
+bool IsSingleGroupImage(const JxlEncoder* enc) {
+  return enc->metadata.xsize() <= jxl::kGroupDim &&
+         enc->metadata.ysize() <= jxl::kGroupDim;
+}
+}  // namespace
+
+JxlEncoderStatus JxlEncoderFlushInput(JxlEncoder* enc) {
+  if (!enc->HasOutputSink()) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE, "No output sink set");
+  }
+  return ProcessAllInput(enc);
+}
+
+JxlEncoderStatus JxlEncoderProcessBatch(JxlEncoder* const* encoders,
+                                        size_t num_encoders,
+                                        JxlParallelRunner parallel_runner,
+                                        void* parallel_runner_opaque) {
+  std::vector<JxlEncoder*> small;
+  std::vector<JxlEncoder*> large;
+  for (size_t i = 0; i < num_encoders; i++) {
+    if (IsSingleGroupImage(encoders[i])) {
+      small.push_back(encoders[i]);
+    } else {
+      large.push_back(encoders[i]);
+    }
+  }
+  jxl::ThreadPool pool(parallel_runner, parallel_runner_opaque);
+  bool ok = true;
+
+  // The runner does not support nested parallelism, so the small images are
+  // each encoded without a thread pool of their own.
+  std::vector<jxl::MemoryManagerUniquePtr<jxl::ThreadPool>> saved_pools;
+  saved_pools.reserve(small.size());
+  for (JxlEncoder* enc : small) {
+    saved_pools.emplace_back(
+        nullptr, jxl::MemoryManagerDeleteHelper(&enc->memory_manager));
+    std::swap(saved_pools.back(), enc->thread_pool);
+  }
+  std::vector<uint8_t> small_ok(small.size(), 0);
+  if (!jxl::RunOnPool(
+          &pool, 0, small.size(), jxl::ThreadPool::NoInit,
+          [&](const uint32_t task, size_t /*thread*/) {
+            small_ok[task] = ProcessAllInput(small[task]) == JXL_ENC_SUCCESS;
+          },
+          "EncodeBatch")) {
+    ok = false;
+  }
+  for (size_t i = 0; i < small.size(); i++) {
+    std::swap(saved_pools[i], small[i]->thread_pool);
+    ok &= small_ok[i] != 0;
+  }
+
+  for (JxlEncoder* enc : large) {
+    jxl::MemoryManagerUniquePtr<jxl::ThreadPool> saved_pool =
+        jxl::MemoryManagerMakeUnique<jxl::ThreadPool>(
+            &enc->memory_manager, parallel_runner, parallel_runner_opaque);
+    if (!saved_pool) {
+      (void)JXL_API_ERROR(enc, JXL_ENC_ERR_GENERIC,
+                          "error setting parallel runner");
+      ok = false;
+      continue;
+    }
+    if (enc->runner_stats_enabled) {
+      saved_pool->SetStats(enc->runner_stats.get());
+    }
+    std::swap(saved_pool, enc->thread_pool);
+    ok &= ProcessAllInput(enc) == JXL_ENC_SUCCESS;
+    std::swap(saved_pool, enc->thread_pool);
+  }
+  return ok ? JXL_ENC_SUCCESS : JXL_ENC_ERROR;
+}
+
 JxlEncoderStatus JxlEncoderSetFrameHeader(JxlEncoderOptions* frame_settings,
                                           const JxlFrameHeader* frame_header) {
   if (frame_header->layer_info.blend_info.source > 3) {
@@ -8,6 +8,7 @@
 #define LIB_JXL_ENCODE_INTERNAL_H_
 
 #include <deque>
+#include <memory>
 #include <vector>
 
 #include "jxl/encode.h"
@@ -15,6 +16,7 @@
 #include "jxl/parallel_runner.h"
 #include "jxl/types.h"
 #include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/enc_fast_lossless.h"
 #include "lib/jxl/enc_frame.h"
 #include "lib/jxl/memory_manager_internal.h"
 
@@ -110,6 +112,9 @@ typedef struct JxlEncoderFrameSettingsValuesStruct {
   std::string frame_name;
   JxlBitDepth image_bit_depth;
   bool frame_index_box = false;
+  bool auto_crop = false;
+  // JXL_ENC_FRAME_SETTING_MAX_MEMORY, 0 if there is no limit.
+  size_t max_memory = 0;
 } JxlEncoderFrameSettingsValues;
 
 typedef std::array<uint8_t, 4> BoxType;
@@ -129,10 +134,30 @@ constexpr unsigned char kContainerHeader[] = {
 
 constexpr unsigned char kLevelBoxHeader[] = {0, 0, 0, 0x9, 'j', 'x', 'l', 'l'};
 
+// Reference slot that holds the canvas for JXL_ENC_FRAME_SETTING_AUTO_CROP.
+constexpr uint32_t kAutoCropReference = 3;
+
+struct FastLosslessFrameStateDeleter {
+  void operator()(JxlFastLosslessFrameState* frame) const {
+    JxlFastLosslessFreeFrameState(frame);
+  }
+};
+
+using FastLosslessFrameStatePtr =
+    std::unique_ptr<JxlFastLosslessFrameState, FastLosslessFrameStateDeleter>;
+
 struct JxlEncoderQueuedFrame {
   JxlEncoderFrameSettingsValues option_values;
   ImageBundle frame;
   std::vector<uint8_t> ec_initialized;
+  // Set if the frame was already encoded by the effort 1 lossless encoder when
+  // it was added, in which case `frame` holds no pixel data.
+  FastLosslessFrameStatePtr fast_lossless_frame;
+  // Set if the frame was encoded ahead of its turn by EncodeFramesAhead, in
+  // which case `encoded_frame` and `encoded_sections` hold the result.
+  bool encoded;
+  BitWriter encoded_frame;
+  std::vector<BitWriter> encoded_sections;
 };
 
 struct JxlEncoderQueuedBox {
@@ -190,6 +215,13 @@ struct JxlEncoderStruct {
   JxlMemoryManager memory_manager;
   jxl::MemoryManagerUniquePtr<jxl::ThreadPool> thread_pool{
       nullptr, jxl::MemoryManagerDeleteHelper(&memory_manager)};
+  // Accounts and, with the memory manager and optional pool, provides the
+  // image memory allocated while encoding.
+  jxl::AllocationTrackerPtr allocation_tracker;
+  // Timing of the parallel runner calls, kept across resets. Recorded while
+  // runner_stats_enabled.
+  std::unique_ptr<jxl::RunStats> runner_stats;
+  bool runner_stats_enabled = false;
   JxlCmsInterface cms;
   std::vector<jxl::MemoryManagerUniquePtr<JxlEncoderFrameSettings>>
       encoder_options;
@@ -198,6 +230,10 @@ struct JxlEncoderStruct {
   size_t num_queued_boxes;
   std::vector<jxl::JxlEncoderQueuedInput> input_queue;
   std::deque<uint8_t> output_byte_queue;
+  // If set, the output goes to this sink instead of the output buffers of
+  // JxlEncoderProcessOutput. Frame sections are written directly, without
+  // passing through output_byte_queue.
+  JxlEncoderOutputSink output_sink;
 
   // How many codestream bytes have been written, i.e.,
   // content of jxlc and jxlp boxes. Frame index box jxli
@@ -229,6 +265,18 @@ struct JxlEncoderStruct {
   jxl::CompressParams last_used_cparams;
   JxlBasicInfo basic_info;
 
+  // Coefficient buffers of the previously encoded frame, handed to the next
+  // frame so that it only allocates them if they are too small. Kept by
+  // JxlEncoderRecycle and freed by JxlEncoderReset.
+  std::vector<std::unique_ptr<jxl::ACImage>> recycled_coeffs;
+
+  // The full image of the last frame encoded with
+  // JXL_ENC_FRAME_SETTING_AUTO_CROP, which is what the decoder holds in
+  // reference slot jxl::kAutoCropReference. Empty if the canvas changed in
+  // another way since.
+  jxl::Image3F auto_crop_color;
+  std::vector<jxl::ImageF> auto_crop_extra_channels;
+
   // Encoder wrote a jxlp (partial codestream) box, so any next codestream
   // parts must also be written in jxlp boxes, a single jxlc box cannot be
   // used. The counter is used for the 4-byte jxlp box index header.
@@ -245,9 +293,32 @@ struct JxlEncoderStruct {
   // the bytes to the output_byte_queue.
   JxlEncoderStatus RefillOutputByteQueue();
 
+  // If JXL_ENC_FRAME_SETTING_AUTO_CROP applies to the queued frame, crops it
+  // to the region that changed since the previous one and blends it onto the
+  // saved canvas. Must be called for every frame, in order.
+  void AutoCropFrame(jxl::JxlEncoderQueuedFrame* input_frame);
+
+  // Sets the cparams, image bundle fields and frame info of a queued frame
+  // for jxl::EncodeFrame.
+  void PrepareFrame(jxl::JxlEncoderQueuedFrame* input_frame, bool last_frame,
+                    jxl::FrameInfo* frame_info);
+
+  // Encodes the frames at the front of the input_queue concurrently on the
+  // thread pool, if there are enough of them. RefillOutputByteQueue then
+  // emits them in order.
+  void EncodeFramesAhead();
+
+  bool HasOutputSink() const { return output_sink.write != nullptr; }
+
+  // Writes all of data to the output sink.
+  JxlEncoderStatus WriteToOutputSink(const uint8_t* data, size_t size);
+
+  // Moves the contents of output_byte_queue to the output sink.
+  JxlEncoderStatus FlushOutputByteQueue();
+
   bool MustUseContainer() const {
     return use_container || codestream_level != 5 || store_jpeg_metadata ||
-           use_boxes;
+           use_boxes || frame_index_box.index_box_requested_through_api;
   }
 
   // Appends the bytes of a JXL box header with the provided type and size to
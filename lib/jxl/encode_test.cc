@@ -5,11 +5,14 @@
 
 #include "jxl/encode.h"
 
+#include <limits>
+
 #include "enc_color_management.h"
 #include "gtest/gtest.h"
 #include "jxl/decode.h"
 #include "jxl/decode_cxx.h"
 #include "jxl/encode_cxx.h"
+#include "jxl/thread_parallel_runner_cxx.h"
 #include "lib/extras/codec.h"
 #include "lib/extras/dec/jxl.h"
 #include "lib/jxl/enc_butteraugli_pnorm.h"
@@ -251,6 +254,24 @@ TEST(EncodeTest, EncoderResetTest) {
                       false);
 }
 
+TEST(EncodeTest, EncoderRecycleTest) {
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+  VerifyFrameEncoding(300, 200, enc.get(),
+                      JxlEncoderFrameSettingsCreate(enc.get(), nullptr), 30000,
+                      false);
+  // The buffers kept from the first image are larger than needed for the
+  // second one and too small for the third one.
+  JxlEncoderRecycle(enc.get());
+  VerifyFrameEncoding(157, 77, enc.get(),
+                      JxlEncoderFrameSettingsCreate(enc.get(), nullptr), 2300,
+                      false);
+  JxlEncoderRecycle(enc.get());
+  VerifyFrameEncoding(520, 300, enc.get(),
+                      JxlEncoderFrameSettingsCreate(enc.get(), nullptr), 70000,
+                      false);
+}
+
 TEST(EncodeTest, CmsTest) {
   JxlEncoderPtr enc = JxlEncoderMake(nullptr);
   EXPECT_NE(nullptr, enc.get());
@@ -495,6 +516,40 @@ TEST(EncodeTest, frame_settingsTest) {
     VerifyFrameEncoding(enc.get(), frame_settings);
     EXPECT_EQ(true, enc->last_used_cparams.force_cfl_jpeg_recompression);
   }
+
+  {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_TARGET_SIZE, -2));
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_TARGET_BITRATE, 1));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_TARGET_SIZE, 2400));
+    // The limit applies to the frame, the rest is the image header.
+    VerifyFrameEncoding(63, 129, enc.get(), frame_settings, 2450, false);
+    EXPECT_EQ(2400u, enc->last_used_cparams.target_size);
+  }
+
+  {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetFloatOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_TARGET_BITRATE, -2.0f));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetFloatOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_TARGET_BITRATE, 2.0f));
+    VerifyFrameEncoding(enc.get(), frame_settings);
+    EXPECT_EQ(2.0f, enc->last_used_cparams.target_bitrate);
+  }
 }
 
 TEST(EncodeTest, LossyEncoderUseOriginalProfileTest) {
@@ -1167,6 +1222,759 @@ TEST(EncodeTest, CroppedFrameTest) {
   EXPECT_EQ(true, seen_frame);
 }
 
+TEST(EncodeTest, AutoCropTest) {
+  const size_t xsize = 64;
+  const size_t ysize = 48;
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  const size_t bytes_per_pixel = 8;
+  // The second frame changes a rectangle of the first one, the third frame
+  // changes nothing and the fourth frame only changes the alpha of one pixel.
+  std::vector<uint8_t> frames[4];
+  frames[0] = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  frames[1] = frames[0];
+  std::vector<uint8_t> other = jxl::test::GetSomeTestImage(xsize, ysize, 4, 1);
+  for (size_t y = 5; y < 20; y++) {
+    size_t offset = (y * xsize + 10) * bytes_per_pixel;
+    memcpy(frames[1].data() + offset, other.data() + offset,
+           20 * bytes_per_pixel);
+  }
+  frames[2] = frames[1];
+  frames[3] = frames[1];
+  frames[3][(40 * xsize + 50) * bytes_per_pixel + 6] ^= 0xff;
+
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = JXL_TRUE;
+  basic_info.have_animation = JXL_TRUE;
+  basic_info.animation.tps_numerator = 1000;
+  basic_info.animation.tps_denominator = 1;
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+
+  std::vector<uint8_t> compressed[2];
+  for (int auto_crop = 0; auto_crop < 2; auto_crop++) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameLossless(frame_settings, JXL_TRUE));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_AUTO_CROP, auto_crop));
+    JxlFrameHeader header;
+    JxlEncoderInitFrameHeader(&header);
+    header.duration = 10;
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameHeader(frame_settings, &header));
+    for (const std::vector<uint8_t>& frame : frames) {
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                        frame.data(), frame.size()));
+    }
+    JxlEncoderCloseInput(enc.get());
+    compressed[auto_crop].resize(64);
+    uint8_t* next_out = compressed[auto_crop].data();
+    size_t avail_out = compressed[auto_crop].size();
+    ProcessEncoder(enc.get(), compressed[auto_crop], next_out, avail_out);
+  }
+  EXPECT_LT(compressed[1].size(), compressed[0].size());
+
+  // Without coalescing, the frames are the changed regions.
+  const size_t expected_crops[4][4] = {
+      {0, 0, xsize, ysize}, {10, 5, 20, 15}, {0, 0, 1, 1}, {50, 40, 1, 1}};
+  for (int coalescing = 0; coalescing < 2; coalescing++) {
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_NE(nullptr, dec.get());
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetCoalescing(dec.get(), coalescing ? JXL_TRUE
+                                                            : JXL_FALSE));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(),
+                                        JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+    JxlDecoderSetInput(dec.get(), compressed[1].data(), compressed[1].size());
+    JxlDecoderCloseInput(dec.get());
+    std::vector<uint8_t> pixels;
+    size_t num_frames = 0;
+    for (;;) {
+      JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+      if (status == JXL_DEC_SUCCESS) break;
+      ASSERT_LT(num_frames, 4u);
+      if (status == JXL_DEC_FRAME) {
+        JxlFrameHeader header;
+        EXPECT_EQ(JXL_DEC_SUCCESS,
+                  JxlDecoderGetFrameHeader(dec.get(), &header));
+        if (!coalescing) {
+          const size_t* crop = expected_crops[num_frames];
+          EXPECT_EQ(static_cast<int32_t>(crop[0]), header.layer_info.crop_x0);
+          EXPECT_EQ(static_cast<int32_t>(crop[1]), header.layer_info.crop_y0);
+          EXPECT_EQ(crop[2], header.layer_info.xsize);
+          EXPECT_EQ(crop[3], header.layer_info.ysize);
+        }
+      } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+        size_t buffer_size;
+        EXPECT_EQ(JXL_DEC_SUCCESS,
+                  JxlDecoderImageOutBufferSize(dec.get(), &pixel_format,
+                                               &buffer_size));
+        pixels.resize(buffer_size);
+        EXPECT_EQ(JXL_DEC_SUCCESS,
+                  JxlDecoderSetImageOutBuffer(dec.get(), &pixel_format,
+                                              pixels.data(), pixels.size()));
+      } else if (status == JXL_DEC_FULL_IMAGE) {
+        if (coalescing) {
+          EXPECT_EQ(frames[num_frames], pixels);
+        }
+        num_frames++;
+      } else {
+        FAIL();  // unexpected status
+      }
+    }
+    EXPECT_EQ(4u, num_frames);
+  }
+
+  // Reference slot 3 holds the canvas, so frames can't use it themselves.
+  for (int use_as_source = 0; use_as_source < 2; use_as_source++) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_AUTO_CROP, 1));
+    JxlFrameHeader header;
+    JxlEncoderInitFrameHeader(&header);
+    header.duration = 10;
+    if (use_as_source) {
+      header.layer_info.blend_info.source = 3;
+    } else {
+      header.layer_info.save_as_reference = 3;
+    }
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameHeader(frame_settings, &header));
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      frames[0].data(), frames[0].size()));
+    EXPECT_EQ(JXL_ENC_ERR_API_USAGE, JxlEncoderGetError(enc.get()));
+  }
+}
+
+namespace {
+struct ChunkedInputState {
+  JxlPixelFormat pixel_format;
+  size_t xsize;
+  const std::vector<uint8_t>* pixels;
+  size_t num_requested = 0;
+  size_t num_released = 0;
+};
+
+void GetChunkedColorFormat(void* opaque, JxlPixelFormat* pixel_format) {
+  *pixel_format = static_cast<ChunkedInputState*>(opaque)->pixel_format;
+}
+
+const void* GetChunkedColorData(void* opaque, size_t xpos, size_t ypos,
+                                size_t xsize, size_t ysize,
+                                size_t* row_offset) {
+  auto* state = static_cast<ChunkedInputState*>(opaque);
+  const size_t bytes_per_pixel = 2 * state->pixel_format.num_channels;
+  *row_offset = state->xsize * bytes_per_pixel;
+  state->num_requested++;
+  return state->pixels->data() + ypos * *row_offset + xpos * bytes_per_pixel;
+}
+
+void ReleaseChunkedBuffer(void* opaque, const void* /*buf*/) {
+  static_cast<ChunkedInputState*>(opaque)->num_released++;
+}
+}  // namespace
+
+TEST(EncodeTest, ChunkedFrameTest) {
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+  // Wider than one 2048 pixel chunk, so the frame is pulled in two pieces.
+  size_t xsize = 2100;
+  size_t ysize = 40;
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  std::vector<uint8_t> pixels2(pixels.size());
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = JXL_TRUE;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetCodestreamLevel(enc.get(), 10));
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  JxlEncoderSetFrameLossless(frame_settings, JXL_TRUE);
+  JxlEncoderFrameSettingsSetOption(frame_settings, JXL_ENC_FRAME_SETTING_EFFORT,
+                                   1);
+
+  ChunkedInputState state;
+  state.pixel_format = pixel_format;
+  state.xsize = xsize;
+  state.pixels = &pixels;
+  JxlChunkedFrameInputSource input = {&state,
+                                      GetChunkedColorFormat,
+                                      GetChunkedColorData,
+                                      nullptr,
+                                      nullptr,
+                                      ReleaseChunkedBuffer};
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderAddChunkedFrame(frame_settings, JXL_TRUE, input));
+  // Two chunks, each giving the color channels and the interleaved alpha.
+  EXPECT_EQ(2u, state.num_requested);
+  EXPECT_EQ(state.num_requested, state.num_released);
+
+  std::vector<uint8_t> compressed = std::vector<uint8_t>(100);
+  uint8_t* next_out = compressed.data();
+  size_t avail_out = compressed.size() - (next_out - compressed.data());
+  ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_NE(nullptr, dec.get());
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size());
+  JxlDecoderCloseInput(dec.get());
+  bool checked_frame = false;
+  for (;;) {
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+    if (status == JXL_DEC_ERROR) {
+      FAIL();
+    } else if (status == JXL_DEC_SUCCESS) {
+      break;
+    } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderSetImageOutBuffer(dec.get(), &pixel_format,
+                                            pixels2.data(), pixels2.size()));
+    } else if (status == JXL_DEC_FULL_IMAGE) {
+      EXPECT_EQ(0, memcmp(pixels.data(), pixels2.data(), pixels.size()));
+      checked_frame = true;
+    } else {
+      FAIL();  // unexpected status
+    }
+  }
+  EXPECT_EQ(true, checked_frame);
+}
+
+TEST(EncodeTest, ChunkedFrameAlphaWithoutExtraChannelTest) {
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+  size_t xsize = 64;
+  size_t ysize = 64;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+
+  // Interleaved alpha needs an alpha extra channel in the basic info.
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  ChunkedInputState state;
+  state.pixel_format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  state.xsize = xsize;
+  state.pixels = &pixels;
+  JxlChunkedFrameInputSource input = {&state,
+                                      GetChunkedColorFormat,
+                                      GetChunkedColorData,
+                                      nullptr,
+                                      nullptr,
+                                      ReleaseChunkedBuffer};
+  EXPECT_EQ(JXL_ENC_ERROR,
+            JxlEncoderAddChunkedFrame(frame_settings, JXL_TRUE, input));
+  EXPECT_EQ(JXL_ENC_ERR_API_USAGE, JxlEncoderGetError(enc.get()));
+  EXPECT_EQ(0u, state.num_requested);
+}
+
+namespace {
+size_t WriteToVector(void* opaque, const uint8_t* data, size_t size) {
+  auto* out = static_cast<std::vector<uint8_t>*>(opaque);
+  // Accept at most 1000 bytes per call to exercise partial writes.
+  size = std::min<size_t>(size, 1000);
+  out->insert(out->end(), data, data + size);
+  return size;
+}
+}  // namespace
+
+TEST(EncodeTest, OutputSinkTest) {
+  size_t xsize = 300;
+  size_t ysize = 300;
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = JXL_FALSE;
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+
+  std::vector<uint8_t> outputs[2];
+  for (int use_sink = 0; use_sink < 2; use_sink++) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetCodestreamLevel(enc.get(), 10));
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderUseContainer(enc.get(), JXL_TRUE));
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      pixels.data(), pixels.size()));
+    JxlEncoderCloseInput(enc.get());
+    if (use_sink) {
+      JxlEncoderOutputSink sink = {&outputs[1], WriteToVector};
+      EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetOutputSink(enc.get(), sink));
+      uint8_t* next_out = nullptr;
+      size_t avail_out = 0;
+      EXPECT_EQ(JXL_ENC_ERROR,
+                JxlEncoderProcessOutput(enc.get(), &next_out, &avail_out));
+      EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderFlushInput(enc.get()));
+    } else {
+      outputs[0].resize(64);
+      uint8_t* next_out = outputs[0].data();
+      size_t avail_out = outputs[0].size();
+      ProcessEncoder(enc.get(), outputs[0], next_out, avail_out);
+    }
+  }
+  EXPECT_EQ(outputs[0], outputs[1]);
+}
+
+TEST(EncodeTest, ProcessBatchTest) {
+  // Two single group images that are encoded concurrently, and one larger
+  // image that uses the runner by itself.
+  const size_t sizes[][2] = {{64, 48}, {300, 200}, {256, 256}};
+  const size_t kNumImages = 3;
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+  std::vector<JxlEncoderPtr> encoders;
+  std::vector<uint8_t> expected[kNumImages];
+  for (size_t i = 0; i < kNumImages; i++) {
+    std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(sizes[i][0], sizes[i][1], 4, i);
+    JxlBasicInfo basic_info;
+    jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+    basic_info.xsize = sizes[i][0];
+    basic_info.ysize = sizes[i][1];
+    basic_info.uses_original_profile = JXL_FALSE;
+    for (int batch = 0; batch < 2; batch++) {
+      JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+      EXPECT_NE(nullptr, enc.get());
+      EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetCodestreamLevel(enc.get(), 10));
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+      JxlEncoderFrameSettings* frame_settings =
+          JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+      // Independent settings for each image.
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderSetFrameDistance(frame_settings, 1.0f + i));
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                        pixels.data(), pixels.size()));
+      JxlEncoderCloseInput(enc.get());
+      if (batch) {
+        encoders.push_back(std::move(enc));
+      } else {
+        expected[i].resize(64);
+        uint8_t* next_out = expected[i].data();
+        size_t avail_out = expected[i].size();
+        ProcessEncoder(enc.get(), expected[i], next_out, avail_out);
+      }
+    }
+  }
+
+  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(
+      nullptr, JxlThreadParallelRunnerDefaultNumWorkerThreads());
+  std::vector<JxlEncoder*> batch;
+  for (const JxlEncoderPtr& enc : encoders) batch.push_back(enc.get());
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderProcessBatch(batch.data(), batch.size(),
+                                   JxlThreadParallelRunner, runner.get()));
+  for (size_t i = 0; i < kNumImages; i++) {
+    std::vector<uint8_t> compressed(64);
+    uint8_t* next_out = compressed.data();
+    size_t avail_out = compressed.size();
+    ProcessEncoder(batch[i], compressed, next_out, avail_out);
+    EXPECT_EQ(expected[i], compressed);
+  }
+}
+
+TEST(EncodeTest, ParallelAnimationTest) {
+  // Single group frames, so that the frames are encoded concurrently when
+  // there is a runner. Some of them blend onto or are saved as references,
+  // which only matters for decoding.
+  const size_t xsize = 64;
+  const size_t ysize = 48;
+  const size_t kNumFrames = 6;
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = JXL_FALSE;
+  basic_info.have_animation = JXL_TRUE;
+  basic_info.animation.tps_numerator = 1000;
+  basic_info.animation.tps_denominator = 1;
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+  std::vector<uint8_t> pixels[kNumFrames];
+  for (size_t i = 0; i < kNumFrames; i++) {
+    pixels[i] = jxl::test::GetSomeTestImage(xsize, ysize, 4, i);
+  }
+
+  // 0: no runner, 1: runner, 2: runner with output processed before the
+  // frames are closed, so the last frame is added afterwards.
+  std::vector<uint8_t> outputs[3];
+  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(
+      nullptr, JxlThreadParallelRunnerDefaultNumWorkerThreads());
+  for (int mode = 0; mode < 3; mode++) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    if (mode > 0) {
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderSetParallelRunner(enc.get(), JxlThreadParallelRunner,
+                                            runner.get()));
+    }
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+    outputs[mode].resize(64);
+    uint8_t* next_out = outputs[mode].data();
+    size_t avail_out = outputs[mode].size();
+    for (size_t i = 0; i < kNumFrames; i++) {
+      JxlFrameHeader header;
+      JxlEncoderInitFrameHeader(&header);
+      header.duration = 10 + i;
+      if (i % 3 == 1) {
+        header.layer_info.blend_info.blendmode = JXL_BLEND_ADD;
+        header.layer_info.blend_info.source = 1;
+      }
+      header.layer_info.save_as_reference = (i % 3 == 0) ? 1 : 0;
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderSetFrameHeader(frame_settings, &header));
+      if (mode == 2 && i + 1 == kNumFrames) {
+        ProcessEncoder(enc.get(), outputs[mode], next_out, avail_out);
+      }
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                        pixels[i].data(), pixels[i].size()));
+    }
+    JxlEncoderCloseInput(enc.get());
+    ProcessEncoder(enc.get(), outputs[mode], next_out, avail_out);
+  }
+  EXPECT_EQ(outputs[0], outputs[1]);
+  EXPECT_EQ(outputs[0], outputs[2]);
+}
+
+TEST(EncodeTest, MaxMemoryTest) {
+  const size_t xsize = 300;
+  const size_t ysize = 200;
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = JXL_FALSE;
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+
+  size_t unset_peak = 0;
+  const auto make_encoder = [&](int effort, int64_t max_memory,
+                                JxlEncoderFrameSettings** frame_settings)
+      -> JxlEncoderPtr {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    *frame_settings = JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+    // The basic info is needed for the estimate.
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderEstimatePeakMemory(*frame_settings, &unset_peak));
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  *frame_settings, JXL_ENC_FRAME_SETTING_EFFORT, effort));
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderFrameSettingsSetOption(
+                                   *frame_settings,
+                                   JXL_ENC_FRAME_SETTING_MAX_MEMORY,
+                                   max_memory));
+    return enc;
+  };
+
+  // A slower effort needs more memory.
+  size_t peak7 = 0;
+  size_t peak9 = 0;
+  JxlEncoderFrameSettings* frame_settings;
+  JxlEncoderPtr enc7 = make_encoder(7, -1, &frame_settings);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderEstimatePeakMemory(frame_settings, &peak7));
+  JxlEncoderPtr enc9 = make_encoder(9, -1, &frame_settings);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderEstimatePeakMemory(frame_settings, &peak9));
+  EXPECT_GT(peak7, xsize * ysize * 4 * sizeof(float));
+  EXPECT_GT(peak9, peak7);
+
+  // With a limit in between, effort 9 is lowered to fit it.
+  JxlEncoderPtr enc = make_encoder(9, peak7, &frame_settings);
+  size_t peak = 0;
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderEstimatePeakMemory(frame_settings, &peak));
+  EXPECT_LE(peak, peak7);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                    pixels.data(), pixels.size()));
+  JxlEncoderCloseInput(enc.get());
+  std::vector<uint8_t> compressed(64);
+  uint8_t* next_out = compressed.data();
+  size_t avail_out = compressed.size();
+  ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+  jxl::CodecInOut io;
+  EXPECT_TRUE(jxl::test::DecodeFile(
+      {}, jxl::Span<const uint8_t>(compressed.data(), compressed.size()), &io,
+      /*pool=*/nullptr));
+  EXPECT_EQ(xsize, io.xsize());
+
+  // A limit below the size of the input image can't be met.
+  enc = make_encoder(7, xsize * ysize, &frame_settings);
+  EXPECT_EQ(JXL_ENC_ERROR,
+            JxlEncoderEstimatePeakMemory(frame_settings, &peak));
+  EXPECT_EQ(JXL_ENC_ERR_OOM, JxlEncoderGetError(enc.get()));
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                    pixels.data(), pixels.size()));
+  JxlEncoderCloseInput(enc.get());
+  compressed.resize(64);
+  next_out = compressed.data();
+  avail_out = compressed.size();
+  EXPECT_EQ(JXL_ENC_ERROR,
+            JxlEncoderProcessOutput(enc.get(), &next_out, &avail_out));
+  EXPECT_EQ(JXL_ENC_ERR_OOM, JxlEncoderGetError(enc.get()));
+
+  // Limits must be -1 or fit in a size_t.
+  enc = make_encoder(7, -1, &frame_settings);
+  EXPECT_EQ(JXL_ENC_ERROR,
+            JxlEncoderFrameSettingsSetOption(
+                frame_settings, JXL_ENC_FRAME_SETTING_MAX_MEMORY, -2));
+  if (sizeof(size_t) < sizeof(int64_t)) {
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_MAX_MEMORY,
+                  std::numeric_limits<int64_t>::max()));
+  }
+}
+
+TEST(EncodeTest, FastLosslessTest) {
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+  size_t xsize = 300;
+  size_t ysize = 280;
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  // Keep the high byte of the 16-bit big endian test images.
+  auto get_8bit_image = [&](uint16_t seed) {
+    std::vector<uint8_t> pixels16 =
+        jxl::test::GetSomeTestImage(xsize, ysize, 4, seed);
+    std::vector<uint8_t> pixels8(pixels16.size() / 2);
+    for (size_t i = 0; i < pixels8.size(); i++) pixels8[i] = pixels16[2 * i];
+    return pixels8;
+  };
+  std::vector<uint8_t> pixels = get_8bit_image(0);
+  std::vector<uint8_t> pixels2 = get_8bit_image(1);
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = JXL_TRUE;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  JxlEncoderSetFrameLossless(frame_settings, JXL_TRUE);
+  JxlEncoderFrameSettingsSetOption(frame_settings, JXL_ENC_FRAME_SETTING_EFFORT,
+                                   1);
+
+  // Two frames, so that both the last and a non-last frame header are written
+  // by the fast lossless encoder.
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                    pixels.data(), pixels.size()));
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                    pixels2.data(), pixels2.size()));
+  // The alpha channel was already taken from the interleaved pixels.
+  EXPECT_EQ(JXL_ENC_ERROR,
+            JxlEncoderSetExtraChannelBuffer(frame_settings, &pixel_format,
+                                            pixels2.data(), pixels2.size(), 0));
+  JxlEncoderCloseInput(enc.get());
+
+  std::vector<uint8_t> compressed = std::vector<uint8_t>(64);
+  uint8_t* next_out = compressed.data();
+  size_t avail_out = compressed.size() - (next_out - compressed.data());
+  ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_NE(nullptr, dec.get());
+  // Non-coalesced decoding, so that the first frame is returned as well.
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetCoalescing(dec.get(), JXL_FALSE));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size());
+  JxlDecoderCloseInput(dec.get());
+
+  std::vector<uint8_t> decoded(pixels.size());
+  size_t num_frames = 0;
+  for (;;) {
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+    if (status == JXL_DEC_ERROR) {
+      FAIL();
+    } else if (status == JXL_DEC_SUCCESS) {
+      break;
+    } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderSetImageOutBuffer(dec.get(), &pixel_format,
+                                            decoded.data(), decoded.size()));
+    } else if (status == JXL_DEC_FULL_IMAGE) {
+      const std::vector<uint8_t>& expected =
+          num_frames == 0 ? pixels : pixels2;
+      EXPECT_EQ(0, memcmp(expected.data(), decoded.data(), expected.size()));
+      num_frames++;
+    } else {
+      FAIL();  // unexpected status
+    }
+  }
+  EXPECT_EQ(2u, num_frames);
+}
+
+TEST(EncodeTest, FastLossless16BitTest) {
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+  size_t xsize = 300;
+  size_t ysize = 280;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  std::vector<uint8_t> pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = JXL_TRUE;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  JxlEncoderSetFrameLossless(frame_settings, JXL_TRUE);
+  JxlEncoderFrameSettingsSetOption(frame_settings, JXL_ENC_FRAME_SETTING_EFFORT,
+                                   1);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                    pixels.data(), pixels.size()));
+  JxlEncoderCloseInput(enc.get());
+
+  std::vector<uint8_t> compressed = std::vector<uint8_t>(64);
+  uint8_t* next_out = compressed.data();
+  size_t avail_out = compressed.size() - (next_out - compressed.data());
+  ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_NE(nullptr, dec.get());
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size());
+  JxlDecoderCloseInput(dec.get());
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  std::vector<uint8_t> decoded(pixels.size());
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetImageOutBuffer(dec.get(), &pixel_format,
+                                        decoded.data(), decoded.size()));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(0, memcmp(pixels.data(), decoded.data(), pixels.size()));
+}
+
+namespace {
+JxlParallelRetCode FailingRunner(void* /*runner_opaque*/,
+                                 void* /*jpegxl_opaque*/,
+                                 JxlParallelRunInit /*init*/,
+                                 JxlParallelRunFunction /*func*/,
+                                 uint32_t /*start_range*/,
+                                 uint32_t /*end_range*/) {
+  return -1;
+}
+}  // namespace
+
+TEST(EncodeTest, FastLosslessRunnerErrorTest) {
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetParallelRunner(enc.get(), FailingRunner, nullptr));
+
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+  size_t xsize = 300;
+  size_t ysize = 280;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  std::vector<uint8_t> pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = JXL_TRUE;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  JxlEncoderSetFrameLossless(frame_settings, JXL_TRUE);
+  JxlEncoderFrameSettingsSetOption(frame_settings, JXL_ENC_FRAME_SETTING_EFFORT,
+                                   1);
+  // The failure of the runner is reported, rather than aborting. Without the
+  // fast encoder on this platform, it is the regular encoder that fails.
+  JxlEncoderStatus status = JxlEncoderAddImageFrame(
+      frame_settings, &pixel_format, pixels.data(), pixels.size());
+  if (status == JXL_ENC_SUCCESS) {
+    JxlEncoderCloseInput(enc.get());
+    std::vector<uint8_t> compressed(1 << 20);
+    uint8_t* next_out = compressed.data();
+    size_t avail_out = compressed.size();
+    status = JxlEncoderProcessOutput(enc.get(), &next_out, &avail_out);
+  }
+  EXPECT_EQ(JXL_ENC_ERROR, status);
+}
+
 TEST(EncodeTest, BoxTest) {
   // Test with uncompressed boxes and with brob boxes
   for (int compress_box = 0; compress_box <= 1; ++compress_box) {
@@ -1292,6 +2100,198 @@ TEST(EncodeTest, BoxTest) {
   }
 }
 
+namespace {
+
+// Encodes an animation of 5 frames with durations 10 to 14, indexing the
+// frames in indexed and blending the frames in blended. Returns the status of
+// processing the output.
+JxlEncoderStatus EncodeIndexedAnimation(const std::vector<size_t>& indexed,
+                                        const std::vector<size_t>& blended,
+                                        std::vector<uint8_t>* compressed) {
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  size_t xsize = 32;
+  size_t ysize = 32;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT8, JXL_BIG_ENDIAN, 0};
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.have_animation = true;
+  basic_info.animation.tps_numerator = 1000;
+  basic_info.animation.tps_denominator = 1;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  for (size_t i = 0; i < 5; ++i) {
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+    JxlFrameHeader header;
+    JxlEncoderInitFrameHeader(&header);
+    header.duration = 10 + i;
+    if (std::count(blended.begin(), blended.end(), i)) {
+      header.layer_info.blend_info.blendmode = JXL_BLEND_BLEND;
+    }
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameHeader(frame_settings, &header));
+    if (std::count(indexed.begin(), indexed.end(), i)) {
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderFrameSettingsSetOption(frame_settings,
+                                                 JXL_ENC_FRAME_INDEX_BOX, 1));
+    }
+    std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, 3, i);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      pixels.data(), pixels.size()));
+  }
+  JxlEncoderCloseInput(enc.get());
+  compressed->resize(64);
+  uint8_t* next_out = compressed->data();
+  size_t avail_out = compressed->size();
+  JxlEncoderStatus process_result = JXL_ENC_NEED_MORE_OUTPUT;
+  while (process_result == JXL_ENC_NEED_MORE_OUTPUT) {
+    process_result = JxlEncoderProcessOutput(enc.get(), &next_out, &avail_out);
+    size_t offset = next_out - compressed->data();
+    compressed->resize(process_result == JXL_ENC_NEED_MORE_OUTPUT
+                           ? compressed->size() * 2
+                           : offset);
+    next_out = compressed->data() + offset;
+    avail_out = compressed->size() - offset;
+  }
+  return process_result;
+}
+
+}  // namespace
+
+TEST(EncodeTest, FrameIndexBoxTest) {
+  std::vector<uint8_t> compressed;
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            EncodeIndexedAnimation({0, 3}, {1, 2}, &compressed));
+
+  // The index box comes after the codestream.
+  size_t codestream_size = 0;
+  std::vector<uint8_t> index;
+  for (size_t pos = 0; pos + 8 <= compressed.size();) {
+    size_t box_size = LoadBE32(compressed.data() + pos);
+    ASSERT_GE(box_size, 8u);
+    if (!memcmp(compressed.data() + pos + 4, "jxlp", 4)) {
+      EXPECT_TRUE(index.empty());
+      codestream_size += box_size - 12;
+    } else if (!memcmp(compressed.data() + pos + 4, "jxli", 4)) {
+      index.assign(compressed.begin() + pos + 8,
+                   compressed.begin() + pos + box_size);
+    }
+    pos += box_size;
+  }
+  ASSERT_GT(index.size(), 8u);
+  size_t pos = 0;
+  EXPECT_EQ(2u, jxl::DecodeVarInt(index.data(), index.size(), &pos));
+  // A tick lasts TNUM / TDEN seconds.
+  EXPECT_EQ(1u, LoadBE32(index.data() + pos));
+  EXPECT_EQ(1000u, LoadBE32(index.data() + pos + 4));
+  pos += 8;
+  uint64_t offset0 = jxl::DecodeVarInt(index.data(), index.size(), &pos);
+  EXPECT_EQ(10u + 11u + 12u,
+            jxl::DecodeVarInt(index.data(), index.size(), &pos));
+  EXPECT_EQ(3u, jxl::DecodeVarInt(index.data(), index.size(), &pos));
+  uint64_t offset3 = jxl::DecodeVarInt(index.data(), index.size(), &pos);
+  EXPECT_EQ(13u + 14u, jxl::DecodeVarInt(index.data(), index.size(), &pos));
+  EXPECT_EQ(2u, jxl::DecodeVarInt(index.data(), index.size(), &pos));
+  EXPECT_EQ(index.size(), pos);
+  EXPECT_GT(offset0, 0u);
+  EXPECT_GT(offset3, 0u);
+  EXPECT_LT(offset0 + offset3, codestream_size);
+
+  // All frames still decode.
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FRAME));
+  JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size());
+  JxlDecoderCloseInput(dec.get());
+  size_t num_frames = 0;
+  JxlDecoderStatus status;
+  while ((status = JxlDecoderProcessInput(dec.get())) == JXL_DEC_FRAME) {
+    num_frames++;
+  }
+  EXPECT_EQ(JXL_DEC_SUCCESS, status);
+  EXPECT_EQ(5u, num_frames);
+
+  // With input given one byte at a time, the decoder consumes the index box as
+  // it arrives, so the caller does not need to keep it.
+  dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_BOX));
+  size_t begin = 0;
+  size_t end = 0;
+  bool in_index = false;
+  bool index_seen = false;
+  while ((status = JxlDecoderProcessInput(dec.get())) != JXL_DEC_SUCCESS) {
+    if (status == JXL_DEC_BOX) {
+      JxlBoxType type;
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderGetBoxType(dec.get(), type, JXL_FALSE));
+      in_index = !memcmp(type, "jxli", 4);
+      index_seen |= in_index;
+      continue;
+    }
+    ASSERT_EQ(JXL_DEC_NEED_MORE_INPUT, status);
+    size_t remaining = JxlDecoderReleaseInput(dec.get());
+    if (in_index) {
+      EXPECT_EQ(0u, remaining);
+    }
+    ASSERT_LT(end, compressed.size());
+    begin = end - remaining;
+    end++;
+    JxlDecoderSetInput(dec.get(), compressed.data() + begin, end - begin);
+    if (end == compressed.size()) JxlDecoderCloseInput(dec.get());
+  }
+  EXPECT_TRUE(index_seen);
+
+  // Frames that blend are not keyframes, and the first frame must be indexed
+  // as well.
+  EXPECT_EQ(JXL_ENC_ERROR, EncodeIndexedAnimation({0, 2}, {2}, &compressed));
+  EXPECT_EQ(JXL_ENC_ERROR, EncodeIndexedAnimation({3}, {}, &compressed));
+}
+
+// Only the frames that are added decide whether the container is used for the
+// index box.
+TEST(EncodeTest, FrameIndexBoxUnusedSettingsTest) {
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+  JxlEncoderFrameSettings* unused_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderFrameSettingsSetOption(unused_settings,
+                                             JXL_ENC_FRAME_INDEX_BOX, 1));
+  size_t xsize = 32;
+  size_t ysize = 32;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT8, JXL_BIG_ENDIAN, 0};
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                    pixels.data(), pixels.size()));
+  JxlEncoderCloseInput(enc.get());
+  std::vector<uint8_t> compressed = std::vector<uint8_t>(64);
+  uint8_t* next_out = compressed.data();
+  size_t avail_out = compressed.size() - (next_out - compressed.data());
+  ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+  ASSERT_GE(compressed.size(), 2u);
+  // A bare codestream.
+  EXPECT_EQ(0xFF, compressed[0]);
+  EXPECT_EQ(0x0A, compressed[1]);
+}
+
 #if JPEGXL_ENABLE_JPEG  // Loading .jpg files requires libjpeg support.
 TEST(EncodeTest, JXL_TRANSCODE_JPEG_TEST(JPEGFrameTest)) {
   for (int skip_basic_info = 0; skip_basic_info < 2; skip_basic_info++) {
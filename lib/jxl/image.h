@@ -62,6 +62,12 @@ struct PlaneBase {
     // better locality because that would invalidate the image contents.
   }
 
+  // Whether ShrinkTo(xsize, ysize) is allowed, i.e. the memory was allocated
+  // for at least that size.
+  bool HasCapacity(const size_t xsize, const size_t ysize) const {
+    return xsize <= orig_xsize_ && ysize <= orig_ysize_;
+  }
+
   // How many pixels.
   JXL_INLINE size_t xsize() const { return xsize_; }
   JXL_INLINE size_t ysize() const { return ysize_; }
@@ -154,6 +160,16 @@ class Plane : public PlaneBase {
     InitializePadding(sizeof(T), Padding::kUnaligned);
   }
 
+  // Changes the size to xsize x ysize, keeping the current memory if it is
+  // large enough. The contents are undefined afterwards, as for a new image.
+  void ReuseOrAllocate(const size_t xsize, const size_t ysize) {
+    if (HasCapacity(xsize, ysize)) {
+      ShrinkTo(xsize, ysize);
+    } else {
+      *this = Plane(xsize, ysize);
+    }
+  }
+
   JXL_INLINE T* Row(const size_t y) { return static_cast<T*>(VoidRow(y)); }
 
   // Returns pointer to const (see above).
@@ -453,6 +469,17 @@ class Image3 {
     }
   }
 
+  bool HasCapacity(const size_t xsize, const size_t ysize) const {
+    return planes_[0].HasCapacity(xsize, ysize);
+  }
+
+  // See Plane::ReuseOrAllocate.
+  void ReuseOrAllocate(const size_t xsize, const size_t ysize) {
+    for (PlaneT& plane : planes_) {
+      plane.ReuseOrAllocate(xsize, ysize);
+    }
+  }
+
   // Sizes of all three images are guaranteed to be equal.
   JXL_INLINE size_t xsize() const { return planes_[0].xsize(); }
   JXL_INLINE size_t ysize() const { return planes_[0].ysize(); }
@@ -340,6 +340,26 @@ TEST(JxlTest, RoundtripRGBToGrayscale) {
               IsSlightlyBelow(1.7));
 }
 
+TEST(JxlTest, RoundtripTargetBitrate) {
+  ThreadPoolInternal pool(4);
+  const PaddedBytes orig = ReadTestData("jxl/flower/flower.png");
+  CodecInOut io;
+  ASSERT_TRUE(SetFromBytes(Span<const uint8_t>(orig), &io, &pool));
+  io.ShrinkTo(256, 256);
+
+  CompressParams cparams;
+  cparams.speed_tier = SpeedTier::kSquirrel;
+  cparams.target_bitrate = 1.0f;
+
+  CodecInOut io2;
+  const size_t target_size = 256 * 256 / kBitsPerByte;
+  EXPECT_NEAR(Roundtrip(&io, cparams, {}, &pool, &io2), target_size,
+              target_size / 10);
+  EXPECT_LE(ButteraugliDistance(io, io2, cparams.ba_params, GetJxlCms(),
+                                /*distmap=*/nullptr, &pool),
+            3.0);
+}
+
 TEST(JxlTest, RoundtripLargeFast) {
   ThreadPoolInternal pool(8);
   const PaddedBytes orig = ReadTestData("jxl/flower/flower.png");
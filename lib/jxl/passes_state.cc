@@ -22,12 +22,13 @@ Status InitializePassesSharedState(const FrameHeader& frame_header,
 
   const FrameDimensions& frame_dim = shared->frame_dim;
 
-  shared->ac_strategy =
-      AcStrategyImage(frame_dim.xsize_blocks, frame_dim.ysize_blocks);
-  shared->raw_quant_field =
-      ImageI(frame_dim.xsize_blocks, frame_dim.ysize_blocks);
-  shared->epf_sharpness =
-      ImageB(frame_dim.xsize_blocks, frame_dim.ysize_blocks);
+  // The per-block images of a previous frame are reused if large enough.
+  shared->ac_strategy.ReuseOrAllocate(frame_dim.xsize_blocks,
+                                      frame_dim.ysize_blocks);
+  shared->raw_quant_field.ReuseOrAllocate(frame_dim.xsize_blocks,
+                                          frame_dim.ysize_blocks);
+  shared->epf_sharpness.ReuseOrAllocate(frame_dim.xsize_blocks,
+                                        frame_dim.ysize_blocks);
   shared->cmap = ColorCorrelationMap(frame_dim.xsize, frame_dim.ysize);
 
   // In the decoder, we allocate coeff orders afterwards, when we know how many
@@ -41,7 +42,8 @@ Status InitializePassesSharedState(const FrameHeader& frame_header,
                                 kCoeffOrderMaxSize);
   }
 
-  shared->quant_dc = ImageB(frame_dim.xsize_blocks, frame_dim.ysize_blocks);
+  shared->quant_dc.ReuseOrAllocate(frame_dim.xsize_blocks,
+                                   frame_dim.ysize_blocks);
 
   bool use_dc_frame = !!(frame_header.flags & FrameHeader::kUseDcFrame);
   if (!encoder && use_dc_frame) {
@@ -59,8 +61,8 @@ Status InitializePassesSharedState(const FrameHeader& frame_header,
     }
     ZeroFillImage(&shared->quant_dc);
   } else {
-    shared->dc_storage =
-        Image3F(frame_dim.xsize_blocks, frame_dim.ysize_blocks);
+    shared->dc_storage.ReuseOrAllocate(frame_dim.xsize_blocks,
+                                       frame_dim.ysize_blocks);
     shared->dc = &shared->dc_storage;
   }
 
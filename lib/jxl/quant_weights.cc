@@ -1181,6 +1181,16 @@ DequantMatrices::DequantMatrices() {
   }
 }
 
+void DequantMatrices::ResetToDefault() {
+  computed_mask_ = 0;
+  for (size_t c = 0; c < 3; c++) {
+    dc_quant_[c] = kDCQuant[c];
+    inv_dc_quant_[c] = kInvDCQuant[c];
+  }
+  encodings_.clear();
+  encodings_.resize(size_t(QuantTable::kNum), QuantEncoding::Library(0));
+}
+
 Status DequantMatrices::EnsureComputed(uint32_t acs_mask) {
   const QuantEncoding* library = Library();
 
@@ -365,6 +365,10 @@ class DequantMatrices {
 
   DequantMatrices();
 
+  // Same as assigning DequantMatrices(), but keeps the memory of the computed
+  // tables for reuse.
+  void ResetToDefault();
+
   static const QuantEncoding* Library();
 
   typedef std::array<QuantEncodingInternal, kNumPredefinedTables * kNum>
@@ -26,6 +26,11 @@ class LowMemoryRenderPipeline final : public RenderPipeline {
 
   void ClearDone(size_t i) override { group_border_assigner_.ClearDone(i); }
 
+  bool GetGroupBorder(std::pair<size_t, size_t>* border) const override {
+    *border = group_border_;
+    return true;
+  }
+
   void Init() override;
 
   void EnsureBordersStorage();
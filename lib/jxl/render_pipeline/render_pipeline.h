@@ -102,6 +102,14 @@ class RenderPipeline {
 
   virtual void ClearDone(size_t i) {}
 
+  // Returns true if each group is rendered as soon as its input is ready,
+  // except for a border of `*border` pixels, in frame coordinates, that also
+  // needs the input of the neighbouring groups. Returns false if rendering
+  // needs the input of all the groups.
+  virtual bool GetGroupBorder(std::pair<size_t, size_t>* border) const {
+    return false;
+  }
+
  protected:
   std::vector<std::unique_ptr<RenderPipelineStage>> stages_;
   // Shifts for every channel at the input of each stage.
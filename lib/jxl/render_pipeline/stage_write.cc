@@ -34,12 +34,15 @@ using hwy::HWY_NAMESPACE::ShiftRightSame;
 class WriteToOutputStage : public RenderPipelineStage {
  public:
   WriteToOutputStage(const ImageOutput& main_output, size_t width,
-                     size_t height, bool has_alpha, bool unpremul_alpha,
-                     size_t alpha_c, Orientation undo_orientation,
+                     size_t height, const Rect& crop, size_t downsampling,
+                     bool has_alpha, bool unpremul_alpha, size_t alpha_c,
+                     Orientation undo_orientation,
                      const std::vector<ImageOutput>& extra_output)
       : RenderPipelineStage(RenderPipelineStage::Settings()),
         width_(width),
         height_(height),
+        crop_(crop),
+        downsampling_(downsampling),
         main_(main_output),
         num_color_(main_.num_channels_ < 3 ? 1 : 3),
         want_alpha_(main_.num_channels_ == 2 || main_.num_channels_ == 4),
@@ -80,6 +83,22 @@ class WriteToOutputStage : public RenderPipelineStage {
                   size_t thread_id) const final {
     JXL_DASSERT(xextra == 0);
     JXL_DASSERT(main_.run_opaque_ || main_.buffer_);
+    // Offset of the first pixel to write in the input rows.
+    size_t xoffset = 0;
+    if (crop_.xsize() != 0) {
+      if (ypos < crop_.y0() || xpos + xsize <= crop_.x0()) return;
+      ypos -= crop_.y0();
+      if (xpos < crop_.x0()) {
+        xoffset = crop_.x0() - xpos;
+        xsize -= xoffset;
+        xpos = crop_.x0();
+      }
+      xpos -= crop_.x0();
+    }
+    if (downsampling_ > 1) {
+      ProcessSampledRow(input_rows, xoffset, xsize, xpos, ypos, thread_id);
+      return;
+    }
     if (ypos >= height_) return;
     if (xpos >= width_) return;
     if (flip_y_) {
@@ -92,10 +111,11 @@ class WriteToOutputStage : public RenderPipelineStage {
 
       const float* line_buffers[4];
       for (size_t c = 0; c < num_color_; c++) {
-        line_buffers[c] = GetInputRow(input_rows, c, 0) + x0;
+        line_buffers[c] = GetInputRow(input_rows, c, 0) + xoffset + x0;
       }
       if (has_alpha_) {
-        line_buffers[num_color_] = GetInputRow(input_rows, alpha_c_, 0) + x0;
+        line_buffers[num_color_] =
+            GetInputRow(input_rows, alpha_c_, 0) + xoffset + x0;
       } else {
         // opaque_alpha_ is a way to set all values to 1.0f.
         line_buffers[num_color_] = opaque_alpha_.data();
@@ -105,7 +125,8 @@ class WriteToOutputStage : public RenderPipelineStage {
       }
       OutputBuffers(main_, thread_id, ypos, xstart, len, line_buffers);
       for (const auto& extra : extra_channels_) {
-        line_buffers[0] = GetInputRow(input_rows, extra.channel_index_, 0) + x0;
+        line_buffers[0] =
+            GetInputRow(input_rows, extra.channel_index_, 0) + xoffset + x0;
         OutputBuffers(extra, thread_id, ypos, xstart, len, line_buffers);
       }
     }
@@ -126,6 +147,73 @@ class WriteToOutputStage : public RenderPipelineStage {
   const char* GetName() const override { return "WritePixelCB"; }
 
  private:
+  // Position in the crop region, of size `size`, of the pixel that is written
+  // at downsampled position `pos`: the center of its block, or the last pixel
+  // of the region for a block that is cut by the region edge.
+  size_t SamplePos(size_t pos, size_t size) const {
+    return std::min(pos * downsampling_ + downsampling_ / 2, size - 1);
+  }
+
+  // Returns the first downsampled position whose pixel is at or after `x`.
+  size_t FirstSampleFrom(size_t x, size_t size, size_t num_samples) const {
+    size_t pos = x / downsampling_;
+    if (pos < num_samples && SamplePos(pos, size) < x) pos++;
+    return std::min(pos, num_samples);
+  }
+
+  void SampleRow(const float* row, size_t xpos, size_t first, size_t len,
+                 float* JXL_RESTRICT out) const {
+    for (size_t i = 0; i < len; i++) {
+      out[i] = row[SamplePos(first + i, crop_.xsize()) - xpos];
+    }
+  }
+
+  // Like ProcessRow, for the pixels of the row that are kept when
+  // downsampling. `xpos` and `ypos` are relative to the crop region, and the
+  // first pixel of the row is at `xoffset` in the input rows.
+  void ProcessSampledRow(const RowInfo& input_rows, size_t xoffset,
+                         size_t xsize, size_t xpos, size_t ypos,
+                         size_t thread_id) const {
+    size_t out_y = ypos / downsampling_;
+    if (out_y >= height_ || SamplePos(out_y, crop_.ysize()) != ypos) return;
+    if (flip_y_) {
+      out_y = height_ - 1u - out_y;
+    }
+    size_t begin = FirstSampleFrom(xpos, crop_.xsize(), width_);
+    size_t end = FirstSampleFrom(xpos + xsize, crop_.xsize(), width_);
+    float* sampled[4];
+    for (size_t c = 0; c < 4; c++) {
+      sampled[c] =
+          reinterpret_cast<float*>(temp_sampled_[thread_id * 4 + c].get());
+    }
+    for (size_t x0 = begin; x0 < end; x0 += kMaxPixelsPerCall) {
+      size_t len = std::min<size_t>(kMaxPixelsPerCall, end - x0);
+      const float* line_buffers[4];
+      for (size_t c = 0; c < num_color_; c++) {
+        SampleRow(GetInputRow(input_rows, c, 0) + xoffset, xpos, x0, len,
+                  sampled[c]);
+        line_buffers[c] = sampled[c];
+      }
+      if (has_alpha_) {
+        SampleRow(GetInputRow(input_rows, alpha_c_, 0) + xoffset, xpos, x0,
+                  len, sampled[num_color_]);
+        line_buffers[num_color_] = sampled[num_color_];
+      } else {
+        line_buffers[num_color_] = opaque_alpha_.data();
+      }
+      if (has_alpha_ && want_alpha_ && unpremul_alpha_) {
+        UnpremulAlpha(thread_id, len, line_buffers);
+      }
+      OutputBuffers(main_, thread_id, out_y, x0, len, line_buffers);
+      for (const auto& extra : extra_channels_) {
+        SampleRow(GetInputRow(input_rows, extra.channel_index_, 0) + xoffset,
+                  xpos, x0, len, sampled[0]);
+        line_buffers[0] = sampled[0];
+        OutputBuffers(extra, thread_id, out_y, x0, len, line_buffers);
+      }
+    }
+  }
+
   struct Output {
     Output(const ImageOutput& image_out)
         : pixel_callback_(image_out.callback),
@@ -170,6 +258,12 @@ class WriteToOutputStage : public RenderPipelineStage {
       temp = AllocateArray(sizeof(float) * kMaxPixelsPerCall *
                            main_.num_channels_);
     }
+    if (downsampling_ > 1) {
+      temp_sampled_.resize(num_threads * 4);
+      for (CacheAlignedUniquePtr& temp : temp_sampled_) {
+        temp = AllocateArray(sizeof(float) * kMaxPixelsPerCall);
+      }
+    }
     if ((has_alpha_ && want_alpha_ && unpremul_alpha_) || flip_x_) {
       temp_in_.resize(num_threads * main_.num_channels_);
       for (CacheAlignedUniquePtr& temp : temp_in_) {
@@ -443,6 +537,8 @@ class WriteToOutputStage : public RenderPipelineStage {
   static constexpr size_t kMaxPixelsPerCall = 1024;
   size_t width_;
   size_t height_;
+  Rect crop_;
+  size_t downsampling_;
   Output main_;  // color + alpha
   size_t num_color_;
   bool want_alpha_;
@@ -456,17 +552,19 @@ class WriteToOutputStage : public RenderPipelineStage {
   std::vector<float> opaque_alpha_;
   std::vector<CacheAlignedUniquePtr> temp_in_;
   std::vector<CacheAlignedUniquePtr> temp_out_;
+  std::vector<CacheAlignedUniquePtr> temp_sampled_;
 };
 
 constexpr size_t WriteToOutputStage::kMaxPixelsPerCall;
 
 std::unique_ptr<RenderPipelineStage> GetWriteToOutputStage(
-    const ImageOutput& main_output, size_t width, size_t height, bool has_alpha,
-    bool unpremul_alpha, size_t alpha_c, Orientation undo_orientation,
+    const ImageOutput& main_output, size_t width, size_t height,
+    const Rect& crop, size_t downsampling, bool has_alpha, bool unpremul_alpha,
+    size_t alpha_c, Orientation undo_orientation,
     std::vector<ImageOutput>& extra_output) {
   return jxl::make_unique<WriteToOutputStage>(
-      main_output, width, height, has_alpha, unpremul_alpha, alpha_c,
-      undo_orientation, extra_output);
+      main_output, width, height, crop, downsampling, has_alpha, unpremul_alpha,
+      alpha_c, undo_orientation, extra_output);
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -588,12 +686,13 @@ std::unique_ptr<RenderPipelineStage> GetWriteToImage3FStage(Image3F* image) {
 }
 
 std::unique_ptr<RenderPipelineStage> GetWriteToOutputStage(
-    const ImageOutput& main_output, size_t width, size_t height, bool has_alpha,
-    bool unpremul_alpha, size_t alpha_c, Orientation undo_orientation,
+    const ImageOutput& main_output, size_t width, size_t height,
+    const Rect& crop, size_t downsampling, bool has_alpha, bool unpremul_alpha,
+    size_t alpha_c, Orientation undo_orientation,
     std::vector<ImageOutput>& extra_output) {
   return HWY_DYNAMIC_DISPATCH(GetWriteToOutputStage)(
-      main_output, width, height, has_alpha, unpremul_alpha, alpha_c,
-      undo_orientation, extra_output);
+      main_output, width, height, crop, downsampling, has_alpha, unpremul_alpha,
+      alpha_c, undo_orientation, extra_output);
 }
 
 }  // namespace jxl
@@ -20,10 +20,15 @@ std::unique_ptr<RenderPipelineStage> GetWriteToImageBundleStage(
 // Gets a stage to write color channels to an Image3F.
 std::unique_ptr<RenderPipelineStage> GetWriteToImage3FStage(Image3F* image);
 
-// Gets a stage to write to a pixel callback or image buffer.
+// Gets a stage to write to a pixel callback or image buffer. If `crop` is not
+// empty, only the pixels inside it are written, at coordinates relative to its
+// origin, and `width` and `height` are its dimensions. If `downsampling` is
+// larger than 1, `crop` must not be empty and only the center pixel of each
+// `downsampling` x `downsampling` block of it is written.
 std::unique_ptr<RenderPipelineStage> GetWriteToOutputStage(
-    const ImageOutput& main_output, size_t width, size_t height, bool has_alpha,
-    bool unpremul_alpha, size_t alpha_c, Orientation undo_orientation,
+    const ImageOutput& main_output, size_t width, size_t height,
+    const Rect& crop, size_t downsampling, bool has_alpha, bool unpremul_alpha,
+    size_t alpha_c, Orientation undo_orientation,
     std::vector<ImageOutput>& extra_output);
 
 }  // namespace jxl
@@ -7,6 +7,9 @@
 
 #include <string.h>
 
+#include <algorithm>
+#include <vector>
+
 #include "lib/threads/thread_parallel_runner_internal.h"
 
 namespace {
@@ -84,6 +87,59 @@ void* JxlThreadParallelRunnerCreate(const JxlMemoryManager* memory_manager,
   return runner;
 }
 
+void* JxlThreadParallelRunnerCreateWithOptions(
+    const JxlMemoryManager* memory_manager,
+    const JxlThreadParallelRunnerOptions* options) {
+  if (options == nullptr) return nullptr;
+  if (options->num_cpus != 0 && options->cpus == nullptr) return nullptr;
+  JxlMemoryManager local_memory_manager;
+  if (!ThreadMemoryManagerInit(&local_memory_manager, memory_manager))
+    return nullptr;
+
+  std::vector<int> cpus(options->cpus, options->cpus + options->num_cpus);
+  std::vector<int> cpu_nodes;
+  if (options->cpu_nodes) {
+    cpu_nodes.assign(options->cpu_nodes,
+                     options->cpu_nodes + options->num_cpus);
+  }
+  void* alloc = ThreadMemoryManagerAlloc(&local_memory_manager,
+                                         sizeof(jpegxl::ThreadParallelRunner));
+  if (!alloc) return nullptr;
+  // Placement new constructor on allocated memory
+  jpegxl::ThreadParallelRunner* runner =
+      new (alloc) jpegxl::ThreadParallelRunner(
+          options->num_worker_threads, cpus, cpu_nodes,
+          options->numa_partition != 0);
+  runner->memory_manager = local_memory_manager;
+
+  return runner;
+}
+
+void JxlThreadParallelRunnerSetStatsEnabled(void* runner_opaque,
+                                            JXL_BOOL enabled) {
+  static_cast<jpegxl::ThreadParallelRunner*>(runner_opaque)
+      ->SetStatsEnabled(enabled != 0);
+}
+
+void JxlThreadParallelRunnerGetStats(
+    const void* runner_opaque, JxlThreadParallelRunnerStats* stats,
+    JxlThreadParallelRunnerThreadStats* threads, size_t num_threads) {
+  const jpegxl::ThreadParallelRunner::Stats runner_stats =
+      static_cast<const jpegxl::ThreadParallelRunner*>(runner_opaque)
+          ->GetStats();
+  stats->num_calls = runner_stats.num_calls;
+  stats->num_tasks = runner_stats.num_tasks;
+  stats->wall_ns = runner_stats.wall_ns;
+  stats->num_threads = runner_stats.threads.size();
+  for (size_t i = 0; i < std::min(num_threads, runner_stats.threads.size());
+       ++i) {
+    threads[i].num_tasks = runner_stats.threads[i].num_tasks;
+    threads[i].busy_ns = runner_stats.threads[i].busy_ns;
+    threads[i].idle_ns = runner_stats.threads[i].idle_ns;
+    threads[i].wake_ns = runner_stats.threads[i].wake_ns;
+  }
+}
+
 void JxlThreadParallelRunnerDestroy(void* runner_opaque) {
   jpegxl::ThreadParallelRunner* runner =
       reinterpret_cast<jpegxl::ThreadParallelRunner*>(runner_opaque);
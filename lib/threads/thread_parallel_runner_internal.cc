@@ -6,6 +6,14 @@
 #include "lib/threads/thread_parallel_runner_internal.h"
 
 #include <algorithm>
+#include <chrono>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#endif
 
 #if defined(ADDRESS_SANITIZER) || defined(MEMORY_SANITIZER) || \
     defined(THREAD_SANITIZER)
@@ -48,6 +56,46 @@ bool Abort() {
   do {                        \
   } while (0)
 #endif
+
+// Returns the NUMA node of `cpu`, or 0 if unknown.
+int CpuNode(int cpu) {
+#if defined(__linux__)
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR* dir = opendir(path);
+  if (dir == nullptr) return 0;
+  int node = 0;
+  while (const dirent* entry = readdir(dir)) {
+    if (sscanf(entry->d_name, "node%d", &node) == 1) break;
+    node = 0;
+  }
+  closedir(dir);
+  return node;
+#else
+  (void)cpu;
+  return 0;
+#endif
+}
+
+// Restricts the calling thread to `cpu`, where supported.
+void PinToCpu(int cpu) {
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  // Best effort: the CPU may not be available to the process.
+  (void)pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+  (void)cpu;
+#endif
+}
+
+uint64_t NowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
 }  // namespace
 
 namespace jpegxl {
@@ -64,6 +112,9 @@ JxlParallelRetCode ThreadParallelRunner::Runner(
   int ret = init(jpegxl_opaque, std::max<size_t>(self->num_worker_threads_, 1));
   if (ret != 0) return ret;
 
+  const bool stats_enabled = self->stats_enabled_;
+  if (stats_enabled) self->call_start_ns_ = NowNanos();
+
   // Use a sequential run when num_worker_threads_ is zero since we have no
   // worker threads.
   if (self->num_worker_threads_ == 0) {
@@ -71,6 +122,12 @@ JxlParallelRetCode ThreadParallelRunner::Runner(
     for (uint32_t task = start_range; task < end_range; ++task) {
       func(jpegxl_opaque, task, thread);
     }
+    if (stats_enabled) {
+      const uint64_t wall_ns = NowNanos() - self->call_start_ns_;
+      self->thread_slots_[0].call_busy_ns = wall_ns;
+      self->thread_slots_[0].stats.num_tasks += end_range - start_range;
+      self->RecordCall(end_range - start_range, wall_ns);
+    }
     return 0;
   }
 
@@ -87,11 +144,16 @@ JxlParallelRetCode ThreadParallelRunner::Runner(
 
   self->data_func_ = func;
   self->jpegxl_opaque_ = jpegxl_opaque;
-  self->num_reserved_.store(0, std::memory_order_relaxed);
+  self->PartitionRange(start_range, end_range);
 
   self->StartWorkers(worker_command);
   self->WorkersReadyBarrier();
 
+  if (stats_enabled) {
+    self->RecordCall(end_range - start_range,
+                     NowNanos() - self->call_start_ns_);
+  }
+
   if (self->depth_.fetch_add(-1, std::memory_order_acq_rel) != 1) {
     return -1;
   }
@@ -102,10 +164,20 @@ JxlParallelRetCode ThreadParallelRunner::Runner(
 void ThreadParallelRunner::RunRange(ThreadParallelRunner* self,
                                     const WorkerCommand command,
                                     const int thread) {
-  const uint32_t begin = command >> 32;
-  const uint32_t end = command & 0xFFFFFFFF;
-  const uint32_t num_tasks = end - begin;
-  const uint32_t num_worker_threads = self->num_worker_threads_;
+  (void)command;  // The ranges were set up by PartitionRange.
+  ThreadSlot* slot =
+      self->stats_enabled_ ? &self->thread_slots_[thread] : nullptr;
+  const size_t num_nodes = self->node_ranges_.size();
+  const uint32_t home_node = self->worker_nodes_[thread];
+  for (size_t i = 0; i < num_nodes; ++i) {
+    const uint32_t node = (home_node + i) % num_nodes;
+    NodeRange& range = self->node_ranges_[node];
+    const uint32_t begin = range.begin;
+    const uint32_t num_tasks = range.end - range.begin;
+    // Helpers from other nodes are few by the time they get here, so chunks
+    // stay sized for the node's own workers.
+    const uint32_t num_worker_threads =
+        std::max<uint32_t>(self->workers_per_node_[node], 1);
 
   // OpenMP introduced several "schedule" strategies:
   // "single" (static assignment of exactly one chunk per thread): slower.
@@ -114,36 +186,108 @@ void ThreadParallelRunner::RunRange(ThreadParallelRunner* self,
   //   is faster than halving k each iteration. We prefer this strategy
   //   because it avoids user-specified parameters.
 
-  for (;;) {
+    for (;;) {
 #if 0
       // dynamic
-      const uint32_t my_size = std::max(num_tasks / (num_worker_threads * 4), 1);
+      const uint32_t my_size =
+          std::max(num_tasks / (num_worker_threads * 4), 1);
 #else
-    // guided
-    const uint32_t num_reserved =
-        self->num_reserved_.load(std::memory_order_relaxed);
-    // It is possible that more tasks are reserved than ready to run.
-    const uint32_t num_remaining =
-        num_tasks - std::min(num_reserved, num_tasks);
-    const uint32_t my_size =
-        std::max(num_remaining / (num_worker_threads * 4), 1u);
+      // guided
+      const uint32_t num_reserved =
+          range.num_reserved.load(std::memory_order_relaxed);
+      // It is possible that more tasks are reserved than ready to run.
+      const uint32_t num_remaining =
+          num_tasks - std::min(num_reserved, num_tasks);
+      const uint32_t my_size =
+          std::max(num_remaining / (num_worker_threads * 4), 1u);
 #endif
-    const uint32_t my_begin = begin + self->num_reserved_.fetch_add(
-                                          my_size, std::memory_order_relaxed);
-    const uint32_t my_end = std::min(my_begin + my_size, begin + num_tasks);
-    // Another thread already reserved the last task.
-    if (my_begin >= my_end) {
-      break;
-    }
-    for (uint32_t task = my_begin; task < my_end; ++task) {
-      self->data_func_(self->jpegxl_opaque_, task, thread);
+      const uint32_t my_begin =
+          begin + range.num_reserved.fetch_add(my_size,
+                                               std::memory_order_relaxed);
+      const uint32_t my_end = std::min(my_begin + my_size, begin + num_tasks);
+      // Another thread already reserved the last task.
+      if (my_begin >= my_end) {
+        break;
+      }
+      if (slot == nullptr) {
+        for (uint32_t task = my_begin; task < my_end; ++task) {
+          self->data_func_(self->jpegxl_opaque_, task, thread);
+        }
+        continue;
+      }
+      const uint64_t start_ns = NowNanos();
+      if (!slot->call_started) {
+        slot->call_started = true;
+        slot->stats.wake_ns += start_ns - self->call_start_ns_;
+      }
+      for (uint32_t task = my_begin; task < my_end; ++task) {
+        self->data_func_(self->jpegxl_opaque_, task, thread);
+      }
+      slot->call_busy_ns += NowNanos() - start_ns;
+      slot->stats.num_tasks += my_end - my_begin;
     }
   }
 }
 
+void ThreadParallelRunner::RecordCall(const uint32_t num_tasks,
+                                      const uint64_t wall_ns) {
+  num_calls_++;
+  num_tasks_ += num_tasks;
+  wall_ns_ += wall_ns;
+  for (ThreadSlot& slot : thread_slots_) {
+    slot.stats.busy_ns += slot.call_busy_ns;
+    slot.stats.idle_ns += wall_ns - std::min(slot.call_busy_ns, wall_ns);
+    slot.call_busy_ns = 0;
+    slot.call_started = false;
+  }
+}
+
+void ThreadParallelRunner::SetStatsEnabled(const bool enabled) {
+  stats_enabled_ = enabled;
+  if (!enabled) return;
+  num_calls_ = 0;
+  num_tasks_ = 0;
+  wall_ns_ = 0;
+  thread_slots_ = std::vector<ThreadSlot>(num_threads_);
+}
+
+ThreadParallelRunner::Stats ThreadParallelRunner::GetStats() const {
+  Stats stats;
+  stats.num_calls = num_calls_;
+  stats.num_tasks = num_tasks_;
+  stats.wall_ns = wall_ns_;
+  for (const ThreadSlot& slot : thread_slots_) {
+    stats.threads.push_back(slot.stats);
+  }
+  return stats;
+}
+
+std::vector<std::pair<uint32_t, uint32_t>> ThreadParallelRunner::NodeRanges()
+    const {
+  std::vector<std::pair<uint32_t, uint32_t>> ranges;
+  for (const NodeRange& range : node_ranges_) {
+    ranges.emplace_back(range.begin, range.end);
+  }
+  return ranges;
+}
+
+void ThreadParallelRunner::PartitionRange(const uint32_t begin,
+                                          const uint32_t end) {
+  const uint64_t num_tasks = end - begin;
+  uint64_t workers_before = 0;
+  for (size_t node = 0; node < node_ranges_.size(); ++node) {
+    NodeRange& range = node_ranges_[node];
+    range.begin = begin + num_tasks * workers_before / num_worker_threads_;
+    workers_before += workers_per_node_[node];
+    range.end = begin + num_tasks * workers_before / num_worker_threads_;
+    range.num_reserved.store(0, std::memory_order_relaxed);
+  }
+}
+
 // static
 void ThreadParallelRunner::ThreadFunc(ThreadParallelRunner* self,
                                       const int thread) {
+  if (!self->worker_cpus_.empty()) PinToCpu(self->worker_cpus_[thread]);
   // Until kWorkerExit command received:
   for (;;) {
     std::unique_lock<std::mutex> lock(self->mutex_);
@@ -173,15 +317,41 @@ void ThreadParallelRunner::ThreadFunc(ThreadParallelRunner* self,
 }
 
 ThreadParallelRunner::ThreadParallelRunner(const int num_worker_threads)
+    : ThreadParallelRunner(num_worker_threads, {}, {}, false) {}
+
+ThreadParallelRunner::ThreadParallelRunner(const int num_worker_threads,
+                                           const std::vector<int>& cpus,
+                                           const std::vector<int>& cpu_nodes,
+                                           const bool numa_partition)
     : num_worker_threads_(num_worker_threads),
       num_threads_(std::max(num_worker_threads, 1)) {
   PROFILER_ZONE("ThreadParallelRunner ctor");
 
   threads_.reserve(num_worker_threads_);
 
-  // Suppress "unused-private-field" warning.
-  (void)padding1;
-  (void)padding2;
+  // Numbers the nodes of the workers in order of first appearance.
+  std::vector<int> nodes;
+  worker_nodes_.resize(num_worker_threads_);
+  for (uint32_t i = 0; i < num_worker_threads_; ++i) {
+    int node = 0;
+    if (!cpus.empty()) {
+      const size_t cpu_index = i % cpus.size();
+      worker_cpus_.push_back(cpus[cpu_index]);
+      if (numa_partition) {
+        node = cpu_nodes.empty() ? CpuNode(cpus[cpu_index])
+                                 : cpu_nodes[cpu_index];
+      }
+    }
+    auto it = std::find(nodes.begin(), nodes.end(), node);
+    worker_nodes_[i] = it - nodes.begin();
+    if (it == nodes.end()) {
+      nodes.push_back(node);
+      workers_per_node_.push_back(0);
+    }
+    workers_per_node_[worker_nodes_[i]]++;
+  }
+  node_ranges_ = std::vector<NodeRange>(std::max<size_t>(nodes.size(), 1));
+  thread_slots_.resize(num_threads_);
 
   // Safely handle spurious worker wakeups.
   worker_start_command_ = kWorkerWait;
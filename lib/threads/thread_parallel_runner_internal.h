@@ -40,6 +40,7 @@
 #include <condition_variable>  //NOLINT
 #include <mutex>               //NOLINT
 #include <thread>              //NOLINT
+#include <utility>
 #include <vector>
 
 #include "jxl/memory_manager.h"
@@ -62,6 +63,13 @@ class ThreadParallelRunner {
   explicit ThreadParallelRunner(
       int num_worker_threads = std::thread::hardware_concurrency());
 
+  // As above, and pins worker i to cpus[i % cpus.size()] unless `cpus` is
+  // empty. With `numa_partition`, tasks are split between the NUMA nodes of
+  // the workers, given by `cpu_nodes` (parallel to `cpus`) or looked up if
+  // empty.
+  ThreadParallelRunner(int num_worker_threads, const std::vector<int>& cpus,
+                       const std::vector<int>& cpu_nodes, bool numa_partition);
+
   // Waits for all threads to exit.
   ~ThreadParallelRunner();
 
@@ -91,6 +99,39 @@ class ThreadParallelRunner {
     WorkersReadyBarrier();
   }
 
+  // Counters of one thread over the calls made while stats are enabled.
+  struct ThreadStats {
+    uint64_t num_tasks = 0;
+    // Time spent running tasks.
+    uint64_t busy_ns = 0;
+    // Time from the start to the end of the calls not spent running tasks.
+    uint64_t idle_ns = 0;
+    // Time from the start of the calls until the thread reserved its first
+    // task, part of idle_ns.
+    uint64_t wake_ns = 0;
+  };
+
+  struct Stats {
+    uint64_t num_calls = 0;
+    uint64_t num_tasks = 0;
+    // Time from the start to the end of the calls.
+    uint64_t wall_ns = 0;
+    // One entry per thread that may call Func.
+    std::vector<ThreadStats> threads;
+  };
+
+  // Starts recording stats from zero, or stops recording them. Must not be
+  // called concurrently with Runner.
+  void SetStatsEnabled(bool enabled);
+  bool StatsEnabled() const { return stats_enabled_; }
+  // Must not be called concurrently with Runner.
+  Stats GetStats() const;
+
+  // Returns the [begin, end) range of tasks that the workers of each node
+  // started with in the last call, in the order in which the nodes first
+  // appear among the workers. Must not be called concurrently with Runner.
+  std::vector<std::pair<uint32_t, uint32_t>> NodeRanges() const;
+
   JxlMemoryManager memory_manager;
 
  private:
@@ -137,10 +178,18 @@ class ThreadParallelRunner {
   }
 
   // Attempts to reserve and perform some work from the global range of tasks,
-  // which is encoded within "command". Returns after all tasks are reserved.
+  // which is encoded within "command", starting with the part of the range of
+  // the node of the thread. Returns after all tasks are reserved.
   static void RunRange(ThreadParallelRunner* self, const WorkerCommand command,
                        const int thread);
 
+  // Adds a call to the stats and the time of each thread in it.
+  void RecordCall(uint32_t num_tasks, uint64_t wall_ns);
+
+  // Splits [begin, end) into one contiguous range per node, in proportion to
+  // the number of workers of each node.
+  void PartitionRange(uint32_t begin, uint32_t end);
+
   static void ThreadFunc(ThreadParallelRunner* self, int thread);
 
   // Unmodified after ctor, but cannot be const because we call thread::join().
@@ -161,10 +210,38 @@ class ThreadParallelRunner {
   JxlParallelRunFunction data_func_;
   void* jpegxl_opaque_;
 
-  // Updated by workers; padding avoids false sharing.
-  uint8_t padding1[64];
-  std::atomic<uint32_t> num_reserved_{0};
-  uint8_t padding2[64];
+  // CPU that each worker is pinned to, or empty if not pinned.
+  std::vector<int> worker_cpus_;
+  // Index of the node of each worker; all 0 without NUMA partitioning.
+  std::vector<uint32_t> worker_nodes_;
+  std::vector<uint32_t> workers_per_node_;
+
+  // Part of the tasks of the current call reserved first by the workers of
+  // one node. Written by main thread, num_reserved updated by workers;
+  // padding avoids false sharing.
+  struct NodeRange {
+    std::atomic<uint32_t> num_reserved{0};
+    uint32_t begin = 0;
+    uint32_t end = 0;
+    uint8_t padding[64];
+  };
+  std::vector<NodeRange> node_ranges_;
+
+  // Written by main thread between calls.
+  bool stats_enabled_ = false;
+  uint64_t num_calls_ = 0;
+  uint64_t num_tasks_ = 0;
+  uint64_t wall_ns_ = 0;
+  // Start of the current call, read by workers.
+  uint64_t call_start_ns_ = 0;
+  // Written by their thread during a call; padding avoids false sharing.
+  struct ThreadSlot {
+    ThreadStats stats;
+    uint64_t call_busy_ns = 0;
+    bool call_started = false;
+    uint8_t padding[64];
+  };
+  std::vector<ThreadSlot> thread_slots_;
 };
 
 }  // namespace jpegxl
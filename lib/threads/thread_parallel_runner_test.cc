@@ -4,10 +4,16 @@
 // license that can be found in the LICENSE file.
 
 #include <atomic>
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "gtest/gtest.h"
+#include "jxl/thread_parallel_runner_cxx.h"
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/thread_pool_internal.h"
+#include "lib/threads/thread_parallel_runner_internal.h"
 
 namespace jpegxl {
 namespace {
@@ -117,5 +123,106 @@ TEST(ThreadParallelRunnerTest, TestCounter) {
   EXPECT_EQ(expected, counters[0].counter);
 }
 
+// With NUMA partitioning, each node's workers start with their own contiguous
+// part of the tasks, in proportion to their number, and all tasks still run
+// once.
+TEST(ThreadParallelRunnerTest, TestNumaPartition) {
+  // Three workers on node 3, which appears first, and one on node 1.
+  ThreadParallelRunner runner(/*num_worker_threads=*/4, {0, 0, 0, 0},
+                              {3, 3, 3, 1}, /*numa_partition=*/true);
+  jxl::ThreadPool pool(&ThreadParallelRunner::Runner, &runner);
+
+  for (uint32_t num_tasks : {1u, 3u, 64u}) {
+    std::vector<std::atomic<int>> num_runs(num_tasks);
+    for (std::atomic<int>& n : num_runs) n.store(0);
+    EXPECT_TRUE(RunOnPool(
+        &pool, 10, 10 + num_tasks, jxl::ThreadPool::NoInit,
+        [&num_runs](const uint32_t task, const size_t thread) {
+          num_runs[task - 10].fetch_add(1, std::memory_order_relaxed);
+        },
+        "TestNumaPartition"));
+    for (const std::atomic<int>& n : num_runs) EXPECT_EQ(1, n.load());
+
+    const std::vector<std::pair<uint32_t, uint32_t>> ranges =
+        runner.NodeRanges();
+    ASSERT_EQ(2u, ranges.size());
+    const uint32_t split = 10 + num_tasks * 3 / 4;
+    EXPECT_EQ(10u, ranges[0].first);
+    EXPECT_EQ(split, ranges[0].second);
+    EXPECT_EQ(split, ranges[1].first);
+    EXPECT_EQ(10 + num_tasks, ranges[1].second);
+  }
+}
+
+TEST(ThreadParallelRunnerTest, TestCreateWithOptions) {
+  EXPECT_EQ(nullptr, JxlThreadParallelRunnerCreateWithOptions(nullptr,
+                                                              nullptr));
+  JxlThreadParallelRunnerOptions options = {};
+  options.num_worker_threads = 2;
+  options.num_cpus = 1;
+  EXPECT_EQ(nullptr, JxlThreadParallelRunnerCreateWithOptions(nullptr,
+                                                              &options));
+
+  const int cpus[] = {0};
+  options.cpus = cpus;
+  options.numa_partition = JXL_TRUE;
+  JxlThreadParallelRunnerPtr runner(
+      JxlThreadParallelRunnerCreateWithOptions(nullptr, &options));
+  ASSERT_NE(nullptr, runner.get());
+  jxl::ThreadPool pool(JxlThreadParallelRunner, runner.get());
+  std::atomic<uint32_t> sum{0};
+  EXPECT_TRUE(RunOnPool(
+      &pool, 0, 64, jxl::ThreadPool::NoInit,
+      [&sum](const uint32_t task, const size_t thread) {
+        sum.fetch_add(task, std::memory_order_relaxed);
+      },
+      "TestCreateWithOptions"));
+  EXPECT_EQ(64u * 63 / 2, sum.load());
+}
+
+// Stats count every task once, and the time of each thread adds up to the
+// wall time of the calls.
+TEST(ThreadParallelRunnerTest, TestStats) {
+  for (size_t num_workers : {0u, 3u}) {
+    JxlThreadParallelRunnerPtr runner =
+        JxlThreadParallelRunnerMake(nullptr, num_workers);
+    jxl::ThreadPool pool(JxlThreadParallelRunner, runner.get());
+    const auto run = [&pool](uint32_t num_tasks) {
+      EXPECT_TRUE(RunOnPool(
+          &pool, 0, num_tasks, jxl::ThreadPool::NoInit,
+          [](const uint32_t task, const size_t thread) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          },
+          "TestStats"));
+    };
+    run(5);  // Not recorded.
+    JxlThreadParallelRunnerSetStatsEnabled(runner.get(), JXL_TRUE);
+    run(20);
+    run(1);
+    JxlThreadParallelRunnerSetStatsEnabled(runner.get(), JXL_FALSE);
+    run(5);  // Not recorded.
+
+    JxlThreadParallelRunnerStats stats;
+    std::vector<JxlThreadParallelRunnerThreadStats> threads(4);
+    JxlThreadParallelRunnerGetStats(runner.get(), &stats, threads.data(),
+                                    threads.size());
+    EXPECT_EQ(2u, stats.num_calls);
+    EXPECT_EQ(21u, stats.num_tasks);
+    ASSERT_EQ(std::max<size_t>(num_workers, 1), stats.num_threads);
+    uint64_t num_tasks = 0;
+    for (size_t i = 0; i < stats.num_threads; ++i) {
+      num_tasks += threads[i].num_tasks;
+      EXPECT_EQ(stats.wall_ns, threads[i].busy_ns + threads[i].idle_ns);
+      EXPECT_LE(threads[i].wake_ns, threads[i].idle_ns);
+    }
+    EXPECT_EQ(21u, num_tasks);
+    if (num_workers == 3) {
+      // The single task of the second call leaves two threads idle.
+      EXPECT_GE(threads[0].idle_ns + threads[1].idle_ns + threads[2].idle_ns,
+                2000000u);
+    }
+  }
+}
+
 }  // namespace
 }  // namespace jpegxl
@@ -0,0 +1,407 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "jxl/work_stealing_parallel_runner.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+namespace jpegxl {
+namespace {
+
+constexpr int kNumPriorities = JXL_PARALLEL_RUNNER_PRIORITY_INTERACTIVE + 1;
+
+class WorkStealingParallelRunner;
+
+void* DefaultAlloc(void* opaque, size_t size) { return malloc(size); }
+
+void DefaultFree(void* opaque, void* address) { free(address); }
+
+// Initializes `self` with `memory_manager`, which may be NULL or have NULL
+// functions, replaced by the default ones. Fails if only one of alloc and free
+// is set.
+bool InitMemoryManager(JxlMemoryManager* self,
+                       const JxlMemoryManager* memory_manager) {
+  if (memory_manager) {
+    *self = *memory_manager;
+  } else {
+    memset(self, 0, sizeof(*self));
+  }
+  if (!self->alloc != !self->free) return false;
+  if (!self->alloc) self->alloc = DefaultAlloc;
+  if (!self->free) self->free = DefaultFree;
+  return true;
+}
+
+// One attachment to a runner, which is what the runner opaque points to.
+struct Client {
+  std::shared_ptr<WorkStealingParallelRunner> runner;
+  int priority;
+  // Memory manager that allocated the client, also used for the clients
+  // attached to it.
+  JxlMemoryManager memory_manager;
+  // Number of threads running tasks of this client's calls, for sharing the
+  // workers fairly between the clients of the same priority.
+  std::atomic<size_t> active_threads{0};
+};
+
+// The tasks of one JxlWorkStealingParallelRunner call. Lives on the stack of
+// the calling thread, which returns only once no other thread refers to it.
+struct Job {
+  Client* client;
+  JxlParallelRunFunction func;
+  void* jpegxl_opaque;
+  std::atomic<uint32_t> next_task;
+  uint32_t end_task;
+  // Number of threads that took the job from a queue and may still claim or
+  // run its tasks. Only changed with `mutex` held.
+  size_t refs = 0;
+  std::mutex mutex;
+  std::condition_variable done;
+
+  bool HasTasks() const {
+    return next_task.load(std::memory_order_relaxed) < end_task;
+  }
+};
+
+// Jobs that a thread made available to the others. The owner takes the newest
+// job, thieves take the oldest one, which is more likely to be large.
+struct JobQueue {
+  std::mutex mutex;
+  std::deque<Job*> jobs;
+};
+
+// Which runner the current thread is a worker of, and the jobs whose tasks it
+// is running, innermost last. The thread must not run another task of these
+// jobs before the current one returns, since tasks of the same call with the
+// same thread id could share per-thread state.
+struct ThreadState {
+  const WorkStealingParallelRunner* runner = nullptr;
+  size_t worker_id = 0;
+  std::vector<const Job*> active_jobs;
+};
+
+thread_local ThreadState thread_state;
+
+// A thread pool where every worker has its own queue of jobs and steals from
+// the queues of the others when idle. Calls may be nested, from within a task,
+// and may come from several threads at once. A worker that waits for the
+// tasks of its nested call to finish runs other tasks meanwhile.
+//
+// Idle workers pick the job of the highest priority, and among those, the job
+// of the client with the fewest threads working for it. Workers that help
+// with a job return to picking as soon as a job of a higher priority is
+// queued, after their current task.
+class WorkStealingParallelRunner {
+ public:
+  explicit WorkStealingParallelRunner(size_t num_worker_threads)
+      : queues_(num_worker_threads + 1) {
+    workers_.reserve(num_worker_threads);
+    for (size_t i = 0; i < num_worker_threads; ++i) {
+      workers_.emplace_back([this, i]() { WorkerBody(i); });
+    }
+  }
+
+  ~WorkStealingParallelRunner() {
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex_);
+      quit_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread& worker : workers_) worker.join();
+  }
+
+  JxlParallelRetCode Run(Client* client, void* jpegxl_opaque,
+                         JxlParallelRunInit init,
+                         JxlParallelRunFunction func, uint32_t start,
+                         uint32_t end) {
+    if (start >= end) return 0;
+    // Workers use their index as thread id, other threads use the one after
+    // the last worker.
+    const size_t num_threads = workers_.size() + 1;
+    JxlParallelRetCode ret = init(jpegxl_opaque, num_threads);
+    if (ret != 0) return ret;
+
+    const bool is_worker = thread_state.runner == this;
+    const size_t thread_id = is_worker ? thread_state.worker_id
+                                       : workers_.size();
+    Job job;
+    job.client = client;
+    job.func = func;
+    job.jpegxl_opaque = jpegxl_opaque;
+    job.next_task.store(start, std::memory_order_relaxed);
+    job.end_task = end;
+
+    if (end - start == 1 || workers_.empty()) {
+      RunTasks(&job, thread_id, /*may_yield=*/false);
+      return 0;
+    }
+
+    // Non-worker threads share the last queue.
+    JobQueue& queue = queues_[thread_id];
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.jobs.push_back(&job);
+    }
+    queued_[client->priority].fetch_add(1, std::memory_order_relaxed);
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex_);
+      ++epoch_;
+    }
+    const size_t num_helpers =
+        std::min<size_t>(end - start - 1, workers_.size());
+    for (size_t i = 0; i < num_helpers; ++i) wake_.notify_one();
+
+    RunTasks(&job, thread_id, /*may_yield=*/false);
+
+    // No thread can take the job anymore once it left the queue, so only the
+    // ones that took it before must be waited for.
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      auto it = std::find(queue.jobs.begin(), queue.jobs.end(), &job);
+      if (it != queue.jobs.end()) queue.jobs.erase(it);
+    }
+    queued_[client->priority].fetch_sub(1, std::memory_order_relaxed);
+    std::unique_lock<std::mutex> lock(job.mutex);
+    while (job.refs != 0) {
+      if (is_worker) {
+        lock.unlock();
+        bool helped = RunStolenTasks(thread_id);
+        lock.lock();
+        // The last thread may have left while the lock was released.
+        if (helped || job.refs == 0) continue;
+      }
+      job.done.wait(lock);
+    }
+    return 0;
+  }
+
+ private:
+  void WorkerBody(size_t worker_id) {
+    thread_state.runner = this;
+    thread_state.worker_id = worker_id;
+    for (;;) {
+      uint64_t epoch;
+      {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        if (quit_) return;
+        epoch = epoch_;
+      }
+      if (RunStolenTasks(worker_id)) continue;
+      std::unique_lock<std::mutex> lock(wake_mutex_);
+      wake_.wait(lock, [&]() { return quit_ || epoch_ != epoch; });
+    }
+  }
+
+  bool HigherPriorityQueued(int priority) const {
+    for (int p = priority + 1; p < kNumPriorities; ++p) {
+      if (queued_[p].load(std::memory_order_relaxed) != 0) return true;
+    }
+    return false;
+  }
+
+  // Runs the remaining tasks of `job`, which the calling thread either owns or
+  // took from a queue. With `may_yield`, stops early when a job of a higher
+  // priority is waiting.
+  void RunTasks(Job* job, size_t thread_id, bool may_yield) {
+    Client* client = job->client;
+    thread_state.active_jobs.push_back(job);
+    client->active_threads.fetch_add(1, std::memory_order_relaxed);
+    for (;;) {
+      const uint32_t task =
+          job->next_task.fetch_add(1, std::memory_order_relaxed);
+      if (task >= job->end_task) break;
+      job->func(job->jpegxl_opaque, task, thread_id);
+      if (may_yield && HigherPriorityQueued(client->priority)) break;
+    }
+    client->active_threads.fetch_sub(1, std::memory_order_relaxed);
+    thread_state.active_jobs.pop_back();
+  }
+
+  // Takes the best job with unclaimed tasks, preferring the own queue, newest
+  // first, over the other queues, oldest first, among equally good jobs, and
+  // helps running it. Returns whether a job was found.
+  bool RunStolenTasks(size_t worker_id) {
+    const auto can_take = [](const Job* candidate) {
+      const std::vector<const Job*>& active = thread_state.active_jobs;
+      return candidate->HasTasks() &&
+             std::find(active.begin(), active.end(), candidate) ==
+                 active.end();
+    };
+    Job* job = nullptr;
+    while (!job) {
+      // Jobs may leave their queue once it is unlocked, so only the address
+      // of the best one is kept to find it again.
+      const Job* best = nullptr;
+      size_t best_queue = 0;
+      int best_priority = -1;
+      size_t best_active_threads = 0;
+      const auto consider = [&](const Job* candidate, size_t queue_index) {
+        if (!can_take(candidate)) return;
+        const int priority = candidate->client->priority;
+        const size_t active_threads =
+            candidate->client->active_threads.load(std::memory_order_relaxed);
+        if (priority > best_priority ||
+            (priority == best_priority &&
+             active_threads < best_active_threads)) {
+          best = candidate;
+          best_queue = queue_index;
+          best_priority = priority;
+          best_active_threads = active_threads;
+        }
+      };
+      for (size_t i = 0; i < queues_.size(); ++i) {
+        const size_t queue_index = (worker_id + i) % queues_.size();
+        JobQueue& queue = queues_[queue_index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (i == 0) {
+          for (auto it = queue.jobs.rbegin(); it != queue.jobs.rend(); ++it) {
+            consider(*it, queue_index);
+          }
+        } else {
+          for (const Job* candidate : queue.jobs) {
+            consider(candidate, queue_index);
+          }
+        }
+      }
+      if (!best) return false;
+      JobQueue& queue = queues_[best_queue];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      auto it = std::find(queue.jobs.begin(), queue.jobs.end(), best);
+      if (it != queue.jobs.end() && can_take(*it)) {
+        job = *it;
+        // The owner removes the job from the queue with the queue lock held
+        // before waiting for the references to drop, so it is still alive.
+        std::lock_guard<std::mutex> job_lock(job->mutex);
+        ++job->refs;
+      }
+    }
+    RunTasks(job, worker_id, /*may_yield=*/true);
+    std::lock_guard<std::mutex> job_lock(job->mutex);
+    if (--job->refs == 0) job->done.notify_all();
+    return true;
+  }
+
+  std::vector<std::thread> workers_;
+  // One queue per worker, and a last one for the calls of other threads.
+  std::vector<JobQueue> queues_;
+
+  // Incremented whenever a job is queued, to wake up idle workers.
+  std::mutex wake_mutex_;
+  std::condition_variable wake_;
+  uint64_t epoch_ = 0;
+  bool quit_ = false;
+
+  // Number of queued jobs of each priority.
+  std::atomic<size_t> queued_[kNumPriorities] = {};
+};
+
+// Destroys a runner allocated with the memory manager of its first client.
+struct RunnerDeleter {
+  JxlMemoryManager memory_manager;
+  void operator()(WorkStealingParallelRunner* runner) const {
+    runner->~WorkStealingParallelRunner();
+    memory_manager.free(memory_manager.opaque, runner);
+  }
+};
+
+std::shared_ptr<WorkStealingParallelRunner> CreateRunner(
+    const JxlMemoryManager& memory_manager, size_t num_worker_threads) {
+  void* alloc = memory_manager.alloc(memory_manager.opaque,
+                                     sizeof(WorkStealingParallelRunner));
+  if (!alloc) return nullptr;
+  // Placement new constructor on allocated memory
+  return std::shared_ptr<WorkStealingParallelRunner>(
+      new (alloc) WorkStealingParallelRunner(num_worker_threads),
+      RunnerDeleter{memory_manager});
+}
+
+Client* Attach(std::shared_ptr<WorkStealingParallelRunner> runner,
+               JxlParallelRunnerPriority priority,
+               const JxlMemoryManager& memory_manager) {
+  if (!runner) return nullptr;
+  if (priority < JXL_PARALLEL_RUNNER_PRIORITY_BACKGROUND ||
+      priority > JXL_PARALLEL_RUNNER_PRIORITY_INTERACTIVE) {
+    return nullptr;
+  }
+  void* alloc = memory_manager.alloc(memory_manager.opaque, sizeof(Client));
+  if (!alloc) return nullptr;
+  // Placement new constructor on allocated memory
+  Client* client = new (alloc) Client();
+  client->runner = std::move(runner);
+  client->priority = priority;
+  client->memory_manager = memory_manager;
+  return client;
+}
+
+}  // namespace
+}  // namespace jpegxl
+
+extern "C" {
+JXL_THREADS_EXPORT JxlParallelRetCode JxlWorkStealingParallelRunner(
+    void* runner_opaque, void* jpegxl_opaque, JxlParallelRunInit init,
+    JxlParallelRunFunction func, uint32_t start_range, uint32_t end_range) {
+  jpegxl::Client* client = static_cast<jpegxl::Client*>(runner_opaque);
+  return client->runner->Run(client, jpegxl_opaque, init, func, start_range,
+                             end_range);
+}
+
+JXL_THREADS_EXPORT void* JxlWorkStealingParallelRunnerCreate(
+    const JxlMemoryManager* memory_manager, size_t num_worker_threads) {
+  JxlMemoryManager local_memory_manager;
+  if (!jpegxl::InitMemoryManager(&local_memory_manager, memory_manager)) {
+    return nullptr;
+  }
+  return jpegxl::Attach(
+      jpegxl::CreateRunner(local_memory_manager, num_worker_threads),
+      JXL_PARALLEL_RUNNER_PRIORITY_NORMAL, local_memory_manager);
+}
+
+JXL_THREADS_EXPORT void* JxlWorkStealingParallelRunnerAttach(
+    void* runner_opaque, JxlParallelRunnerPriority priority) {
+  const jpegxl::Client* client = static_cast<jpegxl::Client*>(runner_opaque);
+  return jpegxl::Attach(client->runner, priority, client->memory_manager);
+}
+
+JXL_THREADS_EXPORT void* JxlWorkStealingParallelRunnerAttachShared(
+    JxlParallelRunnerPriority priority, size_t num_worker_threads) {
+  static std::mutex shared_mutex;
+  static std::weak_ptr<jpegxl::WorkStealingParallelRunner> shared_runner;
+  JxlMemoryManager memory_manager;
+  jpegxl::InitMemoryManager(&memory_manager, nullptr);
+  std::lock_guard<std::mutex> lock(shared_mutex);
+  std::shared_ptr<jpegxl::WorkStealingParallelRunner> runner =
+      shared_runner.lock();
+  if (!runner) {
+    if (num_worker_threads == 0) {
+      num_worker_threads = std::thread::hardware_concurrency();
+    }
+    runner = jpegxl::CreateRunner(memory_manager, num_worker_threads);
+    shared_runner = runner;
+  }
+  return jpegxl::Attach(std::move(runner), priority, memory_manager);
+}
+
+JXL_THREADS_EXPORT void JxlWorkStealingParallelRunnerDestroy(
+    void* runner_opaque) {
+  jpegxl::Client* client = static_cast<jpegxl::Client*>(runner_opaque);
+  if (!client) return;
+  const JxlMemoryManager memory_manager = client->memory_manager;
+  client->~Client();
+  memory_manager.free(memory_manager.opaque, client);
+}
+}
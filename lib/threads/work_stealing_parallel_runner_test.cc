@@ -0,0 +1,223 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "jxl/work_stealing_parallel_runner_cxx.h"
+#include "lib/jxl/base/data_parallel.h"
+
+namespace jpegxl {
+namespace {
+
+// Runs `num_tasks` tasks that each check that no other task of the same call
+// runs with their thread id, then call `inner(task)`.
+template <class Inner>
+void RunChecked(jxl::ThreadPool* pool, uint32_t num_tasks,
+                const Inner& inner) {
+  std::unique_ptr<std::atomic<bool>[]> busy;
+  size_t num_threads = 0;
+  EXPECT_TRUE(jxl::RunOnPool(
+      pool, 0, num_tasks,
+      [&](size_t threads) {
+        num_threads = threads;
+        busy.reset(new std::atomic<bool>[threads]);
+        for (size_t i = 0; i < threads; ++i) busy[i] = false;
+        return true;
+      },
+      [&](const uint32_t task, size_t thread) {
+        ASSERT_LT(thread, num_threads);
+        EXPECT_FALSE(busy[thread].exchange(true));
+        inner(task);
+        busy[thread] = false;
+      },
+      "RunChecked"));
+}
+
+// Every task is run exactly once, for any number of workers and tasks.
+TEST(WorkStealingParallelRunnerTest, TestAllTasks) {
+  for (size_t num_workers = 0; num_workers <= 8; ++num_workers) {
+    JxlWorkStealingParallelRunnerPtr runner =
+        JxlWorkStealingParallelRunnerMake(nullptr, num_workers);
+    jxl::ThreadPool pool(JxlWorkStealingParallelRunner, runner.get());
+    for (uint32_t num_tasks = 0; num_tasks < 40; ++num_tasks) {
+      std::vector<std::atomic<int>> visits(num_tasks);
+      for (auto& visit : visits) visit = 0;
+      RunChecked(&pool, num_tasks, [&](uint32_t task) { visits[task]++; });
+      for (uint32_t task = 0; task < num_tasks; ++task) {
+        EXPECT_EQ(1, visits[task].load());
+      }
+    }
+  }
+}
+
+// Tasks may call the runner again, which runs the inner tasks in parallel
+// instead of deadlocking or reusing the thread ids of the outer call.
+TEST(WorkStealingParallelRunnerTest, TestNested) {
+  JxlWorkStealingParallelRunnerPtr runner =
+      JxlWorkStealingParallelRunnerMake(nullptr, 6);
+  jxl::ThreadPool pool(JxlWorkStealingParallelRunner, runner.get());
+  constexpr uint32_t kOuter = 9, kMiddle = 5, kInner = 13;
+  std::vector<std::atomic<int>> visits(kOuter * kMiddle * kInner);
+  for (auto& visit : visits) visit = 0;
+  RunChecked(&pool, kOuter, [&](uint32_t outer) {
+    RunChecked(&pool, kMiddle, [&](uint32_t middle) {
+      RunChecked(&pool, kInner, [&](uint32_t inner) {
+        visits[(outer * kMiddle + middle) * kInner + inner]++;
+      });
+    });
+  });
+  for (const auto& visit : visits) EXPECT_EQ(1, visit.load());
+}
+
+// Several threads share the runner, each with nested calls.
+TEST(WorkStealingParallelRunnerTest, TestConcurrentCallers) {
+  JxlWorkStealingParallelRunnerPtr runner =
+      JxlWorkStealingParallelRunnerMake(nullptr, 4);
+  constexpr size_t kCallers = 5;
+  constexpr uint32_t kOuter = 17, kInner = 11;
+  std::vector<std::atomic<uint64_t>> sums(kCallers);
+  for (auto& sum : sums) sum = 0;
+  std::vector<std::thread> callers;
+  for (size_t caller = 0; caller < kCallers; ++caller) {
+    callers.emplace_back([&, caller]() {
+      jxl::ThreadPool pool(JxlWorkStealingParallelRunner, runner.get());
+      for (int repeat = 0; repeat < 10; ++repeat) {
+        RunChecked(&pool, kOuter, [&](uint32_t outer) {
+          RunChecked(&pool, kInner, [&](uint32_t inner) {
+            sums[caller] += outer * kInner + inner;
+          });
+        });
+      }
+    });
+  }
+  for (std::thread& caller : callers) caller.join();
+  const uint64_t n = kOuter * kInner;
+  for (const auto& sum : sums) EXPECT_EQ(10 * n * (n - 1) / 2, sum.load());
+}
+
+// Clients of the shared workers see the same number of threads and may run
+// at the same time.
+TEST(WorkStealingParallelRunnerTest, TestSharedClients) {
+  JxlWorkStealingParallelRunnerPtr background(
+      JxlWorkStealingParallelRunnerAttachShared(
+          JXL_PARALLEL_RUNNER_PRIORITY_BACKGROUND, 3));
+  // The number of threads is fixed by the first client.
+  JxlWorkStealingParallelRunnerPtr interactive(
+      JxlWorkStealingParallelRunnerAttachShared(
+          JXL_PARALLEL_RUNNER_PRIORITY_INTERACTIVE, 7));
+  EXPECT_EQ(nullptr, JxlWorkStealingParallelRunnerAttach(
+                         interactive.get(), JxlParallelRunnerPriority(3)));
+  const auto run = [](void* runner, uint64_t* sum) {
+    jxl::ThreadPool pool(JxlWorkStealingParallelRunner, runner);
+    std::atomic<uint64_t> total{0};
+    EXPECT_TRUE(jxl::RunOnPool(
+        &pool, 0, 1000,
+        [](size_t num_threads) { return num_threads == 4; },
+        [&](const uint32_t task, size_t /*thread*/) { total += task; },
+        "TestSharedClients"));
+    *sum = total.load();
+  };
+  uint64_t sums[2];
+  std::thread other(run, background.get(), &sums[0]);
+  run(interactive.get(), &sums[1]);
+  other.join();
+  EXPECT_EQ(999 * 1000 / 2, sums[0]);
+  EXPECT_EQ(999 * 1000 / 2, sums[1]);
+}
+
+struct CountingAllocator {
+  std::atomic<int> num_allocs{0};
+  std::atomic<int> num_frees{0};
+
+  static void* Alloc(void* opaque, size_t size) {
+    static_cast<CountingAllocator*>(opaque)->num_allocs++;
+    return malloc(size);
+  }
+  static void Free(void* opaque, void* address) {
+    static_cast<CountingAllocator*>(opaque)->num_frees++;
+    free(address);
+  }
+};
+
+// The runner and its clients are allocated with the memory manager of the
+// first client.
+TEST(WorkStealingParallelRunnerTest, TestMemoryManager) {
+  CountingAllocator allocator;
+  JxlMemoryManager memory_manager = {&allocator, &CountingAllocator::Alloc,
+                                     nullptr};
+  // Only one of alloc and free is set.
+  EXPECT_EQ(nullptr, JxlWorkStealingParallelRunnerCreate(&memory_manager, 2));
+  memory_manager.free = &CountingAllocator::Free;
+  {
+    JxlWorkStealingParallelRunnerPtr runner =
+        JxlWorkStealingParallelRunnerMake(&memory_manager, 2);
+    ASSERT_NE(nullptr, runner.get());
+    // The runner and the client.
+    EXPECT_EQ(2, allocator.num_allocs.load());
+    JxlWorkStealingParallelRunnerPtr other(JxlWorkStealingParallelRunnerAttach(
+        runner.get(), JXL_PARALLEL_RUNNER_PRIORITY_INTERACTIVE));
+    ASSERT_NE(nullptr, other.get());
+    EXPECT_EQ(3, allocator.num_allocs.load());
+    runner.reset();
+    // The runner lives on with its last client.
+    EXPECT_EQ(1, allocator.num_frees.load());
+    jxl::ThreadPool pool(JxlWorkStealingParallelRunner, other.get());
+    std::atomic<uint32_t> sum{0};
+    RunChecked(&pool, 100, [&](uint32_t task) { sum += task; });
+    EXPECT_EQ(99u * 100 / 2, sum.load());
+  }
+  EXPECT_EQ(3, allocator.num_frees.load());
+}
+
+// A worker helping with a background call switches to an interactive call as
+// soon as it is queued, rather than after the background call is done.
+TEST(WorkStealingParallelRunnerTest, TestPriority) {
+  JxlWorkStealingParallelRunnerPtr background =
+      JxlWorkStealingParallelRunnerMake(nullptr, 1);
+  JxlWorkStealingParallelRunnerPtr interactive(
+      JxlWorkStealingParallelRunnerAttach(
+          background.get(), JXL_PARALLEL_RUNNER_PRIORITY_INTERACTIVE));
+  const auto sleep = []() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  };
+  constexpr uint32_t kBackgroundTasks = 400;
+  std::atomic<uint32_t> background_done{0};
+  std::atomic<bool> worker_helped_background{false};
+  std::thread background_caller([&]() {
+    jxl::ThreadPool pool(JxlWorkStealingParallelRunner, background.get());
+    EXPECT_TRUE(jxl::RunOnPool(
+        &pool, 0, kBackgroundTasks, jxl::ThreadPool::NoInit,
+        [&](const uint32_t task, size_t thread) {
+          if (thread == 0) worker_helped_background = true;
+          sleep();
+          background_done++;
+        },
+        "TestPriorityBackground"));
+  });
+  while (!worker_helped_background) std::this_thread::yield();
+
+  jxl::ThreadPool pool(JxlWorkStealingParallelRunner, interactive.get());
+  std::atomic<uint32_t> worker_tasks{0};
+  EXPECT_TRUE(jxl::RunOnPool(
+      &pool, 0, 40, jxl::ThreadPool::NoInit,
+      [&](const uint32_t task, size_t thread) {
+        if (thread == 0) worker_tasks++;
+        sleep();
+      },
+      "TestPriorityInteractive"));
+  EXPECT_LT(background_done.load(), kBackgroundTasks);
+  EXPECT_LT(0u, worker_tasks.load());
+  background_caller.join();
+}
+
+}  // namespace
+}  // namespace jpegxl